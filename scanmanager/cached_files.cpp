@@ -257,16 +257,18 @@ bool FileCache::DropFromCache(const string &filepath, const string &filename)
 //
 // Copies an external (non-versioned) file into the file cache's base directory.
 // "file" should be an absolute path (or at least relative to the working directory); "relativedir" is the destination
-// under the file cache base directory where the file should be copied.
+// under the file cache base directory where the file should be copied. If a
+// progress callback is given it is told of each chunk copied and may cancel.
 //
-bool FileCache::CopyIntoCache(const string &file, const string &relativedir)
+bool FileCache::CopyIntoCache(const string &file, const string &relativedir,
+                              const filecopyprogress_t &progress)
 {
    if(CreateDirectoryRecursive(relativedir))
    {
       pair<string, string> file_parts = GetFileSpec(file);
       string dest_path = PathConcatenate(PathConcatenate(GetBasePath(), relativedir), file_parts.second);
 
-      return (CopyFileA((LPCSTR)file.c_str(), (LPCSTR)dest_path.c_str(), FALSE) != 0);
+      return (FileCopy_Copy(file, dest_path, false, progress) == FILECOPY_OK);
    }
    else
       return false; // failed to create that path, can't copy the file
@@ -13,6 +13,7 @@
 
 #include <string>
 #include <utility>
+#include "filecopy.h"
 
 using namespace std;
 
@@ -109,9 +110,12 @@ namespace FileCache
     * @param file Absolute path to the source file to copy.
     * @param relativedir Directory under the AppData folder into which the 
     *        file will be copied.
+    * @param progress Optional callback told of the copy's progress, which
+    *        may cancel it.
     * @return True if the file was copied, false otherwise.
     */
-   bool   CopyIntoCache(const string &file, const string &relativedir);
+   bool   CopyIntoCache(const string &file, const string &relativedir,
+                        const filecopyprogress_t &progress = nullptr);
 
    /**
     * Delete a file from the user's AppData file cache directory, if
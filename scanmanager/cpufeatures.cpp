@@ -0,0 +1,113 @@
+/*
+  Scan Manager
+
+  CPU feature detection for SIMD code paths
+*/
+
+#include "cpufeatures.h"
+
+#if defined(SCANMGR_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+struct cpufeatures_t
+{
+   bool sse2;
+   bool avx2;
+};
+
+#if defined(SCANMGR_X86)
+
+//
+// Execute CPUID for a leaf and subleaf
+//
+static void CPU_CPUID(int regs[4], int leaf, int subleaf)
+{
+#if defined(_MSC_VER)
+   __cpuidex(regs, leaf, subleaf);
+#else
+   unsigned int a, b, c, d;
+   __cpuid_count(leaf, subleaf, a, b, c, d);
+   regs[0] = int(a);
+   regs[1] = int(b);
+   regs[2] = int(c);
+   regs[3] = int(d);
+#endif
+}
+
+//
+// Read extended control register 0 to learn which register states the OS
+// saves on a context switch.
+//
+static unsigned long long CPU_XGETBV0()
+{
+#if defined(_MSC_VER)
+   return _xgetbv(0);
+#else
+   unsigned int eax, edx;
+   __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+   return (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+}
+
+#endif
+
+//
+// Probe the processor once.
+//
+static cpufeatures_t CPU_Detect()
+{
+   cpufeatures_t features = { false, false };
+
+#if defined(SCANMGR_X86)
+   int regs[4];
+
+   CPU_CPUID(regs, 0, 0);
+   const int maxLeaf = regs[0];
+
+   if(maxLeaf >= 1)
+   {
+      CPU_CPUID(regs, 1, 0);
+      features.sse2 = ((regs[3] & (1 << 26)) != 0);
+
+      // AVX2 needs OSXSAVE and the OS to preserve XMM and YMM state
+      const bool osxsave = ((regs[2] & (1 << 27)) != 0);
+      const bool avx     = ((regs[2] & (1 << 28)) != 0);
+      if(osxsave && avx && (CPU_XGETBV0() & 0x6) == 0x6 && maxLeaf >= 7)
+      {
+         CPU_CPUID(regs, 7, 0);
+         features.avx2 = ((regs[1] & (1 << 5)) != 0);
+      }
+   }
+#endif
+
+   return features;
+}
+
+static const cpufeatures_t &CPU_Features()
+{
+   static const cpufeatures_t features = CPU_Detect();
+   return features;
+}
+
+//
+// True if SSE2 instructions may be used.
+//
+bool CPU_HasSSE2()
+{
+   return CPU_Features().sse2;
+}
+
+//
+// True if AVX2 instructions may be used.
+//
+bool CPU_HasAVX2()
+{
+   return CPU_Features().avx2;
+}
+
+// EOF
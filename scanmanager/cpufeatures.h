@@ -0,0 +1,27 @@
+/*
+  Scan Manager
+
+  CPU feature detection for SIMD code paths
+*/
+
+#ifndef CPUFEATURES_H__
+#define CPUFEATURES_H__
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define SCANMGR_X86 1
+#endif
+
+// GCC and Clang need per-function target attributes to emit AVX2 code from
+// a translation unit that is not itself compiled for AVX2; MSVC does not.
+#if defined(SCANMGR_X86) && !defined(_MSC_VER)
+#define SCANMGR_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define SCANMGR_TARGET_AVX2
+#endif
+
+bool CPU_HasSSE2();
+bool CPU_HasAVX2();
+
+#endif
+
+// EOF
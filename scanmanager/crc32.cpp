@@ -0,0 +1,58 @@
+/*
+  Scan Manager
+
+  CRC-32 checksums
+*/
+
+#include "crc32.h"
+
+//
+// Build the table of CRCs of all byte values, processing four bytes at a
+// time with a set of four tables ("slicing by 4").
+//
+struct crc32tables_t
+{
+   uint32_t t[4][256];
+
+   crc32tables_t()
+   {
+      for(uint32_t i = 0; i < 256; i++)
+      {
+         uint32_t c = i;
+         for(int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+         t[0][i] = c;
+      }
+
+      for(uint32_t i = 0; i < 256; i++)
+      {
+         for(int s = 1; s < 4; s++)
+            t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+      }
+   }
+};
+
+uint32_t CRC32_Update(uint32_t crc, const void *data, size_t size)
+{
+   static const crc32tables_t tables;
+
+   auto p = static_cast<const uint8_t *>(data);
+   crc = ~crc;
+
+   while(size >= 4)
+   {
+      crc ^= uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+      crc  = tables.t[3][crc & 0xFF] ^ tables.t[2][(crc >> 8) & 0xFF] ^
+             tables.t[1][(crc >> 16) & 0xFF] ^ tables.t[0][crc >> 24];
+      p    += 4;
+      size -= 4;
+   }
+
+   while(size--)
+      crc = tables.t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+   return ~crc;
+}
+
+// EOF
+
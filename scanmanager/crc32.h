@@ -0,0 +1,21 @@
+/*
+  Scan Manager
+
+  CRC-32 checksums
+*/
+
+#ifndef CRC32_H__
+#define CRC32_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Continue a CRC-32 (the zlib/PNG polynomial) over size more bytes. Start
+// with a crc of 0; the result of one call can be passed to the next to
+// checksum data that arrives in pieces.
+uint32_t CRC32_Update(uint32_t crc, const void *data, size_t size);
+
+#endif
+
+// EOF
+
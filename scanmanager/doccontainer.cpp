@@ -0,0 +1,397 @@
+/*
+  Scan Manager
+
+  Single-file document containers
+
+  A document stored as one JPEG file per page costs a file open and several
+  SMB metadata operations per page, on saving and again on every viewing.
+  A container holds all of a document's pages in one file instead, with a
+  table of where each page lies at a fixed place at its start, so a reader
+  can open the one file and go straight to any page.
+
+  Layout, all integers little-endian:
+
+     char     magic[4]   "SMDC"
+     uint16_t version    DOCCONTAINER_VERSION
+     uint16_t reserved   0
+     uint32_t count      number of pages
+     uint32_t crc        CRC-32 of the 12 bytes above and the page table
+     page table at offset 16, count entries, each:
+        uint64_t offset  of the page's JPEG data from the start of the file
+        uint64_t size
+        uint32_t width
+        uint32_t height
+        uint32_t crc     of the page's JPEG data
+        uint32_t reserved
+     JPEG data of each page, in no particular order
+*/
+
+#include <string.h>
+#include "cached_files.h"
+#include "crc32.h"
+#include "doccontainer.h"
+#include "mappedfile.h"
+
+#define DOCCONTAINER_MAGIC      "SMDC"
+#define DOCCONTAINER_VERSION    1
+#define DOCCONTAINER_HEADERSIZE 16
+#define DOCCONTAINER_ENTRYSIZE  32
+
+// Bound that a sane container stays within
+#define DOCCONTAINER_MAXPAGES 100000
+
+//=============================================================================
+//
+// Encoding
+//
+
+static void DocContainer_Put32(uint8_t *p, uint32_t v)
+{
+   p[0] = uint8_t(v);
+   p[1] = uint8_t(v >> 8);
+   p[2] = uint8_t(v >> 16);
+   p[3] = uint8_t(v >> 24);
+}
+
+static void DocContainer_Put64(uint8_t *p, uint64_t v)
+{
+   DocContainer_Put32(p,     uint32_t(v));
+   DocContainer_Put32(p + 4, uint32_t(v >> 32));
+}
+
+static uint32_t DocContainer_Get32(const uint8_t *p)
+{
+   return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static uint64_t DocContainer_Get64(const uint8_t *p)
+{
+   return uint64_t(DocContainer_Get32(p)) | (uint64_t(DocContainer_Get32(p + 4)) << 32);
+}
+
+//
+// Checksum of a container's header fields and page table.
+//
+static uint32_t DocContainer_HeaderCRC(const uint8_t *header, size_t size)
+{
+   uint32_t crc = CRC32_Update(0, header, 12);
+   return CRC32_Update(crc, header + DOCCONTAINER_HEADERSIZE, size - DOCCONTAINER_HEADERSIZE);
+}
+
+//=============================================================================
+//
+// Reading
+//
+
+//
+// Read the page table from the start of a container, of which only the
+// first avail bytes are at data; fileSize is the size of the whole file.
+//
+static bool DocContainer_ParseIndex(const uint8_t *data, size_t avail, uint64_t fileSize, DocContainerIndex &index)
+{
+   if(avail < DOCCONTAINER_HEADERSIZE || memcmp(data, DOCCONTAINER_MAGIC, 4))
+      return false;
+
+   uint32_t version = uint32_t(data[4]) | (uint32_t(data[5]) << 8);
+   uint32_t count   = DocContainer_Get32(data + 8);
+   if(version != DOCCONTAINER_VERSION || count > DOCCONTAINER_MAXPAGES)
+      return false;
+
+   uint64_t tableEnd = DOCCONTAINER_HEADERSIZE + uint64_t(count) * DOCCONTAINER_ENTRYSIZE;
+   if(tableEnd > avail || tableEnd > fileSize ||
+      DocContainer_Get32(data + 12) != DocContainer_HeaderCRC(data, size_t(tableEnd)))
+      return false;
+
+   DocContainerIndex pages(count);
+   for(uint32_t i = 0; i < count; i++)
+   {
+      const uint8_t      *entry = data + DOCCONTAINER_HEADERSIZE + i * DOCCONTAINER_ENTRYSIZE;
+      doccontainerpage_t &page  = pages[i];
+
+      page.offset = DocContainer_Get64(entry);
+      page.size   = DocContainer_Get64(entry + 8);
+      page.width  = DocContainer_Get32(entry + 16);
+      page.height = DocContainer_Get32(entry + 20);
+      page.crc    = DocContainer_Get32(entry + 24);
+
+      if(page.offset < tableEnd || page.offset > fileSize || page.size > fileSize - page.offset)
+         return false;
+   }
+
+   index.swap(pages);
+   return true;
+}
+
+//
+// Read the page table of a container held in memory, such as a mapped
+// file. Returns false if the data is not a container or its table is
+// damaged or points outside the file.
+//
+bool DocContainer_ReadIndex(const uint8_t *data, size_t size, DocContainerIndex &index)
+{
+   return DocContainer_ParseIndex(data, size, size, index);
+}
+
+DocContainerReader::DocContainerReader()
+   : m_hFile(INVALID_HANDLE_VALUE), m_index(), m_mutex()
+{
+}
+
+DocContainerReader::~DocContainerReader()
+{
+   close();
+}
+
+//
+// Read size bytes at offset from the file. Call with m_mutex held.
+//
+bool DocContainerReader::readAt(uint64_t offset, uint8_t *data, size_t size)
+{
+   LARGE_INTEGER pos;
+   pos.QuadPart = LONGLONG(offset);
+   if(!SetFilePointerEx(m_hFile, pos, nullptr, FILE_BEGIN))
+      return false;
+
+   while(size)
+   {
+      DWORD chunk = DWORD((size < 0x40000000) ? size : 0x40000000);
+      DWORD got   = 0;
+      if(!ReadFile(m_hFile, data, chunk, &got, nullptr) || !got)
+         return false;
+      data += got;
+      size -= got;
+   }
+   return true;
+}
+
+//
+// Open a container and read its page table. Returns false if the file
+// cannot be read or is not a sound container.
+//
+bool DocContainerReader::open(const std::string &path)
+{
+   close();
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   m_hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+   if(m_hFile == INVALID_HANDLE_VALUE)
+      return false;
+
+   LARGE_INTEGER size;
+   uint8_t       header[DOCCONTAINER_HEADERSIZE];
+   bool ok = GetFileSizeEx(m_hFile, &size) && uint64_t(size.QuadPart) >= DOCCONTAINER_HEADERSIZE &&
+             readAt(0, header, sizeof(header));
+
+   if(ok)
+   {
+      uint32_t count = DocContainer_Get32(header + 8);
+      ok = (count <= DOCCONTAINER_MAXPAGES);
+      if(ok)
+      {
+         std::vector<uint8_t> table(DOCCONTAINER_HEADERSIZE + size_t(count) * DOCCONTAINER_ENTRYSIZE);
+         ok = (table.size() <= uint64_t(size.QuadPart)) && readAt(0, table.data(), table.size()) &&
+              DocContainer_ParseIndex(table.data(), table.size(), uint64_t(size.QuadPart), m_index);
+      }
+   }
+
+   if(!ok)
+   {
+      CloseHandle(m_hFile);
+      m_hFile = INVALID_HANDLE_VALUE;
+   }
+   return ok;
+}
+
+//
+// Close the file.
+//
+void DocContainerReader::close()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   if(m_hFile != INVALID_HANDLE_VALUE)
+   {
+      CloseHandle(m_hFile);
+      m_hFile = INVALID_HANDLE_VALUE;
+   }
+   m_index.clear();
+}
+
+//
+// Read the JPEG data of one page. May be called from any thread.
+//
+bool DocContainerReader::readPage(size_t page, std::vector<uint8_t> &data)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   if(m_hFile == INVALID_HANDLE_VALUE || page >= m_index.size())
+      return false;
+
+   const doccontainerpage_t &entry = m_index[page];
+   if(entry.size > SIZE_MAX)
+      return false;
+
+   data.resize(size_t(entry.size));
+   return readAt(entry.offset, data.data(), data.size());
+}
+
+//=============================================================================
+//
+// Writing
+//
+
+DocContainerWriter::DocContainerWriter()
+   : m_hFile(INVALID_HANDLE_VALUE), m_dirPath(), m_tmpPath(), m_index(), m_end(0), m_mutex()
+{
+}
+
+DocContainerWriter::~DocContainerWriter()
+{
+   abandon();
+}
+
+//
+// Start a container for a document of numPages pages in the given
+// directory. With writeThrough, writes are pushed through the system cache
+// to the file server before they return.
+//
+bool DocContainerWriter::create(const std::string &dirPath, size_t numPages, bool writeThrough)
+{
+   abandon();
+
+   if(!numPages || numPages > DOCCONTAINER_MAXPAGES)
+      return false;
+
+   DWORD flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN;
+   if(writeThrough)
+      flags |= FILE_FLAG_WRITE_THROUGH;
+
+   m_dirPath = dirPath;
+   m_tmpPath = FileCache::PathConcatenate(dirPath, DOCCONTAINER_FILENAME) + ".tmp";
+   m_hFile   = CreateFileA(m_tmpPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, flags, nullptr);
+   if(m_hFile == INVALID_HANDLE_VALUE)
+      return false;
+
+   m_index.assign(numPages, doccontainerpage_t { 0, 0, 0, 0, 0 });
+   m_end = DOCCONTAINER_HEADERSIZE + uint64_t(numPages) * DOCCONTAINER_ENTRYSIZE;
+   return true;
+}
+
+//
+// Append the JPEG data of one page. May be called from any thread.
+//
+bool DocContainerWriter::writePage(size_t page, const uint8_t *data, size_t size, uint32_t width, uint32_t height)
+{
+   uint32_t crc = CRC32_Update(0, data, size);
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   if(m_hFile == INVALID_HANDLE_VALUE || page >= m_index.size() || m_index[page].size || !size)
+      return false;
+
+   LARGE_INTEGER pos;
+   pos.QuadPart = LONGLONG(m_end);
+
+   DWORD written = 0;
+   if(!SetFilePointerEx(m_hFile, pos, nullptr, FILE_BEGIN) ||
+      !WriteFile(m_hFile, data, DWORD(size), &written, nullptr) || written != DWORD(size))
+      return false;
+
+   m_index[page] = doccontainerpage_t { m_end, uint64_t(size), width, height, crc };
+   m_end += size;
+   return true;
+}
+
+//
+// Write the page table and give the container its real name, replacing any
+// existing container. Every page must have been written. On success, entry
+// describes the container for the document's manifest.
+//
+bool DocContainerWriter::finish(docmanifestentry_t &entry)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   if(m_hFile == INVALID_HANDLE_VALUE)
+      return false;
+
+   size_t tableEnd = DOCCONTAINER_HEADERSIZE + m_index.size() * DOCCONTAINER_ENTRYSIZE;
+   std::vector<uint8_t> header(tableEnd, 0);
+
+   memcpy(header.data(), DOCCONTAINER_MAGIC, 4);
+   header[4] = uint8_t(DOCCONTAINER_VERSION);
+   DocContainer_Put32(&header[8], uint32_t(m_index.size()));
+
+   for(size_t i = 0; i < m_index.size(); i++)
+   {
+      const doccontainerpage_t &page = m_index[i];
+      uint8_t *p = &header[DOCCONTAINER_HEADERSIZE + i * DOCCONTAINER_ENTRYSIZE];
+
+      if(!page.size)
+         return false; // a page is missing
+
+      DocContainer_Put64(p,      page.offset);
+      DocContainer_Put64(p + 8,  page.size);
+      DocContainer_Put32(p + 16, page.width);
+      DocContainer_Put32(p + 20, page.height);
+      DocContainer_Put32(p + 24, page.crc);
+   }
+   DocContainer_Put32(&header[12], DocContainer_HeaderCRC(header.data(), header.size()));
+
+   LARGE_INTEGER pos;
+   pos.QuadPart = 0;
+
+   DWORD written = 0;
+   BOOL  ok      = SetFilePointerEx(m_hFile, pos, nullptr, FILE_BEGIN) &&
+                   WriteFile(m_hFile, header.data(), DWORD(header.size()), &written, nullptr) &&
+                   written == DWORD(header.size());
+
+   if(!CloseHandle(m_hFile))
+      ok = FALSE;
+   m_hFile = INVALID_HANDLE_VALUE;
+
+   // the manifest checksum covers the whole file, whose pages went out in
+   // whatever order they were finished; read it back from the cache
+   if(ok)
+   {
+      MappedFile file;
+      if((ok = file.open(m_tmpPath.c_str())))
+      {
+         entry.name   = DOCCONTAINER_FILENAME;
+         entry.size   = file.size();
+         entry.width  = 0;
+         entry.height = 0;
+         entry.crc    = CRC32_Update(0, file.data(), file.size());
+      }
+   }
+
+   std::string path = FileCache::PathConcatenate(m_dirPath, DOCCONTAINER_FILENAME);
+   if(ok)
+      ok = MoveFileExA(m_tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+
+   if(!ok)
+      DeleteFileA(m_tmpPath.c_str());
+
+   m_index.clear();
+   return ok != FALSE;
+}
+
+//
+// Give up on an unfinished container, deleting what has been written.
+//
+void DocContainerWriter::abandon()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   if(m_hFile != INVALID_HANDLE_VALUE)
+   {
+      CloseHandle(m_hFile);
+      m_hFile = INVALID_HANDLE_VALUE;
+      DeleteFileA(m_tmpPath.c_str());
+   }
+   m_index.clear();
+}
+
+// EOF
+
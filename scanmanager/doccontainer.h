@@ -0,0 +1,98 @@
+/*
+  Scan Manager
+
+  Single-file document containers
+*/
+
+#ifndef DOCCONTAINER_H__
+#define DOCCONTAINER_H__
+
+#include <Windows.h>
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "docmanifest.h"
+
+// Name of the container file within a document directory
+#define DOCCONTAINER_FILENAME "pages.smc"
+
+//
+// Where one page's JPEG data lies within a container.
+//
+struct doccontainerpage_t
+{
+   uint64_t offset; // from the start of the file
+   uint64_t size;   // in bytes
+   uint32_t width;  // page size in pixels
+   uint32_t height;
+   uint32_t crc;    // CRC-32 of the page's JPEG data
+};
+
+typedef std::vector<doccontainerpage_t> DocContainerIndex;
+
+bool DocContainer_ReadIndex(const uint8_t *data, size_t size, DocContainerIndex &index);
+
+//
+// Reads a container with ordinary file reads: the page table when opened,
+// then only the pages asked for. Used for containers that may be on the
+// share, where mapping the file would turn a network error into an
+// exception in the decoder.
+//
+class DocContainerReader
+{
+protected:
+   HANDLE            m_hFile;
+   DocContainerIndex m_index;
+   std::mutex        m_mutex;
+
+   bool readAt(uint64_t offset, uint8_t *data, size_t size);
+
+public:
+   DocContainerReader();
+   ~DocContainerReader();
+
+   DocContainerReader(const DocContainerReader &) = delete;
+   DocContainerReader &operator = (const DocContainerReader &) = delete;
+
+   bool open(const std::string &path);
+   void close();
+   bool readPage(size_t page, std::vector<uint8_t> &data);
+
+   const DocContainerIndex &index() const { return m_index; }
+};
+
+//
+// Writes the pages of a document into a container. Pages may be written in
+// any order and from several threads at once; each is appended to the file
+// as it arrives and the page table records where it went. The container is
+// written under a temporary name and only appears under its real one when
+// finished.
+//
+class DocContainerWriter
+{
+protected:
+   HANDLE            m_hFile;
+   std::string       m_dirPath;
+   std::string       m_tmpPath;
+   DocContainerIndex m_index;
+   uint64_t          m_end; // where the next page goes
+   std::mutex        m_mutex;
+
+public:
+   DocContainerWriter();
+   ~DocContainerWriter();
+
+   DocContainerWriter(const DocContainerWriter &) = delete;
+   DocContainerWriter &operator = (const DocContainerWriter &) = delete;
+
+   bool create(const std::string &dirPath, size_t numPages, bool writeThrough);
+   bool writePage(size_t page, const uint8_t *data, size_t size, uint32_t width, uint32_t height);
+   bool finish(docmanifestentry_t &entry);
+   void abandon();
+};
+
+#endif
+
+// EOF
+
@@ -0,0 +1,305 @@
+/*
+  Scan Manager
+
+  Document manifests
+
+  Listing a document directory on the share costs several round trips, and
+  over a slow link each listing takes a noticeable fraction of a second. The
+  writer therefore puts a manifest in every new document, naming its files
+  in page order along with their sizes, page dimensions and checksums, so
+  that a reader can learn everything it needs from one small file. Documents
+  written before manifests existed are still read by listing the directory.
+
+  Layout, all integers little-endian:
+
+     char     magic[4]   "SMDM"
+     uint16_t version    DOCMANIFEST_VERSION
+     uint16_t reserved   0
+     uint32_t count      number of entries
+     entries, each:
+        uint16_t nameLength
+        char     name[nameLength]
+        uint64_t size
+        uint32_t width
+        uint32_t height
+        uint32_t crc
+     uint32_t crc        CRC-32 of everything above
+*/
+
+#include <Windows.h>
+#include <set>
+#include <string.h>
+#include "cached_files.h"
+#include "crc32.h"
+#include "docmanifest.h"
+#include "i_opndir.h"
+#include "jpegdecode.h"
+#include "mappedfile.h"
+#include "util.h"
+
+#define DOCMANIFEST_MAGIC   "SMDM"
+#define DOCMANIFEST_VERSION 1
+
+// Bounds that a sane manifest stays within
+#define DOCMANIFEST_MAXENTRIES 100000
+#define DOCMANIFEST_MAXNAME    255
+
+//=============================================================================
+//
+// Encoding
+//
+
+static void DocManifest_Put16(std::vector<uint8_t> &buf, uint16_t v)
+{
+   buf.push_back(uint8_t(v));
+   buf.push_back(uint8_t(v >> 8));
+}
+
+static void DocManifest_Put32(std::vector<uint8_t> &buf, uint32_t v)
+{
+   DocManifest_Put16(buf, uint16_t(v));
+   DocManifest_Put16(buf, uint16_t(v >> 16));
+}
+
+static void DocManifest_Put64(std::vector<uint8_t> &buf, uint64_t v)
+{
+   DocManifest_Put32(buf, uint32_t(v));
+   DocManifest_Put32(buf, uint32_t(v >> 32));
+}
+
+//
+// Bounds-checked reader over the bytes of a manifest.
+//
+struct manifestreader_t
+{
+   const uint8_t *p;
+   const uint8_t *end;
+
+   bool get(void *out, size_t n)
+   {
+      if(size_t(end - p) < n)
+         return false;
+      memcpy(out, p, n);
+      p += n;
+      return true;
+   }
+
+   bool get16(uint16_t &v)
+   {
+      uint8_t b[2];
+      if(!get(b, 2))
+         return false;
+      v = uint16_t(b[0] | (b[1] << 8));
+      return true;
+   }
+
+   bool get32(uint32_t &v)
+   {
+      uint16_t lo, hi;
+      if(!get16(lo) || !get16(hi))
+         return false;
+      v = uint32_t(lo) | (uint32_t(hi) << 16);
+      return true;
+   }
+
+   bool get64(uint64_t &v)
+   {
+      uint32_t lo, hi;
+      if(!get32(lo) || !get32(hi))
+         return false;
+      v = uint64_t(lo) | (uint64_t(hi) << 32);
+      return true;
+   }
+};
+
+//=============================================================================
+//
+// Interface
+//
+
+static bool DocManifest_HasExtension(const std::string &name, const char *ext)
+{
+   std::string lower = LowercaseString(name);
+   size_t      len   = strlen(ext);
+   return (lower.length() > len && !lower.compare(lower.length() - len, len, ext));
+}
+
+//
+// Check whether a document file name is that of a page image.
+//
+bool DocManifest_IsPage(const std::string &name)
+{
+   return DocManifest_HasExtension(name, ".jpg");
+}
+
+//
+// Check whether a document file name is that of a PDF.
+//
+bool DocManifest_IsPDF(const std::string &name)
+{
+   return DocManifest_HasExtension(name, ".pdf");
+}
+
+//
+// Check whether a document file name is that of a page container.
+//
+bool DocManifest_IsContainer(const std::string &name)
+{
+   return DocManifest_HasExtension(name, ".smc");
+}
+
+//
+// Write the manifest of a document directory. It is written under a
+// temporary name and renamed over any existing manifest, so readers only
+// ever see a complete one.
+//
+bool DocManifest_Write(const std::string &dirPath, const DocManifest &manifest)
+{
+   std::vector<uint8_t> buf;
+   buf.insert(buf.end(), DOCMANIFEST_MAGIC, DOCMANIFEST_MAGIC + 4);
+   DocManifest_Put16(buf, DOCMANIFEST_VERSION);
+   DocManifest_Put16(buf, 0);
+   DocManifest_Put32(buf, uint32_t(manifest.size()));
+
+   for(const auto &entry : manifest)
+   {
+      if(entry.name.empty() || entry.name.length() > DOCMANIFEST_MAXNAME)
+         return false;
+
+      DocManifest_Put16(buf, uint16_t(entry.name.length()));
+      buf.insert(buf.end(), entry.name.begin(), entry.name.end());
+      DocManifest_Put64(buf, entry.size);
+      DocManifest_Put32(buf, entry.width);
+      DocManifest_Put32(buf, entry.height);
+      DocManifest_Put32(buf, entry.crc);
+   }
+
+   DocManifest_Put32(buf, CRC32_Update(0, buf.data(), buf.size()));
+
+   std::string path    = FileCache::PathConcatenate(dirPath, DOCMANIFEST_FILENAME);
+   std::string tmpPath = path + ".tmp";
+
+   HANDLE hFile = CreateFileA(tmpPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+   if(hFile == INVALID_HANDLE_VALUE)
+      return false;
+
+   DWORD size    = DWORD(buf.size());
+   DWORD written = 0;
+   BOOL  ok      = WriteFile(hFile, buf.data(), size, &written, nullptr) && written == size;
+
+   if(!CloseHandle(hFile))
+      ok = FALSE;
+
+   if(ok)
+      ok = MoveFileExA(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+
+   if(!ok)
+      DeleteFileA(tmpPath.c_str());
+
+   return ok != FALSE;
+}
+
+//
+// Load the manifest of a document directory. Returns false if there is no
+// manifest, as for documents written before they were introduced, or if it
+// is damaged; either way the caller should list the directory instead.
+//
+bool DocManifest_Read(const std::string &dirPath, DocManifest &manifest)
+{
+   MappedFile file;
+   if(!file.open(FileCache::PathConcatenate(dirPath, DOCMANIFEST_FILENAME).c_str()))
+      return false;
+
+   if(file.size() < 16 || memcmp(file.data(), DOCMANIFEST_MAGIC, 4))
+      return false;
+
+   // the checksum covers everything before it
+   manifestreader_t crcReader = { file.data() + file.size() - 4, file.data() + file.size() };
+   uint32_t crc;
+   if(!crcReader.get32(crc) || crc != CRC32_Update(0, file.data(), file.size() - 4))
+      return false;
+
+   manifestreader_t reader = { file.data() + 4, file.data() + file.size() - 4 };
+   uint16_t version, reserved;
+   uint32_t count;
+   if(!reader.get16(version) || !reader.get16(reserved) || !reader.get32(count))
+      return false;
+   if(version != DOCMANIFEST_VERSION || count > DOCMANIFEST_MAXENTRIES)
+      return false;
+
+   DocManifest entries;
+   entries.reserve(count);
+
+   for(uint32_t i = 0; i < count; i++)
+   {
+      docmanifestentry_t entry;
+      uint16_t nameLength;
+      char     name[DOCMANIFEST_MAXNAME];
+
+      if(!reader.get16(nameLength) || !nameLength || nameLength > DOCMANIFEST_MAXNAME || !reader.get(name, nameLength))
+         return false;
+
+      entry.name.assign(name, nameLength);
+      if(entry.name.find_first_of("\\/:") != std::string::npos || entry.name[0] == '.')
+         return false; // must name a file within the directory
+
+      if(!reader.get64(entry.size) || !reader.get32(entry.width) || !reader.get32(entry.height) || !reader.get32(entry.crc))
+         return false;
+
+      entries.push_back(entry);
+   }
+
+   if(reader.p != reader.end)
+      return false;
+
+   manifest.swap(entries);
+   return true;
+}
+
+//
+// Write a fresh manifest for a document directory from the files in it, as
+// after its pages have been changed in place. Files are listed in name
+// order, which is page order.
+//
+bool DocManifest_Rebuild(const std::string &dirPath)
+{
+   DIR    *dir;
+   dirent *ent;
+   std::set<std::string> filenames;
+
+   if(!(dir = opendir(dirPath.c_str())))
+      return false;
+
+   while((ent = readdir(dir)))
+   {
+      if(DocManifest_IsPage(ent->d_name) || DocManifest_IsPDF(ent->d_name) || DocManifest_IsContainer(ent->d_name))
+         filenames.insert(ent->d_name);
+   }
+
+   closedir(dir);
+
+   DocManifest manifest;
+   for(const auto &fn : filenames)
+   {
+      MappedFile file;
+      if(!file.open(FileCache::PathConcatenate(dirPath, fn).c_str()))
+         return false;
+
+      docmanifestentry_t entry;
+      entry.name   = fn;
+      entry.size   = file.size();
+      entry.width  = 0;
+      entry.height = 0;
+      entry.crc    = CRC32_Update(0, file.data(), file.size());
+      if(DocManifest_IsPage(fn))
+         JPEGDecode_GetSize(file.data(), file.size(), entry.width, entry.height);
+
+      manifest.push_back(entry);
+   }
+
+   return DocManifest_Write(dirPath, manifest);
+}
+
+// EOF
+
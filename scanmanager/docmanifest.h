@@ -0,0 +1,41 @@
+/*
+  Scan Manager
+
+  Document manifests
+*/
+
+#ifndef DOCMANIFEST_H__
+#define DOCMANIFEST_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Name of the manifest file within a document directory
+#define DOCMANIFEST_FILENAME "manifest.bin"
+
+//
+// One file of a document, as listed in its manifest.
+//
+struct docmanifestentry_t
+{
+   std::string name;   // file name within the document directory
+   uint64_t    size;   // size of the file in bytes
+   uint32_t    width;  // page size in pixels; 0 if not an image or not known
+   uint32_t    height;
+   uint32_t    crc;    // CRC-32 of the file's contents
+};
+
+typedef std::vector<docmanifestentry_t> DocManifest;
+
+bool DocManifest_IsPage(const std::string &name);
+bool DocManifest_IsPDF(const std::string &name);
+bool DocManifest_IsContainer(const std::string &name);
+bool DocManifest_Write(const std::string &dirPath, const DocManifest &manifest);
+bool DocManifest_Read(const std::string &dirPath, DocManifest &manifest);
+bool DocManifest_Rebuild(const std::string &dirPath);
+
+#endif
+
+// EOF
+
@@ -4,14 +4,22 @@
   Document reader
 */
 
+#include <map>
+#include <mutex>
 #include <set>
 #include <string>
-#include <sys/stat.h>
+#include <vector>
 #include <stdio.h>
+#include <string.h>
 #include "cached_files.h"
+#include "doccontainer.h"
+#include "docmanifest.h"
+#include "docread.h"
 #include "docwrite.h"
 #include "i_opndir.h"
 #include "imagelist.h"
+#include "jpegdecode.h"
+#include "mappedfile.h"
 
 //=============================================================================
 //
@@ -41,6 +49,7 @@ struct hglobalbuffer_t
 typedef DLList<hglobalbuffer_t, &hglobalbuffer_t::links> HGlobalList;
 
 static HGlobalList imageBuffers;
+static std::mutex  imageBuffersMutex; // pages may be loaded on worker threads
 
 //
 // Add an image buffer.
@@ -49,6 +58,8 @@ static void ScanMgr_AddImageBuffer(HGLOBAL hBuffer)
 {
    auto newBuffer = new hglobalbuffer_t();
    newBuffer->hBuffer = hBuffer;
+
+   std::lock_guard<std::mutex> lock(imageBuffersMutex);
    imageBuffers.tailInsert(newBuffer);
 }
 
@@ -57,181 +68,379 @@ static void ScanMgr_AddImageBuffer(HGLOBAL hBuffer)
 //
 void ScanMgr_DeleteImageBuffers()
 {
+   std::lock_guard<std::mutex> lock(imageBuffersMutex);
    while(imageBuffers.head)
       delete imageBuffers.head->dllObject;
 }
 
 //=============================================================================
 //
-// Local utilities
+// Document listings
 //
+// A document's files are learned from its manifest where it has one, or by
+// listing its directory where it does not. Published documents never change
+// while the program runs, so each listing is kept for the rest of the
+// session; viewing and then printing a document reads it once.
+//
+
+static std::map<std::string, DocManifest> documentListings;
+static std::mutex                         documentListingsMutex;
 
 //
-// Read in a single file in the directory
+// List the page images and PDFs in a document directory, in page order.
+// Files of documents without a manifest have no size, dimensions or
+// checksum.
 //
-static bool ScanMgr_ReadDocumentFile(const std::string &inpath, const std::string &fn, Gdiplus::Bitmap *&bmpOut)
+static bool ScanMgr_ListDocument(const std::string &inpath, DocManifest &listing)
 {
-   std::string fullname = FileCache::PathConcatenate(inpath, fn);
-
-   bmpOut = nullptr;
+   {
+      std::lock_guard<std::mutex> lock(documentListingsMutex);
+      auto itr = documentListings.find(inpath);
+      if(itr != documentListings.end())
+      {
+         listing = itr->second;
+         return true;
+      }
+   }
 
-   struct stat st;
-   if(stat(fullname.c_str(), &st))
+   if(!ScanMgr_ConnectToShare())
       return false;
 
-   long filesize = st.st_size;
-   if(!filesize)
-      return false;
+   if(!DocManifest_Read(inpath, listing))
+   {
+      DIR    *dir;
+      dirent *ent;
+      std::set<std::string> filenames;
+
+      if(!(dir = opendir(inpath.c_str())))
+         return false;
+
+      while((ent = readdir(dir)))
+      {
+         // put the file names into a set so they will come out in numeric order.
+         if(DocManifest_IsPage(ent->d_name) || DocManifest_IsPDF(ent->d_name) || DocManifest_IsContainer(ent->d_name))
+            filenames.insert(ent->d_name);
+      }
+
+      closedir(dir);
+
+      listing.clear();
+      for(const auto &fn : filenames)
+         listing.push_back({ fn, 0, 0, 0, 0 });
+   }
 
+   std::lock_guard<std::mutex> lock(documentListingsMutex);
+   documentListings[inpath] = listing;
+   return true;
+}
+
+//=============================================================================
+//
+// Local utilities
+//
+
+//
+// Hand a copy of a file's data to GDI+. GDI+ reads from its stream for as
+// long as the bitmap lives, so the copy is kept until the image buffers are
+// deleted.
+//
+static Gdiplus::Bitmap *ScanMgr_LoadWithGdiplus(const uint8_t *data, size_t size)
+{
    HGLOBAL hBuffer;
-   if((hBuffer = GlobalAlloc(GMEM_MOVEABLE, SIZE_T(filesize))))
+   if(!(hBuffer = GlobalAlloc(GMEM_MOVEABLE, SIZE_T(size))))
+      return nullptr;
+
+   void *buffer = GlobalLock(hBuffer);
+   if(buffer)
    {
-      void *buffer = GlobalLock(hBuffer);
-      if(buffer)
+      memcpy(buffer, data, size);
+
+      IStream *pStream = nullptr;
+      if(CreateStreamOnHGlobal(hBuffer, FALSE, &pStream) == S_OK)
       {
-         FILE *f;
-         if((f = fopen(fullname.c_str(), "rb")))
+         Gdiplus::Bitmap *bitmap = Gdiplus::Bitmap::FromStream(pStream);
+         pStream->Release();
+         if(bitmap && bitmap->GetLastStatus() == Gdiplus::Ok)
          {
-            if(fread(buffer, 1, filesize, f) == filesize)
-            {
-               IStream *pStream = nullptr;
-               if(CreateStreamOnHGlobal(hBuffer, FALSE, &pStream) == S_OK)
-               {
-                  bmpOut = Gdiplus::Bitmap::FromStream(pStream);
-                  pStream->Release();
-                  if(bmpOut && bmpOut->GetLastStatus() == Gdiplus::Ok)
-                  {
-                     fclose(f);
-                     ScanMgr_AddImageBuffer(hBuffer);
-                     return true;
-                  }
-
-                  // bitmap creation failed
-                  delete bmpOut;
-                  bmpOut = nullptr;
-               }
-               // IStream creation failed
-            }
-            // fread failed
-            fclose(f);
+            ScanMgr_AddImageBuffer(hBuffer);
+            return bitmap;
          }
-         // fopen failed
-         GlobalUnlock(hBuffer);
+
+         // bitmap creation failed
+         delete bitmap;
       }
-      // GlobalLock failed
-      GlobalFree(hBuffer);
+      // IStream creation failed
+      GlobalUnlock(hBuffer);
    }
-   // GlobalAlloc failed
-   return false;
+   // GlobalLock failed
+   GlobalFree(hBuffer);
+   return nullptr;
 }
 
-//=============================================================================
 //
-// Interface
+// Decode one page's JPEG data. If maxWidth or maxHeight are non-zero, the
+// page is decoded at the reduced size it will be displayed at.
 //
+static Gdiplus::Bitmap *ScanMgr_DecodePage(const uint8_t *data, size_t size, uint32_t maxWidth, uint32_t maxHeight)
+{
+   Gdiplus::Bitmap *bitmap;
+   std::string      errorMsg;
+   if((bitmap = JPEGDecode_ToBitmap(data, size, maxWidth, maxHeight, errorMsg)))
+      return bitmap;
 
+   // not a JPEG that libjpeg can read; let GDI+ have a try
+   return ScanMgr_LoadWithGdiplus(data, size);
+}
+
+//
+// Read in a single page file
 //
-// Read in the document from the path that was saved in the database.
+// A file on local disk, such as a copy in the view cache, is mapped rather
+// than read, and decoded straight out of the mapping, which is released as
+// soon as the page is decoded: only the decoded bitmap stays resident. See
+// MappedFile for files on the share.
 //
-bool ScanMgr_ReadDocumentFromPath(const std::string &inpath, ImageList &list)
+static bool ScanMgr_ReadDocumentFile(const std::string &fullname, Gdiplus::Bitmap *&bmpOut,
+                                     uint32_t maxWidth, uint32_t maxHeight)
 {
-   DIR     *dir;
-   dirent  *ent;
-   bool     res = true;
-   std::set<std::string> filenames;
+   MappedFile file;
+   if(!file.open(fullname.c_str()))
+   {
+      bmpOut = nullptr;
+      return false;
+   }
 
-   if(!ScanMgr_ConnectToShare())
+   return (bmpOut = ScanMgr_DecodePage(file.data(), file.size(), maxWidth, maxHeight)) != nullptr;
+}
+
+//
+// Find the page container among a document's files, for a document stored
+// in one; see doccontainer.cpp. Returns nullptr for a document stored as a
+// file per page.
+//
+static const docmanifestentry_t *ScanMgr_FindContainer(const DocManifest &listing)
+{
+   for(const auto &entry : listing)
+   {
+      if(DocManifest_IsContainer(entry.name))
+         return &entry;
+   }
+   return nullptr;
+}
+
+//
+// Decode one page of a container. Containers are read rather than mapped,
+// since they are usually on the share, and only the page table and the pages
+// asked for are read.
+//
+static Gdiplus::Bitmap *ScanMgr_DecodeContainerPage(DocContainerReader &reader, size_t page,
+                                                   uint32_t maxWidth, uint32_t maxHeight)
+{
+   std::vector<uint8_t> data;
+   if(!reader.readPage(page, data))
+      return nullptr;
+
+   return ScanMgr_DecodePage(data.data(), data.size(), maxWidth, maxHeight);
+}
+
+//
+// Delete the page files extracted from a container, along with the
+// directory they were written to.
+//
+static void ScanMgr_DeleteExtractedFiles(const std::string &outDir, const std::set<std::string> &filenames)
+{
+   for(const auto &fn : filenames)
+      DeleteFileA(fn.c_str());
+   RemoveDirectoryA(outDir.c_str());
+}
+
+//
+// Write the pages of a container out as JPEG files in the user's temporary
+// directory, for programs that want a file per page. The files are patient
+// data outside of any cache budget, so the caller must delete them with
+// ScanMgr_DeleteDocumentImagePaths as soon as it is done with them; nothing
+// is left behind if extraction fails.
+//
+static bool ScanMgr_ExtractContainerPages(const std::string &inpath, const docmanifestentry_t &container,
+                                          std::set<std::string> &filenames, std::string &outDir)
+{
+   DocContainerReader reader;
+   if(!reader.open(FileCache::PathConcatenate(inpath, container.name)))
       return false;
-   
-   if(!(dir = opendir(inpath.c_str())))
+
+   char  tempPath[MAX_PATH + 1];
+   DWORD len = GetTempPathA(sizeof(tempPath), tempPath);
+   if(!len || len > MAX_PATH)
       return false;
 
-   while((ent = readdir(dir)))
+   std::string docID = FileCache::GetFileSpec(FileCache::RemoveTrailingSlash(inpath)).second;
+   outDir = FileCache::PathConcatenate(tempPath, "ScanManager");
+   CreateDirectoryA(outDir.c_str(), nullptr);
+   outDir = FileCache::PathConcatenate(outDir, docID);
+   if(!CreateDirectoryA(outDir.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
    {
-      if(!strstr(ent->d_name, ".jpg"))
-         continue;
-
-      // put the file names into a set so they will come out in numeric order.
-      filenames.insert(ent->d_name);
+      outDir.clear();
+      return false;
    }
 
-   closedir(dir);
-
-   for(auto &fn : filenames)
+   std::vector<uint8_t> data;
+   for(size_t i = 0; i < reader.index().size(); i++)
    {
-      auto node = new ImageNode();
-      node->hBitmap   = nullptr;
-      node->gdiBitmap = nullptr;
+      char filename[16];
+      _snprintf(filename, sizeof(filename), "%08d.jpg", int(i));
+      std::string path = FileCache::PathConcatenate(outDir, filename);
+      filenames.insert(path);
 
-      if((res = ScanMgr_ReadDocumentFile(inpath, fn, node->gdiBitmap)))
-         list.tailInsert(node);
-      else
+      bool ok = reader.readPage(i, data);
+      if(ok)
+      {
+         FILE *f = fopen(path.c_str(), "wb");
+         ok = (f != nullptr);
+         if(ok)
+         {
+            ok = (fwrite(data.data(), 1, data.size(), f) == data.size());
+            ok = !fclose(f) && ok;
+         }
+      }
+      if(!ok)
       {
-         delete node;
-         res = false;
-         break;
+         ScanMgr_DeleteExtractedFiles(outDir, filenames);
+         filenames.clear();
+         outDir.clear();
+         return false;
       }
    }
 
-   return res;
+   return true;
 }
 
+//=============================================================================
+//
+// Interface
+//
+
 //
-// Get the paths of all JPEG images that are part of the document.
+// Load a single page of a document from the file named by path, which is
+// either a page file or, for a document stored in a container, the container
+// holding the page with the given index. The page is decoded no larger than
+// needed to show it within maxWidth x maxHeight; pass 0 for both to load it
+// at full resolution. Returns nullptr if the page cannot be loaded. Safe to
+// call on worker threads, provided the share is already connected.
 //
-bool ScanMgr_GetDocumentImagePaths(const std::string &inpath, std::set<std::string> &filenames)
+Gdiplus::Bitmap *ScanMgr_ReadDocumentPage(const std::string &path, size_t page, uint32_t maxWidth, uint32_t maxHeight)
 {
-   DIR     *dir;
-   dirent  *ent;
-   bool     res = true;
+   if(DocManifest_IsContainer(path))
+   {
+      DocContainerReader reader;
+      if(!reader.open(path))
+         return nullptr;
 
-   if(!ScanMgr_ConnectToShare())
-      return false;
-   
-   if(!(dir = opendir(inpath.c_str())))
+      return ScanMgr_DecodeContainerPage(reader, page, maxWidth, maxHeight);
+   }
+
+   Gdiplus::Bitmap *bitmap;
+   return ScanMgr_ReadDocumentFile(path, bitmap, maxWidth, maxHeight) ? bitmap : nullptr;
+}
+
+//
+// Get the paths of all JPEG images that are part of the document. The pages
+// of a document stored in a container are first extracted to files of their
+// own in the user's temporary directory, which is returned in tempDir; it is
+// left empty when the paths are of the document's own files. Pass tempDir to
+// ScanMgr_DeleteDocumentImagePaths once the files have been used.
+//
+bool ScanMgr_GetDocumentImagePaths(const std::string &inpath, std::set<std::string> &filenames,
+                                   std::string &tempDir)
+{
+   tempDir.clear();
+
+   DocManifest listing;
+   if(!ScanMgr_ListDocument(inpath, listing))
       return false;
 
-   while((ent = readdir(dir)))
-   {
-      if(!strstr(ent->d_name, ".jpg"))
-         continue;
+   if(const docmanifestentry_t *container = ScanMgr_FindContainer(listing))
+      return ScanMgr_ExtractContainerPages(inpath, *container, filenames, tempDir);
 
-      filenames.insert(inpath + "\\" + ent->d_name);
+   for(const auto &entry : listing)
+   {
+      if(DocManifest_IsPage(entry.name))
+         filenames.insert(FileCache::PathConcatenate(inpath, entry.name));
    }
 
-   closedir(dir);
-
-   return res;
+   return true;
 }
 
 //
-// Find a PDF document filepath from the path that was saved in the database.
+// Delete the files extracted by ScanMgr_GetDocumentImagePaths into tempDir,
+// if it extracted any. The document's own files are never touched.
 //
-bool ScanMgr_ReadPDFDocumentFromPath(const std::string &inpath, std::string &outpath)
+void ScanMgr_DeleteDocumentImagePaths(const std::set<std::string> &filenames, const std::string &tempDir)
 {
-   DIR     *dir;
-   dirent  *ent;
-   bool     res = false;
+   if(!tempDir.empty())
+      ScanMgr_DeleteExtractedFiles(tempDir, filenames);
+}
 
-   if(!ScanMgr_ConnectToShare())
-      return false;
-   
-   if(!(dir = opendir(inpath.c_str())))
+//
+// Get the page images of a document in page order, along with their sizes
+// in pixels where the document's manifest records them; see
+// docmanifestentry_t. For a document stored in a container, every page's
+// entry names the container, with the size and checksum of the container
+// and the dimensions of the page; the page's index within the container is
+// its position in pages.
+//
+bool ScanMgr_GetDocumentPages(const std::string &inpath, DocManifest &pages)
+{
+   DocManifest listing;
+   if(!ScanMgr_ListDocument(inpath, listing))
       return false;
 
-   while((ent = readdir(dir)))
+   pages.clear();
+
+   if(const docmanifestentry_t *container = ScanMgr_FindContainer(listing))
    {
-      if(!strstr(ent->d_name, ".pdf") && !strstr(ent->d_name, ".PDF"))
-         continue;
+      DocContainerReader reader;
+      if(!reader.open(FileCache::PathConcatenate(inpath, container->name)))
+         return false;
 
-      outpath = FileCache::PathConcatenate(inpath, ent->d_name);
-      res = true;
-      break; // there is only one PDF in the directory
+      for(const auto &page : reader.index())
+      {
+         docmanifestentry_t entry = *container;
+         entry.width  = page.width;
+         entry.height = page.height;
+         pages.push_back(entry);
+      }
+      return true;
    }
 
-   closedir(dir);
+   for(const auto &entry : listing)
+   {
+      if(DocManifest_IsPage(entry.name))
+         pages.push_back(entry);
+   }
+
+   return true;
+}
+
+//
+// Find the PDF file of a PDF document, along with its size and checksum
+// where the document's manifest records them.
+//
+bool ScanMgr_GetDocumentPDF(const std::string &inpath, docmanifestentry_t &pdf)
+{
+   DocManifest listing;
+   if(!ScanMgr_ListDocument(inpath, listing))
+      return false;
 
-   return res;
+   for(const auto &entry : listing)
+   {
+      if(DocManifest_IsPDF(entry.name))
+      {
+         pdf = entry;
+         return true; // there is only one PDF in the directory
+      }
+   }
+
+   return false;
 }
 
 // EOF
@@ -7,13 +7,18 @@
 #ifndef DOCREAD_H__
 #define DOCREAD_H__
 
+#include <stdint.h>
 #include <set>
+#include "docmanifest.h"
 #include "imagelist.h"
 
 void ScanMgr_DeleteImageBuffers();
-bool ScanMgr_ReadDocumentFromPath(const std::string &inpath, ImageList &list);
-bool ScanMgr_GetDocumentImagePaths(const std::string &inpath, std::set<std::string> &filenames);
-bool ScanMgr_ReadPDFDocumentFromPath(const std::string &inpath, std::string &outpath);
+Gdiplus::Bitmap *ScanMgr_ReadDocumentPage(const std::string &path, size_t page, uint32_t maxWidth, uint32_t maxHeight);
+bool ScanMgr_GetDocumentImagePaths(const std::string &inpath, std::set<std::string> &filenames,
+                                   std::string &tempDir);
+void ScanMgr_DeleteDocumentImagePaths(const std::set<std::string> &filenames, const std::string &tempDir);
+bool ScanMgr_GetDocumentPages(const std::string &inpath, DocManifest &pages);
+bool ScanMgr_GetDocumentPDF(const std::string &inpath, docmanifestentry_t &pdf);
 
 #endif
 
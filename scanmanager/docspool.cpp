@@ -0,0 +1,426 @@
+/*
+  Scan Manager
+
+  Local document spool and background uploader
+
+  Saving used to write every page straight onto the file share, holding up
+  the UI for the whole transfer and leaving a half-written document behind
+  whenever the share went away partway through. Pages are now encoded into a
+  directory on the local disk, which is quick and dependable, and a worker
+  thread moves them to the share afterward. The document record is only
+  written once the pages are published, so the database never points at a
+  document that is not all there. A spooled document outlives the session
+  that saved it; if Scan Manager exits or crashes first, the upload is
+  resumed the next time the same user starts it.
+*/
+
+#include <Windows.h>
+#include <ShlObj.h>
+#include <chrono>
+#include <system_error>
+#include <stdio.h>
+#include <string.h>
+#include "cached_files.h"
+#include "docspool.h"
+#include "docwrite.h"
+#include "i_opndir.h"
+#include "inifile.h"
+#include "util.h"
+
+// Ini section for document writer settings
+#define DOCSPOOL_SECTION "docwrite"
+
+// Name of the file holding a spooled document's record fields
+#define DOCSPOOL_JOBFILE "spool.job"
+
+// Suffix of the job file while it is being written
+#define DOCSPOOL_TEMPSUFFIX ".tmp"
+
+// Upload attempts per document, and the delay before the first retry. The
+// delay doubles after each failed attempt up to the maximum, so a document
+// is given up on after about a minute.
+#define DOCSPOOL_MAXATTEMPTS 6
+#define DOCSPOOL_RETRYMS     2000
+#define DOCSPOOL_MAXRETRYMS  60000
+
+//=============================================================================
+//
+// Spool directory
+//
+
+//
+// Get the local directory documents are spooled in, creating it if needed.
+// This is ScanManager\Spool under the user's local application data unless
+// set in the ini file:
+//
+// [docwrite]
+// spooldir=D:\ScanSpool
+//
+bool DocSpool_GetBasePath(std::string &path)
+{
+   if(IniFile::GetIniValue(DOCSPOOL_SECTION, "spooldir", path))
+   {
+      path = FileCache::RemoveTrailingSlash(path);
+      return (CreateDirectoryA(path.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS);
+   }
+
+   char localAppData[_MAX_PATH + 1];
+   memset(localAppData, 0, sizeof(localAppData));
+   if(SHGetFolderPathA(nullptr, CSIDL_LOCAL_APPDATA, nullptr, SHGFP_TYPE_CURRENT, localAppData) != S_OK)
+      return false;
+
+   FileCache::SetBasePath(localAppData);
+   if(!FileCache::CreateDirectoryRecursive("ScanManager\\Spool"))
+      return false;
+
+   path = FileCache::PathConcatenate(localAppData, "ScanManager\\Spool");
+   return true;
+}
+
+//
+// Save a spooled document's record fields beside its pages. The file is
+// written under a temporary name and renamed, so that a job file is never
+// seen half-written; a spool directory without one is incomplete and is
+// never uploaded.
+//
+bool DocSpool_WriteJobFile(const docspooljob_t &job)
+{
+   std::string path    = FileCache::PathConcatenate(job.spoolPath, DOCSPOOL_JOBFILE);
+   std::string tmpPath = path + DOCSPOOL_TEMPSUFFIX;
+
+   FILE *f = fopen(tmpPath.c_str(), "w");
+   if(!f)
+      return false;
+
+   fprintf(f, "user=%d\n",   job.userID);
+   fprintf(f, "person=%s\n", job.personID.c_str());
+   fprintf(f, "title=%s\n",  job.title.c_str());
+   fprintf(f, "date=%s\n",   job.date.c_str());
+   fprintf(f, "type=%s\n",   job.type.c_str());
+
+   bool ok = !ferror(f);
+   if(fclose(f))
+      ok = false;
+
+   if(ok)
+      ok = (MoveFileExA(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH) != 0);
+   if(!ok)
+      remove(tmpPath.c_str());
+
+   return ok;
+}
+
+//
+// Load the record fields of a document in the spool.
+//
+static bool DocSpool_ReadJobFile(const std::string &spoolPath, docspooljob_t &job)
+{
+   std::string path = FileCache::PathConcatenate(spoolPath, DOCSPOOL_JOBFILE);
+
+   FILE *f = fopen(path.c_str(), "r");
+   if(!f)
+      return false;
+
+   job.id        = FileCache::GetFileSpec(spoolPath).second;
+   job.spoolPath = spoolPath;
+   job.userID    = 0;
+
+   char line[1024];
+   while(fgets(line, sizeof(line), f))
+   {
+      line[strcspn(line, "\r\n")] = '\0';
+
+      std::string key, value;
+      if(!SplitKeyValue(line, key, value))
+         continue;
+
+      if(key == "user")
+         job.userID = StringToInt(value);
+      else if(key == "person")
+         job.personID = value;
+      else if(key == "title")
+         job.title = value;
+      else if(key == "date")
+         job.date = value;
+      else if(key == "type")
+         job.type = value;
+   }
+
+   fclose(f);
+   return (job.userID != 0);
+}
+
+//
+// Delete a document's spool directory once it is no longer needed.
+//
+void DocSpool_Discard(const docspooljob_t &job)
+{
+   if(!job.spoolPath.empty())
+      ScanMgr_RemoveFailedDocument(job.spoolPath);
+}
+
+//=============================================================================
+//
+// Uploader
+//
+
+DocSpool::DocSpool()
+   : m_queue(), m_results(), m_thread(), m_mutex(), m_wake(), m_stopping(false),
+     m_uploading(false), m_hNotifyWnd(nullptr), m_notifyMsg(0)
+{
+}
+
+DocSpool::~DocSpool()
+{
+   stop();
+}
+
+//
+// Make one attempt at publishing a spooled document. Its files are copied
+// into its staging directory on the share, which is then renamed into
+// place. A document found already under its final name was published by an
+// earlier attempt that did not get to report it.
+//
+bool DocSpool::publish(const docspooljob_t &job, std::string &sharePath, std::string &errorMsg)
+{
+   if(!ScanMgr_ConnectToShare())
+   {
+      errorMsg = "Cannot connect to CHS document file share.";
+      return false;
+   }
+
+   std::string finalPath = FileCache::PathConcatenate(ScanMgr_GetShareBase(), job.id);
+
+   DWORD attrs = GetFileAttributesA(finalPath.c_str());
+   if(attrs != INVALID_FILE_ATTRIBUTES && (attrs & FILE_ATTRIBUTE_DIRECTORY))
+   {
+      sharePath = finalPath;
+      return true;
+   }
+
+   std::string tmpPath;
+   if(!ScanMgr_CreateStagingDir(job.id, tmpPath))
+   {
+      errorMsg = "Cannot create a new document directory.";
+      return false;
+   }
+
+   DIR *dir = opendir(job.spoolPath.c_str());
+   if(!dir)
+   {
+      errorMsg = "Cannot read the document spool directory " + job.spoolPath + ".";
+      return false;
+   }
+
+   bool    ok = true;
+   dirent *ent;
+   while(ok && (ent = readdir(dir)))
+   {
+      if(ent->d_name[0] == '.' || !strcmp(ent->d_name, DOCSPOOL_JOBFILE))
+         continue;
+
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         if(m_stopping)
+         {
+            errorMsg = "Upload was interrupted.";
+            ok = false;
+            break;
+         }
+      }
+
+      std::string srcPath = FileCache::PathConcatenate(job.spoolPath, ent->d_name);
+      std::string dstPath = FileCache::PathConcatenate(tmpPath, ent->d_name);
+      if(!CopyFileA(srcPath.c_str(), dstPath.c_str(), FALSE))
+      {
+         errorMsg = "Could not copy " + std::string(ent->d_name) + " to the document file share.";
+         ok = false;
+      }
+   }
+   closedir(dir);
+
+   if(ok && !ScanMgr_PublishStagingDir(tmpPath, sharePath))
+   {
+      errorMsg = "Could not publish the document directory " + finalPath + ".";
+      ok = false;
+   }
+
+   return ok;
+}
+
+//
+// Wait out the delay after a failed upload attempt. Returns false if the
+// spool is stopped in the meantime.
+//
+bool DocSpool::waitForRetry(unsigned attempt)
+{
+   DWORD delay = DOCSPOOL_RETRYMS;
+   while(attempt-- && delay < DOCSPOOL_MAXRETRYMS)
+      delay *= 2;
+   if(delay > DOCSPOOL_MAXRETRYMS)
+      delay = DOCSPOOL_MAXRETRYMS;
+
+   std::unique_lock<std::mutex> lock(m_mutex);
+   return !m_wake.wait_for(lock, std::chrono::milliseconds(delay), [this] { return m_stopping; });
+}
+
+//
+// Worker thread body: publish queued documents one at a time until the
+// spool stops. A document still being uploaded when that happens stays in
+// the spool for the next session. Leftovers in the share's staging area are
+// cleaned up first, while the user is still getting started.
+//
+void DocSpool::workerLoop()
+{
+   if(ScanMgr_ConnectToShare())
+      ScanMgr_CollectStagingGarbage();
+
+   std::unique_lock<std::mutex> lock(m_mutex);
+
+   for(;;)
+   {
+      m_wake.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+      if(m_stopping)
+         break;
+
+      docspoolresult_t result;
+      result.job       = m_queue.front();
+      result.published = false;
+      m_queue.pop_front();
+      m_uploading = true;
+
+      lock.unlock();
+      for(unsigned attempt = 0; ; attempt++)
+      {
+         if((result.published = publish(result.job, result.sharePath, result.errorMsg)))
+            break;
+         if(attempt + 1 >= DOCSPOOL_MAXATTEMPTS || !waitForRetry(attempt))
+            break;
+      }
+      lock.lock();
+
+      m_uploading = false;
+      if(m_stopping)
+         break;
+
+      // what was uploaded of a document given up on is left to be collected
+      if(!result.published)
+         ScanMgr_AbandonStagingDir(ScanMgr_GetStagingPath(result.job.id));
+
+      m_results.push_back(result);
+      PostMessage(m_hNotifyWnd, m_notifyMsg, 0, 0);
+   }
+}
+
+//
+// Start the uploader thread. The notify message is posted to the given
+// window each time a document has been published or given up on.
+//
+bool DocSpool::start(HWND hNotifyWnd, UINT notifyMsg)
+{
+   stop();
+
+   m_stopping   = false;
+   m_hNotifyWnd = hNotifyWnd;
+   m_notifyMsg  = notifyMsg;
+
+   try
+   {
+      m_thread = std::thread(&DocSpool::workerLoop, this);
+   }
+   catch(const std::system_error &)
+   {
+      return false;
+   }
+
+   return true;
+}
+
+//
+// Stop the uploader. Queued documents remain in the spool directory.
+//
+void DocSpool::stop()
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+   }
+   m_wake.notify_all();
+
+   if(m_thread.joinable())
+      m_thread.join();
+
+   m_queue.clear();
+}
+
+//
+// Queue a spooled document for upload.
+//
+void DocSpool::submit(const docspooljob_t &job)
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_queue.push_back(job);
+   }
+   m_wake.notify_all();
+}
+
+//
+// Queue any documents the given user spooled in an earlier session that
+// never got published. Returns the number of documents queued.
+//
+size_t DocSpool::resume(int userID)
+{
+   std::string basePath;
+   if(!DocSpool_GetBasePath(basePath))
+      return 0;
+
+   DIR *dir = opendir(basePath.c_str());
+   if(!dir)
+      return 0;
+
+   size_t  count = 0;
+   dirent *ent;
+   while((ent = readdir(dir)))
+   {
+      if(ent->d_name[0] == '.')
+         continue;
+
+      docspooljob_t job;
+      if(DocSpool_ReadJobFile(FileCache::PathConcatenate(basePath, ent->d_name), job) && job.userID == userID)
+      {
+         submit(job);
+         ++count;
+      }
+   }
+   closedir(dir);
+
+   return count;
+}
+
+//
+// Collect the outcome of a finished upload. Returns false if there is none.
+//
+bool DocSpool::takeResult(docspoolresult_t &result)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   if(m_results.empty())
+      return false;
+
+   result = m_results.front();
+   m_results.erase(m_results.begin());
+   return true;
+}
+
+//
+// Check whether any document is waiting for or in the middle of upload.
+//
+bool DocSpool::isBusy()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return (m_uploading || !m_queue.empty());
+}
+
+// EOF
+
@@ -0,0 +1,93 @@
+/*
+  Scan Manager
+
+  Local document spool and background uploader
+*/
+
+#ifndef DOCSPOOL_H__
+#define DOCSPOOL_H__
+
+#include <Windows.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//
+// A saved document waiting in the local spool to be published to the share.
+// The record fields are kept with the pages so that a document left behind
+// by an interrupted session can still be recorded once it is published.
+//
+struct docspooljob_t
+{
+   std::string id;        // name of the document directory, locally and on the share
+   std::string spoolPath; // local directory holding the encoded pages
+   int         userID;    // user who saved the document
+   std::string personID;  // fields of the document record
+   std::string title;
+   std::string date;
+   std::string type;
+};
+
+//
+// Outcome of publishing one spooled document.
+//
+struct docspoolresult_t
+{
+   docspooljob_t job;
+   bool          published; // true if the document is now on the share
+   std::string   sharePath; // directory the document was published to
+   std::string   errorMsg;  // reason for the last failure, if not published
+};
+
+//
+// Publishes spooled documents to the share on a background thread. Each
+// document is copied into its own directory in the hidden ~staging area at
+// the root of the share, then renamed from there to its final name, so that
+// it appears on the share whole or not at all. A failed attempt leaves its
+// staging directory to be reused by the retry; one abandoned by a crashed
+// session is deleted by the staging area's garbage collection, which the
+// worker runs when it starts. Failed attempts are retried with increasing
+// delays. Once a document has been published or given up on, notifyMsg is
+// posted to the notify window and the UI thread collects the outcome with
+// takeResult.
+//
+class DocSpool
+{
+protected:
+   std::deque<docspooljob_t>     m_queue;
+   std::vector<docspoolresult_t> m_results;
+   std::thread                   m_thread;
+   std::mutex                    m_mutex;
+   std::condition_variable       m_wake;
+   bool                          m_stopping;
+   bool                          m_uploading; // a job has been taken off the queue
+   HWND                          m_hNotifyWnd;
+   UINT                          m_notifyMsg;
+
+   bool publish(const docspooljob_t &job, std::string &sharePath, std::string &errorMsg);
+   bool waitForRetry(unsigned attempt);
+   void workerLoop();
+
+public:
+   DocSpool();
+   ~DocSpool();
+
+   bool start(HWND hNotifyWnd, UINT notifyMsg);
+   void stop();
+   void submit(const docspooljob_t &job);
+   size_t resume(int userID);
+   bool takeResult(docspoolresult_t &result);
+   bool isBusy();
+};
+
+bool DocSpool_GetBasePath(std::string &path);
+bool DocSpool_WriteJobFile(const docspooljob_t &job);
+void DocSpool_Discard(const docspooljob_t &job);
+
+#endif
+
+// EOF
+
@@ -5,15 +5,28 @@
 */
 
 #include <rpc.h>
+#include <atomic>
+#include <chrono>
 #include <exception>
+#include <mutex>
+#include <vector>
 #include <direct.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <Windows.h>
 #include <gdiplus.h>
 #include "cached_files.h"
+#include "doccontainer.h"
+#include "docmanifest.h"
+#include "docspool.h"
 #include "docwrite.h"
 #include "i_opndir.h"
 #include "imagelist.h"
+#include "inifile.h"
 #include "jpegimage.h"
+#include "jpegprofile.h"
+#include "memfile.h"
+#include "parallel.h"
 #include "prometheusdb.h"
 #include "promuser.h"
 #include "scanmanager.h"
@@ -32,8 +45,23 @@
 #define CHS_FILESHARE_USER "<chsdomain>\\<chsuser>"
 #define CHS_FILESHARE_PWD  "<chssharepwd>"
 
-// JPEG options
-#define SCANMGR_JPEG_QUALITY 100
+// Ini section for document writer settings
+#define SCANMGR_DOCWRITE_SECTION "docwrite"
+
+// Hidden directory under the share root that documents are assembled in
+// before being renamed into place, and the suffix given to assemblies that
+// failed or were withdrawn
+#define SCANMGR_STAGING_DIR  "~staging"
+#define SCANMGR_STAGING_DEAD ".dead"
+
+// Age after which an assembly still in the staging directory is taken to
+// have been abandoned by a crashed session, and the most directories one
+// garbage collection pass will delete
+#define SCANMGR_STAGING_MAXAGE  (24 * 60 * 60)
+#define SCANMGR_STAGING_GCBATCH 16
+
+// Upper bound on the memory held by page snapshots being encoded at once
+#define SCANMGR_ENCODE_MEMBUDGET ((sizeof(void *) > 4 ? 1024ull : 256ull) * 1024 * 1024)
 
 //
 // Module globals
@@ -42,6 +70,10 @@
 // Global file share network resource
 static NETRESOURCEA gnrFileShare;
 static bool         gShareConnected;
+static std::mutex   gShareMutex; // the share is connected from the upload thread too
+
+// Set once the staging directory is known to exist on the share
+static std::atomic<bool> gStagingReady;
 
 //=============================================================================
 //
@@ -73,127 +105,199 @@ static bool ScanMgr_GetUniqueDirectoryName(std::string &out)
 }
 
 //
-// Create a new uniquely named directory under the root file share for the new document.
+// Create a new uniquely named directory under basePath for a new document.
+// Whether a name is taken is learned from the create failing, rather than by
+// looking for the directory first, which over the share would cost a second
+// round trip every time to guard against a UUID collision that never comes.
+// Safe to call from any thread.
 //
 static bool ScanMgr_CreateNewDocumentDir(const std::string &basePath, std::string &out)
 {
-   bool ret = false;
    int dirsToTry = 100;
 
-   FileCache::SetBasePath(basePath);
-
    while(dirsToTry--)
    {
       std::string dirName;
-      if(ScanMgr_GetUniqueDirectoryName(dirName))
+      if(!ScanMgr_GetUniqueDirectoryName(dirName))
+         return false;
+
+      std::string combDirName = FileCache::PathConcatenate(basePath, dirName);
+      if(CreateDirectoryA(combDirName.c_str(), nullptr))
       {
-         std::string combDirName = FileCache::PathConcatenate(basePath, dirName);
-         if(!FileCache::DirectoryExists(combDirName, false))
-         {
-            if(FileCache::CreateDirectorySingle(dirName))
-            {
-               out = combDirName;
-               ret = true;
-               break;
-            }
-         }
+         out = combDirName;
+         return true;
       }
+      if(GetLastError() != ERROR_ALREADY_EXISTS)
+         return false; // no other name would fare any better
    }
 
-   return ret;
+   return false;
 }
 
-static int GetEncoderClsid(const WCHAR* format, CLSID* pClsid)
+//
+// Check whether image files should be written through the server's cache,
+// so that a document is on disk on the file server once its write returns.
+// Off unless set in the ini file:
+//
+// [docwrite]
+// writethrough=yes
+//
+static bool ScanMgr_UseWriteThrough()
 {
-   UINT num = 0;  // number of image encoders
-   UINT size = 0; // size of the image encoder array in bytes
+   return IniFile::GetIniFlag(SCANMGR_DOCWRITE_SECTION, "writethrough", false);
+}
 
-   Gdiplus::ImageCodecInfo *pImageCodecInfo = nullptr;
+//
+// Check whether new documents should be stored as a single page container
+// rather than a file per page; see doccontainer.cpp. Readers handle either,
+// so this can be changed at any time. Off unless set in the ini file:
+//
+// [docwrite]
+// container=yes
+//
+static bool ScanMgr_UseContainer()
+{
+   return IniFile::GetIniFlag(SCANMGR_DOCWRITE_SECTION, "container", false);
+}
 
-   Gdiplus::GetImageEncodersSize(&num, &size);
-   if(size == 0)
-      return -1;  // Failure
+//
+// Get a local share path to use in place of the CHS file share, if one is
+// set in the ini file. This is meant for testing without the server:
+//
+// [docwrite]
+// sharepath=C:\ScanTest\CHS
+//
+static bool ScanMgr_GetLocalShare(std::string &path)
+{
+   if(!IniFile::GetIniValue(SCANMGR_DOCWRITE_SECTION, "sharepath", path))
+      return false;
 
-   pImageCodecInfo = static_cast<Gdiplus::ImageCodecInfo *>(malloc(size));
-   if(pImageCodecInfo == nullptr)
-      return -1;  // Failure
+   path = FileCache::RemoveTrailingSlash(path);
+   return true;
+}
 
-   Gdiplus::GetImageEncoders(num, size, pImageCodecInfo);
+//
+// Check that a page's bitmap can be encoded.
+//
+static bool ScanMgr_CheckBitmap(DocWriteStatus &status, Gdiplus::Bitmap *bitmap)
+{
+   if(!bitmap)
+   {
+      status.code     = DOCWRITE_IMGWRITEFAILED;
+      status.errorMsg = "Invalid Gdiplus Bitmap object";
+      return false;
+   }
 
-   for(UINT j = 0; j < num; ++j)
+   if(bitmap->GetLastStatus() != Gdiplus::Ok)
    {
-      if(wcscmp(pImageCodecInfo[j].MimeType, format) == 0 )
-      {
-         *pClsid = pImageCodecInfo[j].Clsid;
-         free(pImageCodecInfo);
-         return j;  // Success
-      }    
+      status.code     = DOCWRITE_IMGWRITEFAILED;
+      status.errorMsg = "Gdiplus Bitmap object had bad status.";
+      return false;
    }
 
-   free(pImageCodecInfo);
-   return -1;  // Failure
+   return true;
 }
 
 //
 // Write one image file to the server share
 //
-static bool ScanMgr_WriteOneImage(DocWriteStatus &status, const std::string &path, ImageNode &node)
+// Takes a private snapshot of the page's pixels, so this may run on a worker
+// thread as long as no other thread touches the same Gdiplus bitmap. If
+// stripeThreads is more than one, the page itself is encoded in stripes on
+// that many threads. The page is compressed entirely in memory and then sent
+// to the share in one write; the time spent on each is added to status.
+// The file's size, dimensions and checksum are filled into its manifest
+// entry.
+//
+static bool ScanMgr_WriteOneImage(DocWriteStatus &status, const std::string &path, Gdiplus::Bitmap *bitmap,
+                                  const JPEGProfile &profile, unsigned stripeThreads, bool writeThrough,
+                                  docmanifestentry_t &entry)
 {
    try
    {
-      Gdiplus::Bitmap *bitmap;
-      Gdiplus::EncoderParameters encParams;
-
-      if(!node.gdiBitmap)
-         ScanMgr_HBITMAPToGdiplusBitmap(&node);
+      if(!ScanMgr_CheckBitmap(status, bitmap))
+         return false;
 
-      if(!(bitmap = node.gdiBitmap))
+      BitmapImage      image(bitmap);
+      jpegwritestats_t stats;
+      if(!image.writeJPEG(path.c_str(), profile, stripeThreads, writeThrough, &stats))
       {
          status.code     = DOCWRITE_IMGWRITEFAILED;
-         status.errorMsg = "Invalid Gdiplus Bitmap object";
+         status.errorMsg = "Could not create JPEG file " + path + ".";
          return false;
       }
 
-      if(bitmap->GetLastStatus() != Gdiplus::Ok)
-      {
-         status.code     = DOCWRITE_IMGWRITEFAILED;
-         status.errorMsg = "Gdiplus Bitmap object had bad status.";
+      status.bytesWritten += stats.bytes;
+      status.encodeMs     += stats.encodeMs;
+      status.writeMs      += stats.writeMs;
+
+      entry.name   = FileCache::GetFileSpec(path).second;
+      entry.size   = stats.bytes;
+      entry.width  = bitmap->GetWidth();
+      entry.height = bitmap->GetHeight();
+      entry.crc    = stats.crc;
+      return true;
+   }
+   catch(const std::exception &ex)
+   {
+      status.code     = DOCWRITE_IMGWRITEFAILED;
+      status.errorMsg = ex.what();
+      return false;
+   }
+   catch(...)
+   {
+      status.code     = DOCWRITE_IMGWRITEFAILED;
+      status.errorMsg = "An unknown error occurred during image writing.";
+      return false;
+   }
+}
+
+//
+// Encode one image into a document's page container
+//
+// As ScanMgr_WriteOneImage, except that the compressed page is appended to
+// the container instead of going to a file of its own.
+//
+static bool ScanMgr_WriteContainerPage(DocWriteStatus &status, DocContainerWriter &container, size_t page,
+                                       Gdiplus::Bitmap *bitmap, const JPEGProfile &profile, unsigned stripeThreads)
+{
+   try
+   {
+      if(!ScanMgr_CheckBitmap(status, bitmap))
          return false;
-      }
 
-      size_t reqSize = mbstowcs(nullptr, path.c_str(), 0);
-      std::unique_ptr<wchar_t []> upWCS(new wchar_t [reqSize + 1]);
-      size_t size = mbstowcs(upWCS.get(), path.c_str(), reqSize + 1);
-      if(size == size_t(-1))
+      BitmapImage image(bitmap);
+      CxMemFile   mem;
+      if(!mem.open())
       {
          status.code     = DOCWRITE_IMGWRITEFAILED;
-         status.errorMsg = "Could not convert filepath to wide char string.";
+         status.errorMsg = "Out of memory encoding page.";
          return false;
       }
 
-      CLSID jpegCLSID;
-      if(GetEncoderClsid(L"image/jpeg", &jpegCLSID) < 0)
+      auto start = std::chrono::steady_clock::now();
+
+      if(!image.writeJPEG(&mem, profile, stripeThreads))
       {
          status.code     = DOCWRITE_IMGWRITEFAILED;
-         status.errorMsg = "Could not retrieve CLSID for image/jpeg MIME type.";
+         status.errorMsg = "Could not encode page.";
          return false;
       }
 
-      encParams.Count = 1;
-      encParams.Parameter[0].Guid = Gdiplus::EncoderQuality;
-      encParams.Parameter[0].Type = Gdiplus::EncoderParameterValueTypeLong;
-      encParams.Parameter[0].NumberOfValues = 1;
+      auto encoded = std::chrono::steady_clock::now();
 
-      ULONG quality = SCANMGR_JPEG_QUALITY;
-      encParams.Parameter[0].Value = &quality;
-
-      if(bitmap->Save(upWCS.get(), &jpegCLSID, &encParams) != Gdiplus::Ok)
+      if(!container.writePage(page, mem.getBuffer(false), size_t(mem.size()), bitmap->GetWidth(), bitmap->GetHeight()))
       {
          status.code     = DOCWRITE_IMGWRITEFAILED;
-         status.errorMsg = "Could not save Gdiplus image to JPEG.";
+         status.errorMsg = "Could not write page to the document container.";
          return false;
       }
 
+      auto written = std::chrono::steady_clock::now();
+
+      status.bytesWritten += uint64_t(mem.size());
+      status.encodeMs     += std::chrono::duration<double, std::milli>(encoded - start).count();
+      status.writeMs      += std::chrono::duration<double, std::milli>(written - encoded).count();
       return true;
    }
    catch(const std::exception &ex)
@@ -213,50 +317,141 @@ static bool ScanMgr_WriteOneImage(DocWriteStatus &status, const std::string &pat
 //
 // Write out a list of images to the server share
 //
+// Pages are encoded and written concurrently. Each worker snapshots one page
+// at a time, so the number of workers is capped by the memory the snapshots
+// of the largest page would need. File names follow list order no matter
+// which page finishes first; the first failure is reported and stops any
+// pages that have not started yet. If so configured, the pages go into a
+// single container file instead of a file each. A manifest listing the
+// document's files is written last.
+//
 static bool ScanMgr_WriteImageList(DocWriteStatus &status, const std::string &basePath, const ImageList &il)
 {
-   auto img = il.head;
-   char filename[16];
-   int  imagenum = 0;
+   std::vector<Gdiplus::Bitmap *> bitmaps;
+   uint64_t largestPage = 0;
 
-   while(img)
+   // Gdiplus objects for scanned pages are created on demand; do it here on
+   // the calling thread before any worker looks at them.
+   for(auto img = il.head; img; img = img->dllNext)
    {
-      _snprintf(filename, sizeof(filename), "%08d.jpg", imagenum++);
-      std::string fullpath = FileCache::PathConcatenate(basePath, filename);
+      ImageNode *node = img->dllObject;
+      if(!node->gdiBitmap)
+         ScanMgr_HBITMAPToGdiplusBitmap(node);
 
-      if(!ScanMgr_WriteOneImage(status, fullpath, *(img->dllObject)))
-         return false;
+      Gdiplus::Bitmap *bitmap = node->gdiBitmap;
+      if(bitmap)
+      {
+         uint64_t pageSize = uint64_t(bitmap->GetWidth()) * bitmap->GetHeight() * 3;
+         if(pageSize > largestPage)
+            largestPage = pageSize;
+      }
+      bitmaps.push_back(bitmap);
+   }
 
-      img = img->dllNext;
+   unsigned numCores   = Parallel_NumCores();
+   unsigned numThreads = numCores;
+   if(largestPage && uint64_t(numThreads) * largestPage > SCANMGR_ENCODE_MEMBUDGET)
+      numThreads = unsigned(SCANMGR_ENCODE_MEMBUDGET / largestPage);
+   if(numThreads > bitmaps.size())
+      numThreads = unsigned(bitmaps.size());
+   if(numThreads < 1)
+      numThreads = 1;
+
+   // cores left idle by too few pages (or too little memory for more page
+   // snapshots) go to encoding the stripes of each page
+   unsigned stripeThreads = numCores / numThreads;
+
+   const JPEGProfile &profile      = JPEGProfile_Default();
+   const bool         writeThrough = ScanMgr_UseWriteThrough();
+   const bool         useContainer = !bitmaps.empty() && ScanMgr_UseContainer();
+
+   DocContainerWriter container;
+   if(useContainer && !container.create(basePath, bitmaps.size(), writeThrough))
+   {
+      status.code     = DOCWRITE_IMGWRITEFAILED;
+      status.errorMsg = "Could not create the document container in " + basePath + ".";
+      return false;
    }
 
+   std::mutex        statusMutex;
+   std::atomic<bool> failed(false);
+   DocManifest       manifest(bitmaps.size());
+
+   Parallel_For(bitmaps.size(), numThreads, [&] (size_t imagenum) {
+      if(failed)
+         return;
+
+      DocWriteStatus pageStatus;
+      bool ok;
+      if(useContainer)
+         ok = ScanMgr_WriteContainerPage(pageStatus, container, imagenum, bitmaps[imagenum], profile, stripeThreads);
+      else
+      {
+         char filename[16];
+         _snprintf(filename, sizeof(filename), "%08d.jpg", int(imagenum));
+         std::string fullpath = FileCache::PathConcatenate(basePath, filename);
+
+         ok = ScanMgr_WriteOneImage(pageStatus, fullpath, bitmaps[imagenum], profile, stripeThreads, writeThrough,
+                                    manifest[imagenum]);
+      }
+
+      std::lock_guard<std::mutex> lock(statusMutex);
+      status.bytesWritten += pageStatus.bytesWritten;
+      status.encodeMs     += pageStatus.encodeMs;
+      status.writeMs      += pageStatus.writeMs;
+      if(!ok && !failed.exchange(true))
+      {
+         status.code     = pageStatus.code;
+         status.errorMsg = pageStatus.errorMsg;
+      }
+   });
+
+   if(failed)
+      return false; // an unfinished container is deleted with its writer
+
+   if(useContainer)
+   {
+      docmanifestentry_t entry;
+      if(!container.finish(entry))
+      {
+         status.code     = DOCWRITE_IMGWRITEFAILED;
+         status.errorMsg = "Could not finish the document container in " + basePath + ".";
+         return false;
+      }
+      manifest.assign(1, entry);
+   }
+
+   // a manifest that fails to write is not an error; readers fall back to
+   // listing the directory without one
+   DocManifest_Write(basePath, manifest);
+
    return true;
 }
 
 //
-// Copy a single PDF file to the server share
+// Copy a single PDF file to the server share, along with a manifest
+// listing it. The checksum for the manifest is taken as the file is copied.
 //
-static bool ScanMgr_WritePDFFile(DocWriteStatus &status, const std::string &basePath, const std::string &srcPath)
+static bool ScanMgr_WritePDFFile(DocWriteStatus &status, const std::string &basePath, const std::string &srcPath,
+                                 const filecopyprogress_t &progress)
 {
    std::string filename = FileCache::GetFileSpec(srcPath).second;
    std::string destPath = FileCache::PathConcatenate(basePath, filename);
 
-   if(CopyFileA(srcPath.c_str(), destPath.c_str(), TRUE) != 0)
+   filecopystats_t  stats;
+   filecopyresult_e result = FileCopy_Copy(srcPath, destPath, true, progress, &stats);
+   if(result == FILECOPY_OK)
    {
+      docmanifestentry_t entry = { filename, stats.bytes, 0, 0, stats.crc };
+      DocManifest_Write(basePath, DocManifest(1, entry));
+
+      status.bytesWritten = stats.bytes;
       return true;
    }
    else
    {
-      LPVOID lpMsgBuf;
-      DWORD  err = GetLastError();
-
-      FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER|FORMAT_MESSAGE_FROM_SYSTEM|FORMAT_MESSAGE_IGNORE_INSERTS,
-                     nullptr, err, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&lpMsgBuf, 0, nullptr);
-
-      status.code     = DOCWRITE_IMGWRITEFAILED;
-      status.errorMsg = (LPSTR)lpMsgBuf;
-
-      LocalFree(lpMsgBuf);
+      status.code     = (result == FILECOPY_CANCELLED) ? DOCWRITE_CANCELLED : DOCWRITE_IMGWRITEFAILED;
+      status.errorMsg = FileCopy_ResultMessage(result);
       return false;
    }
 }
@@ -271,9 +466,15 @@ static bool ScanMgr_WritePDFFile(DocWriteStatus &status, const std::string &base
 //
 bool ScanMgr_ConnectToShare()
 {
+   std::lock_guard<std::mutex> lock(gShareMutex);
+
    if(gShareConnected)
       return true; // already connected
 
+   std::string localShare;
+   if(ScanMgr_GetLocalShare(localShare))
+      return true; // nothing to connect to
+
    DWORD code = ScanMgr_AuthenticateShare(gnrFileShare, CHS_FILESHARE_BASE, CHS_FILESHARE_USER, CHS_FILESHARE_PWD);
 
    return (gShareConnected = (code == NO_ERROR));
@@ -284,11 +485,231 @@ bool ScanMgr_ConnectToShare()
 //
 void ScanMgr_CloseShare()
 {
+   std::lock_guard<std::mutex> lock(gShareMutex);
+
    if(gShareConnected)
       ScanMgr_DisconnectShare(gnrFileShare);
    gShareConnected = false;
 }
 
+//
+// Get the root of the document file share.
+//
+std::string ScanMgr_GetShareBase()
+{
+   std::string localShare;
+   if(ScanMgr_GetLocalShare(localShare))
+      return localShare;
+
+   return CHS_FILESHARE_BASE;
+}
+
+//=============================================================================
+//
+// Document publishing
+//
+// A document is assembled in a directory under the hidden staging directory
+// on the share, which is on the same volume as the share root, and made
+// visible to readers with a single rename once it is complete. A failed or
+// withdrawn document is disposed of with another rename, into a dead
+// directory in the staging area, rather than file by file. Dead directories
+// and those left behind by crashed sessions are deleted in bulk later by
+// ScanMgr_CollectStagingGarbage.
+//
+// These functions may be called from any thread.
+//
+
+//
+// Get the path of the staging directory for the document with the given
+// directory name.
+//
+std::string ScanMgr_GetStagingPath(const std::string &id)
+{
+   return FileCache::PathConcatenate(FileCache::PathConcatenate(ScanMgr_GetShareBase(), SCANMGR_STAGING_DIR), id);
+}
+
+//
+// Make sure the staging area exists, creating it if this is the first use of
+// the share. It is only created once per session; if it has gone missing
+// since, creating a directory in it fails with ERROR_PATH_NOT_FOUND and the
+// caller passes recreate to try again.
+//
+static bool ScanMgr_CreateStagingBase(std::string &stagingBase, bool recreate)
+{
+   stagingBase = FileCache::PathConcatenate(ScanMgr_GetShareBase(), SCANMGR_STAGING_DIR);
+
+   if(gStagingReady && !recreate)
+      return true;
+
+   if(CreateDirectoryA(stagingBase.c_str(), nullptr))
+      SetFileAttributesA(stagingBase.c_str(), FILE_ATTRIBUTE_HIDDEN);
+   else if(GetLastError() != ERROR_ALREADY_EXISTS)
+      return false;
+
+   gStagingReady = true;
+   return true;
+}
+
+//
+// Create the staging directory for a document, and the staging area itself
+// if needed. An existing staging directory, from an earlier attempt at the
+// same document, is reused.
+//
+bool ScanMgr_CreateStagingDir(const std::string &id, std::string &out)
+{
+   for(int attempt = 0; attempt < 2; attempt++)
+   {
+      std::string stagingBase;
+      if(!ScanMgr_CreateStagingBase(stagingBase, attempt > 0))
+         return false;
+
+      out = FileCache::PathConcatenate(stagingBase, id);
+      if(CreateDirectoryA(out.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS)
+         return true;
+      if(GetLastError() != ERROR_PATH_NOT_FOUND)
+         break;
+   }
+
+   return false;
+}
+
+//
+// Create a staging directory for a new document under a fresh name, which
+// is returned in id.
+//
+static bool ScanMgr_CreateNewStagingDir(std::string &id, std::string &out)
+{
+   for(int attempt = 0; attempt < 2; attempt++)
+   {
+      std::string stagingBase;
+      if(!ScanMgr_CreateStagingBase(stagingBase, attempt > 0))
+         return false;
+
+      if(ScanMgr_CreateNewDocumentDir(stagingBase, out))
+      {
+         id = FileCache::GetFileSpec(out).second;
+         return true;
+      }
+      if(GetLastError() != ERROR_PATH_NOT_FOUND)
+         break;
+   }
+
+   return false;
+}
+
+//
+// Move a complete document from the staging area to the share root. On
+// success, sharePath receives its published location.
+//
+bool ScanMgr_PublishStagingDir(const std::string &stagingPath, std::string &sharePath)
+{
+   std::string id   = FileCache::GetFileSpec(stagingPath).second;
+   std::string dest = FileCache::PathConcatenate(ScanMgr_GetShareBase(), id);
+
+   if(!MoveFileA(stagingPath.c_str(), dest.c_str()))
+      return false;
+
+   sharePath = dest;
+   return true;
+}
+
+//
+// Move a document directory into the staging area under a dead name, to be
+// deleted by the next garbage collection. Each dead name is new, made from
+// the time and a serial number, since an earlier withdrawal of the same
+// document may still be waiting there to be collected.
+//
+static bool ScanMgr_MoveToDead(const std::string &path)
+{
+   static std::atomic<unsigned int> deadSerial(0);
+
+   std::string id = FileCache::GetFileSpec(path).second;
+
+   for(int attempt = 0; attempt < 4; attempt++)
+   {
+      char suffix[48];
+      _snprintf(suffix, sizeof(suffix), ".%llx-%u" SCANMGR_STAGING_DEAD,
+                static_cast<unsigned long long>(time(nullptr)), ++deadSerial);
+      suffix[sizeof(suffix) - 1] = '\0';
+
+      std::string dead = ScanMgr_GetStagingPath(id + suffix);
+      if(MoveFileA(path.c_str(), dead.c_str()))
+         return true;
+      if(GetLastError() != ERROR_ALREADY_EXISTS)
+         break;
+   }
+
+   return false;
+}
+
+//
+// Mark a staging directory for deletion by the next garbage collection.
+// If it cannot even be renamed, it is collected once it is old enough.
+//
+void ScanMgr_AbandonStagingDir(const std::string &stagingPath)
+{
+   ScanMgr_MoveToDead(stagingPath);
+}
+
+//
+// Withdraw a published document, such as one whose record could not be
+// written, by moving it back into the staging area to be deleted. Returns
+// false if the document is still published.
+//
+bool ScanMgr_UnpublishDocument(const std::string &sharePath)
+{
+   return ScanMgr_MoveToDead(sharePath);
+}
+
+//
+// Delete dead and abandoned document assemblies from the staging area, up
+// to a batch at a time so that a backlog does not hold up the caller for
+// long. Returns the number of directories deleted.
+//
+size_t ScanMgr_CollectStagingGarbage()
+{
+   std::string stagingBase = FileCache::PathConcatenate(ScanMgr_GetShareBase(), SCANMGR_STAGING_DIR);
+   std::vector<std::string> garbage;
+
+   DIR *dir = opendir(stagingBase.c_str());
+   if(!dir)
+      return 0; // nothing has been staged on this share yet
+
+   const time_t now = time(nullptr);
+   const size_t deadLen = strlen(SCANMGR_STAGING_DEAD);
+
+   dirent *ent;
+   while(garbage.size() < SCANMGR_STAGING_GCBATCH && (ent = readdir(dir)))
+   {
+      if(ent->d_name[0] == '.')
+         continue;
+
+      std::string name = ent->d_name;
+      std::string path = FileCache::PathConcatenate(stagingBase, name);
+
+      bool dead = (name.length() > deadLen && !name.compare(name.length() - deadLen, deadLen, SCANMGR_STAGING_DEAD));
+
+      struct stat st;
+      if(dead || (!stat(path.c_str(), &st) && now - st.st_mtime > SCANMGR_STAGING_MAXAGE))
+         garbage.push_back(path);
+   }
+   closedir(dir);
+
+   size_t removed = 0;
+   for(const auto &path : garbage)
+   {
+      if(ScanMgr_RemoveFailedDocument(path))
+         ++removed;
+   }
+
+   return removed;
+}
+
+//=============================================================================
+//
+// Document cleanup
+//
+
 //
 // Remove all files and the created directory in the event of an error.
 //
@@ -329,39 +750,45 @@ bool ScanMgr_RemoveFailedDocument(const std::string &path)
 }
 
 //
-// Write a document consisting of the images in il.
+// Write a document consisting of the images in il into the local spool,
+// from where it is published to the share by a DocSpool. The record fields
+// in job must be filled in; its directory is filled in here. On success,
+// status.path is the directory the document will have on the share.
 // Success or failure information is returned in the status structure.
 //
-bool ScanMgr_WriteDocument(DocWriteStatus &status, const ImageList &il)
+bool ScanMgr_SpoolDocument(DocWriteStatus &status, const ImageList &il, docspooljob_t &job)
 {
    status.code     = DOCWRITE_UNKNOWNERROR;
    status.errorMsg = "An unknown error has occurred.";
    status.path     = "";
 
-   // Connect to the global CHS document share
-   if(!ScanMgr_ConnectToShare())
+   // Create a unique document directory in the spool
+   std::string spoolBase;
+   if(!DocSpool_GetBasePath(spoolBase) || !ScanMgr_CreateNewDocumentDir(spoolBase, job.spoolPath))
    {
-      status.code     = DOCWRITE_NOCONNECTION;
-      status.errorMsg = "Cannot connect to CHS document file share.";
+      status.code     = DOCWRITE_NODIR;
+      status.errorMsg = "Cannot create a new document directory in the local spool.";
       return false;
    }
+   job.id = FileCache::GetFileSpec(job.spoolPath).second;
 
-   // Create a unique document directory
-   if(!ScanMgr_CreateNewDocumentDir(CHS_FILESHARE_BASE, status.path))
+   // Write the images to the directory
+   if(!ScanMgr_WriteImageList(status, job.spoolPath, il))
    {
-      status.code     = DOCWRITE_NODIR;
-      status.errorMsg = "Cannot create a new document directory.";
+      // the status code and message were set by the image writing process.
       return false;
    }
 
-   // Write the images to the directory
-   if(!ScanMgr_WriteImageList(status, status.path, il))
+   // Only now is the document complete enough to be uploaded
+   if(!DocSpool_WriteJobFile(job))
    {
-      // the status code and message were set by the image writing process.
+      status.code     = DOCWRITE_IMGWRITEFAILED;
+      status.errorMsg = "Cannot write the document spool file.";
       return false;
    }
 
    // successful!
+   status.path     = FileCache::PathConcatenate(ScanMgr_GetShareBase(), job.id);
    status.code     = DOCWRITE_OK;
    status.errorMsg = "";
    return true;
@@ -370,8 +797,11 @@ bool ScanMgr_WriteDocument(DocWriteStatus &status, const ImageList &il)
 //
 // Write a document consisting of a single PDF file.
 // Success or failure information is returned in the status structure.
+// If a progress callback is given it is told how much of the file has been
+// copied, and may cancel the write.
 //
-bool ScanMgr_WritePDFDocument(DocWriteStatus &status, const std::string &filepath)
+bool ScanMgr_WritePDFDocument(DocWriteStatus &status, const std::string &filepath,
+                              const filecopyprogress_t &progress)
 {
    status.code     = DOCWRITE_UNKNOWNERROR;
    status.errorMsg = "An unknown error has occurred.";
@@ -385,8 +815,9 @@ bool ScanMgr_WritePDFDocument(DocWriteStatus &status, const std::string &filepat
       return false;
    }
 
-   // Create a unique document directory
-   if(!ScanMgr_CreateNewDocumentDir(CHS_FILESHARE_BASE, status.path))
+   // Create a unique document directory in the staging area
+   std::string id, stagingPath;
+   if(!ScanMgr_CreateNewStagingDir(id, stagingPath))
    {
       status.code     = DOCWRITE_NODIR;
       status.errorMsg = "Cannot create a new document directory.";
@@ -394,9 +825,20 @@ bool ScanMgr_WritePDFDocument(DocWriteStatus &status, const std::string &filepat
    }
 
    // Copy the PDF to the directory
-   if(!ScanMgr_WritePDFFile(status, status.path, filepath))
+   if(!ScanMgr_WritePDFFile(status, stagingPath, filepath, progress))
    {
       // the status code and message were set by the write function.
+      ScanMgr_AbandonStagingDir(stagingPath);
+      return false;
+   }
+
+   // Make the document visible on the share
+   if(!ScanMgr_PublishStagingDir(stagingPath, status.path))
+   {
+      ScanMgr_AbandonStagingDir(stagingPath);
+      status.path     = "";
+      status.code     = DOCWRITE_NODIR;
+      status.errorMsg = "Cannot publish the new document directory.";
       return false;
    }
 
@@ -412,6 +854,20 @@ bool ScanMgr_WritePDFDocument(DocWriteStatus &status, const std::string &filepat
 // Document database record creation
 //
 
+//
+// Check whether a document record already points at the given directory,
+// as happens when a spooled document was recorded but the session ended
+// before its spool directory was cleaned up.
+//
+bool ScanMgr_DocumentRecordExists(PrometheusUser &user, const std::string &filepath)
+{
+   PrometheusDB &db = user.getDatabase();
+   std::string   id;
+
+   db.getOneField("select id from documents where filepath = '" + ReplaceStringWithString(filepath, "'", "''") + "'", id);
+   return !id.empty();
+}
+
 bool ScanMgr_WriteDocumentRecord(DocWriteStatus &status, PrometheusUser &user, 
                                  const std::string &personID, const std::string &title, 
                                  const std::string &date, std::string &filepath, 
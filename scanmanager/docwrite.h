@@ -8,11 +8,14 @@
 #define DOCWRITE_H__
 
 #include <exception>
+#include <stdint.h>
 #include <string>
 #include <stdio.h>
+#include "filecopy.h"
 #include "imagelist.h"
 
 class PrometheusUser;
+struct docspooljob_t;
 
 // Reasons why a document write can fail.
 enum docwritefail_e
@@ -22,6 +25,7 @@ enum docwritefail_e
    DOCWRITE_NODIR,          // cannot create a new document directory
    DOCWRITE_IMGWRITEFAILED, // an exception was thrown by the image writer
    DOCWRITE_DATABASEERROR,  // database error
+   DOCWRITE_CANCELLED,      // the user cancelled the write
    DOCWRITE_UNKNOWNERROR    // something strange happened.
 };
 
@@ -32,6 +36,11 @@ public:
    docwritefail_e code;     // if non-0 after write, an error has occurred
    std::string    errorMsg; // contains the error message describing the failure reason, if any
    std::string    path;     // when successful, this contains the document's output path
+
+   // totals over the document's pages, for diagnostics
+   uint64_t bytesWritten = 0; // size of the image files written
+   double   encodeMs     = 0; // time spent compressing pages, summed over workers
+   double   writeMs      = 0; // time spent writing files to the share, summed over workers
 };
 
 class DocException : public std::exception
@@ -53,9 +62,18 @@ public:
 
 bool ScanMgr_ConnectToShare();
 void ScanMgr_CloseShare();
+std::string ScanMgr_GetShareBase();
 bool ScanMgr_RemoveFailedDocument(const std::string &path);
-bool ScanMgr_WriteDocument(DocWriteStatus &status, const ImageList &il);
-bool ScanMgr_WritePDFDocument(DocWriteStatus &status, const std::string &filepath);
+std::string ScanMgr_GetStagingPath(const std::string &id);
+bool ScanMgr_CreateStagingDir(const std::string &id, std::string &out);
+bool ScanMgr_PublishStagingDir(const std::string &stagingPath, std::string &sharePath);
+void ScanMgr_AbandonStagingDir(const std::string &stagingPath);
+bool ScanMgr_UnpublishDocument(const std::string &sharePath);
+size_t ScanMgr_CollectStagingGarbage();
+bool ScanMgr_SpoolDocument(DocWriteStatus &status, const ImageList &il, docspooljob_t &job);
+bool ScanMgr_WritePDFDocument(DocWriteStatus &status, const std::string &filepath,
+                              const filecopyprogress_t &progress = nullptr);
+bool ScanMgr_DocumentRecordExists(PrometheusUser &user, const std::string &filepath);
 bool ScanMgr_WriteDocumentRecord(DocWriteStatus &status, PrometheusUser &user, 
                                  const std::string &personID, const std::string &title, 
                                  const std::string &date, std::string &filepath, 
@@ -11,6 +11,8 @@
 #include "vc2015/resource.h"
 #include "scanmanager.h"
 #include "effectdlg.h"
+#include "effectpreview.h"
+#include "imageedit.h"
 #include "imagelist.h"
 
 //
@@ -68,25 +70,18 @@ static const slideridgrp_t idsForParamNum[] =
    { IDC_SLIDER3, IDC_LABEL_SETTING3, IDC_LABEL_FX3LO, IDC_LABEL_FX3HI }
 };
 
-//
-// Effect dispatch table
-//
-ScanManagerEffectDlg::fxfunc_t ScanManagerEffectDlg::FxFuncs[FXTYPE_MAX] =
-{
-   &ScanManagerEffectDlg::doSharpen,                // FXTYPE_SHARPEN
-   &ScanManagerEffectDlg::doTint,                   // FXTYPE_TINT
-   &ScanManagerEffectDlg::doBrightnessContrast,     // FXTYPE_BRIGHTNESS
-   &ScanManagerEffectDlg::doHueSaturationLightness, // FXTYPE_HSL
-   &ScanManagerEffectDlg::doColorBalance            // FXTYPE_BALANCE
-};
+// Message posted to the dialog by its previewer
+#define WM_EFFECTDLG_RENDERED (WM_APP + 1)
 
 //
 // Constructor
 // 
 ScanManagerEffectDlg::ScanManagerEffectDlg(fxtype_e effectType, ImageNode *pImg)
-   : m_hDialog(nullptr), m_effectType(effectType), m_pImageNode(pImg), m_bConfirmed(false)
+   : m_hDialog(nullptr), m_effectType(effectType), m_pImageNode(pImg), m_bConfirmed(false), m_bRendering(false),
+     m_pPreview(new EffectPreview()), m_pPreviewBmp(nullptr)
 {
-   // create a backup of the GDI+ bitmap for the image node
+   // save the GDI+ bitmap for the image node as it is now, to go back to
+   // should the effect fail
    m_pImageNode->backup();
 }
 
@@ -95,11 +90,17 @@ ScanManagerEffectDlg::ScanManagerEffectDlg(fxtype_e effectType, ImageNode *pImg)
 //
 ScanManagerEffectDlg::~ScanManagerEffectDlg()
 {
+   // waits for the page, if it is still being rendered
+   delete m_pPreview;
+
+   ScanMgr_SetPreviewImage(nullptr);
+   delete m_pPreviewBmp;
+
    if(m_pImageNode)
    {
-      // if the user didn't confirm, restore from backup
-      if(!m_bConfirmed)
-         m_pImageNode->restoreBackup();
+      // if the page was changed but the change never recorded, restore it
+      if(m_bRendering)
+         m_pImageNode->revertToBackup();
 
       // update the parent form either way.
       ScanMgr_SetCurrentImage(m_pImageNode);
@@ -107,99 +108,92 @@ ScanManagerEffectDlg::~ScanManagerEffectDlg()
 }
 
 //
-// Apply sharpen effect
+// Read the effect parameters from the dialog's sliders
 //
-bool ScanManagerEffectDlg::doSharpen()
+void ScanManagerEffectDlg::getEdit(imageedit_t &edit) const
 {
-   Gdiplus::SharpenParams params;
-   params.radius = float(SendDlgItemMessage(m_hDialog, idsForParamNum[0].sliderID, TBM_GETPOS, 0, 0));
-   params.amount = float(SendDlgItemMessage(m_hDialog, idsForParamNum[1].sliderID, TBM_GETPOS, 0, 0));
+   const fxparams_t &fxp = fxParams[m_effectType];
+
+   float params[3];
+   for(int i = 0; i < fxp.numParams; i++)
+      params[i] = float(SendDlgItemMessage(m_hDialog, idsForParamNum[i].sliderID, TBM_GETPOS, 0, 0));
 
-   Gdiplus::Sharpen fx;
-   fx.SetParameters(&params);
-   return (m_pImageNode->gdiBitmap->ApplyEffect(&fx, nullptr) == Gdiplus::Ok);
+   edit = ImageEdit_Effect(m_effectType, params, fxp.numParams);
 }
 
 //
-// Apply tint effect
+// Ask for a preview of the effect with the sliders as they are now
 //
-bool ScanManagerEffectDlg::doTint()
+void ScanManagerEffectDlg::requestPreview()
 {
-   Gdiplus::TintParams params;
-   params.hue    = INT(SendDlgItemMessage(m_hDialog, idsForParamNum[0].sliderID, TBM_GETPOS, 0, 0));
-   params.amount = INT(SendDlgItemMessage(m_hDialog, idsForParamNum[1].sliderID, TBM_GETPOS, 0, 0));
-
-   Gdiplus::Tint fx;
-   fx.SetParameters(&params);
-   return (m_pImageNode->gdiBitmap->ApplyEffect(&fx, nullptr) == Gdiplus::Ok);
+   imageedit_t edit;
+   getEdit(edit);
+   m_pPreview->request(edit);
 }
 
 //
-// Apply brightness/contrast effect
+// Show the latest finished preview in place of the image
 //
-bool ScanManagerEffectDlg::doBrightnessContrast()
+void ScanManagerEffectDlg::showPreview()
 {
-   Gdiplus::BrightnessContrastParams params;
-   params.brightnessLevel = INT(SendDlgItemMessage(m_hDialog, idsForParamNum[0].sliderID, TBM_GETPOS, 0, 0));
-   params.contrastLevel   = INT(SendDlgItemMessage(m_hDialog, idsForParamNum[1].sliderID, TBM_GETPOS, 0, 0));
+   Gdiplus::Bitmap *bitmap = m_pPreview->takePreview();
+   if(!bitmap)
+      return;
 
-   Gdiplus::BrightnessContrast fx;
-   fx.SetParameters(&params);
-   return (m_pImageNode->gdiBitmap->ApplyEffect(&fx, nullptr) == Gdiplus::Ok);
+   ScanMgr_SetPreviewImage(bitmap);
+   delete m_pPreviewBmp;
+   m_pPreviewBmp = bitmap;
 }
 
 //
-// Apply HSL effect
+// Apply the GDI+ image effect to the image. The page is changed in the
+// background; the last preview stays on screen until it is done.
 //
-bool ScanManagerEffectDlg::doHueSaturationLightness()
+void ScanManagerEffectDlg::applyEffect()
 {
-   Gdiplus::HueSaturationLightnessParams params;
-   params.hueLevel        = INT(SendDlgItemMessage(m_hDialog, idsForParamNum[0].sliderID, TBM_GETPOS, 0, 0));
-   params.saturationLevel = INT(SendDlgItemMessage(m_hDialog, idsForParamNum[1].sliderID, TBM_GETPOS, 0, 0));
-   params.lightnessLevel  = INT(SendDlgItemMessage(m_hDialog, idsForParamNum[2].sliderID, TBM_GETPOS, 0, 0));
-
-   Gdiplus::HueSaturationLightness fx;
-   fx.SetParameters(&params);
-   return (m_pImageNode->gdiBitmap->ApplyEffect(&fx, nullptr) == Gdiplus::Ok);
-}
+   if(!m_pImageNode || !m_pImageNode->gdiBitmap || m_pImageNode->gdiBitmap->GetLastStatus() != Gdiplus::Ok)
+   {
+      onEffectApplied(false);
+      return;
+   }
 
-//
-// Apply color balance effect
-//
-bool ScanManagerEffectDlg::doColorBalance()
-{
-   Gdiplus::ColorBalanceParams params;
-   params.cyanRed      = INT(SendDlgItemMessage(m_hDialog, idsForParamNum[0].sliderID, TBM_GETPOS, 0, 0));
-   params.magentaGreen = INT(SendDlgItemMessage(m_hDialog, idsForParamNum[1].sliderID, TBM_GETPOS, 0, 0));
-   params.yellowBlue   = INT(SendDlgItemMessage(m_hDialog, idsForParamNum[2].sliderID, TBM_GETPOS, 0, 0));
-
-   Gdiplus::ColorBalance fx;
-   fx.SetParameters(&params);
-   return (m_pImageNode->gdiBitmap->ApplyEffect(&fx, nullptr) == Gdiplus::Ok);
+   // the page must not be drawn while it is being changed, so the last
+   // preview is shown in its place
+   showPreview();
+   ShowWindow(m_hDialog, SW_HIDE);
+
+   imageedit_t edit;
+   getEdit(edit);
+
+   m_bRendering = true;
+   m_pPreview->render(edit, m_pImageNode->gdiBitmap);
 }
 
 //
-// Apply the GDI+ image effect to the image
+// The page has been rendered with the effect, or the effect failed
 //
-bool ScanManagerEffectDlg::applyEffect()
+void ScanManagerEffectDlg::onEffectApplied(bool ok)
 {
-   if(!m_pImageNode || !m_pImageNode->gdiBitmap || m_pImageNode->gdiBitmap->GetLastStatus() != Gdiplus::Ok)
-      return false;
-
-   // restore the original backup (overwriting any preview results), and then make another one
-   if(!m_pImageNode->restoreBackup())
-      return false;
+   if(m_bRendering)
+   {
+      m_bRendering = false;
 
-   m_pImageNode->backup();
+      if(ok)
+      {
+         // the effect goes into the image's history
+         imageedit_t edit;
+         getEdit(edit);
+         m_pImageNode->commitEdit(edit);
+      }
+      else
+         m_pImageNode->revertToBackup();
+   }
 
-   if(!m_pImageNode->gdiBitmap || m_pImageNode->gdiBitmap->GetLastStatus() != Gdiplus::Ok)
-      return false;
+   if(!ok)
+      MessageBox(GetParent(m_hDialog), L"Failed to apply effect", L"Scan Manager", MB_ICONERROR | MB_OK);
 
-   bool res;
-   if((res = (this->*(FxFuncs[m_effectType]))()))
-      ScanMgr_SetCurrentImage(m_pImageNode);
-   
-   return res;
+   DestroyWindow(m_hDialog);
+   m_hDialog = nullptr;
 }
 
 //
@@ -282,21 +276,38 @@ INT_PTR CALLBACK ScanManagerEffectDlg::DialogProc(HWND hwndDlg, UINT uMsg, WPARA
       switch(LOWORD(wParam))
       {
       case IDOK:
+         if(pEffectDlg->m_bConfirmed)
+            return TRUE; // already being applied
          pEffectDlg->m_bConfirmed = true; // remember that the user clicked OK
-         if(!pEffectDlg->applyEffect())
-            MessageBox(GetParent(hwndDlg), L"Failed to apply effect", L"Scan Manager", MB_ICONERROR | MB_OK);
-         // Fall-through
+         pEffectDlg->applyEffect();
+         return TRUE;
       case IDCANCEL:
+         if(pEffectDlg->m_bConfirmed)
+            return TRUE; // too late
+         // previews never touch the image itself, so there is nothing to undo
          DestroyWindow(pEffectDlg->m_hDialog);
          pEffectDlg->m_hDialog = nullptr;
          return TRUE;
       case IDC_BUTTON_PREVIEW:
-         // apply effect to the current image
-         if(!pEffectDlg->applyEffect())
-            MessageBox(GetParent(hwndDlg), L"Failed to apply effect", L"Scan Manager", MB_ICONERROR | MB_OK);
+         // preview the effect on the current image
+         pEffectDlg->requestPreview();
          return TRUE;
       }
       break;
+   case WM_HSCROLL:
+      // update the preview as the sliders move
+      if(pEffectDlg && !pEffectDlg->m_bConfirmed)
+         pEffectDlg->requestPreview();
+      return TRUE;
+   case WM_EFFECTDLG_RENDERED:
+      if(pEffectDlg)
+      {
+         if(wParam == 0)
+            pEffectDlg->showPreview();
+         else
+            pEffectDlg->onEffectApplied(lParam != 0);
+      }
+      return TRUE;
    default:
       break;
    }
@@ -317,6 +328,12 @@ bool ScanManagerEffectDlg::create(HWND hWndParent)
    if(IsWindow(m_hDialog))
    {
       SetWindowLongPtr(m_hDialog, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(this));
+
+      // previews are made at the size the image is shown at
+      RECT rect = ScanMgr_CalcImageRect();
+      m_pPreview->start(m_pImageNode->gdiBitmap, uint32_t(rect.right - rect.left), uint32_t(rect.bottom - rect.top),
+                        m_hDialog, WM_EFFECTDLG_RENDERED);
+
       ShowWindow(m_hDialog, SW_SHOW);
       return true;
    }
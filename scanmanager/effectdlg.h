@@ -8,19 +8,10 @@
 #define EFFECTDLG_H__
 
 #include <Windows.h>
+#include "imageedit.h"
 
 class ImageNode;
-
-// Types of GDI+ effects supported
-enum fxtype_e
-{
-   FXTYPE_SHARPEN,
-   FXTYPE_TINT,
-   FXTYPE_BRIGHTNESS,
-   FXTYPE_HSL,
-   FXTYPE_BALANCE,
-   FXTYPE_MAX
-};
+class EffectPreview;
 
 // Parmameter type for effects
 enum fxparamtype_e
@@ -55,23 +46,21 @@ struct fxparams_t
 class ScanManagerEffectDlg
 {
 protected:
-   HWND       m_hDialog;
-   fxtype_e   m_effectType;
-   ImageNode *m_pImageNode;
-   bool       m_bConfirmed;
+   HWND             m_hDialog;
+   fxtype_e         m_effectType;
+   ImageNode       *m_pImageNode;
+   bool             m_bConfirmed;
+   bool             m_bRendering;  // the page is being changed by m_pPreview
+   EffectPreview   *m_pPreview;
+   Gdiplus::Bitmap *m_pPreviewBmp; // latest preview, shown in place of the page
 
    static INT_PTR CALLBACK DialogProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam);
 
-   bool applyEffect();
-
-   bool doSharpen();
-   bool doTint();
-   bool doBrightnessContrast();
-   bool doHueSaturationLightness();
-   bool doColorBalance();
-
-   using fxfunc_t = bool (ScanManagerEffectDlg::*)();
-   static fxfunc_t FxFuncs[FXTYPE_MAX];
+   void getEdit(imageedit_t &edit) const;
+   void requestPreview();
+   void showPreview();
+   void applyEffect();
+   void onEffectApplied(bool ok);
 
 public:
    ScanManagerEffectDlg(fxtype_e effectType, ImageNode *pImg);
@@ -0,0 +1,301 @@
+/*
+  Scan Manager
+
+  Background effect previews
+
+  Previewing an effect used to run it over the whole page on the UI thread,
+  though only a window-sized rendering of the page is ever seen, and only
+  when the Preview button was pressed. Previews are now made from a copy of
+  the page scaled down to the window, on a worker thread, as the sliders
+  move. The full page is only rendered once the effect is chosen, and that
+  too happens off the UI thread, with the last preview shown meanwhile.
+
+  The scaled copy is kept in the same kind of bitmap as the page as far as
+  the effects are concerned: a gray page is previewed gray, since that is
+  how its effects are made, and anything else in 32-bit colour.
+*/
+
+#include <Windows.h>
+#include <gdiplus.h>
+#include <memory>
+#include <new>
+#include <system_error>
+#include "effectpreview.h"
+
+EffectPreview::EffectPreview()
+   : m_thread(), m_mutex(), m_wake(), m_stopping(false), m_job(JOB_NONE), m_edit(), m_requested(0), m_proxy(nullptr),
+     m_scale(1.0f), m_result(nullptr), m_page(nullptr), m_hNotifyWnd(nullptr), m_notifyMsg(0)
+{
+}
+
+EffectPreview::~EffectPreview()
+{
+   stop();
+}
+
+//
+// Make a gray copy of a colour rendering of a gray page, with the page's
+// palette. The rendering's channels are all alike, so any one will do.
+//
+static Gdiplus::Bitmap *EffectPreview_ToGray(Gdiplus::Bitmap *rendering, Gdiplus::Bitmap *page)
+{
+   const INT width  = INT(rendering->GetWidth());
+   const INT height = INT(rendering->GetHeight());
+
+   std::unique_ptr<Gdiplus::Bitmap> upGray(new (std::nothrow) Gdiplus::Bitmap(width, height, PixelFormat8bppIndexed));
+   if(!upGray || upGray->GetLastStatus() != Gdiplus::Ok)
+      return nullptr;
+
+   INT size = page->GetPaletteSize();
+   std::unique_ptr<uint8_t []> upPal(new (std::nothrow) uint8_t [size]);
+   if(!upPal)
+      return nullptr;
+
+   auto palette = reinterpret_cast<Gdiplus::ColorPalette *>(upPal.get());
+   if(page->GetPalette(palette, size) != Gdiplus::Ok || upGray->SetPalette(palette) != Gdiplus::Ok)
+      return nullptr;
+
+   Gdiplus::Rect       rect(0, 0, width, height);
+   Gdiplus::BitmapData src, dst;
+   if(rendering->LockBits(&rect, Gdiplus::ImageLockModeRead, PixelFormat32bppARGB, &src) != Gdiplus::Ok)
+      return nullptr;
+   if(upGray->LockBits(&rect, Gdiplus::ImageLockModeWrite, PixelFormat8bppIndexed, &dst) != Gdiplus::Ok)
+   {
+      rendering->UnlockBits(&src);
+      return nullptr;
+   }
+
+   for(INT y = 0; y < height; y++)
+   {
+      const uint8_t *srcRow = static_cast<const uint8_t *>(src.Scan0) + y * src.Stride;
+      uint8_t       *dstRow = static_cast<uint8_t *>(dst.Scan0) + y * dst.Stride;
+      for(INT x = 0; x < width; x++)
+         dstRow[x] = srcRow[x * 4 + 1];
+   }
+
+   upGray->UnlockBits(&dst);
+   rendering->UnlockBits(&src);
+
+   return upGray.release();
+}
+
+//
+// Worker thread body: make the latest preview asked for, until the page is
+// rendered or the previewer stops.
+//
+void EffectPreview::workerLoop()
+{
+   for(;;)
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wake.wait(lock, [this] { return m_stopping || m_job != JOB_NONE; });
+      if(m_stopping)
+         return;
+
+      job_e       job    = m_job;
+      imageedit_t edit   = m_edit;
+      uint64_t    serial = m_requested;
+      m_job = JOB_NONE;
+      lock.unlock();
+
+      if(job == JOB_FINAL)
+      {
+         bool ok = ImageEdit_Apply(edit, m_page);
+         PostMessage(m_hNotifyWnd, m_notifyMsg, 1, ok ? 1 : 0);
+         return; // nothing is previewed after the page is done
+      }
+
+      Gdiplus::Bitmap *copy = m_proxy->Clone(0, 0, INT(m_proxy->GetWidth()), INT(m_proxy->GetHeight()),
+                                             m_proxy->GetPixelFormat());
+      bool ok = (copy && copy->GetLastStatus() == Gdiplus::Ok && ImageEdit_Apply(ImageEdit_Scale(edit, m_scale), copy));
+
+      // keep the result only if nothing newer has been asked for since
+      lock.lock();
+      if(ok && serial == m_requested && !m_page && !m_stopping)
+      {
+         delete m_result;
+         m_result = copy;
+         copy     = nullptr;
+         PostMessage(m_hNotifyWnd, m_notifyMsg, 0, 1);
+      }
+      lock.unlock();
+
+      delete copy;
+   }
+}
+
+//
+// Make the scaled copy of a page to preview effects on, fitting within the
+// given size, and start the worker. Call from the UI thread.
+//
+// GDI+ cannot draw onto an indexed bitmap, so a gray page is scaled in
+// colour and then made gray again.
+//
+bool EffectPreview::start(Gdiplus::Bitmap *page, uint32_t maxWidth, uint32_t maxHeight, HWND hNotifyWnd, UINT notifyMsg)
+{
+   stop();
+
+   m_hNotifyWnd = hNotifyWnd;
+   m_notifyMsg  = notifyMsg;
+
+   if(!page || page->GetLastStatus() != Gdiplus::Ok || !maxWidth || !maxHeight)
+      return false;
+
+   const uint32_t width  = page->GetWidth();
+   const uint32_t height = page->GetHeight();
+   if(!width || !height)
+      return false;
+
+   float scale = 1.0f;
+   if(width > maxWidth || height > maxHeight)
+   {
+      float sx = float(maxWidth) / float(width);
+      float sy = float(maxHeight) / float(height);
+      scale = (sx < sy) ? sx : sy;
+   }
+
+   INT proxyWidth  = INT(float(width)  * scale + 0.5f);
+   INT proxyHeight = INT(float(height) * scale + 0.5f);
+   if(proxyWidth < 1)
+      proxyWidth = 1;
+   if(proxyHeight < 1)
+      proxyHeight = 1;
+
+   auto proxy = new (std::nothrow) Gdiplus::Bitmap(proxyWidth, proxyHeight, PixelFormat32bppARGB);
+   if(!proxy)
+      return false;
+
+   Gdiplus::Status status = proxy->GetLastStatus();
+   if(status == Gdiplus::Ok)
+   {
+      Gdiplus::Graphics graphics(proxy);
+      graphics.SetInterpolationMode(Gdiplus::InterpolationModeHighQualityBilinear);
+      status = graphics.DrawImage(page, 0, 0, proxyWidth, proxyHeight);
+   }
+   if(status == Gdiplus::Ok && ImageEdit_IsGrayPage(page))
+   {
+      Gdiplus::Bitmap *gray = EffectPreview_ToGray(proxy, page);
+      delete proxy;
+      proxy = gray;
+   }
+   if(!proxy || status != Gdiplus::Ok)
+   {
+      delete proxy;
+      return false;
+   }
+   proxy->SetResolution(page->GetHorizontalResolution() * scale, page->GetVerticalResolution() * scale);
+
+   // the first preview is of the page as it is, so there is always one to
+   // show while the page is rendered
+   auto result = proxy->Clone(0, 0, proxyWidth, proxyHeight, proxy->GetPixelFormat());
+   if(!result || result->GetLastStatus() != Gdiplus::Ok)
+   {
+      delete result;
+      delete proxy;
+      return false;
+   }
+
+   m_proxy     = proxy;
+   m_result    = result;
+   m_scale     = scale;
+   m_stopping  = false;
+   m_job       = JOB_NONE;
+   m_requested = 0;
+
+   try
+   {
+      m_thread = std::thread(&EffectPreview::workerLoop, this);
+   }
+   catch(const std::system_error &)
+   {
+      delete m_proxy;
+      delete m_result;
+      m_proxy  = nullptr;
+      m_result = nullptr;
+      return false;
+   }
+
+   PostMessage(m_hNotifyWnd, m_notifyMsg, 0, 1);
+   return true;
+}
+
+//
+// Stop the worker, waiting for the page if it is being rendered, and free
+// the proxy and any preview not taken.
+//
+void EffectPreview::stop()
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+   }
+   m_wake.notify_all();
+
+   if(m_thread.joinable())
+      m_thread.join();
+
+   delete m_proxy;
+   delete m_result;
+   m_proxy  = nullptr;
+   m_result = nullptr;
+   m_page   = nullptr;
+   m_job    = JOB_NONE;
+}
+
+//
+// Ask for a preview of an edit, replacing any asked for before.
+//
+void EffectPreview::request(const imageedit_t &edit)
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(!m_thread.joinable() || m_page)
+         return;
+
+      m_edit = edit;
+      m_job  = JOB_PREVIEW;
+      ++m_requested;
+   }
+   m_wake.notify_one();
+}
+
+//
+// Apply an edit to the page itself. The page must not be touched by the
+// caller until notified that it is done. Without a worker, the edit is
+// applied before returning, though still announced by message.
+//
+void EffectPreview::render(const imageedit_t &edit, Gdiplus::Bitmap *page)
+{
+   bool queued = false;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(m_thread.joinable())
+      {
+         m_edit = edit;
+         m_page = page;
+         m_job  = JOB_FINAL;
+         queued = true;
+      }
+   }
+
+   if(queued)
+      m_wake.notify_one();
+   else
+      PostMessage(m_hNotifyWnd, m_notifyMsg, 1, ImageEdit_Apply(edit, page) ? 1 : 0);
+}
+
+//
+// Get the latest finished preview, if there is one not yet taken. The
+// caller owns it.
+//
+Gdiplus::Bitmap *EffectPreview::takePreview()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   Gdiplus::Bitmap *result = m_result;
+   m_result = nullptr;
+   return result;
+}
+
+// EOF
+
@@ -0,0 +1,67 @@
+/*
+  Scan Manager
+
+  Background effect previews
+*/
+
+#ifndef EFFECTPREVIEW_H__
+#define EFFECTPREVIEW_H__
+
+#include <Windows.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "imageedit.h"
+
+//
+// Renders effect previews on a worker thread, on a copy of the page scaled
+// down to the size it is shown at, and then the chosen effect on the page
+// itself. Only the latest preview asked for is made: one asked for while
+// another is being made replaces it, and a preview finished after a newer
+// one was asked for is thrown away. Each finished job is announced by
+// posting notifyMsg to the notify window, with wParam 0 for a preview, to be
+// collected with takePreview, or 1 for the page, with lParam non-zero if the
+// effect could be applied.
+//
+class EffectPreview
+{
+protected:
+   enum job_e
+   {
+      JOB_NONE,
+      JOB_PREVIEW, // apply m_edit to a copy of the proxy
+      JOB_FINAL    // apply m_edit to m_page
+   };
+
+   std::thread             m_thread;
+   std::mutex              m_mutex;
+   std::condition_variable m_wake;
+   bool                    m_stopping;
+   job_e                   m_job;
+   imageedit_t             m_edit;      // edit of the latest job
+   uint64_t                m_requested; // serial of the latest preview asked for
+   Gdiplus::Bitmap        *m_proxy;     // scaled copy of the page; the worker's own
+   float                   m_scale;     // of the proxy relative to the page
+   Gdiplus::Bitmap        *m_result;    // finished preview waiting to be taken
+   Gdiplus::Bitmap        *m_page;      // page being rendered, during JOB_FINAL
+   HWND                    m_hNotifyWnd;
+   UINT                    m_notifyMsg;
+
+   void workerLoop();
+
+public:
+   EffectPreview();
+   ~EffectPreview();
+
+   bool start(Gdiplus::Bitmap *page, uint32_t maxWidth, uint32_t maxHeight, HWND hNotifyWnd, UINT notifyMsg);
+   void stop();
+   void request(const imageedit_t &edit);
+   void render(const imageedit_t &edit, Gdiplus::Bitmap *page);
+   Gdiplus::Bitmap *takePreview();
+};
+
+#endif
+
+// EOF
+
@@ -0,0 +1,307 @@
+/*
+  Scan Manager
+
+  Chunked file copy engine
+
+  CopyFileA gives no say over how a copy proceeds and no word of how far it
+  has got. Copies here move large page-aligned chunks between two buffers,
+  reading the next chunk while the one before it is still being written, so
+  that a copy between a local disk and the file share keeps both sides busy.
+  The caller is told of progress after every chunk and may cancel, and the
+  data is checksummed on the way through so that it need not be read again
+  for a manifest. A partial destination file is never left behind.
+*/
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#endif
+#include "crc32.h"
+#include "filecopy.h"
+
+// Size of each of the two copy buffers. Large enough that a copy over SMB
+// costs few round trips, small enough that progress is reported often.
+#define FILECOPY_CHUNKSIZE (1024 * 1024)
+
+//
+// Describe a copy result for the user.
+//
+const char *FileCopy_ResultMessage(filecopyresult_e result)
+{
+   switch(result)
+   {
+   case FILECOPY_OK:
+      return "The file was copied.";
+   case FILECOPY_NOSOURCE:
+      return "The file to copy could not be opened.";
+   case FILECOPY_NODEST:
+      return "The copy could not be created.";
+   case FILECOPY_READERROR:
+      return "The file could not be read.";
+   case FILECOPY_WRITEERROR:
+      return "The copy could not be written.";
+   case FILECOPY_NOMEMORY:
+      return "Out of memory copying the file.";
+   case FILECOPY_CANCELLED:
+      return "The copy was cancelled.";
+   }
+   return "An unknown error occurred copying the file.";
+}
+
+#ifdef _WIN32
+
+//
+// An overlapped read or write of one chunk.
+//
+struct filecopyio_t
+{
+   OVERLAPPED ov;
+   bool       pending;
+};
+
+static bool FileCopy_Start(filecopyio_t &io, uint64_t offset)
+{
+   memset(&io.ov, 0, sizeof(io.ov));
+   io.ov.Offset     = DWORD(offset);
+   io.ov.OffsetHigh = DWORD(offset >> 32);
+   io.ov.hEvent     = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+   io.pending       = (io.ov.hEvent != nullptr);
+   return io.pending;
+}
+
+//
+// Wait for an I/O to complete, returning the number of bytes transferred,
+// or false if it failed.
+//
+static bool FileCopy_Finish(HANDLE hFile, filecopyio_t &io, DWORD &transferred)
+{
+   if(!io.pending)
+      return false;
+
+   BOOL ok = GetOverlappedResult(hFile, &io.ov, &transferred, TRUE);
+   CloseHandle(io.ov.hEvent);
+   io.pending = false;
+
+   return ok != FALSE;
+}
+
+static bool FileCopy_Read(HANDLE hFile, filecopyio_t &io, uint8_t *buffer, DWORD size, uint64_t offset)
+{
+   if(!FileCopy_Start(io, offset))
+      return false;
+
+   if(!ReadFile(hFile, buffer, size, nullptr, &io.ov) && GetLastError() != ERROR_IO_PENDING)
+   {
+      CloseHandle(io.ov.hEvent);
+      io.pending = false;
+      return false;
+   }
+   return true;
+}
+
+static bool FileCopy_Write(HANDLE hFile, filecopyio_t &io, const uint8_t *buffer, DWORD size, uint64_t offset)
+{
+   if(!FileCopy_Start(io, offset))
+      return false;
+
+   if(!WriteFile(hFile, buffer, size, nullptr, &io.ov) && GetLastError() != ERROR_IO_PENDING)
+   {
+      CloseHandle(io.ov.hEvent);
+      io.pending = false;
+      return false;
+   }
+   return true;
+}
+
+//
+// Copy a file, reading each chunk while the previous one is being written.
+// If failIfExists is set, an existing destination is an error rather than
+// being replaced. On success, stats receives the size and checksum of the
+// data copied.
+//
+filecopyresult_e FileCopy_Copy(const std::string &srcPath, const std::string &dstPath, bool failIfExists,
+                               const filecopyprogress_t &progress, filecopystats_t *stats)
+{
+   HANDLE hSrc = CreateFileA(srcPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                             FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+   if(hSrc == INVALID_HANDLE_VALUE)
+      return FILECOPY_NOSOURCE;
+
+   LARGE_INTEGER srcSize;
+   if(!GetFileSizeEx(hSrc, &srcSize))
+   {
+      CloseHandle(hSrc);
+      return FILECOPY_NOSOURCE;
+   }
+   const uint64_t total = uint64_t(srcSize.QuadPart);
+
+   HANDLE hDst = CreateFileA(dstPath.c_str(), GENERIC_WRITE, 0, nullptr, failIfExists ? CREATE_NEW : CREATE_ALWAYS,
+                             FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+   if(hDst == INVALID_HANDLE_VALUE)
+   {
+      CloseHandle(hSrc);
+      return FILECOPY_NODEST;
+   }
+
+   // size the destination up front, so the file system can lay it out in
+   // one piece and the server need not extend it with every write
+   LARGE_INTEGER end;
+   end.QuadPart = LONGLONG(total);
+   if(SetFilePointerEx(hDst, end, nullptr, FILE_BEGIN))
+      SetEndOfFile(hDst);
+
+   // page-aligned buffers suit both the cache manager and the redirector
+   uint8_t *buffers[2];
+   buffers[0] = static_cast<uint8_t *>(VirtualAlloc(nullptr, 2 * FILECOPY_CHUNKSIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+   buffers[1] = buffers[0] + FILECOPY_CHUNKSIZE;
+
+   filecopyresult_e result = buffers[0] ? FILECOPY_OK : FILECOPY_NOMEMORY;
+   filecopyio_t     readIO  = { {}, false };
+   filecopyio_t     writeIO = { {}, false };
+   uint64_t         offset  = 0;
+   uint32_t         crc     = 0;
+   int              cur     = 0;
+
+   if(result == FILECOPY_OK && total && !FileCopy_Read(hSrc, readIO, buffers[cur], FILECOPY_CHUNKSIZE, 0))
+      result = FILECOPY_READERROR;
+
+   while(result == FILECOPY_OK && offset < total)
+   {
+      DWORD got = 0, put = 0;
+      if(!FileCopy_Finish(hSrc, readIO, got) || !got)
+      {
+         result = FILECOPY_READERROR;
+         break;
+      }
+
+      // the other buffer is free once the write from it is done
+      if(writeIO.pending && !FileCopy_Finish(hDst, writeIO, put))
+      {
+         result = FILECOPY_WRITEERROR;
+         break;
+      }
+
+      if(offset + got < total && !FileCopy_Read(hSrc, readIO, buffers[cur ^ 1], FILECOPY_CHUNKSIZE, offset + got))
+      {
+         result = FILECOPY_READERROR;
+         break;
+      }
+
+      crc = CRC32_Update(crc, buffers[cur], got);
+      if(!FileCopy_Write(hDst, writeIO, buffers[cur], got, offset))
+      {
+         result = FILECOPY_WRITEERROR;
+         break;
+      }
+
+      offset += got;
+      cur    ^= 1;
+
+      if(progress && !progress(offset, total))
+         result = FILECOPY_CANCELLED;
+   }
+
+   // let anything still in flight finish before its buffer goes away
+   DWORD dummy;
+   if(readIO.pending)
+      FileCopy_Finish(hSrc, readIO, dummy);
+   if(writeIO.pending && !FileCopy_Finish(hDst, writeIO, dummy) && result == FILECOPY_OK)
+      result = FILECOPY_WRITEERROR;
+
+   if(buffers[0])
+      VirtualFree(buffers[0], 0, MEM_RELEASE);
+
+   CloseHandle(hSrc);
+   if(!CloseHandle(hDst) && result == FILECOPY_OK)
+      result = FILECOPY_WRITEERROR;
+
+   if(result != FILECOPY_OK)
+      DeleteFileA(dstPath.c_str());
+   else if(stats)
+   {
+      stats->bytes = total;
+      stats->crc   = crc;
+   }
+
+   return result;
+}
+
+#else
+
+//
+// Copy a file a chunk at a time. Without overlapped I/O each chunk is read
+// and then written; see the Windows version.
+//
+filecopyresult_e FileCopy_Copy(const std::string &srcPath, const std::string &dstPath, bool failIfExists,
+                               const filecopyprogress_t &progress, filecopystats_t *stats)
+{
+   int src = open(srcPath.c_str(), O_RDONLY);
+   if(src < 0)
+      return FILECOPY_NOSOURCE;
+
+   struct stat st;
+   if(fstat(src, &st))
+   {
+      close(src);
+      return FILECOPY_NOSOURCE;
+   }
+   const uint64_t total = uint64_t(st.st_size);
+
+   int dst = open(dstPath.c_str(), O_WRONLY | O_CREAT | (failIfExists ? O_EXCL : O_TRUNC), 0644);
+   if(dst < 0)
+   {
+      close(src);
+      return FILECOPY_NODEST;
+   }
+
+   uint8_t *buffer = static_cast<uint8_t *>(malloc(FILECOPY_CHUNKSIZE));
+
+   filecopyresult_e result = buffer ? FILECOPY_OK : FILECOPY_NOMEMORY;
+   uint64_t         offset = 0;
+   uint32_t         crc    = 0;
+
+   while(result == FILECOPY_OK && offset < total)
+   {
+      ssize_t got = read(src, buffer, FILECOPY_CHUNKSIZE);
+      if(got <= 0)
+      {
+         result = FILECOPY_READERROR;
+         break;
+      }
+
+      crc = CRC32_Update(crc, buffer, size_t(got));
+      if(write(dst, buffer, size_t(got)) != got)
+      {
+         result = FILECOPY_WRITEERROR;
+         break;
+      }
+
+      offset += uint64_t(got);
+      if(progress && !progress(offset, total))
+         result = FILECOPY_CANCELLED;
+   }
+
+   free(buffer);
+   close(src);
+   if(close(dst) && result == FILECOPY_OK)
+      result = FILECOPY_WRITEERROR;
+
+   if(result != FILECOPY_OK)
+      unlink(dstPath.c_str());
+   else if(stats)
+   {
+      stats->bytes = total;
+      stats->crc   = crc;
+   }
+
+   return result;
+}
+
+#endif
+
+// EOF
+
@@ -0,0 +1,44 @@
+/*
+  Scan Manager
+
+  Chunked file copy engine
+*/
+
+#ifndef FILECOPY_H__
+#define FILECOPY_H__
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+
+// Called after each chunk with the bytes copied so far and the size of the
+// file. Return false to cancel the copy.
+typedef std::function<bool (uint64_t copied, uint64_t total)> filecopyprogress_t;
+
+// Outcome of a copy
+enum filecopyresult_e
+{
+   FILECOPY_OK,          // 0 is not an error
+   FILECOPY_NOSOURCE,    // source file could not be opened
+   FILECOPY_NODEST,      // destination file could not be created, or exists
+   FILECOPY_READERROR,   // error reading the source
+   FILECOPY_WRITEERROR,  // error writing the destination
+   FILECOPY_NOMEMORY,    // copy buffers could not be allocated
+   FILECOPY_CANCELLED    // the progress callback asked to stop
+};
+
+// Result details of a successful copy
+struct filecopystats_t
+{
+   uint64_t bytes; // size of the file copied
+   uint32_t crc;   // CRC-32 of its contents
+};
+
+filecopyresult_e FileCopy_Copy(const std::string &srcPath, const std::string &dstPath, bool failIfExists,
+                               const filecopyprogress_t &progress = nullptr, filecopystats_t *stats = nullptr);
+const char *FileCopy_ResultMessage(filecopyresult_e result);
+
+#endif
+
+// EOF
+
@@ -0,0 +1,308 @@
+/*
+  Scan Manager
+
+  Image edit operations
+
+  Rotations, flips and the GDI+ effects are each fully described by a few
+  numbers, so an image's history can be kept as a list of these rather than
+  a copy of the image per step, and any step made again when needed.
+
+  The effects themselves are made by the native kernels in imagefx.cpp on
+  the bitmap's locked pixels. Only indexed images other than gray pages,
+  which those kernels cannot work on in place, still go through GDI+.
+*/
+
+#include "stdafx.h"
+#include <gdiplus.h>
+#include <string.h>
+#include <memory>
+#include <new>
+#include "imageedit.h"
+#include "imagefx.h"
+
+//
+// Make a rotation/flip edit.
+//
+imageedit_t ImageEdit_RotateFlip(Gdiplus::RotateFlipType rft)
+{
+   imageedit_t edit;
+   memset(&edit, 0, sizeof(edit));
+   edit.kind       = IMAGEEDIT_ROTATEFLIP;
+   edit.rotateFlip = rft;
+   return edit;
+}
+
+//
+// Make an effect edit from the effect's parameter values.
+//
+imageedit_t ImageEdit_Effect(fxtype_e effect, const float *params, int numParams)
+{
+   imageedit_t edit;
+   memset(&edit, 0, sizeof(edit));
+   edit.kind   = IMAGEEDIT_EFFECT;
+   edit.effect = effect;
+   for(int i = 0; i < numParams && i < 3; i++)
+      edit.params[i] = params[i];
+   return edit;
+}
+
+//
+// Apply a GDI+ effect with its parameters set.
+//
+template<typename fx_t, typename params_t>
+static bool ImageEdit_ApplyFx(Gdiplus::Bitmap *bitmap, const params_t &params)
+{
+   fx_t fx;
+   fx.SetParameters(&params);
+   return (bitmap->ApplyEffect(&fx, nullptr) == Gdiplus::Ok);
+}
+
+//
+// Make an effect with GDI+'s own version of it. Used for the pixel formats
+// the native kernels cannot work on, and to check the kernels against.
+//
+bool ImageEdit_ApplyGdiplusEffect(const imageedit_t &edit, Gdiplus::Bitmap *bitmap)
+{
+   switch(edit.effect)
+   {
+   case FXTYPE_SHARPEN:
+      {
+         Gdiplus::SharpenParams params;
+         params.radius = edit.params[0];
+         params.amount = edit.params[1];
+         return ImageEdit_ApplyFx<Gdiplus::Sharpen>(bitmap, params);
+      }
+   case FXTYPE_TINT:
+      {
+         Gdiplus::TintParams params;
+         params.hue    = INT(edit.params[0]);
+         params.amount = INT(edit.params[1]);
+         return ImageEdit_ApplyFx<Gdiplus::Tint>(bitmap, params);
+      }
+   case FXTYPE_BRIGHTNESS:
+      {
+         Gdiplus::BrightnessContrastParams params;
+         params.brightnessLevel = INT(edit.params[0]);
+         params.contrastLevel   = INT(edit.params[1]);
+         return ImageEdit_ApplyFx<Gdiplus::BrightnessContrast>(bitmap, params);
+      }
+   case FXTYPE_HSL:
+      {
+         Gdiplus::HueSaturationLightnessParams params;
+         params.hueLevel        = INT(edit.params[0]);
+         params.saturationLevel = INT(edit.params[1]);
+         params.lightnessLevel  = INT(edit.params[2]);
+         return ImageEdit_ApplyFx<Gdiplus::HueSaturationLightness>(bitmap, params);
+      }
+   case FXTYPE_BALANCE:
+      {
+         Gdiplus::ColorBalanceParams params;
+         params.cyanRed      = INT(edit.params[0]);
+         params.magentaGreen = INT(edit.params[1]);
+         params.yellowBlue   = INT(edit.params[2]);
+         return ImageEdit_ApplyFx<Gdiplus::ColorBalance>(bitmap, params);
+      }
+   default:
+      return false;
+   }
+}
+
+//
+// Add an effect to a chain for the native kernels.
+//
+static bool ImageEdit_AddToChain(const imageedit_t &edit, ImageFxChain &chain)
+{
+   switch(edit.effect)
+   {
+   case FXTYPE_SHARPEN:
+      chain.addSharpen(edit.params[0], edit.params[1]);
+      return true;
+   case FXTYPE_TINT:
+      chain.addTint(int(edit.params[0]), int(edit.params[1]));
+      return true;
+   case FXTYPE_BRIGHTNESS:
+      chain.addBrightnessContrast(int(edit.params[0]), int(edit.params[1]));
+      return true;
+   case FXTYPE_HSL:
+      chain.addHueSaturationLightness(int(edit.params[0]), int(edit.params[1]), int(edit.params[2]));
+      return true;
+   case FXTYPE_BALANCE:
+      chain.addColorBalance(int(edit.params[0]), int(edit.params[1]), int(edit.params[2]));
+      return true;
+   default:
+      return false;
+   }
+}
+
+//
+// Check for the linear gray palette given to gray pages.
+//
+static bool ImageEdit_HasGrayPalette(Gdiplus::Bitmap *bitmap)
+{
+   INT size = bitmap->GetPaletteSize();
+   if(size < INT(sizeof(Gdiplus::ColorPalette)))
+      return false;
+
+   std::unique_ptr<uint8_t []> upPal(new (std::nothrow) uint8_t [size]);
+   if(!upPal)
+      return false;
+
+   auto palette = reinterpret_cast<Gdiplus::ColorPalette *>(upPal.get());
+   if(bitmap->GetPalette(palette, size) != Gdiplus::Ok || palette->Count != 256)
+      return false;
+
+   for(uint32_t i = 0; i < 256; i++)
+   {
+      if((palette->Entries[i] & 0xFFFFFFu) != ((i << 16) | (i << 8) | i))
+         return false;
+   }
+   return true;
+}
+
+//
+// Check for a gray page: an 8-bit indexed bitmap with the linear gray
+// palette, whose effects are made on its one channel and so stay gray.
+//
+bool ImageEdit_IsGrayPage(Gdiplus::Bitmap *bitmap)
+{
+   return (bitmap->GetPixelFormat() == PixelFormat8bppIndexed && ImageEdit_HasGrayPalette(bitmap));
+}
+
+//
+// Lock a bitmap's pixels for the native kernels, as gray for a gray page and
+// otherwise as BGR or BGRA, converted by GDI+ both ways if the bitmap is
+// stored some other way. Other indexed bitmaps cannot be.
+//
+static bool ImageEdit_LockPixels(Gdiplus::Bitmap *bitmap, Gdiplus::BitmapData &data, imagefxbuf_t &buf)
+{
+   Gdiplus::PixelFormat format = bitmap->GetPixelFormat();
+
+   if(format == PixelFormat24bppRGB)
+      buf.channels = 3;
+   else if(format == PixelFormat32bppRGB || format == PixelFormat32bppARGB)
+      buf.channels = 4;
+   else if(ImageEdit_IsGrayPage(bitmap))
+      buf.channels = 1;
+   else if(Gdiplus::IsIndexedPixelFormat(format))
+      return false;
+   else
+   {
+      format       = PixelFormat32bppARGB;
+      buf.channels = 4;
+   }
+
+   Gdiplus::Rect rect(0, 0, INT(bitmap->GetWidth()), INT(bitmap->GetHeight()));
+   if(bitmap->LockBits(&rect, Gdiplus::ImageLockModeRead | Gdiplus::ImageLockModeWrite, format, &data) != Gdiplus::Ok)
+      return false;
+
+   buf.pixels = static_cast<uint8_t *>(data.Scan0);
+   buf.stride = data.Stride;
+   buf.width  = data.Width;
+   buf.height = data.Height;
+   return true;
+}
+
+//
+// Make a run of effects on a bitmap. The colour effects among them are made
+// together, in one pass over the pixels.
+//
+bool ImageEdit_ApplyEffects(const imageedit_t *edits, size_t count, Gdiplus::Bitmap *bitmap)
+{
+   if(!bitmap || bitmap->GetLastStatus() != Gdiplus::Ok)
+      return false;
+
+   Gdiplus::BitmapData data;
+   imagefxbuf_t        buf;
+
+   if(!ImageEdit_LockPixels(bitmap, data, buf))
+   {
+      for(size_t i = 0; i < count; i++)
+      {
+         if(!ImageEdit_ApplyGdiplusEffect(edits[i], bitmap))
+            return false;
+      }
+      return true;
+   }
+
+   bool ok = true;
+   try
+   {
+      ImageFxChain chain;
+      for(size_t i = 0; i < count && ok; i++)
+         ok = ImageEdit_AddToChain(edits[i], chain);
+      if(ok)
+         ok = chain.apply(buf);
+   }
+   catch(const std::bad_alloc &)
+   {
+      ok = false;
+   }
+   bitmap->UnlockBits(&data);
+
+   return ok;
+}
+
+//
+// Make an edit to a bitmap.
+//
+bool ImageEdit_Apply(const imageedit_t &edit, Gdiplus::Bitmap *bitmap)
+{
+   if(!bitmap || bitmap->GetLastStatus() != Gdiplus::Ok)
+      return false;
+
+   if(edit.kind == IMAGEEDIT_ROTATEFLIP)
+      return (bitmap->RotateFlip(edit.rotateFlip) == Gdiplus::Ok);
+   else
+      return ImageEdit_ApplyEffects(&edit, 1, bitmap);
+}
+
+//
+// Adapt an edit to a copy of the image scaled by the given factor, for the
+// effects with parameters measured in pixels.
+//
+imageedit_t ImageEdit_Scale(const imageedit_t &edit, float scale)
+{
+   imageedit_t scaled = edit;
+
+   if(edit.kind == IMAGEEDIT_EFFECT && edit.effect == FXTYPE_SHARPEN)
+      scaled.params[0] *= scale; // radius
+
+   return scaled;
+}
+
+//
+// The eight rotations and flips form a group. Each RotateFlipType value is
+// a clockwise rotation by (value & 3) quarter turns, followed by a flip
+// about the vertical axis if (value & 4) is set.
+//
+
+//
+// Get the single rotation/flip that does the same as first followed by
+// second.
+//
+Gdiplus::RotateFlipType ImageEdit_ComposeRotateFlip(Gdiplus::RotateFlipType first, Gdiplus::RotateFlipType second)
+{
+   int r1 = first & 3, f1 = (first >> 2) & 1;
+   int r2 = second & 3, f2 = (second >> 2) & 1;
+
+   // a flip turns the rotations after it the other way
+   int r = (r1 + (f1 ? 4 - r2 : r2)) & 3;
+   int f = f1 ^ f2;
+
+   return Gdiplus::RotateFlipType(f * 4 + r);
+}
+
+//
+// Get the rotation/flip that undoes another.
+//
+Gdiplus::RotateFlipType ImageEdit_InvertRotateFlip(Gdiplus::RotateFlipType rft)
+{
+   // anything flipped is its own inverse
+   if(rft & 4)
+      return rft;
+
+   return Gdiplus::RotateFlipType((4 - (rft & 3)) & 3);
+}
+
+// EOF
+
@@ -0,0 +1,57 @@
+/*
+  Scan Manager
+
+  Image edit operations
+*/
+
+#ifndef IMAGEEDIT_H__
+#define IMAGEEDIT_H__
+
+#include <Windows.h>
+#include <Unknwn.h>
+#include <gdiplus.h>
+
+// Types of effects supported
+enum fxtype_e
+{
+   FXTYPE_SHARPEN,
+   FXTYPE_TINT,
+   FXTYPE_BRIGHTNESS,
+   FXTYPE_HSL,
+   FXTYPE_BALANCE,
+   FXTYPE_MAX
+};
+
+enum imageeditkind_e
+{
+   IMAGEEDIT_ROTATEFLIP, // rotation and/or flip
+   IMAGEEDIT_EFFECT      // parametric effect
+};
+
+//
+// One edit made to an image, described fully enough to make it again.
+//
+struct imageedit_t
+{
+   imageeditkind_e         kind;
+   Gdiplus::RotateFlipType rotateFlip; // for IMAGEEDIT_ROTATEFLIP
+   fxtype_e                effect;     // for IMAGEEDIT_EFFECT
+   float                   params[3];  // effect parameters, as in fxparams_t
+};
+
+imageedit_t ImageEdit_RotateFlip(Gdiplus::RotateFlipType rft);
+imageedit_t ImageEdit_Effect(fxtype_e effect, const float *params, int numParams);
+
+bool        ImageEdit_Apply(const imageedit_t &edit, Gdiplus::Bitmap *bitmap);
+bool        ImageEdit_ApplyEffects(const imageedit_t *edits, size_t count, Gdiplus::Bitmap *bitmap);
+bool        ImageEdit_ApplyGdiplusEffect(const imageedit_t &edit, Gdiplus::Bitmap *bitmap);
+bool        ImageEdit_IsGrayPage(Gdiplus::Bitmap *bitmap);
+imageedit_t ImageEdit_Scale(const imageedit_t &edit, float scale);
+
+Gdiplus::RotateFlipType ImageEdit_ComposeRotateFlip(Gdiplus::RotateFlipType first, Gdiplus::RotateFlipType second);
+Gdiplus::RotateFlipType ImageEdit_InvertRotateFlip(Gdiplus::RotateFlipType rft);
+
+#endif
+
+// EOF
+
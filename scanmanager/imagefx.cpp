@@ -0,0 +1,1272 @@
+/*
+  Scan Manager
+
+  Image effect kernels
+
+  GDI+ applies its effects on one thread, and only on Windows. These do the
+  same jobs on 8-bit gray, BGR or BGRA rows, a block of rows or a stripe of
+  columns to each core, with SSE2 and AVX2 versions of the inner loops
+  chosen at runtime as for the pixel format converters. Every vector kernel
+  computes exactly what its scalar version does, so results do not depend on
+  the processor.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include "cpufeatures.h"
+#include "imagefx.h"
+#include "parallel.h"
+
+#if defined(SCANMGR_X86)
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+// Pixels converted to and from planes per step of a colour transform
+#define IMAGEFX_CHUNK 1024
+
+// Rows handed to a core at a time
+#define IMAGEFX_ROWBLOCK 16
+
+// Bytes of each row in a column stripe of the vertical blur
+#define IMAGEFX_STRIPE 512
+
+// Largest blur half-width; keeps a box sum of 8-bit values within 16 bits
+#define IMAGEFX_MAXHALFWIDTH 85
+
+// Fixed point precision of colour matrices
+#define IMAGEFX_MATRIXBITS 12
+
+// Luma weights of the B, G and R channels
+static const double imageFxLuma[3] = { 0.0722, 0.7152, 0.2126 };
+
+//=============================================================================
+//
+// Scalar kernels
+//
+
+static inline uint8_t ImageFx_Clamp(int v)
+{
+   return uint8_t(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+//
+// Multiply planar rows of B, G and R values by a colour matrix. Results are
+// rounded, clamped to 0-255 and stored as 16-bit values.
+//
+static void Matrix_Scalar(const int16_t *const *in, int16_t *const *out, uint32_t count, const imagefxmatrix_t &mat)
+{
+   for(uint32_t x = 0; x < count; x++)
+   {
+      const int b = in[0][x], g = in[1][x], r = in[2][x];
+      for(int c = 0; c < 3; c++)
+      {
+         const int s = mat.m[c][0] * b + mat.m[c][1] * g + mat.m[c][2] * r + (1 << (IMAGEFX_MATRIXBITS - 1));
+         out[c][x] = ImageFx_Clamp(s >> IMAGEFX_MATRIXBITS);
+      }
+   }
+}
+
+//
+// Average of a box sum, as (sum + half) * inv >> 16 with inv the rounded
+// 16-bit reciprocal of the box width. This is within one of the true
+// rounded average, and exact where all the values summed are the same.
+//
+static inline uint8_t ImageFx_BoxAverage(uint32_t sum, uint32_t half, uint32_t inv)
+{
+   const uint32_t v = ((sum + half) * inv) >> 16;
+   return uint8_t(v > 255 ? 255 : v);
+}
+
+//
+// One row of a vertical box blur: write out the averages of the column sums,
+// then move the sums down a row by adding one row and taking away another.
+//
+static void BoxStep_Scalar(uint16_t *sums, const uint8_t *add, const uint8_t *sub, uint8_t *dst, uint32_t count,
+                           uint16_t half, uint16_t inv)
+{
+   for(uint32_t x = 0; x < count; x++)
+   {
+      dst[x]  = ImageFx_BoxAverage(sums[x], half, inv);
+      sums[x] = uint16_t(sums[x] + add[x] - sub[x]);
+   }
+}
+
+//
+// Push pixels away from their blurred values by amount / 128 of the
+// difference, amount being 0 to 128; the vector versions multiply in 16
+// bits. With keepAlpha, every fourth byte is left as it is.
+//
+static void Unsharp_Scalar(uint8_t *pixels, const uint8_t *blurred, uint32_t count, int amount, bool keepAlpha)
+{
+   for(uint32_t x = 0; x < count; x++)
+   {
+      if(keepAlpha && (x & 3) == 3)
+         continue;
+
+      const int d = pixels[x] - blurred[x];
+      pixels[x] = ImageFx_Clamp(pixels[x] + ((d * amount + 64) >> 7));
+   }
+}
+
+#if defined(SCANMGR_X86)
+
+//=============================================================================
+//
+// SSE2 kernels
+//
+
+//
+// Pair B with G and R with a rounding constant so that each output channel
+// is two multiply-adds per four pixels; 8 pixels per step.
+//
+static void Matrix_SSE2(const int16_t *const *in, int16_t *const *out, uint32_t count, const imagefxmatrix_t &mat)
+{
+   const __m128i one  = _mm_set1_epi16(1);
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i max  = _mm_set1_epi16(255);
+
+   __m128i coefBG[3], coefR1[3];
+   for(int c = 0; c < 3; c++)
+   {
+      coefBG[c] = _mm_set1_epi32(int32_t(uint16_t(mat.m[c][0]) | (uint32_t(uint16_t(mat.m[c][1])) << 16)));
+      coefR1[c] = _mm_set1_epi32(int32_t(uint16_t(mat.m[c][2]) | (uint32_t(1 << (IMAGEFX_MATRIXBITS - 1)) << 16)));
+   }
+
+   uint32_t x = 0;
+
+   for(; x + 8 <= count; x += 8)
+   {
+      const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in[0] + x));
+      const __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in[1] + x));
+      const __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in[2] + x));
+
+      const __m128i bgLo = _mm_unpacklo_epi16(b, g);
+      const __m128i bgHi = _mm_unpackhi_epi16(b, g);
+      const __m128i r1Lo = _mm_unpacklo_epi16(r, one);
+      const __m128i r1Hi = _mm_unpackhi_epi16(r, one);
+
+      for(int c = 0; c < 3; c++)
+      {
+         __m128i lo = _mm_add_epi32(_mm_madd_epi16(bgLo, coefBG[c]), _mm_madd_epi16(r1Lo, coefR1[c]));
+         __m128i hi = _mm_add_epi32(_mm_madd_epi16(bgHi, coefBG[c]), _mm_madd_epi16(r1Hi, coefR1[c]));
+         lo = _mm_srai_epi32(lo, IMAGEFX_MATRIXBITS);
+         hi = _mm_srai_epi32(hi, IMAGEFX_MATRIXBITS);
+
+         const __m128i v = _mm_min_epi16(_mm_max_epi16(_mm_packs_epi32(lo, hi), zero), max);
+         _mm_storeu_si128(reinterpret_cast<__m128i *>(out[c] + x), v);
+      }
+   }
+
+   if(x < count)
+   {
+      const int16_t *const inRest[3]  = { in[0] + x, in[1] + x, in[2] + x };
+      int16_t *const       outRest[3] = { out[0] + x, out[1] + x, out[2] + x };
+      Matrix_Scalar(inRest, outRest, count - x, mat);
+   }
+}
+
+//
+// 16 columns per step, the sums held as two registers of 16-bit values.
+//
+static void BoxStep_SSE2(uint16_t *sums, const uint8_t *add, const uint8_t *sub, uint8_t *dst, uint32_t count,
+                         uint16_t half, uint16_t inv)
+{
+   const __m128i zero  = _mm_setzero_si128();
+   const __m128i vhalf = _mm_set1_epi16(short(half));
+   const __m128i vinv  = _mm_set1_epi16(short(inv));
+
+   uint32_t x = 0;
+
+   for(; x + 16 <= count; x += 16)
+   {
+      __m128i s0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sums + x));
+      __m128i s1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sums + x + 8));
+
+      const __m128i o0 = _mm_mulhi_epu16(_mm_add_epi16(s0, vhalf), vinv);
+      const __m128i o1 = _mm_mulhi_epu16(_mm_add_epi16(s1, vhalf), vinv);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_packus_epi16(o0, o1));
+
+      const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(add + x));
+      const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sub + x));
+      s0 = _mm_sub_epi16(_mm_add_epi16(s0, _mm_unpacklo_epi8(a, zero)), _mm_unpacklo_epi8(s, zero));
+      s1 = _mm_sub_epi16(_mm_add_epi16(s1, _mm_unpackhi_epi8(a, zero)), _mm_unpackhi_epi8(s, zero));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(sums + x),     s0);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(sums + x + 8), s1);
+   }
+
+   BoxStep_Scalar(sums + x, add + x, sub + x, dst + x, count - x, half, inv);
+}
+
+//
+// 16 bytes per step, widened to 16 bits for the multiply.
+//
+static void Unsharp_SSE2(uint8_t *pixels, const uint8_t *blurred, uint32_t count, int amount, bool keepAlpha)
+{
+   const __m128i zero   = _mm_setzero_si128();
+   const __m128i vamt   = _mm_set1_epi16(short(amount));
+   const __m128i round  = _mm_set1_epi16(64);
+   const __m128i alpha  = keepAlpha ? _mm_set1_epi32(int32_t(0xFF000000)) : zero;
+
+   uint32_t x = 0;
+
+   for(; x + 16 <= count; x += 16)
+   {
+      const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixels + x));
+      const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(blurred + x));
+
+      const __m128i pLo = _mm_unpacklo_epi8(p, zero);
+      const __m128i pHi = _mm_unpackhi_epi8(p, zero);
+      const __m128i dLo = _mm_sub_epi16(pLo, _mm_unpacklo_epi8(b, zero));
+      const __m128i dHi = _mm_sub_epi16(pHi, _mm_unpackhi_epi8(b, zero));
+
+      const __m128i oLo = _mm_add_epi16(pLo, _mm_srai_epi16(_mm_add_epi16(_mm_mullo_epi16(dLo, vamt), round), 7));
+      const __m128i oHi = _mm_add_epi16(pHi, _mm_srai_epi16(_mm_add_epi16(_mm_mullo_epi16(dHi, vamt), round), 7));
+
+      const __m128i o = _mm_packus_epi16(oLo, oHi);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(pixels + x), _mm_or_si128(_mm_andnot_si128(alpha, o), _mm_and_si128(alpha, p)));
+   }
+
+   Unsharp_Scalar(pixels + x, blurred + x, count - x, amount, keepAlpha);
+}
+
+//=============================================================================
+//
+// AVX2 kernels
+//
+
+//
+// As for SSE2, 16 pixels per step. The unpacks and the pack both work
+// within 128-bit lanes, so the pixels come out in order.
+//
+SCANMGR_TARGET_AVX2
+static void Matrix_AVX2(const int16_t *const *in, int16_t *const *out, uint32_t count, const imagefxmatrix_t &mat)
+{
+   const __m256i one  = _mm256_set1_epi16(1);
+   const __m256i zero = _mm256_setzero_si256();
+   const __m256i max  = _mm256_set1_epi16(255);
+
+   __m256i coefBG[3], coefR1[3];
+   for(int c = 0; c < 3; c++)
+   {
+      coefBG[c] = _mm256_set1_epi32(int32_t(uint16_t(mat.m[c][0]) | (uint32_t(uint16_t(mat.m[c][1])) << 16)));
+      coefR1[c] = _mm256_set1_epi32(int32_t(uint16_t(mat.m[c][2]) | (uint32_t(1 << (IMAGEFX_MATRIXBITS - 1)) << 16)));
+   }
+
+   uint32_t x = 0;
+
+   for(; x + 16 <= count; x += 16)
+   {
+      const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in[0] + x));
+      const __m256i g = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in[1] + x));
+      const __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in[2] + x));
+
+      const __m256i bgLo = _mm256_unpacklo_epi16(b, g);
+      const __m256i bgHi = _mm256_unpackhi_epi16(b, g);
+      const __m256i r1Lo = _mm256_unpacklo_epi16(r, one);
+      const __m256i r1Hi = _mm256_unpackhi_epi16(r, one);
+
+      for(int c = 0; c < 3; c++)
+      {
+         __m256i lo = _mm256_add_epi32(_mm256_madd_epi16(bgLo, coefBG[c]), _mm256_madd_epi16(r1Lo, coefR1[c]));
+         __m256i hi = _mm256_add_epi32(_mm256_madd_epi16(bgHi, coefBG[c]), _mm256_madd_epi16(r1Hi, coefR1[c]));
+         lo = _mm256_srai_epi32(lo, IMAGEFX_MATRIXBITS);
+         hi = _mm256_srai_epi32(hi, IMAGEFX_MATRIXBITS);
+
+         const __m256i v = _mm256_min_epi16(_mm256_max_epi16(_mm256_packs_epi32(lo, hi), zero), max);
+         _mm256_storeu_si256(reinterpret_cast<__m256i *>(out[c] + x), v);
+      }
+   }
+
+   if(x < count)
+   {
+      const int16_t *const inRest[3]  = { in[0] + x, in[1] + x, in[2] + x };
+      int16_t *const       outRest[3] = { out[0] + x, out[1] + x, out[2] + x };
+      Matrix_Scalar(inRest, outRest, count - x, mat);
+   }
+}
+
+//
+// Pack two registers of 16-bit values to bytes in order; the pack works
+// within lanes, so the middle quadwords are swapped back.
+//
+SCANMGR_TARGET_AVX2
+static inline __m256i ImageFx_PackUS_AVX2(__m256i lo, __m256i hi)
+{
+   return _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8);
+}
+
+//
+// 32 columns per step.
+//
+SCANMGR_TARGET_AVX2
+static void BoxStep_AVX2(uint16_t *sums, const uint8_t *add, const uint8_t *sub, uint8_t *dst, uint32_t count,
+                         uint16_t half, uint16_t inv)
+{
+   const __m256i vhalf = _mm256_set1_epi16(short(half));
+   const __m256i vinv  = _mm256_set1_epi16(short(inv));
+
+   uint32_t x = 0;
+
+   for(; x + 32 <= count; x += 32)
+   {
+      __m256i s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sums + x));
+      __m256i s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sums + x + 16));
+
+      const __m256i o0 = _mm256_mulhi_epu16(_mm256_add_epi16(s0, vhalf), vinv);
+      const __m256i o1 = _mm256_mulhi_epu16(_mm256_add_epi16(s1, vhalf), vinv);
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x), ImageFx_PackUS_AVX2(o0, o1));
+
+      const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(add + x));
+      const __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(add + x + 16));
+      const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sub + x));
+      const __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sub + x + 16));
+      s0 = _mm256_sub_epi16(_mm256_add_epi16(s0, _mm256_cvtepu8_epi16(a0)), _mm256_cvtepu8_epi16(b0));
+      s1 = _mm256_sub_epi16(_mm256_add_epi16(s1, _mm256_cvtepu8_epi16(a1)), _mm256_cvtepu8_epi16(b1));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(sums + x),      s0);
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(sums + x + 16), s1);
+   }
+
+   BoxStep_Scalar(sums + x, add + x, sub + x, dst + x, count - x, half, inv);
+}
+
+//
+// 32 bytes per step.
+//
+SCANMGR_TARGET_AVX2
+static void Unsharp_AVX2(uint8_t *pixels, const uint8_t *blurred, uint32_t count, int amount, bool keepAlpha)
+{
+   const __m256i vamt  = _mm256_set1_epi16(short(amount));
+   const __m256i round = _mm256_set1_epi16(64);
+   const __m256i alpha = keepAlpha ? _mm256_set1_epi32(int32_t(0xFF000000)) : _mm256_setzero_si256();
+
+   uint32_t x = 0;
+
+   for(; x + 32 <= count; x += 32)
+   {
+      const __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pixels + x));
+      const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(blurred + x));
+
+      const __m256i pLo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(p));
+      const __m256i pHi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(p, 1));
+      const __m256i dLo = _mm256_sub_epi16(pLo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b)));
+      const __m256i dHi = _mm256_sub_epi16(pHi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b, 1)));
+
+      const __m256i oLo = _mm256_add_epi16(pLo, _mm256_srai_epi16(_mm256_add_epi16(_mm256_mullo_epi16(dLo, vamt), round), 7));
+      const __m256i oHi = _mm256_add_epi16(pHi, _mm256_srai_epi16(_mm256_add_epi16(_mm256_mullo_epi16(dHi, vamt), round), 7));
+
+      const __m256i o = ImageFx_PackUS_AVX2(oLo, oHi);
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(pixels + x), _mm256_or_si256(_mm256_andnot_si256(alpha, o), _mm256_and_si256(alpha, p)));
+   }
+
+   Unsharp_Scalar(pixels + x, blurred + x, count - x, amount, keepAlpha);
+}
+
+#endif // SCANMGR_X86
+
+//=============================================================================
+//
+// Kernel selection
+//
+
+struct imagefxkernels_t
+{
+   const char *name;
+   void (*Matrix)(const int16_t *const *in, int16_t *const *out, uint32_t count, const imagefxmatrix_t &mat);
+   void (*BoxStep)(uint16_t *sums, const uint8_t *add, const uint8_t *sub, uint8_t *dst, uint32_t count,
+                   uint16_t half, uint16_t inv);
+   void (*Unsharp)(uint8_t *pixels, const uint8_t *blurred, uint32_t count, int amount, bool keepAlpha);
+};
+
+static const imagefxkernels_t imageFxScalar =
+{
+   "scalar",
+   Matrix_Scalar,
+   BoxStep_Scalar,
+   Unsharp_Scalar
+};
+
+#if defined(SCANMGR_X86)
+
+static const imagefxkernels_t imageFxSSE2 =
+{
+   "SSE2",
+   Matrix_SSE2,
+   BoxStep_SSE2,
+   Unsharp_SSE2
+};
+
+static const imagefxkernels_t imageFxAVX2 =
+{
+   "AVX2",
+   Matrix_AVX2,
+   BoxStep_AVX2,
+   Unsharp_AVX2
+};
+
+#endif
+
+static const imagefxkernels_t &ImageFx_Select()
+{
+#if defined(SCANMGR_X86)
+   if(CPU_HasAVX2())
+      return imageFxAVX2;
+   if(CPU_HasSSE2())
+      return imageFxSSE2;
+#endif
+   return imageFxScalar;
+}
+
+static const imagefxkernels_t &ImageFx_Kernels()
+{
+   static const imagefxkernels_t &kernels = ImageFx_Select();
+   return kernels;
+}
+
+//
+// Name of the instruction set the effects run with.
+//
+const char *ImageFx_KernelName()
+{
+   return ImageFx_Kernels().name;
+}
+
+//=============================================================================
+//
+// Drivers
+//
+
+static bool ImageFx_Valid(const imagefxbuf_t &buf)
+{
+   if(!buf.pixels || !buf.width || !buf.height)
+      return false;
+   if(buf.channels != 1 && buf.channels != 3 && buf.channels != 4)
+      return false;
+
+   const ptrdiff_t rowBytes = ptrdiff_t(buf.width) * buf.channels;
+   return (buf.stride >= rowBytes || -buf.stride >= rowBytes);
+}
+
+static inline uint8_t *ImageFx_Row(const imagefxbuf_t &buf, uint32_t y)
+{
+   return buf.pixels + ptrdiff_t(y) * buf.stride;
+}
+
+//
+// Call fn on every row, a block of rows to each core.
+//
+template<typename fn_t>
+static void ImageFx_ForEachRow(const imagefxbuf_t &buf, const fn_t &fn)
+{
+   const size_t numBlocks = (buf.height + IMAGEFX_ROWBLOCK - 1) / IMAGEFX_ROWBLOCK;
+
+   Parallel_For(numBlocks, 0, [&] (size_t block) {
+      uint32_t y   = uint32_t(block) * IMAGEFX_ROWBLOCK;
+      uint32_t end = (y + IMAGEFX_ROWBLOCK < buf.height) ? y + IMAGEFX_ROWBLOCK : buf.height;
+      for(; y < end; y++)
+         fn(ImageFx_Row(buf, y));
+   });
+}
+
+//
+// Start a colour effect that changes nothing.
+//
+static void ImageFx_InitColor(imagefxcolor_t &color)
+{
+   color.useMatrix = false;
+   memset(&color.matrix, 0, sizeof(color.matrix));
+   for(int c = 0; c < 3; c++)
+   {
+      color.matrix.m[c][c] = 1 << IMAGEFX_MATRIXBITS;
+      for(int v = 0; v < 256; v++)
+         color.lut[c][v] = uint8_t(v);
+   }
+}
+
+//
+// Set the matrix of a colour effect, given in R, G, B order.
+//
+static void ImageFx_SetMatrix(imagefxcolor_t &color, const double rgb[3][3])
+{
+   color.useMatrix = true;
+   for(int i = 0; i < 3; i++)
+   {
+      for(int j = 0; j < 3; j++)
+      {
+         double v = floor(rgb[2 - i][2 - j] * (1 << IMAGEFX_MATRIXBITS) + 0.5);
+         if(v > 32767.0)
+            v = 32767.0;
+         else if(v < -32768.0)
+            v = -32768.0;
+         color.matrix.m[i][j] = int16_t(v);
+      }
+   }
+}
+
+static void ImageFx_MultiplyMatrix(const double a[3][3], const double b[3][3], double out[3][3])
+{
+   for(int i = 0; i < 3; i++)
+   {
+      for(int j = 0; j < 3; j++)
+         out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+   }
+}
+
+//=============================================================================
+//
+// Colour effects
+//
+
+//
+// Brightness -255 to 255 is added after contrast -100 to 100 stretches or
+// squeezes the levels about the middle; contrast 100 leaves only black and
+// white.
+//
+static void ImageFx_BrightnessContrast(imagefxcolor_t &color, int brightness, int contrast)
+{
+   ImageFx_InitColor(color);
+
+   const double c = contrast / 100.0;
+   const double factor = (c >= 1.0) ? 255.0 : (c >= 0.0 ? 1.0 / (1.0 - c) : 1.0 + c);
+
+   for(int v = 0; v < 256; v++)
+   {
+      const double level = (v - 127.5) * factor + 127.5 + brightness;
+      const uint8_t out = ImageFx_Clamp(int(floor(level + 0.5)));
+      color.lut[0][v] = color.lut[1][v] = color.lut[2][v] = out;
+   }
+}
+
+//
+// Get the fully saturated colour of a hue in degrees, 0 being red, 120
+// green and -120 blue, as R, G, B from 0 to 1.
+//
+static void ImageFx_HueColor(double hue, double rgb[3])
+{
+   hue = fmod(hue, 360.0);
+   if(hue < 0.0)
+      hue += 360.0;
+
+   const double h = hue / 60.0;
+   const double f = h - floor(h);
+   switch(int(h) % 6)
+   {
+   case 0: rgb[0] = 1.0;     rgb[1] = f;       rgb[2] = 0.0;     break;
+   case 1: rgb[0] = 1.0 - f; rgb[1] = 1.0;     rgb[2] = 0.0;     break;
+   case 2: rgb[0] = 0.0;     rgb[1] = 1.0;     rgb[2] = f;       break;
+   case 3: rgb[0] = 0.0;     rgb[1] = 1.0 - f; rgb[2] = 1.0;     break;
+   case 4: rgb[0] = f;       rgb[1] = 0.0;     rgb[2] = 1.0;     break;
+   default: rgb[0] = 1.0;    rgb[1] = 0.0;     rgb[2] = 1.0 - f; break;
+   }
+}
+
+//
+// Tint shifts each pixel towards the colour of hue -180 to 180, in
+// proportion to its brightness and to amount -100 to 100; a negative amount
+// shifts towards the opposite colour. Brightness is kept, and black stays
+// black.
+//
+static void ImageFx_Tint(imagefxcolor_t &color, int hue, int amount)
+{
+   ImageFx_InitColor(color);
+
+   double tint[3];
+   ImageFx_HueColor(hue, tint);
+
+   const double w[3] = { imageFxLuma[2], imageFxLuma[1], imageFxLuma[0] }; // R, G, B
+   const double luma = w[0] * tint[0] + w[1] * tint[1] + w[2] * tint[2];
+   const double a    = amount / 100.0;
+
+   double rgb[3][3];
+   for(int i = 0; i < 3; i++)
+   {
+      for(int j = 0; j < 3; j++)
+         rgb[i][j] = (i == j ? 1.0 : 0.0) + a * (tint[i] - luma) * w[j];
+   }
+
+   ImageFx_SetMatrix(color, rgb);
+}
+
+//
+// Hue -180 to 180 turns the colours about the gray axis and saturation
+// -100 to 100 moves them from or towards gray, both as the matrices of the
+// SVG colour filters, which keep brightness. Lightness -100 to 100 then
+// moves every level towards white or black.
+//
+static void ImageFx_HueSaturationLightness(imagefxcolor_t &color, int hue, int saturation, int lightness)
+{
+   ImageFx_InitColor(color);
+
+   if(hue || saturation)
+   {
+      const double angle = hue * 3.14159265358979323846 / 180.0;
+      const double cs = cos(angle), sn = sin(angle);
+      const double rot[3][3] =
+      {
+         { 0.213 + cs * 0.787 - sn * 0.213, 0.715 - cs * 0.715 - sn * 0.715, 0.072 - cs * 0.072 + sn * 0.928 },
+         { 0.213 - cs * 0.213 + sn * 0.143, 0.715 + cs * 0.285 + sn * 0.140, 0.072 - cs * 0.072 - sn * 0.283 },
+         { 0.213 - cs * 0.213 - sn * 0.787, 0.715 - cs * 0.715 + sn * 0.715, 0.072 + cs * 0.928 + sn * 0.072 }
+      };
+
+      const double s = 1.0 + saturation / 100.0;
+      const double sat[3][3] =
+      {
+         { 0.213 + 0.787 * s, 0.715 - 0.715 * s, 0.072 - 0.072 * s },
+         { 0.213 - 0.213 * s, 0.715 + 0.285 * s, 0.072 - 0.072 * s },
+         { 0.213 - 0.213 * s, 0.715 - 0.715 * s, 0.072 + 0.928 * s }
+      };
+
+      double rgb[3][3];
+      ImageFx_MultiplyMatrix(sat, rot, rgb);
+      ImageFx_SetMatrix(color, rgb);
+   }
+
+   const double l = lightness / 100.0;
+   for(int v = 0; v < 256; v++)
+   {
+      const double level = (l >= 0.0) ? v + (255.0 - v) * l : v * (1.0 + l);
+      const uint8_t out = ImageFx_Clamp(int(floor(level + 0.5)));
+      color.lut[0][v] = color.lut[1][v] = color.lut[2][v] = out;
+   }
+}
+
+//
+// Each of cyanRed, magentaGreen and yellowBlue, -100 to 100, scales the
+// red, green or blue channel by that percentage more or less.
+//
+static void ImageFx_ColorBalance(imagefxcolor_t &color, int cyanRed, int magentaGreen, int yellowBlue)
+{
+   ImageFx_InitColor(color);
+
+   const int levels[3] = { yellowBlue, magentaGreen, cyanRed }; // B, G, R
+   for(int c = 0; c < 3; c++)
+   {
+      const double gain = 1.0 + levels[c] / 100.0;
+      for(int v = 0; v < 256; v++)
+         color.lut[c][v] = ImageFx_Clamp(int(floor(v * gain + 0.5)));
+   }
+}
+
+//=============================================================================
+//
+// Sharpening
+//
+
+//
+// Box blur of a row, channel by channel, with the edge pixels repeated
+// beyond the ends.
+//
+static void ImageFx_BoxRow(const uint8_t *src, uint8_t *dst, uint32_t width, uint32_t channels, uint32_t halfWidth)
+{
+   const uint32_t n    = 2 * halfWidth + 1;
+   const uint32_t inv  = (65536 + n / 2) / n;
+   const uint32_t last = width - 1;
+
+   for(uint32_t c = 0; c < channels; c++)
+   {
+      uint32_t sum = (halfWidth + 1) * src[c];
+      for(uint32_t i = 1; i <= halfWidth; i++)
+         sum += src[(i < last ? i : last) * channels + c];
+
+      for(uint32_t x = 0; x < width; x++)
+      {
+         dst[x * channels + c] = ImageFx_BoxAverage(sum, halfWidth, inv);
+
+         const uint32_t add = x + halfWidth + 1;
+         const uint32_t sub = (x > halfWidth) ? x - halfWidth : 0;
+         sum += src[(add < last ? add : last) * channels + c];
+         sum -= src[sub * channels + c];
+      }
+   }
+}
+
+//
+// Box blur down a stripe of columns, count bytes wide, between two buffers
+// with rows stride bytes apart.
+//
+static void ImageFx_BoxColumns(const uint8_t *src, uint8_t *dst, size_t stride, uint32_t count, uint32_t height,
+                               uint32_t halfWidth)
+{
+   const imagefxkernels_t &kernels = ImageFx_Kernels();
+
+   const uint32_t n    = 2 * halfWidth + 1;
+   const uint16_t inv  = uint16_t((65536 + n / 2) / n);
+   const uint32_t last = height - 1;
+
+   uint16_t sums[IMAGEFX_STRIPE];
+   for(uint32_t x = 0; x < count; x++)
+      sums[x] = uint16_t((halfWidth + 1) * src[x]);
+   for(uint32_t i = 1; i <= halfWidth; i++)
+   {
+      const uint8_t *row = src + (i < last ? i : last) * stride;
+      for(uint32_t x = 0; x < count; x++)
+         sums[x] = uint16_t(sums[x] + row[x]);
+   }
+
+   for(uint32_t y = 0; y < height; y++)
+   {
+      const uint32_t add = y + halfWidth + 1;
+      const uint32_t sub = (y > halfWidth) ? y - halfWidth : 0;
+      kernels.BoxStep(sums, src + (add < last ? add : last) * stride, src + sub * stride, dst + y * stride, count,
+                      uint16_t(halfWidth), inv);
+   }
+}
+
+//
+// Unsharp mask. The blur is three box blurs of a third of radius each way,
+// which is close to a Gaussian reaching radius pixels out, done across rows
+// and then down columns; amount 0 to 100 is the percentage of the
+// difference from the blur added back.
+//
+static bool ImageFx_Sharpen(const imagefxbuf_t &buf, float radius, float amount)
+{
+   if(!ImageFx_Valid(buf))
+      return false;
+
+   uint32_t halfWidth = (radius > 0.0f) ? uint32_t((radius + 2.0f) / 3.0f) : 0;
+   if(radius > 0.0f && halfWidth < 1)
+      halfWidth = 1;
+   if(halfWidth > IMAGEFX_MAXHALFWIDTH)
+      halfWidth = IMAGEFX_MAXHALFWIDTH;
+
+   // amounts over GDI+'s 100 are taken as 100, as the kernels need
+   const int strength = (amount >= 100.0f) ? 128 : int(floor(amount * 128.0f / 100.0f + 0.5f));
+   if(!halfWidth || strength <= 0)
+      return true;
+
+   const uint32_t rowBytes = buf.width * buf.channels;
+   const size_t   size     = size_t(rowBytes) * buf.height;
+
+   std::unique_ptr<uint8_t []> upBlur(new (std::nothrow) uint8_t [size]);
+   std::unique_ptr<uint8_t []> upWork(new (std::nothrow) uint8_t [size]);
+   if(!upBlur || !upWork)
+      return false;
+
+   uint8_t *const blur = upBlur.get();
+   uint8_t *const work = upWork.get();
+
+   // across the rows, into blur
+   std::atomic<bool> failed(false);
+   const size_t numBlocks = (buf.height + IMAGEFX_ROWBLOCK - 1) / IMAGEFX_ROWBLOCK;
+
+   Parallel_For(numBlocks, 0, [&] (size_t block) {
+      std::unique_ptr<uint8_t []> upRow(new (std::nothrow) uint8_t [rowBytes]);
+      if(!upRow)
+      {
+         failed = true;
+         return;
+      }
+
+      uint32_t y   = uint32_t(block) * IMAGEFX_ROWBLOCK;
+      uint32_t end = (y + IMAGEFX_ROWBLOCK < buf.height) ? y + IMAGEFX_ROWBLOCK : buf.height;
+      for(; y < end; y++)
+      {
+         uint8_t *out = blur + size_t(y) * rowBytes;
+         ImageFx_BoxRow(ImageFx_Row(buf, y), out, buf.width, buf.channels, halfWidth);
+         ImageFx_BoxRow(out, upRow.get(), buf.width, buf.channels, halfWidth);
+         ImageFx_BoxRow(upRow.get(), out, buf.width, buf.channels, halfWidth);
+      }
+   });
+
+   // nothing has been changed yet
+   if(failed)
+      return false;
+
+   // down the columns, ending up in work
+   const size_t numStripes = (rowBytes + IMAGEFX_STRIPE - 1) / IMAGEFX_STRIPE;
+
+   Parallel_For(numStripes, 0, [&] (size_t stripe) {
+      const size_t   x     = stripe * IMAGEFX_STRIPE;
+      const uint32_t count = (rowBytes - x < IMAGEFX_STRIPE) ? uint32_t(rowBytes - x) : IMAGEFX_STRIPE;
+
+      ImageFx_BoxColumns(blur + x, work + x, rowBytes, count, buf.height, halfWidth);
+      ImageFx_BoxColumns(work + x, blur + x, rowBytes, count, buf.height, halfWidth);
+      ImageFx_BoxColumns(blur + x, work + x, rowBytes, count, buf.height, halfWidth);
+   });
+
+   const imagefxkernels_t &kernels = ImageFx_Kernels();
+   const bool keepAlpha = (buf.channels == 4);
+
+   Parallel_For(numBlocks, 0, [&] (size_t block) {
+      uint32_t y   = uint32_t(block) * IMAGEFX_ROWBLOCK;
+      uint32_t end = (y + IMAGEFX_ROWBLOCK < buf.height) ? y + IMAGEFX_ROWBLOCK : buf.height;
+      for(; y < end; y++)
+         kernels.Unsharp(ImageFx_Row(buf, y), work + size_t(y) * rowBytes, rowBytes, strength, keepAlpha);
+   });
+
+   return true;
+}
+
+//=============================================================================
+//
+// Runs of colour effects
+//
+
+//
+// Matrix and lookup tables of one colour effect in a run after the first
+// with a matrix
+//
+struct imagefxstep_t
+{
+   imagefxmatrix_t matrix;
+   uint8_t         lut[3][256];
+   bool            identity; // lut changes nothing
+};
+
+//
+// A run of colour effects prepared to be made in one pass: the lookup
+// tables before the first matrix, then each matrix with the tables after
+// it. Tables next to each other are merged, which gives exactly what
+// mapping through each in turn would. Matrices are not, as the result of
+// each is clamped to 0-255 before the next.
+//
+struct imagefxrun_t
+{
+   uint8_t                    lead[3][256];
+   std::vector<imagefxstep_t> steps;
+};
+
+//
+// Map lut through after, so that lut alone does what lut then after did.
+//
+static void ImageFx_ComposeLuts(uint8_t lut[3][256], const uint8_t after[3][256])
+{
+   for(int c = 0; c < 3; c++)
+   {
+      for(int v = 0; v < 256; v++)
+         lut[c][v] = after[c][lut[c][v]];
+   }
+}
+
+static bool ImageFx_IsIdentity(const uint8_t lut[3][256])
+{
+   for(int c = 0; c < 3; c++)
+   {
+      for(int v = 0; v < 256; v++)
+      {
+         if(lut[c][v] != v)
+            return false;
+      }
+   }
+   return true;
+}
+
+static void ImageFx_PrepareRun(const std::vector<imagefxcolor_t> &colors, imagefxrun_t &run)
+{
+   for(int c = 0; c < 3; c++)
+   {
+      for(int v = 0; v < 256; v++)
+         run.lead[c][v] = uint8_t(v);
+   }
+   run.steps.clear();
+
+   for(const imagefxcolor_t &color : colors)
+   {
+      if(color.useMatrix)
+      {
+         imagefxstep_t step;
+         step.matrix = color.matrix;
+         memcpy(step.lut, color.lut, sizeof(step.lut));
+         run.steps.push_back(step);
+      }
+      else if(run.steps.empty())
+         ImageFx_ComposeLuts(run.lead, color.lut);
+      else
+         ImageFx_ComposeLuts(run.steps.back().lut, color.lut);
+   }
+
+   for(imagefxstep_t &step : run.steps)
+      step.identity = ImageFx_IsIdentity(step.lut);
+}
+
+//
+// Make a run of colour effects on one row of BGR or BGRA pixels. Pixels are
+// split into planes a chunk at a time, and each matrix and table worked
+// through while the chunk is in cache.
+//
+static void ImageFx_RunRow(const imagefxrun_t &run, uint8_t *row, uint32_t width, uint32_t channels)
+{
+   if(run.steps.empty())
+   {
+      for(uint32_t x = 0; x < width; x++, row += channels)
+      {
+         row[0] = run.lead[0][row[0]];
+         row[1] = run.lead[1][row[1]];
+         row[2] = run.lead[2][row[2]];
+      }
+      return;
+   }
+
+   const imagefxkernels_t &kernels = ImageFx_Kernels();
+   int16_t planes[6][IMAGEFX_CHUNK];
+
+   while(width)
+   {
+      const uint32_t n = (width < IMAGEFX_CHUNK) ? width : IMAGEFX_CHUNK;
+
+      const uint8_t *src = row;
+      for(uint32_t x = 0; x < n; x++, src += channels)
+      {
+         planes[0][x] = run.lead[0][src[0]];
+         planes[1][x] = run.lead[1][src[1]];
+         planes[2][x] = run.lead[2][src[2]];
+      }
+
+      int16_t *cur[3]  = { planes[0], planes[1], planes[2] };
+      int16_t *next[3] = { planes[3], planes[4], planes[5] };
+
+      const size_t numSteps = run.steps.size();
+      for(size_t i = 0; i < numSteps; i++)
+      {
+         const imagefxstep_t &step = run.steps[i];
+
+         kernels.Matrix(cur, next, n, step.matrix);
+         for(int c = 0; c < 3; c++)
+         {
+            int16_t *tmp = cur[c];
+            cur[c]  = next[c];
+            next[c] = tmp;
+         }
+
+         // the last step's tables are applied on the way out
+         if(i + 1 < numSteps && !step.identity)
+         {
+            for(int c = 0; c < 3; c++)
+            {
+               for(uint32_t x = 0; x < n; x++)
+                  cur[c][x] = step.lut[c][cur[c][x]];
+            }
+         }
+      }
+
+      const imagefxstep_t &last = run.steps.back();
+      for(uint32_t x = 0; x < n; x++, row += channels)
+      {
+         row[0] = last.lut[0][cur[0][x]];
+         row[1] = last.lut[1][cur[1][x]];
+         row[2] = last.lut[2][cur[2][x]];
+      }
+      width -= n;
+   }
+}
+
+//
+// Get what a colour effect makes of each level of gray, as the luma of its
+// result, so that a gray image stays gray.
+//
+static void ImageFx_GrayLut(const imagefxcolor_t &color, uint8_t gray[256])
+{
+   for(int v = 0; v < 256; v++)
+   {
+      const int16_t level = int16_t(v);
+      const int16_t *const in[3] = { &level, &level, &level };
+      int16_t mixed[3] = { level, level, level };
+      int16_t *const out[3] = { &mixed[0], &mixed[1], &mixed[2] };
+      if(color.useMatrix)
+         Matrix_Scalar(in, out, 1, color.matrix);
+
+      double luma = 0.0;
+      for(int c = 0; c < 3; c++)
+         luma += imageFxLuma[c] * color.lut[c][mixed[c]];
+      gray[v] = ImageFx_Clamp(int(floor(luma + 0.5)));
+   }
+}
+
+//=============================================================================
+//
+// Effect chains
+//
+
+imagefxcolor_t &ImageFxChain::addColor()
+{
+   if(m_stages.empty() || m_stages.back().colors.empty())
+   {
+      stage_t stage;
+      stage.radius = 0.0f;
+      stage.amount = 0.0f;
+      m_stages.push_back(stage);
+   }
+
+   std::vector<imagefxcolor_t> &colors = m_stages.back().colors;
+   colors.resize(colors.size() + 1);
+   return colors.back();
+}
+
+void ImageFxChain::addBrightnessContrast(int brightness, int contrast)
+{
+   ImageFx_BrightnessContrast(addColor(), brightness, contrast);
+}
+
+void ImageFxChain::addTint(int hue, int amount)
+{
+   ImageFx_Tint(addColor(), hue, amount);
+}
+
+void ImageFxChain::addHueSaturationLightness(int hue, int saturation, int lightness)
+{
+   ImageFx_HueSaturationLightness(addColor(), hue, saturation, lightness);
+}
+
+void ImageFxChain::addColorBalance(int cyanRed, int magentaGreen, int yellowBlue)
+{
+   ImageFx_ColorBalance(addColor(), cyanRed, magentaGreen, yellowBlue);
+}
+
+void ImageFxChain::addSharpen(float radius, float amount)
+{
+   stage_t stage;
+   stage.radius = radius;
+   stage.amount = amount;
+   m_stages.push_back(stage);
+}
+
+//
+// Make a run of colour effects in one pass.
+//
+bool ImageFxChain::applyColors(const imagefxbuf_t &buf, const std::vector<imagefxcolor_t> &colors) const
+{
+   if(buf.channels == 1)
+   {
+      uint8_t gray[256], next[256];
+      for(int v = 0; v < 256; v++)
+         gray[v] = uint8_t(v);
+
+      for(const imagefxcolor_t &color : colors)
+      {
+         ImageFx_GrayLut(color, next);
+         for(int v = 0; v < 256; v++)
+            gray[v] = next[gray[v]];
+      }
+
+      ImageFx_ForEachRow(buf, [&] (uint8_t *row) {
+         for(uint32_t x = 0; x < buf.width; x++)
+            row[x] = gray[row[x]];
+      });
+      return true;
+   }
+
+   std::unique_ptr<imagefxrun_t> upRun(new (std::nothrow) imagefxrun_t);
+   if(!upRun)
+      return false;
+
+   try
+   {
+      ImageFx_PrepareRun(colors, *upRun);
+   }
+   catch(const std::bad_alloc &)
+   {
+      return false;
+   }
+
+   const imagefxrun_t &run = *upRun;
+   ImageFx_ForEachRow(buf, [&] (uint8_t *row) {
+      ImageFx_RunRow(run, row, buf.width, buf.channels);
+   });
+   return true;
+}
+
+//
+// Make the effects, in order.
+//
+bool ImageFxChain::apply(const imagefxbuf_t &buf) const
+{
+   if(!ImageFx_Valid(buf))
+      return false;
+
+   for(const stage_t &stage : m_stages)
+   {
+      bool ok;
+      if(!stage.colors.empty())
+         ok = applyColors(buf, stage.colors);
+      else
+         ok = ImageFx_Sharpen(buf, stage.radius, stage.amount);
+
+      if(!ok)
+         return false;
+   }
+
+   return true;
+}
+
+//=============================================================================
+//
+// Self-check
+//
+
+// Random cases tried of each kernel
+#define IMAGEFX_CHECKCASES 500
+
+//
+// Small fixed-seed generator for test data, so that a failure found on one
+// machine can be reproduced on another.
+//
+struct imagefxrand_t
+{
+   uint32_t state;
+
+   uint32_t next()
+   {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      return state;
+   }
+};
+
+//
+// Try a matrix kernel against the scalar one, on row lengths running past
+// every vector width so the leftover pixels are covered. Returns the number
+// of cases that differ.
+//
+static unsigned ImageFx_CheckMatrix(const imagefxkernels_t &kernels, imagefxrand_t &rng)
+{
+   unsigned failures = 0;
+
+   for(int i = 0; i < IMAGEFX_CHECKCASES; i++)
+   {
+      const uint32_t count = 1 + rng.next() % 300;
+
+      imagefxmatrix_t mat;
+      for(int r = 0; r < 3; r++)
+      {
+         for(int c = 0; c < 3; c++)
+            mat.m[r][c] = int16_t(rng.next());
+      }
+
+      std::vector<int16_t> in(3 * count), want(3 * count), got(3 * count);
+      for(auto &v : in)
+         v = int16_t(rng.next() & 255);
+
+      const int16_t *inRows[3]   = { &in[0],   &in[count],   &in[2 * count]   };
+      int16_t       *wantRows[3] = { &want[0], &want[count], &want[2 * count] };
+      int16_t       *gotRows[3]  = { &got[0],  &got[count],  &got[2 * count]  };
+
+      imageFxScalar.Matrix(inRows, wantRows, count, mat);
+      kernels.Matrix(inRows, gotRows, count, mat);
+      if(got != want)
+         ++failures;
+   }
+
+   return failures;
+}
+
+//
+// Try a box blur step against the scalar one, with column sums anywhere a
+// blur of up to the largest half-width can take them.
+//
+static unsigned ImageFx_CheckBoxStep(const imagefxkernels_t &kernels, imagefxrand_t &rng)
+{
+   unsigned failures = 0;
+
+   for(int i = 0; i < IMAGEFX_CHECKCASES; i++)
+   {
+      const uint32_t count = 1 + rng.next() % 300;
+      const uint32_t half  = 1 + rng.next() % IMAGEFX_MAXHALFWIDTH;
+      const uint32_t width = 2 * half + 1;
+      const uint16_t inv   = uint16_t((65536 + width / 2) / width);
+
+      std::vector<uint8_t>  add(count), sub(count), want(count), got(count);
+      std::vector<uint16_t> wantSums(count), gotSums(count);
+      for(uint32_t x = 0; x < count; x++)
+      {
+         add[x] = uint8_t(rng.next());
+         sub[x] = uint8_t(rng.next());
+
+         // the row being taken away is part of the sum
+         wantSums[x] = gotSums[x] = uint16_t(sub[x] + rng.next() % ((width - 1) * 255 + 1));
+      }
+
+      imageFxScalar.BoxStep(&wantSums[0], &add[0], &sub[0], &want[0], count, uint16_t(half), inv);
+      kernels.BoxStep(&gotSums[0], &add[0], &sub[0], &got[0], count, uint16_t(half), inv);
+      if(got != want || gotSums != wantSums)
+         ++failures;
+   }
+
+   return failures;
+}
+
+//
+// Try an unsharp mask kernel against the scalar one, with and without alpha
+// to be kept.
+//
+static unsigned ImageFx_CheckUnsharp(const imagefxkernels_t &kernels, imagefxrand_t &rng)
+{
+   unsigned failures = 0;
+
+   for(int i = 0; i < IMAGEFX_CHECKCASES; i++)
+   {
+      const bool     keepAlpha = (rng.next() & 1) != 0;
+      const uint32_t count     = keepAlpha ? 4 * (1 + rng.next() % 100) : 1 + rng.next() % 300;
+      const int      amount    = int(rng.next() % 129);
+
+      std::vector<uint8_t> want(count), blurred(count);
+      for(uint32_t x = 0; x < count; x++)
+      {
+         want[x]    = uint8_t(rng.next());
+         blurred[x] = uint8_t(rng.next());
+      }
+      std::vector<uint8_t> got(want);
+
+      imageFxScalar.Unsharp(&want[0], &blurred[0], count, amount, keepAlpha);
+      kernels.Unsharp(&got[0], &blurred[0], count, amount, keepAlpha);
+      if(got != want)
+         ++failures;
+   }
+
+   return failures;
+}
+
+//
+// Check one set of vector kernels against the scalar ones and add a line on
+// the outcome to report.
+//
+static bool ImageFx_CheckTable(const imagefxkernels_t &kernels, std::string &report)
+{
+   imagefxrand_t rng = { 0x5ca11ed };
+
+   const unsigned matrix  = ImageFx_CheckMatrix(kernels, rng);
+   const unsigned boxStep = ImageFx_CheckBoxStep(kernels, rng);
+   const unsigned unsharp = ImageFx_CheckUnsharp(kernels, rng);
+
+   char line[160];
+   snprintf(line, sizeof(line), "%s: %u of %d matrix, %u of %d box blur, %u of %d unsharp cases differ from scalar\n",
+            kernels.name, matrix, IMAGEFX_CHECKCASES, boxStep, IMAGEFX_CHECKCASES, unsharp, IMAGEFX_CHECKCASES);
+   report += line;
+
+   return !matrix && !boxStep && !unsharp;
+}
+
+//
+// Check that each set of vector kernels this processor can run gives
+// exactly what the scalar kernels do, on random data from a fixed seed. A
+// line per set is added to report. Returns false if any of them differs.
+//
+bool ImageFx_CheckKernels(std::string &report)
+{
+   bool ok = true;
+
+#if defined(SCANMGR_X86)
+   if(CPU_HasSSE2())
+      ok = ImageFx_CheckTable(imageFxSSE2, report) && ok;
+   else
+      report += "SSE2: not supported by this processor\n";
+
+   if(CPU_HasAVX2())
+      ok = ImageFx_CheckTable(imageFxAVX2, report) && ok;
+   else
+      report += "AVX2: not supported by this processor\n";
+#else
+   report += "no vector kernels on this processor\n";
+#endif
+
+   report += std::string("effects run with: ") + ImageFx_KernelName() + "\n";
+   return ok;
+}
+
+// EOF
@@ -0,0 +1,93 @@
+/*
+  Scan Manager
+
+  Image effect kernels
+
+  Native versions of the GDI+ effects, working on plain 8-bit pixel buffers
+  so they can run on any platform and on all cores. The colour effects are
+  built as per-channel lookup tables, optionally preceded by a 3x3 matrix;
+  sharpening is an unsharp mask over a separable blur.
+*/
+
+#ifndef IMAGEFX_H__
+#define IMAGEFX_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+//
+// Pixels to work on. Channels are 1 for gray, 3 for BGR or 4 for BGRA; alpha
+// is left as it is.
+//
+struct imagefxbuf_t
+{
+   uint8_t  *pixels;   // first row
+   ptrdiff_t stride;   // bytes from one row to the next
+   uint32_t  width;
+   uint32_t  height;
+   uint32_t  channels;
+};
+
+//
+// Colour matrix in fixed point, rows and columns in B, G, R order
+//
+struct imagefxmatrix_t
+{
+   int16_t m[3][3];
+};
+
+//
+// A colour effect: each channel is mapped through its lookup table, after
+// the matrix if there is one.
+//
+struct imagefxcolor_t
+{
+   bool            useMatrix;
+   imagefxmatrix_t matrix;
+   uint8_t         lut[3][256]; // B, G, R
+};
+
+//
+// A list of effects to make one after another. Each run of colour effects
+// is made in a single pass over the pixels, giving exactly what making them
+// one at a time would; sharpening, which needs the pixels around each one,
+// is a pass of its own.
+//
+class ImageFxChain
+{
+protected:
+   struct stage_t
+   {
+      std::vector<imagefxcolor_t> colors; // colour effects, in order
+      float radius;                       // for a sharpening stage, if colors is empty
+      float amount;
+   };
+
+   std::vector<stage_t> m_stages;
+
+   imagefxcolor_t &addColor();
+   bool applyColors(const imagefxbuf_t &buf, const std::vector<imagefxcolor_t> &colors) const;
+
+public:
+   // Each takes the parameters of the GDI+ effect of the same name and has
+   // the same neutral settings.
+   void addBrightnessContrast(int brightness, int contrast);
+   void addTint(int hue, int amount);
+   void addHueSaturationLightness(int hue, int saturation, int lightness);
+   void addColorBalance(int cyanRed, int magentaGreen, int yellowBlue);
+   void addSharpen(float radius, float amount);
+
+   bool apply(const imagefxbuf_t &buf) const;
+   bool empty() const { return m_stages.empty(); }
+   void clear()       { m_stages.clear();        }
+};
+
+const char *ImageFx_KernelName();
+bool        ImageFx_CheckKernels(std::string &report);
+
+#endif
+
+// EOF
+
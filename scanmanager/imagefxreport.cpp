@@ -0,0 +1,279 @@
+/*
+  Scan Manager
+
+  Image effect report
+
+  The image effects are made by native kernels standing in for the GDI+
+  effects of the same names; see imagefx.cpp. This report makes a set of
+  effects on every image in a directory of sample pages both ways, and
+  writes how far apart the results are to a CSV file, together with a check
+  of the vector kernels against the scalar ones. It is the thing to run
+  after changing the kernels, and on any new processor or Windows version.
+
+  The two are not expected to agree exactly, since GDI+ does not document
+  its arithmetic. A case passes if the mean difference over all channel
+  values is within IMAGEFXREPORT_MAXMEAN levels and no more than
+  IMAGEFXREPORT_MAXOVERPCT percent of them differ by more than
+  IMAGEFXREPORT_TOLERANCE levels.
+*/
+
+#include "stdafx.h"
+#include <gdiplus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory>
+#include <set>
+#include <string>
+#include "cached_files.h"
+#include "imageedit.h"
+#include "imagefx.h"
+#include "imagefxreport.h"
+#include "jpegreport.h"
+
+// Tolerance of the native effects against GDI+, in 8-bit levels
+#define IMAGEFXREPORT_TOLERANCE  6
+#define IMAGEFXREPORT_MAXMEAN    1.5
+#define IMAGEFXREPORT_MAXOVERPCT 0.5
+
+//
+// One effect, or run of effects, tried on every sample page.
+//
+struct imagefxcase_t
+{
+   const char *name;
+   int         numEffects;
+   struct
+   {
+      fxtype_e effect;
+      float    params[3];
+   } effects[4];
+};
+
+static const imagefxcase_t imageFxCases[] =
+{
+   { "brightness",          1, { { FXTYPE_BRIGHTNESS, {   40.0f,   0.0f,  0.0f } } } },
+   { "contrast",            1, { { FXTYPE_BRIGHTNESS, {    0.0f,  50.0f,  0.0f } } } },
+   { "darken, flatten",     1, { { FXTYPE_BRIGHTNESS, {  -60.0f, -40.0f,  0.0f } } } },
+   { "tint",                1, { { FXTYPE_TINT,       {   60.0f,  40.0f,  0.0f } } } },
+   { "tint, opposite",      1, { { FXTYPE_TINT,       { -120.0f, -30.0f,  0.0f } } } },
+   { "hue",                 1, { { FXTYPE_HSL,        {   45.0f,   0.0f,  0.0f } } } },
+   { "saturation",          1, { { FXTYPE_HSL,        {    0.0f,  60.0f,  0.0f } } } },
+   { "desaturate, lighten", 1, { { FXTYPE_HSL,        {    0.0f, -70.0f, 25.0f } } } },
+   { "colour balance",      1, { { FXTYPE_BALANCE,    {   40.0f, -25.0f, 15.0f } } } },
+   { "sharpen",             1, { { FXTYPE_SHARPEN,    {    5.0f,  50.0f,  0.0f } } } },
+   { "sharpen, strong",     1, { { FXTYPE_SHARPEN,    {   20.0f, 100.0f,  0.0f } } } },
+   {
+      "chain", 4,
+      {
+         { FXTYPE_BRIGHTNESS, { 20.0f, 15.0f,   0.0f } },
+         { FXTYPE_HSL,        { 30.0f, 20.0f,   0.0f } },
+         { FXTYPE_BALANCE,    { 10.0f,  0.0f, -10.0f } },
+         { FXTYPE_SHARPEN,    {  3.0f, 40.0f,   0.0f } }
+      }
+   }
+};
+
+// Pixel formats the native kernels work on directly
+static const struct
+{
+   Gdiplus::PixelFormat format;
+   const char          *name;
+   uint32_t             bytesPerPixel;
+} imageFxFormats[] =
+{
+   { PixelFormat24bppRGB,   "24bpp", 3 },
+   { PixelFormat32bppARGB,  "32bpp", 4 }
+};
+
+// How far apart two versions of a page are
+struct imagefxdiff_t
+{
+   int    maxDiff;
+   double meanDiff;
+   double overPct;  // percentage of channel values beyond IMAGEFXREPORT_TOLERANCE
+};
+
+//
+// Load a sample page.
+//
+static Gdiplus::Bitmap *ScanMgr_LoadFxSample(const std::string &path)
+{
+   size_t reqSize = mbstowcs(nullptr, path.c_str(), 0);
+   if(reqSize == size_t(-1))
+      return nullptr;
+
+   std::unique_ptr<wchar_t []> upWCS(new wchar_t [reqSize + 1]);
+   mbstowcs(upWCS.get(), path.c_str(), reqSize + 1);
+
+   Gdiplus::Bitmap *bitmap = Gdiplus::Bitmap::FromFile(upWCS.get());
+   if(bitmap && bitmap->GetLastStatus() != Gdiplus::Ok)
+   {
+      delete bitmap;
+      bitmap = nullptr;
+   }
+   return bitmap;
+}
+
+//
+// Compare two bitmaps of the same size, channel value by channel value, in
+// the given pixel format.
+//
+static bool ScanMgr_CompareFxResults(Gdiplus::Bitmap *a, Gdiplus::Bitmap *b, Gdiplus::PixelFormat format,
+                                     uint32_t bytesPerPixel, imagefxdiff_t &diff)
+{
+   Gdiplus::Rect       rect(0, 0, INT(a->GetWidth()), INT(a->GetHeight()));
+   Gdiplus::BitmapData dataA, dataB;
+
+   if(a->LockBits(&rect, Gdiplus::ImageLockModeRead, format, &dataA) != Gdiplus::Ok)
+      return false;
+   if(b->LockBits(&rect, Gdiplus::ImageLockModeRead, format, &dataB) != Gdiplus::Ok)
+   {
+      a->UnlockBits(&dataA);
+      return false;
+   }
+
+   const size_t rowBytes = size_t(dataA.Width) * bytesPerPixel;
+   uint64_t     sum      = 0;
+   uint64_t     over     = 0;
+
+   diff.maxDiff = 0;
+   for(UINT y = 0; y < dataA.Height; y++)
+   {
+      const uint8_t *rowA = static_cast<const uint8_t *>(dataA.Scan0) + ptrdiff_t(y) * dataA.Stride;
+      const uint8_t *rowB = static_cast<const uint8_t *>(dataB.Scan0) + ptrdiff_t(y) * dataB.Stride;
+      for(size_t x = 0; x < rowBytes; x++)
+      {
+         const int d = abs(int(rowA[x]) - int(rowB[x]));
+         sum += d;
+         if(d > IMAGEFXREPORT_TOLERANCE)
+            ++over;
+         if(d > diff.maxDiff)
+            diff.maxDiff = d;
+      }
+   }
+
+   b->UnlockBits(&dataB);
+   a->UnlockBits(&dataA);
+
+   const double count = double(rowBytes) * dataA.Height;
+   diff.meanDiff = count > 0.0 ? sum / count : 0.0;
+   diff.overPct  = count > 0.0 ? over * 100.0 / count : 0.0;
+   return true;
+}
+
+//
+// Make one case on a copy of a page both ways and compare the results.
+//
+static bool ScanMgr_RunFxCase(Gdiplus::Bitmap *page, const imagefxcase_t &fxCase, Gdiplus::PixelFormat format,
+                              uint32_t bytesPerPixel, imagefxdiff_t &diff)
+{
+   const INT width  = INT(page->GetWidth());
+   const INT height = INT(page->GetHeight());
+
+   std::unique_ptr<Gdiplus::Bitmap> upGdiplus(page->Clone(0, 0, width, height, format));
+   std::unique_ptr<Gdiplus::Bitmap> upNative(page->Clone(0, 0, width, height, format));
+   if(!upGdiplus || upGdiplus->GetLastStatus() != Gdiplus::Ok ||
+      !upNative  || upNative->GetLastStatus()  != Gdiplus::Ok)
+      return false;
+
+   imageedit_t edits[4];
+   for(int i = 0; i < fxCase.numEffects; i++)
+   {
+      edits[i] = ImageEdit_Effect(fxCase.effects[i].effect, fxCase.effects[i].params, 3);
+      if(!ImageEdit_ApplyGdiplusEffect(edits[i], upGdiplus.get()))
+         return false;
+   }
+
+   if(!ImageEdit_ApplyEffects(edits, size_t(fxCase.numEffects), upNative.get()))
+      return false;
+
+   return ScanMgr_CompareFxResults(upGdiplus.get(), upNative.get(), format, bytesPerPixel, diff);
+}
+
+//
+// Run the report over inDir and write it to outPath. Returns false with a
+// message if the report could not be produced, or if the vector kernels do
+// not match the scalar ones or any case is outside the tolerance; the report
+// says which.
+//
+bool ScanMgr_ImageFxReport(const std::string &inDir, const std::string &outPath, std::string &errorMsg)
+{
+   std::set<std::string> filenames;
+   if(!ScanMgr_ListSampleImages(inDir, filenames, errorMsg))
+      return false;
+
+   FILE *f;
+   if(!(f = fopen(outPath.c_str(), "w")))
+   {
+      errorMsg = "Cannot create report file " + outPath + ".";
+      return false;
+   }
+
+   // vector kernels against the scalar ones
+   std::string kernelReport;
+   const bool  kernelsOk = ImageFx_CheckKernels(kernelReport);
+
+   fprintf(f, "kernel_check\n");
+   size_t start = 0, end;
+   while((end = kernelReport.find('\n', start)) != std::string::npos)
+   {
+      fprintf(f, "\"%s\"\n", kernelReport.substr(start, end - start).c_str());
+      start = end + 1;
+   }
+
+   // native effects against GDI+
+   fprintf(f, "\ntolerance,\"mean within %.1f levels, at most %.1f%% of values more than %d levels apart\"\n",
+           IMAGEFXREPORT_MAXMEAN, IMAGEFXREPORT_MAXOVERPCT, IMAGEFXREPORT_TOLERANCE);
+   fprintf(f, "\nfile,format,case,max_diff,mean_diff,pct_over_tolerance,result\n");
+
+   unsigned passed = 0, failed = 0;
+   for(const std::string &fn : filenames)
+   {
+      std::unique_ptr<Gdiplus::Bitmap> upPage(ScanMgr_LoadFxSample(FileCache::PathConcatenate(inDir, fn)));
+      if(!upPage)
+      {
+         fprintf(f, "\"%s\",,,,,,load failed\n", fn.c_str());
+         continue;
+      }
+
+      for(const auto &format : imageFxFormats)
+      {
+         for(const imagefxcase_t &fxCase : imageFxCases)
+         {
+            imagefxdiff_t diff;
+            if(!ScanMgr_RunFxCase(upPage.get(), fxCase, format.format, format.bytesPerPixel, diff))
+            {
+               fprintf(f, "\"%s\",%s,\"%s\",,,,effect failed\n", fn.c_str(), format.name, fxCase.name);
+               ++failed;
+               continue;
+            }
+
+            const bool ok = diff.meanDiff <= IMAGEFXREPORT_MAXMEAN && diff.overPct <= IMAGEFXREPORT_MAXOVERPCT;
+            fprintf(f, "\"%s\",%s,\"%s\",%d,%.3f,%.3f,%s\n", fn.c_str(), format.name, fxCase.name,
+                    diff.maxDiff, diff.meanDiff, diff.overPct, ok ? "pass" : "FAIL");
+            if(ok)
+               ++passed;
+            else
+               ++failed;
+         }
+      }
+   }
+
+   fprintf(f, "\ncases_passed,cases_failed,kernels\n%u,%u,%s\n", passed, failed, kernelsOk ? "match" : "DIFFER");
+
+   if(fclose(f))
+   {
+      errorMsg = "Could not finish writing report file " + outPath + ".";
+      return false;
+   }
+
+   if(!kernelsOk || failed)
+   {
+      errorMsg = "Native image effects failed validation; see " + outPath + ".";
+      return false;
+   }
+
+   return true;
+}
+
+// EOF
@@ -0,0 +1,16 @@
+/*
+  Scan Manager
+
+  Image effect report
+*/
+
+#ifndef IMAGEFXREPORT_H__
+#define IMAGEFXREPORT_H__
+
+#include <string>
+
+bool ScanMgr_ImageFxReport(const std::string &inDir, const std::string &outPath, std::string &errorMsg);
+
+#endif
+
+// EOF
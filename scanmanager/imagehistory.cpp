@@ -0,0 +1,728 @@
+/*
+  Scan Manager
+
+  Edit history of images
+
+  Every effect used to clone the whole page before it ran, and previewing an
+  effect restored that clone and cloned the page again, so a few previews of
+  a 35 megapixel scan held hundreds of megabytes. An image's history is now
+  the list of edits made to it, each a few numbers, plus the page as it was
+  before them. Versions after effects are also saved, so that undoing does
+  not mean making every effect again from the start, but these are kept as
+  tiles of the page's own pixel data, a tile the same as in another version
+  being kept only once, and are packed and dropped to keep the history of
+  each image within a budget from the ini file.
+*/
+
+#include <atomic>
+#include <iterator>
+#include <new>
+#include <string.h>
+#include <unordered_set>
+#include "crc32.h"
+#include "imagehistory.h"
+#include "inifile.h"
+#include "parallel.h"
+#include "util.h"
+
+#define IMAGEHISTORY_SECTION "undo"
+
+// Default budget of each image's history
+#define IMAGEHISTORY_DEFAULTMB 256
+
+// Width and height of a tile in pixels
+#define IMAGEHISTORY_TILESIZE 256
+
+//=============================================================================
+//
+// Configuration
+//
+// [undo]
+// budgetmb=256
+// compress=yes
+//
+
+//
+// Get the number of bytes the saved versions of one image may take up. The
+// original and current versions are always kept whatever their size.
+//
+static uint64_t ImageHistory_BudgetFromIni()
+{
+   std::string value;
+   int mb = IMAGEHISTORY_DEFAULTMB;
+
+   if(IniFile::GetIniValue(IMAGEHISTORY_SECTION, "budgetmb", value) && IsInt(value))
+      mb = StringToInt(value);
+   if(mb < 0)
+      mb = 0;
+
+   return uint64_t(mb) << 20;
+}
+
+//
+// Check whether versions other than the current one should be packed. On unless
+// turned off in the ini file.
+//
+static bool ImageHistory_CompressFromIni()
+{
+   return IniFile::GetIniFlag(IMAGEHISTORY_SECTION, "compress", true);
+}
+
+//=============================================================================
+//
+// Tiles
+//
+
+struct imagetilerect_t
+{
+   uint32_t x, y;          // in pixels
+   uint32_t width, height; // in pixels
+   size_t   byteX;         // offset of the first pixel within a row
+   size_t   rowBytes;      // bytes per row of the tile
+};
+
+static size_t ImageHistory_NumTiles(const imagesnapshot_t &snap)
+{
+   size_t across = (snap.width  + IMAGEHISTORY_TILESIZE - 1) / IMAGEHISTORY_TILESIZE;
+   size_t down   = (snap.height + IMAGEHISTORY_TILESIZE - 1) / IMAGEHISTORY_TILESIZE;
+   return across * down;
+}
+
+//
+// Work out where a tile of a snapshot lies within the image. Tiles start on
+// whole bytes even for formats of less than 8 bits per pixel.
+//
+static imagetilerect_t ImageHistory_TileRect(const imagesnapshot_t &snap, size_t tile)
+{
+   size_t   across = (snap.width + IMAGEHISTORY_TILESIZE - 1) / IMAGEHISTORY_TILESIZE;
+   uint32_t bpp    = Gdiplus::GetPixelFormatSize(snap.format);
+
+   imagetilerect_t rect;
+   rect.x        = uint32_t(tile % across) * IMAGEHISTORY_TILESIZE;
+   rect.y        = uint32_t(tile / across) * IMAGEHISTORY_TILESIZE;
+   rect.width    = (snap.width  - rect.x < IMAGEHISTORY_TILESIZE) ? snap.width  - rect.x : IMAGEHISTORY_TILESIZE;
+   rect.height   = (snap.height - rect.y < IMAGEHISTORY_TILESIZE) ? snap.height - rect.y : IMAGEHISTORY_TILESIZE;
+   rect.byteX    = size_t(rect.x) * bpp / 8;
+   rect.rowBytes = (size_t(rect.width) * bpp + 7) / 8;
+   return rect;
+}
+
+static bool ImageHistory_SameGeometry(const imagesnapshot_t &a, const imagesnapshot_t &b)
+{
+   return (a.width == b.width && a.height == b.height && a.format == b.format);
+}
+
+//
+// Pack a tile: each row is XORed with the row above it, which turns the
+// large even areas of a scanned page into zeros, and the result is run-length
+// coded as in PackBits. A tile that would not get smaller is left as it is.
+//
+static void ImageHistory_Pack(imagetile_t &tile, size_t rowBytes)
+{
+   const uint8_t *raw = tile.data.data();
+   const size_t   n   = tile.data.size();
+
+   std::vector<uint8_t> delta(n);
+   for(size_t i = 0; i < n; i++)
+      delta[i] = (i < rowBytes) ? raw[i] : uint8_t(raw[i] ^ raw[i - rowBytes]);
+
+   std::vector<uint8_t> out;
+   out.reserve(n / 4);
+
+   size_t i = 0;
+   while(i < n)
+   {
+      size_t run = 1;
+      while(i + run < n && run < 128 && delta[i + run] == delta[i])
+         ++run;
+
+      if(run >= 3)
+      {
+         out.push_back(uint8_t(257 - run));
+         out.push_back(delta[i]);
+         i += run;
+         continue;
+      }
+
+      // literal bytes, up to where a run of three or more begins
+      size_t start = i;
+      while(i < n && i - start < 128)
+      {
+         if(i + 2 < n && delta[i] == delta[i + 1] && delta[i] == delta[i + 2])
+            break;
+         ++i;
+      }
+      out.push_back(uint8_t(i - start - 1));
+      out.insert(out.end(), delta.begin() + start, delta.begin() + i);
+
+      if(out.size() >= n)
+         return;
+   }
+
+   if(out.size() < n)
+   {
+      out.shrink_to_fit();
+      tile.data.swap(out);
+      tile.packed = true;
+   }
+}
+
+//
+// Get the pixel rows of a packed tile back.
+//
+static bool ImageHistory_Unpack(const imagetile_t &tile, size_t rowBytes, std::vector<uint8_t> &out)
+{
+   const uint8_t *in  = tile.data.data();
+   const uint8_t *end = in + tile.data.size();
+
+   out.resize(tile.rawSize);
+   size_t o = 0;
+
+   while(in < end)
+   {
+      uint8_t header = *in++;
+      if(header < 128)
+      {
+         size_t count = size_t(header) + 1;
+         if(size_t(end - in) < count || out.size() - o < count)
+            return false;
+         memcpy(&out[o], in, count);
+         in += count;
+         o  += count;
+      }
+      else if(header > 128)
+      {
+         size_t count = 257 - size_t(header);
+         if(in == end || out.size() - o < count)
+            return false;
+         memset(&out[o], *in++, count);
+         o += count;
+      }
+   }
+   if(o != out.size())
+      return false;
+
+   for(size_t i = rowBytes; i < out.size(); i++)
+      out[i] ^= out[i - rowBytes];
+
+   return true;
+}
+
+//=============================================================================
+//
+// History
+//
+
+ImageHistory::ImageHistory()
+   : m_edits(), m_redo(), m_checkpoints(), m_budget(0), m_compress(true)
+{
+   static const uint64_t budget   = ImageHistory_BudgetFromIni();
+   static const bool     compress = ImageHistory_CompressFromIni();
+
+   m_budget   = budget;
+   m_compress = compress;
+}
+
+//
+// Save the pixels of a bitmap as a new snapshot. Tiles that are the same as
+// in either of two existing snapshots are shared with it rather than kept
+// again. Returns null if the bitmap could not be read.
+//
+ImageSnapshotPtr ImageHistory::capture(Gdiplus::Bitmap *bitmap, const ImageSnapshotPtr &like1,
+                                       const ImageSnapshotPtr &like2)
+{
+   if(!bitmap || bitmap->GetLastStatus() != Gdiplus::Ok)
+      return nullptr;
+
+   ImageSnapshotPtr snap(new (std::nothrow) imagesnapshot_t);
+   if(!snap)
+      return nullptr;
+
+   snap->width  = bitmap->GetWidth();
+   snap->height = bitmap->GetHeight();
+   snap->format = bitmap->GetPixelFormat();
+   snap->xdpi   = bitmap->GetHorizontalResolution();
+   snap->ydpi   = bitmap->GetVerticalResolution();
+
+   Gdiplus::Rect       rect(0, 0, INT(snap->width), INT(snap->height));
+   Gdiplus::BitmapData data;
+   if(bitmap->LockBits(&rect, Gdiplus::ImageLockModeRead, snap->format, &data) != Gdiplus::Ok)
+   {
+      // formats GDI+ will not hand out as they are are kept as 32-bit ARGB
+      snap->format = PixelFormat32bppARGB;
+      if(bitmap->LockBits(&rect, Gdiplus::ImageLockModeRead, snap->format, &data) != Gdiplus::Ok)
+         return nullptr;
+   }
+
+   if(Gdiplus::IsIndexedPixelFormat(snap->format))
+   {
+      INT paletteSize = bitmap->GetPaletteSize();
+      if(paletteSize > 0)
+      {
+         snap->palette.resize(size_t(paletteSize));
+         if(bitmap->GetPalette(reinterpret_cast<Gdiplus::ColorPalette *>(snap->palette.data()), paletteSize) != Gdiplus::Ok)
+            snap->palette.clear();
+      }
+   }
+
+   const imagesnapshot_t *likes[2] = { like1.get(), like2.get() };
+   for(const imagesnapshot_t *&like : likes)
+   {
+      if(like && !ImageHistory_SameGeometry(*like, *snap))
+         like = nullptr;
+   }
+
+   std::atomic<bool> failed(false);
+   snap->tiles.resize(ImageHistory_NumTiles(*snap));
+
+   Parallel_For(snap->tiles.size(), 0, [&] (size_t t) {
+      try
+      {
+         imagetilerect_t tr   = ImageHistory_TileRect(*snap, t);
+         ImageTilePtr    tile = std::make_shared<imagetile_t>();
+
+         tile->data.resize(tr.rowBytes * tr.height);
+         for(uint32_t y = 0; y < tr.height; y++)
+         {
+            const uint8_t *src = static_cast<const uint8_t *>(data.Scan0) + ptrdiff_t(tr.y + y) * data.Stride + tr.byteX;
+            memcpy(&tile->data[y * tr.rowBytes], src, tr.rowBytes);
+         }
+         tile->rawSize = uint32_t(tile->data.size());
+         tile->crc     = CRC32_Update(0, tile->data.data(), tile->data.size());
+         tile->packed  = false;
+
+         // a matching checksum only says where to look; the pixels
+         // themselves must be the same, so a packed tile is unpacked to be
+         // compared
+         std::vector<uint8_t> unpacked;
+         for(const imagesnapshot_t *like : likes)
+         {
+            if(!like)
+               continue;
+
+            const ImageTilePtr &old = like->tiles[t];
+            if(old->crc != tile->crc || old->rawSize != tile->rawSize)
+               continue;
+
+            const std::vector<uint8_t> *oldData = &old->data;
+            if(old->packed)
+            {
+               if(!ImageHistory_Unpack(*old, tr.rowBytes, unpacked))
+                  continue;
+               oldData = &unpacked;
+            }
+
+            if(*oldData == tile->data)
+            {
+               snap->tiles[t] = old;
+               return;
+            }
+         }
+         snap->tiles[t] = tile;
+      }
+      catch(const std::bad_alloc &)
+      {
+         failed = true;
+      }
+   });
+
+   bitmap->UnlockBits(&data);
+
+   return failed ? nullptr : snap;
+}
+
+//
+// Put a snapshot's pixels back into a bitmap. If the bitmap has changed size
+// or format since, or there is none, a new one replaces it.
+//
+bool ImageHistory::restore(const imagesnapshot_t &snap, Gdiplus::Bitmap *&bitmap)
+{
+   Gdiplus::Bitmap *target = bitmap;
+   bool             fresh  = false;
+
+   if(!target || target->GetLastStatus() != Gdiplus::Ok || target->GetWidth() != snap.width ||
+      target->GetHeight() != snap.height || target->GetPixelFormat() != snap.format)
+   {
+      target = new (std::nothrow) Gdiplus::Bitmap(INT(snap.width), INT(snap.height), snap.format);
+      if(!target)
+         return false;
+      fresh = true;
+   }
+
+   Gdiplus::Rect       rect(0, 0, INT(snap.width), INT(snap.height));
+   Gdiplus::BitmapData data;
+   if(target->GetLastStatus() != Gdiplus::Ok ||
+      target->LockBits(&rect, Gdiplus::ImageLockModeWrite, snap.format, &data) != Gdiplus::Ok)
+   {
+      if(fresh)
+         delete target;
+      return false;
+   }
+
+   std::atomic<bool> failed(false);
+   Parallel_For(snap.tiles.size(), 0, [&] (size_t t) {
+      try
+      {
+         const imagetile_t    &tile = *snap.tiles[t];
+         imagetilerect_t       tr   = ImageHistory_TileRect(snap, t);
+         std::vector<uint8_t>  unpacked;
+         const uint8_t        *rows = tile.data.data();
+
+         if(tile.packed)
+         {
+            if(!ImageHistory_Unpack(tile, tr.rowBytes, unpacked))
+            {
+               failed = true;
+               return;
+            }
+            rows = unpacked.data();
+         }
+
+         for(uint32_t y = 0; y < tr.height; y++)
+         {
+            uint8_t *dst = static_cast<uint8_t *>(data.Scan0) + ptrdiff_t(tr.y + y) * data.Stride + tr.byteX;
+            memcpy(dst, rows + y * tr.rowBytes, tr.rowBytes);
+         }
+      }
+      catch(const std::bad_alloc &)
+      {
+         failed = true;
+      }
+   });
+
+   target->UnlockBits(&data);
+
+   if(failed)
+   {
+      if(fresh)
+         delete target;
+      return false;
+   }
+
+   if(!snap.palette.empty())
+      target->SetPalette(reinterpret_cast<const Gdiplus::ColorPalette *>(snap.palette.data()));
+   target->SetResolution(snap.xdpi, snap.ydpi);
+
+   if(fresh)
+   {
+      delete bitmap;
+      bitmap = target;
+   }
+   return true;
+}
+
+//
+// Get the number of bytes of pixel data held, counting shared tiles once.
+//
+uint64_t ImageHistory::getBytes() const
+{
+   std::unordered_set<const imagetile_t *> seen;
+   uint64_t bytes = 0;
+
+   for(const auto &pr : m_checkpoints)
+   {
+      for(const ImageTilePtr &tile : pr.second->tiles)
+      {
+         if(seen.insert(tile.get()).second)
+            bytes += tile->data.size();
+      }
+   }
+
+   return bytes;
+}
+
+//
+// Save the version of the image after the edits made so far, if it is not
+// saved already, sharing tiles with the saved versions either side of it.
+//
+bool ImageHistory::checkpoint(Gdiplus::Bitmap *bitmap)
+{
+   const size_t count = m_edits.size();
+   if(m_checkpoints.count(count))
+      return true;
+
+   auto             after = m_checkpoints.upper_bound(count);
+   ImageSnapshotPtr like1 = (after != m_checkpoints.begin()) ? std::prev(after)->second : nullptr;
+   ImageSnapshotPtr like2 = (after != m_checkpoints.end()) ? after->second : nullptr;
+   ImageSnapshotPtr snap  = capture(bitmap, like1, like2);
+   if(!snap)
+      return false;
+
+   m_checkpoints[count] = snap;
+   return true;
+}
+
+//
+// Make the image as it is after the edits in the list, starting from the
+// nearest saved version before it and making the edits since again.
+//
+bool ImageHistory::render(Gdiplus::Bitmap *&bitmap)
+{
+   const size_t count = m_edits.size();
+
+   auto itr = m_checkpoints.upper_bound(count);
+   if(itr == m_checkpoints.begin())
+      return false;
+   --itr;
+
+   if(!restore(*itr->second, bitmap))
+      return false;
+
+   // effects in a row are made together, in as few passes over the image
+   // as they can be
+   bool replayedEffect = false;
+   for(size_t i = itr->first; i < count; )
+   {
+      if(m_edits[i].kind == IMAGEEDIT_EFFECT)
+      {
+         size_t end = i + 1;
+         while(end < count && m_edits[end].kind == IMAGEEDIT_EFFECT)
+            ++end;
+
+         if(!ImageEdit_ApplyEffects(&m_edits[i], end - i, bitmap))
+            return false;
+         replayedEffect = true;
+         i = end;
+      }
+      else
+      {
+         if(!ImageEdit_Apply(m_edits[i], bitmap))
+            return false;
+         ++i;
+      }
+   }
+
+   // spare doing the effects again next time
+   if(replayedEffect)
+      checkpoint(bitmap);
+
+   return true;
+}
+
+//
+// Forget the saved versions after the given number of edits, which no
+// longer apply once the image is edited differently from there.
+//
+void ImageHistory::truncate(size_t count)
+{
+   m_checkpoints.erase(m_checkpoints.upper_bound(count), m_checkpoints.end());
+}
+
+//
+// Add an edit made to the image to the list. Anything that could be redone
+// is forgotten. A rotation or flip after another is merged into it.
+//
+void ImageHistory::append(const imageedit_t &edit)
+{
+   truncate(m_edits.size());
+   m_redo.clear();
+
+   if(edit.kind == IMAGEEDIT_ROTATEFLIP && !m_edits.empty() && m_edits.back().kind == IMAGEEDIT_ROTATEFLIP)
+   {
+      // the version after the edit being merged into is gone
+      m_checkpoints.erase(m_edits.size());
+
+      Gdiplus::RotateFlipType rft = ImageEdit_ComposeRotateFlip(m_edits.back().rotateFlip, edit.rotateFlip);
+      if(rft == Gdiplus::RotateNoneFlipNone)
+         m_edits.pop_back();
+      else
+         m_edits.back().rotateFlip = rft;
+   }
+   else
+      m_edits.push_back(edit);
+}
+
+//
+// Pack the tiles of all versions but the current one, which effect previews
+// restore over and over, then drop versions, furthest from the current one
+// first, until the history is within its budget. The original version and
+// the current one are always kept.
+//
+void ImageHistory::trim()
+{
+   const size_t count = m_edits.size();
+
+   auto             cur     = m_checkpoints.find(count);
+   ImageSnapshotPtr current = (cur != m_checkpoints.end()) ? cur->second : nullptr;
+
+   if(m_compress)
+   {
+      std::unordered_set<const imagetile_t *> keep;
+      if(current)
+      {
+         for(const ImageTilePtr &tile : current->tiles)
+            keep.insert(tile.get());
+      }
+
+      std::vector<std::pair<imagetile_t *, size_t>> toPack;
+      for(const auto &pr : m_checkpoints)
+      {
+         const imagesnapshot_t &snap = *pr.second;
+         for(size_t t = 0; t < snap.tiles.size(); t++)
+         {
+            imagetile_t *tile = snap.tiles[t].get();
+            if(!tile->packed && keep.insert(tile).second)
+               toPack.push_back(std::make_pair(tile, ImageHistory_TileRect(snap, t).rowBytes));
+         }
+      }
+
+      Parallel_For(toPack.size(), 0, [&] (size_t i) {
+         try
+         {
+            ImageHistory_Pack(*toPack[i].first, toPack[i].second);
+         }
+         catch(const std::bad_alloc &)
+         {
+            // left unpacked
+         }
+      });
+   }
+
+   while(getBytes() > m_budget)
+   {
+      auto   victim   = m_checkpoints.end();
+      size_t farthest = 0;
+      for(auto itr = m_checkpoints.begin(); itr != m_checkpoints.end(); ++itr)
+      {
+         size_t distance = (itr->first > count) ? itr->first - count : count - itr->first;
+         if(itr->first && itr->first != count && distance > farthest)
+         {
+            victim   = itr;
+            farthest = distance;
+         }
+      }
+      if(victim == m_checkpoints.end())
+         break;
+
+      m_checkpoints.erase(victim);
+   }
+}
+
+//
+// Save the current version of the image, before an edit that may be
+// previewed and then either recorded or reverted.
+//
+bool ImageHistory::mark(Gdiplus::Bitmap *bitmap)
+{
+   if(!checkpoint(bitmap))
+      return false;
+
+   trim();
+   return true;
+}
+
+//
+// Put the current version back, undoing anything done to the bitmap since
+// the last edit was added to the list.
+//
+bool ImageHistory::revert(Gdiplus::Bitmap *&bitmap)
+{
+   auto itr = m_checkpoints.find(m_edits.size());
+   if(itr != m_checkpoints.end())
+      return restore(*itr->second, bitmap);
+
+   return render(bitmap);
+}
+
+//
+// Make an edit to the image and add it to the list.
+//
+bool ImageHistory::apply(const imageedit_t &edit, Gdiplus::Bitmap *bitmap)
+{
+   // keep the original to go back to; a rotation or flip can be undone
+   // without it, but an effect cannot
+   if(m_edits.empty() && !checkpoint(bitmap) && edit.kind == IMAGEEDIT_EFFECT)
+      return false;
+
+   if(!ImageEdit_Apply(edit, bitmap))
+      return false;
+
+   return record(edit, bitmap);
+}
+
+//
+// Add an edit already made to the bitmap to the list.
+//
+bool ImageHistory::record(const imageedit_t &edit, Gdiplus::Bitmap *bitmap)
+{
+   append(edit);
+
+   // save the result of an effect, so undoing later edits need not make it
+   // again
+   if(edit.kind == IMAGEEDIT_EFFECT)
+      checkpoint(bitmap);
+
+   trim();
+   return true;
+}
+
+//
+// Drop the last edit from the list, taking the image back to before it.
+//
+bool ImageHistory::undo(Gdiplus::Bitmap *&bitmap)
+{
+   if(m_edits.empty())
+      return false;
+
+   imageedit_t edit = m_edits.back();
+   m_edits.pop_back();
+
+   bool ok;
+   if(edit.kind == IMAGEEDIT_ROTATEFLIP)
+      ok = ImageEdit_Apply(ImageEdit_RotateFlip(ImageEdit_InvertRotateFlip(edit.rotateFlip)), bitmap);
+   else
+      ok = render(bitmap);
+
+   if(!ok)
+   {
+      m_edits.push_back(edit);
+      return false;
+   }
+
+   m_redo.push_back(edit);
+   trim();
+   return true;
+}
+
+//
+// Make the edit last undone again.
+//
+bool ImageHistory::redo(Gdiplus::Bitmap *&bitmap)
+{
+   if(m_redo.empty())
+      return false;
+
+   const imageedit_t edit = m_redo.back();
+
+   // the result of an effect may still be saved from before it was undone
+   auto itr = m_checkpoints.find(m_edits.size() + 1);
+   bool ok;
+   if(edit.kind == IMAGEEDIT_EFFECT && itr != m_checkpoints.end())
+      ok = restore(*itr->second, bitmap);
+   else
+      ok = ImageEdit_Apply(edit, bitmap);
+
+   if(!ok)
+      return false;
+
+   m_redo.pop_back();
+   m_edits.push_back(edit);
+   if(edit.kind == IMAGEEDIT_EFFECT)
+      checkpoint(bitmap);
+
+   trim();
+   return true;
+}
+
+//
+// Forget all edits and saved versions.
+//
+void ImageHistory::clear()
+{
+   m_edits.clear();
+   m_redo.clear();
+   m_checkpoints.clear();
+}
+
+// EOF
+
@@ -0,0 +1,99 @@
+/*
+  Scan Manager
+
+  Edit history of images
+*/
+
+#ifndef IMAGEHISTORY_H__
+#define IMAGEHISTORY_H__
+
+#include <Windows.h>
+#include <Unknwn.h>
+#include <gdiplus.h>
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <vector>
+#include "imageedit.h"
+
+//
+// One tile of a snapshot's pixels, in the bitmap's own pixel format. Tiles
+// are shared between the snapshots they are the same in.
+//
+struct imagetile_t
+{
+   std::vector<uint8_t> data;    // pixel rows, or packed if packed is set
+   uint32_t             rawSize; // size of the pixel rows unpacked
+   uint32_t             crc;     // CRC-32 of the pixel rows unpacked
+   bool                 packed;
+};
+
+typedef std::shared_ptr<imagetile_t> ImageTilePtr;
+
+//
+// A saved version of an image.
+//
+struct imagesnapshot_t
+{
+   uint32_t                  width;
+   uint32_t                  height;
+   Gdiplus::PixelFormat      format;
+   Gdiplus::REAL             xdpi;
+   Gdiplus::REAL             ydpi;
+   std::vector<uint8_t>      palette; // ColorPalette, for indexed formats
+   std::vector<ImageTilePtr> tiles;   // by row of tiles, then column
+};
+
+typedef std::shared_ptr<imagesnapshot_t> ImageSnapshotPtr;
+
+//
+// Edit history of one image: the image as it was before it was first
+// edited, and the list of edits made to it since. Undoing an edit drops it
+// from the list and makes the image again from the nearest saved version
+// before it; rotations and flips, which lose nothing, are simply turned back.
+// Consecutive rotations and flips are merged into one, and dropped if they
+// cancel out.
+//
+// Versions after effects are saved too, so that undoing does not mean
+// redoing every effect since the start. They are kept as grids of tiles, a
+// tile the same as in another version being stored once, and are packed and
+// then dropped to keep within a memory budget; the original is always kept.
+//
+class ImageHistory
+{
+protected:
+   std::vector<imageedit_t>           m_edits;       // edits made, in order
+   std::vector<imageedit_t>           m_redo;        // edits undone, last undone at the back
+   std::map<size_t, ImageSnapshotPtr> m_checkpoints; // versions by number of edits made
+   uint64_t                           m_budget;
+   bool                               m_compress;
+
+   ImageSnapshotPtr capture(Gdiplus::Bitmap *bitmap, const ImageSnapshotPtr &like1, const ImageSnapshotPtr &like2);
+   bool             restore(const imagesnapshot_t &snap, Gdiplus::Bitmap *&bitmap);
+   bool             checkpoint(Gdiplus::Bitmap *bitmap);
+   void             append(const imageedit_t &edit);
+   bool             render(Gdiplus::Bitmap *&bitmap);
+   void             truncate(size_t count);
+   void             trim();
+
+public:
+   ImageHistory();
+
+   bool mark(Gdiplus::Bitmap *bitmap);
+   bool revert(Gdiplus::Bitmap *&bitmap);
+   bool apply(const imageedit_t &edit, Gdiplus::Bitmap *bitmap);
+   bool record(const imageedit_t &edit, Gdiplus::Bitmap *bitmap);
+   bool undo(Gdiplus::Bitmap *&bitmap);
+   bool redo(Gdiplus::Bitmap *&bitmap);
+   void clear();
+
+   bool     canUndo() const { return !m_edits.empty(); }
+   bool     canRedo() const { return !m_redo.empty(); }
+   size_t   getNumEdits() const { return m_edits.size(); }
+   uint64_t getBytes() const;
+};
+
+#endif
+
+// EOF
+
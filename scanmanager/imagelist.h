@@ -11,26 +11,7 @@
 #include <Unknwn.h>
 #include <gdiplus.h>
 #include "dllist.h"
-
-class GDIPImageNode
-{
-public:
-   DLListItem<GDIPImageNode> links;
-   Gdiplus::Bitmap *gdiBitmap;
-
-   ~GDIPImageNode()
-   {
-      // unlink from list
-      links.remove();
-
-      // free the Gdiplus bitmap object
-      if(gdiBitmap)
-         delete gdiBitmap;
-      gdiBitmap = nullptr;
-   }
-};
-
-typedef DLList<GDIPImageNode, &GDIPImageNode::links> GDIPImageList;
+#include "imagehistory.h"
 
 class ImageNode
 {
@@ -38,7 +19,7 @@ public:
    DLListItem<ImageNode> links;      // linked list links
    HBITMAP               hBitmap;    // HBITMAP from TWAIN device
    Gdiplus::Bitmap      *gdiBitmap;  // current GDI bitmap
-   GDIPImageList         prevImages; // previous versions for undo
+   ImageHistory          history;    // edits made, for undo
 
    ~ImageNode()
    {
@@ -54,41 +35,36 @@ public:
       if(gdiBitmap)
          delete gdiBitmap;
       gdiBitmap = nullptr;
-
-      // delete any backup copies
-      while(prevImages.head)
-         delete prevImages.head->dllObject;
    }
 
-   // Create a backup copy of the Gdiplus bitmap
-   void backup()
+   // Save the current Gdiplus bitmap as a version to go back to
+   bool backup()
    {
-      if(!gdiBitmap)
-         return;
-
-      auto pGdipNode = new GDIPImageNode();
-      pGdipNode->gdiBitmap = gdiBitmap->Clone(0, 0, INT(gdiBitmap->GetWidth()), INT(gdiBitmap->GetHeight()), PixelFormatDontCare);
-      prevImages.insert(pGdipNode);
+      return history.mark(gdiBitmap);
    }
 
-   // If there is a backup Gdiplus bitmap, restore it to be the current image
-   bool restoreBackup()
+   // Restore the saved version to be the current image, discarding any
+   // changes not recorded as an edit
+   bool revertToBackup()
    {
-      if(!prevImages.head)
-         return false;
-
-      // if we currently own one, delete it.
-      if(gdiBitmap)
-         delete gdiBitmap;
+      return history.revert(gdiBitmap);
+   }
 
-      // take over the first backup object's bitmap and then delete it
-      GDIPImageNode *pNode = prevImages.head->dllObject;
-      gdiBitmap = pNode->gdiBitmap;
-      pNode->gdiBitmap = nullptr;
-      delete pNode;
+   // Make an edit to the image and record it
+   bool applyEdit(const imageedit_t &edit)
+   {
+      return history.apply(edit, gdiBitmap);
+   }
 
-      return true;
+   // Record an edit already made to the image
+   bool commitEdit(const imageedit_t &edit)
+   {
+      return history.record(edit, gdiBitmap);
    }
+
+   // Step back and forth through the edits
+   bool undo() { return history.undo(gdiBitmap); }
+   bool redo() { return history.redo(gdiBitmap); }
 };
 
 typedef DLList<ImageNode, &ImageNode::links> ImageList;
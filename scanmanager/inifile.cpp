@@ -122,6 +122,59 @@ IniFile &IniFile::GetIniFile()
    return *theFile;
 }
 
+//
+// IniFile::GetIniValue
+//
+// Look up a single option, which counts as unset if it is empty.
+//
+bool IniFile::GetIniValue(const string &section, const string &key, string &value)
+{
+   IniMap &ini = GetIniOptions();
+
+   IniMap::const_iterator sec = ini.find(section);
+   if(sec == ini.end())
+      return false;
+
+   IniValue::const_iterator itr = sec->second.find(key);
+   if(itr == sec->second.end() || itr->second.empty())
+      return false;
+
+   value = itr->second;
+   return true;
+}
+
+//
+// IniFile::GetIniFlag
+//
+// Look up a yes/no option.
+//
+bool IniFile::GetIniFlag(const string &section, const string &key, bool def)
+{
+   string value;
+
+   if(!GetIniValue(section, key, value))
+      return def;
+
+   return ParseBool(value, def);
+}
+
+//
+// IniFile::ParseBool
+//
+// Interpret an option's value as yes or no.
+//
+bool IniFile::ParseBool(const string &value, bool def)
+{
+   string v = LowercaseString(value);
+
+   if(v == "yes" || v == "true" || v == "on" || v == "1")
+      return true;
+   if(v == "no" || v == "false" || v == "off" || v == "0")
+      return false;
+
+   return def;
+}
+
 // EOF
 
 
@@ -76,6 +76,31 @@ public:
     * singleton instance.
     */
    static IniMap  &GetIniOptions() { return GetIniFile().getIniOptions(); }
+
+   /**
+    * Call to look up a single option in the global singleton instance.
+    * @param section Name of the section the option is in.
+    * @param key     Name of the option.
+    * @param value   Receives the option's value.
+    * @return True if the option is set and not empty, false otherwise.
+    */
+   static bool GetIniValue(const std::string &section, const std::string &key, std::string &value);
+
+   /**
+    * Call to look up a yes/no option in the global singleton instance.
+    * @param section Name of the section the option is in.
+    * @param key     Name of the option.
+    * @param def     Value to use if the option is not set to a yes/no value.
+    */
+   static bool GetIniFlag(const std::string &section, const std::string &key, bool def);
+
+   /**
+    * Call to interpret an option's value as yes or no. Accepts yes/no,
+    * true/false, on/off and 1/0 in any case.
+    * @param value The option's value.
+    * @param def   Value to use if value is none of these.
+    */
+   static bool ParseBool(const std::string &value, bool def);
 };
 
 #endif
@@ -0,0 +1,284 @@
+/*
+  Scan Manager
+
+  Reduced-size JPEG decoding
+
+  libjpeg can scale an image by n/8 inside the inverse DCT, so a page that
+  will only ever be shown fitted to the window can be decoded at close to
+  screen size for a fraction of the time and memory of a full-resolution
+  decode followed by a GDI+ downscale.
+*/
+
+#include <Windows.h>
+#include <gdiplus.h>
+#include <limits.h>
+#include <math.h>
+#include <new>
+#include <memory>
+#include <setjmp.h>
+#include <string>
+#include "jpegdecode.h"
+#include "pixconv.h"
+
+#include "jpeg-9b/jpeglib.h"
+#include "jpeg-9b/jerror.h"
+
+// Number of scanlines read from libjpeg per call
+#define JPEGDEC_ROWBATCH 16
+
+//=============================================================================
+//
+// libjpeg error handling
+//
+
+struct jpegdecerror_t
+{
+   struct jpeg_error_mgr pub;
+   jmp_buf               setjmpBuffer;
+   char                  message[JMSG_LENGTH_MAX];
+};
+
+static void JPEGDecode_ErrorExit(j_common_ptr cinfo)
+{
+   auto err = reinterpret_cast<jpegdecerror_t *>(cinfo->err);
+   (*cinfo->err->format_message)(cinfo, err->message);
+   longjmp(err->setjmpBuffer, 1);
+}
+
+//=============================================================================
+//
+// Decoder
+//
+// Decoding is split in two so that the output bitmap can be created once the
+// scaled size is known, without any C++ object changing between a setjmp and
+// a longjmp back to it.
+//
+
+struct jpegdecoder_t
+{
+   struct jpeg_decompress_struct cinfo;
+   jpegdecerror_t                jerr;
+};
+
+//
+// Pick the smallest n/8 scale at which the image still covers the size it
+// will be shown at when fitted within maxWidth x maxHeight.
+//
+static unsigned JPEGDecode_ScaleNum(uint32_t width, uint32_t height, uint32_t maxWidth, uint32_t maxHeight)
+{
+   if(!width || !height || (!maxWidth && !maxHeight))
+      return 8;
+
+   double fit = 1.0;
+   if(maxWidth)
+      fit = double(maxWidth) / width;
+   if(maxHeight && double(maxHeight) / height < fit)
+      fit = double(maxHeight) / height;
+
+   if(fit >= 1.0)
+      return 8;
+
+   unsigned num = unsigned(ceil(fit * 8.0));
+   return num < 1 ? 1 : num;
+}
+
+//
+// Create the decompressor and read the header. If maxWidth or maxHeight are
+// non-zero, the output dimensions are scaled to suit them.
+//
+static bool JPEGDecode_ReadHeader(jpegdecoder_t &dec, const uint8_t *data, size_t size,
+                                  uint32_t maxWidth, uint32_t maxHeight, std::string &errorMsg)
+{
+   if(size > ULONG_MAX)
+   {
+      errorMsg = "JPEG file is too large";
+      return false;
+   }
+
+   dec.cinfo.err = jpeg_std_error(&dec.jerr.pub);
+   dec.jerr.pub.error_exit = JPEGDecode_ErrorExit;
+   if(setjmp(dec.jerr.setjmpBuffer))
+   {
+      jpeg_destroy_decompress(&dec.cinfo);
+      errorMsg = dec.jerr.message;
+      return false;
+   }
+
+   jpeg_create_decompress(&dec.cinfo);
+   jpeg_mem_src(&dec.cinfo, data, static_cast<unsigned long>(size));
+   jpeg_read_header(&dec.cinfo, TRUE);
+
+   switch(dec.cinfo.num_components)
+   {
+   case 1:
+      dec.cinfo.out_color_space = JCS_GRAYSCALE;
+      break;
+   case 3:
+      dec.cinfo.out_color_space = JCS_RGB;
+      break;
+   default:
+      jpeg_destroy_decompress(&dec.cinfo);
+      errorMsg = "Unsupported JPEG color space";
+      return false;
+   }
+
+   dec.cinfo.scale_num   = JPEGDecode_ScaleNum(dec.cinfo.image_width, dec.cinfo.image_height, maxWidth, maxHeight);
+   dec.cinfo.scale_denom = 8;
+   jpeg_calc_output_dimensions(&dec.cinfo);
+
+   return true;
+}
+
+//
+// Decode the image into top-down rows of 8-bit gray or 24-bit BGR pixels
+// and destroy the decompressor.
+//
+static bool JPEGDecode_ReadPixels(jpegdecoder_t &dec, uint8_t *bits, int stride, std::string &errorMsg)
+{
+   const bool     gray     = (dec.cinfo.out_color_space == JCS_GRAYSCALE);
+   const uint32_t rowBytes = dec.cinfo.output_width * (gray ? 1 : 3);
+
+   // color rows come out of libjpeg as RGB and are swapped into place
+   std::unique_ptr<uint8_t []> upBatch;
+   if(!gray)
+   {
+      upBatch.reset(new (std::nothrow) uint8_t [size_t(rowBytes) * JPEGDEC_ROWBATCH]);
+      if(!upBatch)
+      {
+         jpeg_destroy_decompress(&dec.cinfo);
+         errorMsg = "Out of memory decoding JPEG";
+         return false;
+      }
+   }
+
+   if(setjmp(dec.jerr.setjmpBuffer))
+   {
+      jpeg_destroy_decompress(&dec.cinfo);
+      errorMsg = dec.jerr.message;
+      return false;
+   }
+
+   jpeg_start_decompress(&dec.cinfo);
+
+   const pixconv_t &pc = PixConv_Get();
+   JSAMPROW rows[JPEGDEC_ROWBATCH];
+
+   while(dec.cinfo.output_scanline < dec.cinfo.output_height)
+   {
+      JDIMENSION first = dec.cinfo.output_scanline;
+      JDIMENSION count = dec.cinfo.output_height - first;
+      if(count > JPEGDEC_ROWBATCH)
+         count = JPEGDEC_ROWBATCH;
+
+      for(JDIMENSION i = 0; i < count; i++)
+         rows[i] = gray ? bits + ptrdiff_t(first + i) * stride : upBatch.get() + size_t(i) * rowBytes;
+
+      count = jpeg_read_scanlines(&dec.cinfo, rows, count);
+
+      if(!gray)
+      {
+         for(JDIMENSION i = 0; i < count; i++)
+            pc.SwapRB24(rows[i], bits + ptrdiff_t(first + i) * stride, dec.cinfo.output_width);
+      }
+   }
+
+   jpeg_finish_decompress(&dec.cinfo);
+   jpeg_destroy_decompress(&dec.cinfo);
+
+   return true;
+}
+
+//
+// Give an 8-bit indexed bitmap a linear gray palette.
+//
+static bool JPEGDecode_SetGrayPalette(Gdiplus::Bitmap *bitmap)
+{
+   std::unique_ptr<uint8_t []> upPal(new (std::nothrow) uint8_t [sizeof(Gdiplus::ColorPalette) + 255 * sizeof(Gdiplus::ARGB)]);
+   if(!upPal)
+      return false;
+
+   auto palette = reinterpret_cast<Gdiplus::ColorPalette *>(upPal.get());
+   palette->Flags = PaletteFlagsGrayScale;
+   palette->Count = 256;
+   for(uint32_t i = 0; i < 256; i++)
+      palette->Entries[i] = 0xFF000000u | (i << 16) | (i << 8) | i;
+
+   return bitmap->SetPalette(palette) == Gdiplus::Ok;
+}
+
+//=============================================================================
+//
+// Interface
+//
+
+//
+// Get the dimensions of a JPEG image from its header alone.
+//
+bool JPEGDecode_GetSize(const uint8_t *data, size_t size, uint32_t &width, uint32_t &height)
+{
+   jpegdecoder_t dec;
+   std::string   errorMsg;
+
+   if(!JPEGDecode_ReadHeader(dec, data, size, 0, 0, errorMsg))
+      return false;
+
+   width  = dec.cinfo.image_width;
+   height = dec.cinfo.image_height;
+   jpeg_destroy_decompress(&dec.cinfo);
+
+   return true;
+}
+
+//
+// Decode a JPEG into a new Gdiplus bitmap, scaled in the IDCT to no more
+// than the size it will be displayed at within maxWidth x maxHeight. Gray
+// images become 8-bit indexed bitmaps, so a bilevel or gray page costs a
+// third of the memory of a color one.
+//
+Gdiplus::Bitmap *JPEGDecode_ToBitmap(const uint8_t *data, size_t size, uint32_t maxWidth, uint32_t maxHeight,
+                                     std::string &errorMsg)
+{
+   jpegdecoder_t dec;
+
+   if(!JPEGDecode_ReadHeader(dec, data, size, maxWidth, maxHeight, errorMsg))
+      return nullptr;
+
+   const bool  gray   = (dec.cinfo.out_color_space == JCS_GRAYSCALE);
+   const INT   width  = INT(dec.cinfo.output_width);
+   const INT   height = INT(dec.cinfo.output_height);
+   PixelFormat format = gray ? PixelFormat8bppIndexed : PixelFormat24bppRGB;
+
+   std::unique_ptr<Gdiplus::Bitmap> upBitmap(new (std::nothrow) Gdiplus::Bitmap(width, height, format));
+   if(!upBitmap || upBitmap->GetLastStatus() != Gdiplus::Ok || (gray && !JPEGDecode_SetGrayPalette(upBitmap.get())))
+   {
+      jpeg_destroy_decompress(&dec.cinfo);
+      errorMsg = "Out of memory decoding JPEG";
+      return nullptr;
+   }
+
+   // carry the resolution over, scaled along with the image
+   if(dec.cinfo.density_unit == 1 || dec.cinfo.density_unit == 2)
+   {
+      double dpi   = (dec.cinfo.density_unit == 2) ? 2.54 : 1.0;
+      double scale = double(dec.cinfo.output_width) / dec.cinfo.image_width;
+      upBitmap->SetResolution(Gdiplus::REAL(dec.cinfo.X_density * dpi * scale),
+                              Gdiplus::REAL(dec.cinfo.Y_density * dpi * scale));
+   }
+
+   Gdiplus::BitmapData bmData;
+   Gdiplus::Rect       rect(0, 0, width, height);
+   if(upBitmap->LockBits(&rect, Gdiplus::ImageLockModeWrite, format, &bmData) != Gdiplus::Ok)
+   {
+      jpeg_destroy_decompress(&dec.cinfo);
+      errorMsg = "Cannot lock bitmap for JPEG decoding";
+      return nullptr;
+   }
+
+   bool ok = JPEGDecode_ReadPixels(dec, static_cast<uint8_t *>(bmData.Scan0), bmData.Stride, errorMsg);
+   upBitmap->UnlockBits(&bmData);
+
+   return ok ? upBitmap.release() : nullptr;
+}
+
+// EOF
+
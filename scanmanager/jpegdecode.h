@@ -0,0 +1,30 @@
+/*
+  Scan Manager
+
+  Reduced-size JPEG decoding
+*/
+
+#ifndef JPEGDECODE_H__
+#define JPEGDECODE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace Gdiplus
+{
+   class Bitmap;
+}
+
+bool JPEGDecode_GetSize(const uint8_t *data, size_t size, uint32_t &width, uint32_t &height);
+
+// Decode a JPEG into a new Gdiplus bitmap no larger than needed to show it
+// fitted within maxWidth x maxHeight. Passing 0 for both decodes at full
+// size. Returns nullptr with a message on failure.
+Gdiplus::Bitmap *JPEGDecode_ToBitmap(const uint8_t *data, size_t size, uint32_t maxWidth, uint32_t maxHeight,
+                                     std::string &errorMsg);
+
+#endif
+
+// EOF
+
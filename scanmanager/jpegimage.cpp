@@ -10,12 +10,25 @@
 #include <stdio.h>
 #include <exception>
 #include <math.h>
+#include <new>
 #include <setjmp.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "crc32.h"
 #include "docwrite.h"
 #include "jpegimage.h"
+#include "jpegprofile.h"
 #include "memfile.h"
+#include "parallel.h"
+#include "pixconv.h"
 
 #include "jpeg-9b/jpeglib.h"
+#include "jpeg-9b/jerror.h"
+
+// Number of scanlines converted and handed to libjpeg per call; one MCU row
+// at the default 2x2 chroma subsampling.
+#define JPEG_ROWBATCH 16
 
 //=============================================================================
 //
@@ -165,6 +178,108 @@ void BitmapImage::startup()
    setYDPI(CXIMAGE_DEFAULT_DPI);
 }
 
+//
+// True if every entry of a Gdiplus palette is a shade of gray.
+//
+static bool BitmapImage_IsGrayPalette(const Gdiplus::ColorPalette *palette)
+{
+   for(UINT i = 0; i < palette->Count; i++)
+   {
+      const Gdiplus::ARGB c = palette->Entries[i];
+      const uint8_t r = uint8_t(c >> 16), g = uint8_t(c >> 8), b = uint8_t(c);
+      if(r != g || g != b)
+         return false;
+   }
+
+   return palette->Count > 0;
+}
+
+//
+// Copy the pixels of a Gdiplus bitmap into the internal DIB. Indexed bitmaps
+// with an all-gray palette, such as 8-bit gray and 1-bit bilevel scans, keep
+// their depth and palette; anything else is converted to 24-bit BGR.
+//
+void BitmapImage::loadFromGdiplus(Gdiplus::Bitmap *bitmap)
+{
+   if(bitmap->GetLastStatus() != Gdiplus::Ok)
+      throw DocException("Gdiplus::Bitmap object reports invalid status");
+
+   Gdiplus::PixelFormat format = bitmap->GetPixelFormat();
+   uint32_t bpp;
+
+   switch(format)
+   {
+   case PixelFormat1bppIndexed:
+      bpp = 1;
+      break;
+   case PixelFormat4bppIndexed:
+      bpp = 4;
+      break;
+   case PixelFormat8bppIndexed:
+      bpp = 8;
+      break;
+   default:
+      bpp = 24;
+      break;
+   }
+
+   std::unique_ptr<uint8_t []> upPalette;
+   Gdiplus::ColorPalette *palette = nullptr;
+   if(bpp != 24)
+   {
+      INT paletteSize = bitmap->GetPaletteSize();
+      if(paletteSize >= INT(sizeof(Gdiplus::ColorPalette)))
+      {
+         upPalette.reset(new uint8_t [paletteSize]);
+         palette = reinterpret_cast<Gdiplus::ColorPalette *>(upPalette.get());
+         if(bitmap->GetPalette(palette, paletteSize) != Gdiplus::Ok || !BitmapImage_IsGrayPalette(palette))
+            palette = nullptr;
+      }
+
+      if(!palette)
+      {
+         format = PixelFormat24bppRGB;
+         bpp    = 24;
+      }
+   }
+
+   Gdiplus::BitmapData bmpData;
+   Gdiplus::Rect       rect(0, 0, bitmap->GetWidth(), bitmap->GetHeight());
+   if(bitmap->LockBits(&rect, Gdiplus::ImageLockModeRead, format, &bmpData) != Gdiplus::Ok)
+      throw DocException("Could not lock bits from Gdiplus::Bitmap");
+
+   if(!create(bmpData.Width, bmpData.Height, bpp, uint32_t(abs(bmpData.Stride))))
+   {
+      bitmap->UnlockBits(&bmpData);
+      throw DocException("Could not create internal BitmapImage buffer");
+   }
+
+   if(palette)
+   {
+      RGBQUAD *ppal = getPalette();
+      for(UINT i = 0; i < palette->Count && i < header.biClrUsed; i++)
+      {
+         const Gdiplus::ARGB c = palette->Entries[i];
+         ppal[i].rgbRed   = uint8_t(c >> 16);
+         ppal[i].rgbGreen = uint8_t(c >> 8);
+         ppal[i].rgbBlue  = uint8_t(c);
+      }
+   }
+
+   // DIB rows are stored bottom-up; Gdiplus hands back top-down rows unless
+   // the stride is negative.
+   for(uint32_t y = 0; y < bmpData.Height; y++)
+   {
+      const uint8_t *src = static_cast<const uint8_t *>(bmpData.Scan0) + ptrdiff_t(y) * bmpData.Stride;
+      memcpy(info.pImage + (bmpData.Height - 1 - y) * info.effWidth, src, info.effWidth);
+   }
+
+   bitmap->UnlockBits(&bmpData);
+
+   setXDPI(int32_t(bitmap->GetHorizontalResolution() + 0.5f));
+   setYDPI(int32_t(bitmap->GetVerticalResolution()   + 0.5f));
+}
+
 //
 // Constructor for HBITMAP
 //
@@ -208,28 +323,21 @@ BitmapImage::BitmapImage(HBITMAP hBmp) : info(), pDib()
    if(!(bitmap = upBitmap.get()))
       throw DocException("Failed to instantiate a Gdiplus::Bitmap object");
 
-   if(bitmap->GetLastStatus() != Gdiplus::Ok)
-      throw DocException("Gdiplus::Bitmap object reports invalid status");
-
-   Gdiplus::BitmapData bmpData;
-   if(bitmap->LockBits(&Gdiplus::Rect(0, 0, bitmap->GetWidth(), bitmap->GetHeight()), Gdiplus::ImageLockModeRead, PixelFormat24bppRGB, &bmpData) != Gdiplus::Ok)
-      throw DocException("Could not lock bits from Gdiplus::Bitmap");
-
-   if(!create(bmpData.Width, bmpData.Height, 24, uint32_t(abs(bmpData.Stride))))
-   {
-      bitmap->UnlockBits(&bmpData);
-      throw DocException("Could not create internal BitmapImage buffer");
-   }
+   loadFromGdiplus(bitmap);
+}
 
-   uint8_t *start;
-   if(bmpData.Stride < 0)
-      start = (uint8_t *)bmpData.Scan0 - (bmpData.Height - 1) * -bmpData.Stride;
-   else
-      start = (uint8_t *)bmpData.Scan0;
+//
+// Constructor for Gdiplus::Bitmap; takes a snapshot of the bitmap's current
+// pixels, so the bitmap may be edited or destroyed afterward.
+//
+BitmapImage::BitmapImage(Gdiplus::Bitmap *bitmap) : info(), pDib()
+{
+   startup();
 
-   memcpy(info.pImage, start, info.effWidth * bmpData.Height);
+   if(!bitmap)
+      throw DocException("Invalid Gdiplus::Bitmap");
 
-   bitmap->UnlockBits(&bmpData);
+   loadFromGdiplus(bitmap);
 }
 
 //
@@ -309,6 +417,51 @@ RGBQUAD BitmapImage::blindGetPixelColor(int32_t x, int32_t y) const
    return rgb;
 }
 
+//
+// Expand the DIB palette into packed RGB entries for PixConv_Get().Pal8To24,
+// so that paletted rows are converted with one table lookup per pixel.
+//
+void BitmapImage::buildRGBPalette(uint32_t (&palRGB)[256]) const
+{
+   memset(palRGB, 0, sizeof(palRGB));
+
+   RGBQUAD *ppal = getPalette();
+   if(!ppal)
+      return;
+
+   for(uint32_t i = 0; i < header.biClrUsed && i < 256; i++)
+      palRGB[i] = PixConv_PackPal(ppal[i].rgbRed, ppal[i].rgbGreen, ppal[i].rgbBlue);
+}
+
+//
+// Convert a single DIB row, in storage order (0 is the bottom row), into
+// packed RGB triplets at dst, which must hold at least width * 3 bytes.
+//
+void BitmapImage::encodeRowToRGB(uint32_t y, const uint32_t (&palRGB)[256], uint8_t *dst) const
+{
+   const uint8_t *src   = info.pImage + y * info.effWidth;
+   const uint32_t width = uint32_t(header.biWidth);
+
+   switch(header.biBitCount)
+   {
+   case 24:
+      PixConv_Get().SwapRB24(src, dst, width);
+      break;
+   case 8:
+      PixConv_Get().Pal8To24(src, dst, width, palRGB);
+      break;
+   case 4:
+      PixConv_Pal4To24(src, dst, width, palRGB);
+      break;
+   case 1:
+      PixConv_Pal1To24(src, dst, width, palRGB);
+      break;
+   default:
+      memset(dst, 0, width * 3);
+      break;
+   }
+}
+
 //
 // Export the image into an RGB buffer.
 //
@@ -320,17 +473,26 @@ bool BitmapImage::encodeToRGB(CxMemFile *hFile, bool bFlipY)
    if(pDib.get() == nullptr)
       return false;
 
-   for(int32_t y1 = 0; y1 < header.biHeight; y1++)
+   const uint32_t height    = uint32_t(header.biHeight);
+   const size_t   rowStride = size_t(header.biWidth) * 3;
+
+   uint32_t palRGB[256];
+   buildRGBPalette(palRGB);
+
+   // the final size is known, so allocate it once
+   uint64_t total = uint64_t(hFile->tell()) + uint64_t(rowStride) * height;
+   if(total > uint64_t(INT32_MAX) || !hFile->reserve(uint32_t(total)))
+      return false;
+
+   std::unique_ptr<uint8_t []> upRow(new uint8_t [rowStride]);
+
+   for(uint32_t y1 = 0; y1 < height; y1++)
    {
-      int32_t y = bFlipY ? header.biHeight - 1 - y1 : y1;
-      
-      for(int32_t x = 0; x < header.biWidth; x++)
-      {
-         RGBQUAD color = blindGetPixelColor(x, y);
-         hFile->putc(color.rgbRed);
-         hFile->putc(color.rgbGreen);
-         hFile->putc(color.rgbBlue);
-      }
+      uint32_t y = bFlipY ? height - 1 - y1 : y1;
+
+      encodeRowToRGB(y, palRGB, upRow.get());
+      if(hFile->write(upRow.get(), 1, rowStride) != rowStride)
+         return false;
    }
 
    return true;
@@ -375,107 +537,672 @@ bool BitmapImage::isGrayScale() const
    return true;
 }
 
+//
+// True if image is paletted and every palette entry is a shade of gray; this
+// covers bilevel images as well as linear and non-linear gray ramps.
+//
+bool BitmapImage::hasGrayPalette() const
+{
+   RGBQUAD *ppal = getPalette();
+
+   if(!(pDib.get() && ppal && header.biClrUsed))
+      return false;
+
+   for(uint32_t i = 0; i < header.biClrUsed; i++)
+   {
+      if(ppal[i].rgbBlue != ppal[i].rgbGreen || ppal[i].rgbGreen != ppal[i].rgbRed)
+         return false;
+   }
+
+   return true;
+}
+
+//
+// Create a 24-bit DIB from packed RGB rows; stride is the distance in bytes
+// between rows of the source array.
+//
 bool BitmapImage::createFromRGB(const uint8_t *pArray, uint32_t width, uint32_t height, uint32_t stride, bool flipimage)
 {
    if(pArray == nullptr)
       return false;
 
-   if(!create(width, height, 3, stride))
+   if(!create(width, height, 24, ((24 * width + 31) / 32) * 4))
       return false;
 
-   const uint8_t *src;
-   uint8_t *dst;
+   const pixconv_t &pc = PixConv_Get();
 
    for(uint32_t y = 0; y < height; y++)
    {
-      dst = info.pImage + (flipimage ? (height - 1 - y) : y) * info.effWidth;
-      src = pArray + y * width * 4;
-      for(uint32_t x = 0; x < width; x++)
-      {
-         *dst++ = src[2]; // B
-         *dst++ = src[1]; // G
-         *dst++ = src[0]; // R
-         src += 3;
-      }
+      uint8_t       *dst = info.pImage + (flipimage ? (height - 1 - y) : y) * info.effWidth;
+      const uint8_t *src = pArray + y * stride;
+      pc.SwapRB24(src, dst, width);
    }
 
    return true;
 }
 
+//=============================================================================
+//
+// libjpeg error handling
+//
+// The default libjpeg error handler calls exit(). Errors are instead routed
+// back to the caller with longjmp so that a failed page cannot take down the
+// application (or a worker thread's siblings).
+//
+
+struct jpegerror_t
+{
+   struct jpeg_error_mgr pub;
+   jmp_buf               setjmpBuffer;
+   char                  message[JMSG_LENGTH_MAX];
+};
+
+static void BitmapImage_JPEGErrorExit(j_common_ptr cinfo)
+{
+   auto err = reinterpret_cast<jpegerror_t *>(cinfo->err);
+   (*cinfo->err->format_message)(cinfo, err->message);
+   longjmp(err->setjmpBuffer, 1);
+}
+
+//=============================================================================
+//
+// libjpeg destination manager writing to a CxMemFile
+//
+// libjpeg compresses straight into the memory file's buffer; there is no
+// intermediate copy. Whenever the window runs out the file grows
+// geometrically, so a page costs only a handful of reallocations.
+//
+
+// Smallest amount of space handed to libjpeg at a time
+#define JPEG_DESTMINWINDOW 65536
+
+struct jpegmemdest_t
+{
+   struct jpeg_destination_mgr pub;
+   CxMemFile *file;
+   uint32_t   windowSize; // size of the window last handed to libjpeg
+};
+
+//
+// Hand libjpeg a fresh window at the end of the memory file.
+//
+static void BitmapImage_NextMemWindow(j_compress_ptr cinfo)
+{
+   auto     dest = reinterpret_cast<jpegmemdest_t *>(cinfo->dest);
+   uint32_t available;
+   uint8_t *window;
+
+   if(!(window = dest->file->writeWindow(JPEG_DESTMINWINDOW, available)))
+      ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 20);
+
+   dest->pub.next_output_byte = window;
+   dest->pub.free_in_buffer   = available;
+   dest->windowSize           = available;
+}
+
+static void BitmapImage_InitMemDest(j_compress_ptr cinfo)
+{
+   BitmapImage_NextMemWindow(cinfo);
+}
+
+static boolean BitmapImage_EmptyMemDest(j_compress_ptr cinfo)
+{
+   // libjpeg only calls this once the whole window is full
+   auto dest = reinterpret_cast<jpegmemdest_t *>(cinfo->dest);
+   dest->file->commitWrite(dest->windowSize);
+
+   BitmapImage_NextMemWindow(cinfo);
+   return TRUE;
+}
+
+static void BitmapImage_TermMemDest(j_compress_ptr cinfo)
+{
+   auto dest = reinterpret_cast<jpegmemdest_t *>(cinfo->dest);
+   dest->file->commitWrite(uint32_t(dest->windowSize - dest->pub.free_in_buffer));
+}
+
+void BitmapImage_JPEGMemFileDest(j_compress_ptr cinfo, CxMemFile *file)
+{
+   auto dest = static_cast<jpegmemdest_t *>(
+      (*cinfo->mem->alloc_small)(reinterpret_cast<j_common_ptr>(cinfo), JPOOL_IMAGE, sizeof(jpegmemdest_t)));
+   dest->pub.init_destination    = BitmapImage_InitMemDest;
+   dest->pub.empty_output_buffer = BitmapImage_EmptyMemDest;
+   dest->pub.term_destination    = BitmapImage_TermMemDest;
+   dest->file       = file;
+   dest->windowSize = 0;
+   cinfo->dest = &dest->pub;
+}
+
+//=============================================================================
+//
+// File output
+//
+
+//
+// Create a file for sequential output. With writeThrough, writes are pushed
+// through the system cache to the file server before they return.
+//
+static HANDLE BitmapImage_CreateOutputFile(const char *filename, bool writeThrough)
+{
+   DWORD flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN;
+   if(writeThrough)
+      flags |= FILE_FLAG_WRITE_THROUGH;
+
+   return CreateFileA(filename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, flags, nullptr);
+}
+
+//
+// Write a finished file with a single write and close it. Removes the
+// partial file and returns false on failure.
+//
+static bool BitmapImage_WriteAndClose(HANDLE hFile, const char *filename, const uint8_t *data, uint32_t size)
+{
+   DWORD written = 0;
+   BOOL  ok      = WriteFile(hFile, data, size, &written, nullptr) && written == size;
+
+   if(!CloseHandle(hFile))
+      ok = FALSE;
+
+   if(!ok)
+      DeleteFileA(filename);
+
+   return ok != FALSE;
+}
+
+//=============================================================================
+//
+// JPEG writing
+//
+
+//
+// Build the tables used to turn DIB rows into JPEG scanlines. Gray and
+// bilevel images are written as single-component grayscale JPEGs.
+//
+void BitmapImage::buildJPEGPalette(jpegpalette_t &pal) const
+{
+   pal.gray     = hasGrayPalette();
+   pal.identity = pal.gray && header.biBitCount == 8 && isGrayScale();
+
+   buildRGBPalette(pal.rgb);
+
+   memset(pal.level, 0, sizeof(pal.level));
+   if(pal.gray)
+   {
+      RGBQUAD *ppal = getPalette();
+      for(uint32_t i = 0; i < header.biClrUsed && i < 256; i++)
+         pal.level[i] = ppal[i].rgbGreen;
+   }
+}
+
+//
+// Convert a single DIB row, in storage order, into a JPEG scanline at dst,
+// which must hold at least width * 3 bytes. Returns the scanline, which for
+// linear 8-bit gray images is the DIB row itself.
+//
+const uint8_t *BitmapImage::encodeRowToJPEG(uint32_t y, const jpegpalette_t &pal, uint8_t *dst) const
+{
+   const uint8_t *src   = info.pImage + y * info.effWidth;
+   const uint32_t width = uint32_t(header.biWidth);
+
+   if(!pal.gray)
+   {
+      encodeRowToRGB(y, pal.rgb, dst);
+      return dst;
+   }
+
+   switch(header.biBitCount)
+   {
+   case 8:
+      if(pal.identity)
+         return src;
+      PixConv_Pal8To8(src, dst, width, pal.level);
+      break;
+   case 4:
+      PixConv_Pal4To8(src, dst, width, pal.level);
+      break;
+   case 1:
+      PixConv_Get().Mono1To8(src, dst, width, pal.level[0], pal.level[1]);
+      break;
+   default:
+      memset(dst, 0, width);
+      break;
+   }
+
+   return dst;
+}
+
+//
+// Set compression parameters from an encode profile for an image of the
+// given height; the width and resolution come from this image. If gray is
+// true, scanlines are single gray samples.
+//
+void BitmapImage::setupJPEG(jpeg_compress_struct *cinfo, const JPEGProfile &profile, uint32_t height, bool gray) const
+{
+   cinfo->image_width      = header.biWidth;
+   cinfo->image_height     = height;
+   cinfo->input_components = gray ? 1 : 3;
+   cinfo->in_color_space   = gray ? JCS_GRAYSCALE : JCS_RGB;
+   jpeg_set_defaults(cinfo);
+   jpeg_set_quality(cinfo, profile.quality, TRUE);
+
+   // libjpeg defaults to 4:2:0; 4:4:4 keeps luma at the chroma resolution
+   if(!gray && !profile.subsample)
+   {
+      cinfo->comp_info[0].h_samp_factor = 1;
+      cinfo->comp_info[0].v_samp_factor = 1;
+   }
+
+   cinfo->optimize_coding = profile.optimize ? TRUE : FALSE;
+
+   switch(profile.dctMethod)
+   {
+   case JPEGDCT_IFAST:
+      cinfo->dct_method = JDCT_IFAST;
+      break;
+   case JPEGDCT_FLOAT:
+      cinfo->dct_method = JDCT_FLOAT;
+      break;
+   default:
+      cinfo->dct_method = JDCT_ISLOW;
+      break;
+   }
+
+   if(profile.progressive)
+      jpeg_simple_progression(cinfo);
+
+   // record resolution in the JFIF header
+   cinfo->density_unit = 1; // dots per inch
+   cinfo->X_density    = UINT16(info.xDPI);
+   cinfo->Y_density    = UINT16(info.yDPI);
+}
+
+//
+// Feed cinfo->image_height scanlines to a started compressor, beginning at
+// JPEG scanline firstRow of this image. Rows are converted straight out of
+// the DIB into a reusable batch of JPEG_ROWBATCH rows at rowBuffer, so no
+// full-size copy of the page is ever built; linear gray rows are handed to
+// libjpeg in place. DIBs are stored bottom-up, so JPEG scanline n is read
+// from DIB row (height - 1 - n).
+//
+void BitmapImage::writeJPEGRows(jpeg_compress_struct *cinfo, uint32_t firstRow, 
+                                const jpegpalette_t &pal, uint8_t *rowBuffer) const
+{
+   JSAMPROW row_pointer[JPEG_ROWBATCH];
+   size_t   row_stride = size_t(header.biWidth) * cinfo->input_components;
+
+   while(cinfo->next_scanline < cinfo->image_height)
+   {
+      JDIMENSION numRows = cinfo->image_height - cinfo->next_scanline;
+      if(numRows > JPEG_ROWBATCH)
+         numRows = JPEG_ROWBATCH;
+
+      uint32_t row = firstRow + cinfo->next_scanline;
+      for(JDIMENSION i = 0; i < numRows; i++)
+      {
+         uint8_t *buffer = rowBuffer + row_stride * i;
+         row_pointer[i]  = const_cast<uint8_t *>(encodeRowToJPEG(header.biHeight - 1 - (row + i), pal, buffer));
+      }
+
+      jpeg_write_scanlines(cinfo, row_pointer, numRows);
+   }
+}
+
 //
 // Write image to a JPEG file
 //
-bool BitmapImage::writeJPEG(const char *filename, int quality)
+// The image is compressed into memory first and then written with a single
+// sequential write, so that a file on a network share costs a few large
+// I/Os instead of one per libjpeg buffer. See writeJPEG(CxMemFile *) for the
+// meaning of numThreads. If stats is not null, it receives the encode and
+// write times separately.
+//
+// Returns false if the file cannot be created; throws DocException if the
+// image cannot be encoded or the write fails, after removing the partial
+// file.
+//
+bool BitmapImage::writeJPEG(const char *filename, const JPEGProfile &profile, unsigned numThreads,
+                            bool writeThrough, jpegwritestats_t *stats)
 {
-   struct jpeg_compress_struct cinfo;
-   struct jpeg_error_mgr       jerr;
+   CxMemFile mem;
+   if(!mem.open())
+      return false;
+
+   auto start = std::chrono::steady_clock::now();
 
-   uint8_t *inputImg  = nullptr;
-   int32_t  inputSize = 0;
+   if(!writeJPEG(&mem, profile, numThreads))
+      return false;
 
-   FILE *outfile;
-   JSAMPROW row_pointer[1];
-   int row_stride;
+   auto encoded = std::chrono::steady_clock::now();
 
-   // get input RGB data
-   if(!encodeToRGB(inputImg, inputSize, true) || !inputImg)
+   HANDLE hFile = BitmapImage_CreateOutputFile(filename, writeThrough);
+   if(hFile == INVALID_HANDLE_VALUE)
       return false;
 
-   // open output file
-   if((outfile = fopen(filename, "wb")) == nullptr)
+   if(!BitmapImage_WriteAndClose(hFile, filename, mem.getBuffer(false), uint32_t(mem.size())))
+      throw DocException("Could not write JPEG file");
+
+   auto written = std::chrono::steady_clock::now();
+
+   if(stats)
    {
-      free(inputImg);
-      return false;
+      stats->encodeMs = std::chrono::duration<double, std::milli>(encoded - start).count();
+      stats->writeMs  = std::chrono::duration<double, std::milli>(written - encoded).count();
+      stats->bytes    = uint32_t(mem.size());
+      stats->crc      = CRC32_Update(0, mem.getBuffer(false), mem.size());
    }
 
+   return true;
+}
+
+//
+// Encode image as a JPEG into a memory file
+//
+// If numThreads is greater than one and the page is tall enough, the page is
+// split into horizontal stripes which are encoded concurrently; see
+// writeJPEGStriped. Stripes need a baseline image with the standard Huffman
+// tables, so profiles asking for progressive or optimized output are always
+// encoded serially.
+//
+// Throws DocException if libjpeg reports an error.
+//
+bool BitmapImage::writeJPEG(CxMemFile *hFile, const JPEGProfile &profile, unsigned numThreads)
+{
+   struct jpeg_compress_struct cinfo;
+   jpegerror_t                 jerr;
+
+   if(hFile == nullptr || pDib.get() == nullptr)
+      return false;
+
+   if(numThreads > 1 && !profile.optimize && !profile.progressive && writeJPEGStriped(hFile, profile, numThreads))
+      return true;
+
+   // build the palette lookup and the scanline batch buffer
+   jpegpalette_t pal;
+   buildJPEGPalette(pal);
+
+   std::unique_ptr<uint8_t []> upRows(new (std::nothrow) uint8_t [size_t(header.biWidth) * 3 * JPEG_ROWBATCH]);
+   if(!upRows)
+      return false;
+
    // allocate and initialize JPEG compression object
 
    // setup error handler first
-   cinfo.err = jpeg_std_error(&jerr);
+   cinfo.err = jpeg_std_error(&jerr.pub);
+   jerr.pub.error_exit = BitmapImage_JPEGErrorExit;
+   if(setjmp(jerr.setjmpBuffer))
+   {
+      // libjpeg signaled an error
+      jpeg_destroy_compress(&cinfo);
+      throw DocException(jerr.message);
+   }
+
    jpeg_create_compress(&cinfo);
 
    // specify data destination
 
-   jpeg_stdio_dest(&cinfo, outfile);
+   BitmapImage_JPEGMemFileDest(&cinfo, hFile);
 
    // set parameters for compression
 
-   cinfo.image_width      = header.biWidth;
-   cinfo.image_height     = header.biHeight;
-   cinfo.input_components = 3;
-   cinfo.in_color_space   = JCS_RGB;
-   jpeg_set_defaults(&cinfo);
-   jpeg_set_quality(&cinfo, quality, TRUE);
+   setupJPEG(&cinfo, profile, header.biHeight, pal.gray);
 
    // start compressor
 
    jpeg_start_compress(&cinfo, TRUE);
 
-   // write scanlines
+   // convert and write scanlines a batch at a time
+
+   writeJPEGRows(&cinfo, 0, pal, upRows.get());
+
+   // finish compression
+
+   jpeg_finish_compress(&cinfo);
+
+   // destroy compressor
+
+   jpeg_destroy_compress(&cinfo);
+
+   return true;
+}
 
-   row_stride = cinfo.image_width * 3;
+//=============================================================================
+//
+// Striped JPEG writing
+//
+// A page is cut into horizontal stripes on MCU row boundaries, and each stripe
+// is encoded on its own thread as a complete JPEG with a restart marker after
+// every MCU row and the standard Huffman tables. Because every stripe then
+// starts on a restart boundary with the same tables, their entropy-coded
+// segments can be concatenated behind the headers of the first stripe. The
+// only edits needed are the frame height and the numbering of the RSTn
+// markers, which must run modulo 8 across the whole image. The result is an
+// ordinary baseline JPEG that decodes to the same pixels as the serial path;
+// only the restart markers differ.
+//
+
+//
+// Walk the marker segments at the head of a JPEG stream up to and including
+// the SOS header. Returns the offset of the first entropy-coded byte, or 0 if
+// the stream is malformed. If sofHeight is non-null, it receives the offset of
+// the frame height field.
+//
+static size_t BitmapImage_FindScanData(const uint8_t *data, size_t size, size_t *sofHeight)
+{
+   if(size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+      return 0;
 
-   while(cinfo.next_scanline < cinfo.image_height)
+   size_t pos = 2;
+   while(pos + 4 <= size)
    {
-      row_pointer[0] = &inputImg[cinfo.next_scanline * row_stride];
-      jpeg_write_scanlines(&cinfo, row_pointer, 1);
+      if(data[pos] != 0xFF)
+         return 0;
+
+      uint8_t marker = data[pos + 1];
+      size_t  length = (size_t(data[pos + 2]) << 8) | data[pos + 3];
+      if(length < 2 || pos + 2 + length > size)
+         return 0;
+
+      if(marker >= 0xC0 && marker <= 0xC2 && sofHeight)
+         *sofHeight = pos + 5;
+
+      pos += 2 + length;
+      if(marker == 0xDA) // SOS
+         return pos;
    }
 
-   // finish compression
+   return 0;
+}
 
-   jpeg_finish_compress(&cinfo);
+//
+// Renumber the restart markers in a stripe's entropy-coded data so that they
+// continue the sequence of the stripes before it. firstInterval is the index
+// of the stripe's first restart interval within the whole image.
+//
+static void BitmapImage_RenumberRestarts(uint8_t *data, size_t size, uint32_t firstInterval)
+{
+   uint32_t marker = firstInterval;
 
-   // close file and free temp RGB image
+   for(size_t i = 0; i + 1 < size; i++)
+   {
+      if(data[i] != 0xFF)
+         continue;
 
-   fclose(outfile);
-   free(inputImg);
+      uint8_t code = data[i + 1];
+      if(code >= 0xD0 && code <= 0xD7)
+         data[i + 1] = uint8_t(0xD0 + (marker++ & 7));
+      ++i; // skip stuffed zero or marker code
+   }
+}
 
-   // destroy compressor
+//
+// Encode scanlines [firstRow, firstRow + numRows) as a standalone JPEG in a
+// memory file. Runs on a worker thread, so errors are returned through error
+// rather than thrown.
+//
+bool BitmapImage::encodeJPEGStripe(CxMemFile &out, const JPEGProfile &profile, uint32_t firstRow, uint32_t numRows,
+                                   const jpegpalette_t &pal, std::string &error) const
+{
+   struct jpeg_compress_struct cinfo;
+   jpegerror_t                 jerr;
+
+   std::unique_ptr<uint8_t []> upRows(new (std::nothrow) uint8_t [size_t(header.biWidth) * 3 * JPEG_ROWBATCH]);
+   if(!upRows || !out.open())
+   {
+      error = "Out of memory while encoding JPEG stripe";
+      return false;
+   }
 
+   cinfo.err = jpeg_std_error(&jerr.pub);
+   jerr.pub.error_exit = BitmapImage_JPEGErrorExit;
+   if(setjmp(jerr.setjmpBuffer))
+   {
+      jpeg_destroy_compress(&cinfo);
+      error = jerr.message;
+      return false;
+   }
+
+   jpeg_create_compress(&cinfo);
+   setupJPEG(&cinfo, profile, numRows, pal.gray);
+   BitmapImage_JPEGMemFileDest(&cinfo, &out);
+
+   // all stripes must share one set of tables and restart every MCU row
+   cinfo.optimize_coding = FALSE;
+   cinfo.restart_in_rows = 1;
+
+   jpeg_start_compress(&cinfo, TRUE);
+   writeJPEGRows(&cinfo, firstRow, pal, upRows.get());
+   jpeg_finish_compress(&cinfo);
    jpeg_destroy_compress(&cinfo);
 
    return true;
 }
 
-// EOF
+//
+// Encode the image as stripes on up to numThreads threads and join them into
+// one JPEG in hFile. Returns false without writing anything if the image is
+// too short to split.
+//
+bool BitmapImage::writeJPEGStriped(CxMemFile *hFile, const JPEGProfile &profile, unsigned numThreads)
+{
+   jpegpalette_t pal;
+   buildJPEGPalette(pal);
+
+   // find the MCU height for the parameters in use
+   uint32_t mcuHeight;
+   {
+      struct jpeg_compress_struct cinfo;
+      jpegerror_t                 jerr;
+
+      cinfo.err = jpeg_std_error(&jerr.pub);
+      jerr.pub.error_exit = BitmapImage_JPEGErrorExit;
+      if(setjmp(jerr.setjmpBuffer))
+      {
+         jpeg_destroy_compress(&cinfo);
+         throw DocException(jerr.message);
+      }
+
+      jpeg_create_compress(&cinfo);
+      setupJPEG(&cinfo, profile, header.biHeight, pal.gray);
+
+      int maxVSamp = 1;
+      for(int ci = 0; ci < cinfo.num_components; ci++)
+      {
+         if(cinfo.comp_info[ci].v_samp_factor > maxVSamp)
+            maxVSamp = cinfo.comp_info[ci].v_samp_factor;
+      }
+      if(cinfo.num_components == 1)
+         maxVSamp = 1; // non-interleaved scans use one block per MCU
+      mcuHeight = uint32_t(maxVSamp * cinfo.block_size);
+
+      jpeg_destroy_compress(&cinfo);
+   }
+
+   // lay out the stripes in whole MCU rows
+   uint32_t mcuRows       = (header.biHeight + mcuHeight - 1) / mcuHeight;
+   uint32_t numStripes    = numThreads < mcuRows ? numThreads : mcuRows;
+   uint32_t rowsPerStripe = (mcuRows + numStripes - 1) / numStripes;
+   numStripes = (mcuRows + rowsPerStripe - 1) / rowsPerStripe;
+
+   if(numStripes < 2)
+      return false;
+
+   std::unique_ptr<CxMemFile []> stripes(new CxMemFile [numStripes]);
+   std::vector<std::string>      errors(numStripes);
+
+   Parallel_For(numStripes, numStripes, [&] (size_t i) {
+      uint32_t firstRow = uint32_t(i) * rowsPerStripe * mcuHeight;
+      uint32_t numRows  = rowsPerStripe * mcuHeight;
+      if(numRows > header.biHeight - firstRow)
+         numRows = header.biHeight - firstRow;
+
+      try
+      {
+         encodeJPEGStripe(stripes[i], profile, firstRow, numRows, pal, errors[i]);
+      }
+      catch(...)
+      {
+         errors[i] = "An unknown error occurred while encoding a JPEG stripe";
+      }
+   });
 
+   for(auto &error : errors)
+   {
+      if(!error.empty())
+         throw DocException(error.c_str());
+   }
+
+   // locate the entropy-coded data of each stripe
+   std::vector<size_t> scanStart(numStripes);
+   size_t sofHeight = 0;
+   for(uint32_t i = 0; i < numStripes; i++)
+   {
+      const uint8_t *data = stripes[i].getBuffer(false);
+      size_t         size = size_t(stripes[i].size());
+
+      scanStart[i] = BitmapImage_FindScanData(data, size, i == 0 ? &sofHeight : nullptr);
+      if(!scanStart[i] || !sofHeight || size < scanStart[i] + 2 || 
+         data[size - 2] != 0xFF || data[size - 1] != 0xD9)
+         throw DocException("Malformed JPEG stripe");
+   }
+
+   // patch the full image height into the frame header of the first stripe
+   uint8_t *head = stripes[0].getBuffer(false);
+   head[sofHeight]     = uint8_t(header.biHeight >> 8);
+   head[sofHeight + 1] = uint8_t(header.biHeight & 0xFF);
+
+   // the joined image is the stripes less their own headers and trailers
+   uint64_t total = scanStart[0] + 2;
+   for(uint32_t i = 0; i < numStripes; i++)
+      total += uint64_t(stripes[i].size()) - scanStart[i];
+   if(total > uint64_t(INT32_MAX) || !hFile->reserve(uint32_t(hFile->tell() + total)))
+      throw DocException("Out of memory while joining JPEG stripes");
+
+   bool ok = (hFile->write(head, 1, scanStart[0]) == scanStart[0]);
+
+   for(uint32_t i = 0; i < numStripes && ok; i++)
+   {
+      uint8_t *data     = stripes[i].getBuffer(false) + scanStart[i];
+      size_t   dataSize = size_t(stripes[i].size()) - scanStart[i] - 2; // less EOI
+
+      // one restart interval per MCU row
+      uint32_t firstInterval = i * rowsPerStripe;
+      if(i > 0)
+      {
+         const uint8_t rst[2] = { 0xFF, uint8_t(0xD0 + ((firstInterval - 1) & 7)) };
+         ok = (hFile->write(rst, 1, 2) == 2);
+      }
+
+      BitmapImage_RenumberRestarts(data, dataSize, firstInterval);
+      ok = ok && (hFile->write(data, 1, dataSize) == dataSize);
+   }
+
+   const uint8_t eoi[2] = { 0xFF, 0xD9 };
+   ok = ok && (hFile->write(eoi, 1, 2) == 2);
+
+   if(!ok)
+      throw DocException("Could not join JPEG stripes");
+
+   return true;
+}
+
+// EOF
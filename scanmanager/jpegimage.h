@@ -11,10 +11,30 @@
 #include <Windows.h>
 #include <stdint.h>
 #include <memory>
+#include <string>
 
 #define CXIMAGE_DEFAULT_DPI 96
 
 class CxMemFile;
+struct JPEGProfile;
+struct jpeg_compress_struct;
+
+namespace Gdiplus
+{
+   class Bitmap;
+}
+
+// libjpeg destination that compresses into a CxMemFile
+void BitmapImage_JPEGMemFileDest(jpeg_compress_struct *cinfo, CxMemFile *file);
+
+// Timings of one BitmapImage::writeJPEG call
+struct jpegwritestats_t
+{
+   double   encodeMs; // compressing into memory
+   double   writeMs;  // writing the compressed file out
+   uint32_t bytes;    // size of the file written
+   uint32_t crc;      // CRC-32 of the file written
+};
 
 //
 // Stores unpacked data extracted from the DIB HBITMAP returned by a 
@@ -32,23 +52,46 @@ public:
    };
 
 protected:
+   // Lookup tables for converting DIB rows to JPEG scanlines
+   struct jpegpalette_t
+   {
+      bool     gray;       // write a single-component grayscale JPEG
+      bool     identity;   // 8-bit rows are already gray levels
+      uint32_t rgb[256];   // packed RGB entries for color output
+      uint8_t  level[256]; // gray levels for grayscale output
+   };
+
    BITMAPINFOHEADER header;
    imageinfo_t      info;
    
    std::unique_ptr<uint8_t []> pDib;
 
    void  startup();
+   void  loadFromGdiplus(Gdiplus::Bitmap *bitmap);
    void *create(uint32_t width, uint32_t height, uint32_t bpp, uint32_t stride);
+   void  buildRGBPalette(uint32_t (&palRGB)[256]) const;
+   void  encodeRowToRGB(uint32_t y, const uint32_t (&palRGB)[256], uint8_t *dst) const;
+   void  buildJPEGPalette(jpegpalette_t &pal) const;
+   const uint8_t *encodeRowToJPEG(uint32_t y, const jpegpalette_t &pal, uint8_t *dst) const;
+   void  setupJPEG(jpeg_compress_struct *cinfo, const JPEGProfile &profile, uint32_t height, bool gray) const;
+   void  writeJPEGRows(jpeg_compress_struct *cinfo, uint32_t firstRow, 
+                       const jpegpalette_t &pal, uint8_t *rowBuffer) const;
+   bool  encodeJPEGStripe(CxMemFile &out, const JPEGProfile &profile, uint32_t firstRow, uint32_t numRows,
+                          const jpegpalette_t &pal, std::string &error) const;
+   bool  writeJPEGStriped(CxMemFile *hFile, const JPEGProfile &profile, unsigned numThreads);
 
 public:
    BitmapImage(HBITMAP hBmp);
+   BitmapImage(Gdiplus::Bitmap *bitmap);
 
    void      setXDPI(int32_t dpi);
    void      setYDPI(int32_t dpi);
-   int32_t   getXDPI()   const { return info.xDPI;       }
-   int32_t   getYDPI()   const { return info.yDPI;       }
-   uint32_t  getWidth()  const { return header.biWidth;  }
-   uint32_t  getHeight() const { return header.biHeight; }
+   int32_t   getXDPI()     const { return info.xDPI;         }
+   int32_t   getYDPI()     const { return info.yDPI;         }
+   uint32_t  getWidth()    const { return header.biWidth;    }
+   uint32_t  getHeight()   const { return header.biHeight;   }
+   uint32_t  getStride()   const { return info.effWidth;     }
+   uint32_t  getBitCount() const { return header.biBitCount; }
 
    int32_t   getSize() const;
    uint32_t  getPaletteSize() const;
@@ -60,8 +103,11 @@ public:
    bool      encodeToRGB(CxMemFile *hFile, bool bFlipY = false);
    bool      encodeToRGB(uint8_t *&buffer, int32_t &size, bool bFlipY = false);
    bool      isGrayScale() const;
+   bool      hasGrayPalette() const;
    bool      createFromRGB(const uint8_t *pArray, uint32_t width, uint32_t height, uint32_t stride, bool flipimage);
-   bool      writeJPEG(const char *filename, int quality);
+   bool      writeJPEG(const char *filename, const JPEGProfile &profile, unsigned numThreads = 1,
+                       bool writeThrough = false, jpegwritestats_t *stats = nullptr);
+   bool      writeJPEG(CxMemFile *hFile, const JPEGProfile &profile, unsigned numThreads = 1);
 };
 
 #endif
@@ -0,0 +1,144 @@
+/*
+  Scan Manager
+
+  JPEG encode profiles
+
+  Three profiles are built in. Any of their settings may be overridden, and
+  the profile used for new documents chosen, through the ini file:
+
+  [jpeg]
+  profile=standard
+
+  [jpeg.standard]
+  quality=85
+  subsampling=420   ; or 444
+  optimize=yes
+  progressive=no
+  dct=islow         ; or ifast, float
+*/
+
+#include <map>
+#include <mutex>
+#include "inifile.h"
+#include "jpegprofile.h"
+#include "util.h"
+
+// Section and key of the profile selection in the ini file
+#define JPEGPROFILE_SECTION "jpeg"
+#define JPEGPROFILE_DEFAULT "standard"
+
+//
+// Built-in profiles.
+//
+// archival: very high quality with full chroma resolution, for records that
+//           must survive later reprocessing.
+// standard: visually lossless for scanned paperwork. Baseline with standard
+//           Huffman tables, so single large pages can be encoded in parallel
+//           stripes.
+// compact:  smallest files that remain comfortably legible.
+//
+static const JPEGProfile builtinProfiles[] =
+{
+   //  name        quality  subsample  optimize  progressive  dctMethod
+   { "archival",   95,      false,     true,     false,       JPEGDCT_ISLOW },
+   { "standard",   90,      true,      false,    false,       JPEGDCT_ISLOW },
+   { "compact",    75,      true,      true,     true,        JPEGDCT_ISLOW },
+};
+
+static std::map<std::string, JPEGProfile> profiles;
+static std::once_flag                     profilesInit;
+
+//
+// Apply any ini settings for a profile on top of its built-in values.
+//
+static void JPEGProfile_ApplyIni(JPEGProfile &profile)
+{
+   const std::string section = JPEGPROFILE_SECTION "." + profile.name;
+   std::string value;
+
+   if(IniFile::GetIniValue(section, "quality", value) && IsInt(value))
+   {
+      int quality = StringToInt(value);
+      if(quality >= 1 && quality <= 100)
+         profile.quality = quality;
+   }
+
+   if(IniFile::GetIniValue(section, "subsampling", value))
+   {
+      if(value == "420")
+         profile.subsample = true;
+      else if(value == "444")
+         profile.subsample = false;
+   }
+
+   profile.optimize    = IniFile::GetIniFlag(section, "optimize",    profile.optimize);
+   profile.progressive = IniFile::GetIniFlag(section, "progressive", profile.progressive);
+
+   if(IniFile::GetIniValue(section, "dct", value))
+   {
+      std::string dct = LowercaseString(value);
+      if(dct == "islow")
+         profile.dctMethod = JPEGDCT_ISLOW;
+      else if(dct == "ifast")
+         profile.dctMethod = JPEGDCT_IFAST;
+      else if(dct == "float")
+         profile.dctMethod = JPEGDCT_FLOAT;
+   }
+}
+
+//
+// Build the profile table the first time it is needed. Pages may be encoded
+// on several threads at once, so this is done exactly once.
+//
+static void JPEGProfile_Init()
+{
+   std::call_once(profilesInit, [] {
+      for(const JPEGProfile &builtin : builtinProfiles)
+      {
+         JPEGProfile profile = builtin;
+         JPEGProfile_ApplyIni(profile);
+         profiles[profile.name] = profile;
+      }
+   });
+}
+
+//
+// Look up a profile by name. Unknown names get the standard profile.
+//
+const JPEGProfile &JPEGProfile_Get(const std::string &name)
+{
+   JPEGProfile_Init();
+
+   auto itr = profiles.find(LowercaseString(name));
+   if(itr == profiles.end())
+      itr = profiles.find(JPEGPROFILE_DEFAULT);
+
+   return itr->second;
+}
+
+//
+// Get the profile selected in the ini file for writing documents.
+//
+const JPEGProfile &JPEGProfile_Default()
+{
+   std::string name;
+   if(IniFile::GetIniValue(JPEGPROFILE_SECTION, "profile", name))
+      return JPEGProfile_Get(name);
+
+   return JPEGProfile_Get(JPEGPROFILE_DEFAULT);
+}
+
+//
+// Names of all profiles, in order of decreasing quality.
+//
+std::vector<std::string> JPEGProfile_Names()
+{
+   std::vector<std::string> names;
+
+   for(const JPEGProfile &builtin : builtinProfiles)
+      names.push_back(builtin.name);
+
+   return names;
+}
+
+// EOF
@@ -0,0 +1,41 @@
+/*
+  Scan Manager
+
+  JPEG encode profiles
+*/
+
+#ifndef JPEGPROFILE_H__
+#define JPEGPROFILE_H__
+
+#include <string>
+#include <vector>
+
+// DCT implementations offered by libjpeg
+enum jpegdct_e
+{
+   JPEGDCT_ISLOW, // accurate integer
+   JPEGDCT_IFAST, // fast, less accurate integer
+   JPEGDCT_FLOAT  // floating point
+};
+
+//
+// Settings for one named way of encoding document pages.
+//
+struct JPEGProfile
+{
+   std::string name;
+   int         quality;     // libjpeg quality, 1 to 100
+   bool        subsample;   // 4:2:0 chroma if true, 4:4:4 if false
+   bool        optimize;    // compute optimal Huffman tables
+   bool        progressive; // write a progressive rather than baseline JPEG
+   jpegdct_e   dctMethod;
+};
+
+const JPEGProfile &JPEGProfile_Get(const std::string &name);
+const JPEGProfile &JPEGProfile_Default();
+
+std::vector<std::string> JPEGProfile_Names();
+
+#endif
+
+// EOF
@@ -0,0 +1,351 @@
+/*
+  Scan Manager
+
+  JPEG profile report
+
+  Encodes every image in a directory of sample pages with each JPEG profile
+  and writes the resulting sizes and encode times to a CSV file, so that the
+  trade-offs can be judged on real paperwork before changing the profile
+  used for new documents.
+
+  The stripe report encodes the same pages with the default profile on one
+  thread and then split into stripes on more and more threads, to show what
+  striped encoding gains on the machines it will run on.
+*/
+
+#include <Windows.h>
+#include <gdiplus.h>
+#include <stdio.h>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include "cached_files.h"
+#include "docwrite.h"
+#include "i_opndir.h"
+#include "jpegimage.h"
+#include "jpegprofile.h"
+#include "jpegreport.h"
+#include "memfile.h"
+#include "parallel.h"
+#include "util.h"
+
+// Each page is encoded this many times per profile and the fastest run kept,
+// to keep scheduling noise out of the timings.
+#define JPEGREPORT_RUNS 3
+
+// Totals for one profile over the whole corpus
+struct jpegreporttotal_t
+{
+   uint64_t bytes;
+   double   ms;
+};
+
+//
+// True if a file name has an extension GDI+ can load.
+//
+static bool ScanMgr_IsSampleImage(const std::string &name)
+{
+   static const char *const extensions[] = { ".jpg", ".jpeg", ".bmp", ".png", ".tif", ".tiff", ".gif" };
+
+   std::string lower = LowercaseString(name);
+   for(const char *ext : extensions)
+   {
+      size_t len = strlen(ext);
+      if(lower.length() > len && !lower.compare(lower.length() - len, len, ext))
+         return true;
+   }
+
+   return false;
+}
+
+//
+// Load a sample page into a BitmapImage snapshot.
+//
+static std::unique_ptr<BitmapImage> ScanMgr_LoadSampleImage(const std::string &path)
+{
+   size_t reqSize = mbstowcs(nullptr, path.c_str(), 0);
+   if(reqSize == size_t(-1))
+      return nullptr;
+
+   std::unique_ptr<wchar_t []> upWCS(new wchar_t [reqSize + 1]);
+   mbstowcs(upWCS.get(), path.c_str(), reqSize + 1);
+
+   std::unique_ptr<Gdiplus::Bitmap> upBitmap(Gdiplus::Bitmap::FromFile(upWCS.get()));
+   if(!upBitmap || upBitmap->GetLastStatus() != Gdiplus::Ok)
+      return nullptr;
+
+   return std::unique_ptr<BitmapImage>(new BitmapImage(upBitmap.get()));
+}
+
+//
+// List the sample images in inDir. Returns false with a message if there are
+// none.
+//
+bool ScanMgr_ListSampleImages(const std::string &inDir, std::set<std::string> &filenames, std::string &errorMsg)
+{
+   DIR    *dir;
+   dirent *ent;
+
+   if(!(dir = opendir(inDir.c_str())))
+   {
+      errorMsg = "Cannot open sample directory " + inDir + ".";
+      return false;
+   }
+
+   while((ent = readdir(dir)))
+   {
+      if(ScanMgr_IsSampleImage(ent->d_name))
+         filenames.insert(ent->d_name);
+   }
+
+   closedir(dir);
+
+   if(filenames.empty())
+   {
+      errorMsg = "No sample images found in " + inDir + ".";
+      return false;
+   }
+
+   return true;
+}
+
+//
+// Load a sample page, returning nullptr if it cannot be loaded.
+//
+static std::unique_ptr<BitmapImage> ScanMgr_TryLoadSampleImage(const std::string &inDir, const std::string &fn)
+{
+   try
+   {
+      return ScanMgr_LoadSampleImage(FileCache::PathConcatenate(inDir, fn));
+   }
+   catch(...)
+   {
+      return nullptr;
+   }
+}
+
+//
+// Encode a page JPEGREPORT_RUNS times and get the time of the fastest run.
+// Returns false if the page could not be encoded.
+//
+static bool ScanMgr_TimeEncode(BitmapImage &image, const JPEGProfile &profile, unsigned numThreads,
+                               uint32_t &bytes, double &bestMs)
+{
+   bool ok = true;
+
+   for(int run = 0; run < JPEGREPORT_RUNS && ok; run++)
+   {
+      CxMemFile mem;
+      mem.open();
+
+      auto start = std::chrono::steady_clock::now();
+      try
+      {
+         ok = image.writeJPEG(&mem, profile, numThreads);
+      }
+      catch(...)
+      {
+         ok = false;
+      }
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+      bytes = uint32_t(mem.size());
+      if(run == 0 || elapsed.count() < bestMs)
+         bestMs = elapsed.count();
+   }
+
+   return ok;
+}
+
+//
+// Run the report over inDir and write it to outPath. Returns false with a
+// message if the report could not be produced; pages that fail to load or
+// encode are noted in the report and skipped.
+//
+bool ScanMgr_JPEGReport(const std::string &inDir, const std::string &outPath, std::string &errorMsg)
+{
+   std::set<std::string> filenames;
+   if(!ScanMgr_ListSampleImages(inDir, filenames, errorMsg))
+      return false;
+
+   FILE *f;
+   if(!(f = fopen(outPath.c_str(), "w")))
+   {
+      errorMsg = "Cannot create report file " + outPath + ".";
+      return false;
+   }
+
+   const std::vector<std::string> names = JPEGProfile_Names();
+   std::map<std::string, jpegreporttotal_t> totals;
+
+   fprintf(f, "file,width,height,bpp,profile,quality,subsampling,optimize,progressive,bytes,bits_per_pixel,encode_ms\n");
+
+   for(const std::string &fn : filenames)
+   {
+      std::unique_ptr<BitmapImage> upImage = ScanMgr_TryLoadSampleImage(inDir, fn);
+      if(!upImage)
+      {
+         fprintf(f, "\"%s\",,,,,,,,,,,load failed\n", fn.c_str());
+         continue;
+      }
+
+      const double pixels = double(upImage->getWidth()) * upImage->getHeight();
+
+      for(const std::string &name : names)
+      {
+         const JPEGProfile &profile = JPEGProfile_Get(name);
+         uint32_t bytes  = 0;
+         double   bestMs = 0.0;
+
+         if(!ScanMgr_TimeEncode(*upImage, profile, 1, bytes, bestMs))
+         {
+            fprintf(f, "\"%s\",%u,%u,%u,%s,,,,,,,encode failed\n", fn.c_str(), upImage->getWidth(),
+                    upImage->getHeight(), upImage->getBitCount(), name.c_str());
+            continue;
+         }
+
+         fprintf(f, "\"%s\",%u,%u,%u,%s,%d,%s,%s,%s,%u,%.3f,%.1f\n", fn.c_str(),
+                 upImage->getWidth(), upImage->getHeight(), upImage->getBitCount(), name.c_str(),
+                 profile.quality, profile.subsample ? "4:2:0" : "4:4:4",
+                 profile.optimize ? "yes" : "no", profile.progressive ? "yes" : "no",
+                 bytes, bytes * 8.0 / pixels, bestMs);
+
+         jpegreporttotal_t &total = totals[name];
+         total.bytes += bytes;
+         total.ms    += bestMs;
+      }
+   }
+
+   // summary, relative to the first (highest quality) profile
+   fprintf(f, "\nprofile,total_bytes,total_encode_ms,size_vs_%s\n", names.front().c_str());
+
+   const double baseBytes = double(totals[names.front()].bytes);
+   for(const std::string &name : names)
+   {
+      const jpegreporttotal_t &total = totals[name];
+      fprintf(f, "%s,%llu,%.1f,%.3f\n", name.c_str(), (unsigned long long)total.bytes, total.ms,
+              baseBytes > 0.0 ? total.bytes / baseBytes : 0.0);
+   }
+
+   if(fclose(f))
+   {
+      errorMsg = "Could not finish writing report file " + outPath + ".";
+      return false;
+   }
+
+   return true;
+}
+
+//
+// Get the thread counts the stripe report tries: 1, which is the serial
+// encoder, then doubling up to the number of cores, and the number of cores
+// itself.
+//
+static std::vector<unsigned> ScanMgr_StripeThreadCounts()
+{
+   std::vector<unsigned> counts;
+   const unsigned cores = Parallel_NumCores();
+
+   for(unsigned n = 1; n < cores; n *= 2)
+      counts.push_back(n);
+   counts.push_back(cores);
+
+   return counts;
+}
+
+//
+// Run the stripe report over inDir and write it to outPath: each page is
+// encoded with the default profile serially and in stripes on each of
+// ScanMgr_StripeThreadCounts threads. Stripes are only made for baseline
+// output with the standard Huffman tables, so if the default profile asks
+// for optimized or progressive output, those settings are turned off for
+// every run, serial included, so that like is compared with like. Returns
+// false with a message if the report could not be produced.
+//
+bool ScanMgr_JPEGStripeReport(const std::string &inDir, const std::string &outPath, std::string &errorMsg)
+{
+   std::set<std::string> filenames;
+   if(!ScanMgr_ListSampleImages(inDir, filenames, errorMsg))
+      return false;
+
+   FILE *f;
+   if(!(f = fopen(outPath.c_str(), "w")))
+   {
+      errorMsg = "Cannot create report file " + outPath + ".";
+      return false;
+   }
+
+   JPEGProfile profile = JPEGProfile_Default();
+   const bool  changed = profile.optimize || profile.progressive;
+   profile.optimize    = false;
+   profile.progressive = false;
+
+   const std::vector<unsigned> counts = ScanMgr_StripeThreadCounts();
+   std::map<unsigned, double>  totalMs;
+
+   fprintf(f, "profile,%s%s\n", profile.name.c_str(), changed ? " (baseline, standard tables)" : "");
+   fprintf(f, "file,width,height,threads,bytes,encode_ms,speedup\n");
+
+   for(const std::string &fn : filenames)
+   {
+      std::unique_ptr<BitmapImage> upImage = ScanMgr_TryLoadSampleImage(inDir, fn);
+      if(!upImage)
+      {
+         fprintf(f, "\"%s\",,,,,,load failed\n", fn.c_str());
+         continue;
+      }
+
+      // a page only counts towards the totals if every run of it worked
+      std::map<unsigned, double> pageMs;
+      double serialMs = 0.0;
+      for(unsigned threads : counts)
+      {
+         uint32_t bytes  = 0;
+         double   bestMs = 0.0;
+
+         if(!ScanMgr_TimeEncode(*upImage, profile, threads, bytes, bestMs))
+         {
+            fprintf(f, "\"%s\",%u,%u,%u,,,encode failed\n", fn.c_str(), upImage->getWidth(),
+                    upImage->getHeight(), threads);
+            continue;
+         }
+
+         if(threads == 1)
+            serialMs = bestMs;
+
+         fprintf(f, "\"%s\",%u,%u,%u,%u,%.1f,%.2f\n", fn.c_str(), upImage->getWidth(), upImage->getHeight(),
+                 threads, bytes, bestMs, (bestMs > 0.0 && serialMs > 0.0) ? serialMs / bestMs : 0.0);
+
+         pageMs[threads] = bestMs;
+      }
+
+      if(pageMs.size() == counts.size())
+      {
+         for(const auto &pr : pageMs)
+            totalMs[pr.first] += pr.second;
+      }
+   }
+
+   // summary, relative to the serial encoder
+   fprintf(f, "\nthreads,total_encode_ms,speedup\n");
+
+   const double serialMs = totalMs[1];
+   for(unsigned threads : counts)
+   {
+      fprintf(f, "%u,%.1f,%.2f\n", threads, totalMs[threads],
+              totalMs[threads] > 0.0 ? serialMs / totalMs[threads] : 0.0);
+   }
+
+   if(fclose(f))
+   {
+      errorMsg = "Could not finish writing report file " + outPath + ".";
+      return false;
+   }
+
+   return true;
+}
+
+// EOF
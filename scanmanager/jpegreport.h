@@ -0,0 +1,19 @@
+/*
+  Scan Manager
+
+  JPEG profile report
+*/
+
+#ifndef JPEGREPORT_H__
+#define JPEGREPORT_H__
+
+#include <set>
+#include <string>
+
+bool ScanMgr_ListSampleImages(const std::string &inDir, std::set<std::string> &filenames, std::string &errorMsg);
+bool ScanMgr_JPEGReport(const std::string &inDir, const std::string &outPath, std::string &errorMsg);
+bool ScanMgr_JPEGStripeReport(const std::string &inDir, const std::string &outPath, std::string &errorMsg);
+
+#endif
+
+// EOF
@@ -0,0 +1,515 @@
+/*
+  Scan Manager
+
+  Lossless JPEG transforms
+
+  Rotates, flips, and crops stored pages in the DCT domain using the IJG
+  transupp routines, so a correction to a saved document touches only its
+  files: there is no decode/encode cycle, nothing is lost to requantization,
+  and a page costs a small fraction of the time of re-encoding it.
+
+  Transforms that would leave a partial block at the top or left edge of
+  the result trim it instead, which removes at most one block row or column
+  (8 to 16 pixels of margin) from a page whose size is not a multiple of
+  the block size.
+*/
+
+#include <Windows.h>
+#include <limits.h>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <setjmp.h>
+#include <string>
+#include <vector>
+#include "cached_files.h"
+#include "doccontainer.h"
+#include "docmanifest.h"
+#include "i_opndir.h"
+#include "jpegdecode.h"
+#include "jpegimage.h"
+#include "jpegtransform.h"
+#include "mappedfile.h"
+#include "memfile.h"
+#include "parallel.h"
+#include "util.h"
+
+#include "jpeg-9b/jpeglib.h"
+#include "jpeg-9b/jerror.h"
+extern "C"
+{
+#include "jpeg-9b/transupp.h"
+}
+
+//=============================================================================
+//
+// libjpeg error handling
+//
+
+struct jpegxformerror_t
+{
+   struct jpeg_error_mgr pub;
+   jmp_buf               setjmpBuffer;
+   char                  message[JMSG_LENGTH_MAX];
+};
+
+static void JPEGTransform_ErrorExit(j_common_ptr cinfo)
+{
+   auto err = reinterpret_cast<jpegxformerror_t *>(cinfo->err);
+   (*cinfo->err->format_message)(cinfo, err->message);
+   longjmp(err->setjmpBuffer, 1);
+}
+
+//=============================================================================
+//
+// Transform names
+//
+
+static const struct jpegxformname_t
+{
+   const char *name;
+   jpegxform_e xform;
+} jpegXformNames[] =
+{
+   { "rot90",      JPEGXFORM_ROT_90     },
+   { "rot180",     JPEGXFORM_ROT_180    },
+   { "rot270",     JPEGXFORM_ROT_270    },
+   { "fliph",      JPEGXFORM_FLIP_H     },
+   { "flipv",      JPEGXFORM_FLIP_V     },
+   { "transpose",  JPEGXFORM_TRANSPOSE  },
+   { "transverse", JPEGXFORM_TRANSVERSE },
+   { "none",       JPEGXFORM_NONE       },
+};
+
+//
+// Look up a transform by the name used on the command line.
+//
+bool JPEGTransform_ParseName(const std::string &name, jpegxform_e &xform)
+{
+   std::string lower = LowercaseString(name);
+
+   for(const auto &entry : jpegXformNames)
+   {
+      if(lower == entry.name)
+      {
+         xform = entry.xform;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+//=============================================================================
+//
+// Transform engine
+//
+
+static JXFORM_CODE JPEGTransform_Code(jpegxform_e xform)
+{
+   switch(xform)
+   {
+   case JPEGXFORM_FLIP_H:     return JXFORM_FLIP_H;
+   case JPEGXFORM_FLIP_V:     return JXFORM_FLIP_V;
+   case JPEGXFORM_TRANSPOSE:  return JXFORM_TRANSPOSE;
+   case JPEGXFORM_TRANSVERSE: return JXFORM_TRANSVERSE;
+   case JPEGXFORM_ROT_90:     return JXFORM_ROT_90;
+   case JPEGXFORM_ROT_180:    return JXFORM_ROT_180;
+   case JPEGXFORM_ROT_270:    return JXFORM_ROT_270;
+   default:                   return JXFORM_NONE;
+   }
+}
+
+//
+// True if the transform exchanges the page's width and height.
+//
+static bool JPEGTransform_SwapsAxes(jpegxform_e xform)
+{
+   return (xform == JPEGXFORM_TRANSPOSE || xform == JPEGXFORM_TRANSVERSE ||
+           xform == JPEGXFORM_ROT_90    || xform == JPEGXFORM_ROT_270);
+}
+
+//
+// Apply a transform to a JPEG image in memory, appending the result to out.
+// The entropy coding mode of the source is kept (progressive stays
+// progressive), Huffman tables are optimized for the new coefficient order,
+// and all markers are carried over.
+//
+bool JPEGTransform_Memory(const uint8_t *src, size_t srcSize, CxMemFile &out,
+                          const jpegtransform_t &transform, std::string &errorMsg)
+{
+   struct jpeg_decompress_struct srcinfo = {};
+   struct jpeg_compress_struct   dstinfo = {};
+   jpegxformerror_t              jerr;
+   jpeg_transform_info           xinfo = {};
+
+   if(srcSize > ULONG_MAX)
+   {
+      errorMsg = "JPEG file is too large to transform";
+      return false;
+   }
+
+   xinfo.transform = JPEGTransform_Code(transform.xform);
+   xinfo.perfect   = FALSE;
+   xinfo.trim      = TRUE;
+   if(transform.crop)
+   {
+      xinfo.crop             = TRUE;
+      xinfo.crop_xoffset     = transform.cropX;
+      xinfo.crop_xoffset_set = JCROP_POS;
+      xinfo.crop_yoffset     = transform.cropY;
+      xinfo.crop_yoffset_set = JCROP_POS;
+      xinfo.crop_width       = transform.cropWidth;
+      xinfo.crop_width_set   = JCROP_POS;
+      xinfo.crop_height      = transform.cropHeight;
+      xinfo.crop_height_set  = JCROP_POS;
+   }
+
+   // both objects share one error handler; whichever fails unwinds both
+   srcinfo.err = dstinfo.err = jpeg_std_error(&jerr.pub);
+   jerr.pub.error_exit = JPEGTransform_ErrorExit;
+   if(setjmp(jerr.setjmpBuffer))
+   {
+      jpeg_destroy_compress(&dstinfo);
+      jpeg_destroy_decompress(&srcinfo);
+      errorMsg = jerr.message;
+      return false;
+   }
+
+   jpeg_create_decompress(&srcinfo);
+   jpeg_create_compress(&dstinfo);
+
+   // read the source header, keeping every marker for the output
+   jpeg_mem_src(&srcinfo, src, static_cast<unsigned long>(srcSize));
+   jcopy_markers_setup(&srcinfo, JCOPYOPT_ALL);
+   jpeg_read_header(&srcinfo, TRUE);
+
+   if(!jtransform_request_workspace(&srcinfo, &xinfo))
+   {
+      jpeg_destroy_compress(&dstinfo);
+      jpeg_destroy_decompress(&srcinfo);
+      errorMsg = "Crop region is outside the image";
+      return false;
+   }
+
+   // read the coefficients and set up the destination to match
+   jvirt_barray_ptr *srcCoefs = jpeg_read_coefficients(&srcinfo);
+   jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
+   jvirt_barray_ptr *dstCoefs = jtransform_adjust_parameters(&srcinfo, &dstinfo, srcCoefs, &xinfo);
+
+   // transupp leaves the JFIF density alone
+   if(JPEGTransform_SwapsAxes(transform.xform))
+   {
+      UINT16 density = dstinfo.X_density;
+      dstinfo.X_density = dstinfo.Y_density;
+      dstinfo.Y_density = density;
+   }
+
+   dstinfo.optimize_coding = TRUE;
+   if(srcinfo.progressive_mode)
+      jpeg_simple_progression(&dstinfo);
+
+   // write the transformed coefficients
+   BitmapImage_JPEGMemFileDest(&dstinfo, &out);
+   jpeg_write_coefficients(&dstinfo, dstCoefs);
+   jcopy_markers_execute(&srcinfo, &dstinfo, JCOPYOPT_ALL);
+   jtransform_execute_transform(&srcinfo, &dstinfo, srcCoefs, &xinfo);
+
+   jpeg_finish_compress(&dstinfo);
+   jpeg_destroy_compress(&dstinfo);
+   jpeg_finish_decompress(&srcinfo);
+   jpeg_destroy_decompress(&srcinfo);
+
+   return true;
+}
+
+//=============================================================================
+//
+// Files
+//
+
+//
+// Write a memory file out with a single write, removing it on failure.
+//
+static bool JPEGTransform_WriteFile(const std::string &path, CxMemFile &mem)
+{
+   HANDLE hFile = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+   if(hFile == INVALID_HANDLE_VALUE)
+      return false;
+
+   DWORD size    = DWORD(mem.size());
+   DWORD written = 0;
+   BOOL  ok      = WriteFile(hFile, mem.getBuffer(false), size, &written, nullptr) && written == size;
+
+   if(!CloseHandle(hFile))
+      ok = FALSE;
+
+   if(!ok)
+      DeleteFileA(path.c_str());
+
+   return ok != FALSE;
+}
+
+//
+// Name of the file a transformed page is staged in before it replaces the
+// original. It must not end in .jpg, so that a reader never mistakes a
+// leftover for a page.
+//
+static std::string JPEGTransform_StagingPath(const std::string &path)
+{
+   return path + ".xform";
+}
+
+//
+// Transform one file into its staging file.
+//
+static bool JPEGTransform_StageFile(const std::string &path, const jpegtransform_t &transform, std::string &errorMsg)
+{
+   MappedFile src;
+   if(!src.open(path.c_str()))
+   {
+      errorMsg = "Cannot read " + path + ".";
+      return false;
+   }
+
+   CxMemFile out;
+   if(!out.open() || !out.reserve(uint32_t(src.size() + src.size() / 8)))
+   {
+      errorMsg = "Out of memory transforming " + path + ".";
+      return false;
+   }
+
+   if(!JPEGTransform_Memory(src.data(), src.size(), out, transform, errorMsg))
+   {
+      errorMsg = path + ": " + errorMsg;
+      return false;
+   }
+
+   if(!JPEGTransform_WriteFile(JPEGTransform_StagingPath(path), out))
+   {
+      errorMsg = "Cannot write transformed copy of " + path + ".";
+      return false;
+   }
+
+   return true;
+}
+
+//
+// Replace a file with its staged copy.
+//
+static bool JPEGTransform_Publish(const std::string &path)
+{
+   return MoveFileExA(JPEGTransform_StagingPath(path).c_str(), path.c_str(),
+                      MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
+//
+// Transform a single JPEG file in place. The original is replaced only once
+// the transformed copy has been written in full. If the file belongs to a
+// document with a manifest, the manifest is brought up to date.
+//
+bool ScanMgr_TransformJPEGFile(const std::string &path, const jpegtransform_t &transform, std::string &errorMsg)
+{
+   if(!JPEGTransform_StageFile(path, transform, errorMsg))
+      return false;
+
+   if(!JPEGTransform_Publish(path))
+   {
+      DeleteFileA(JPEGTransform_StagingPath(path).c_str());
+      errorMsg = "Cannot replace " + path + ".";
+      return false;
+   }
+
+   std::string docPath = FileCache::GetFileSpec(path).first;
+   DocManifest manifest;
+   if(DocManifest_Read(docPath, manifest) && !DocManifest_Rebuild(docPath))
+   {
+      errorMsg = "Cannot update the manifest of " + docPath + ".";
+      return false;
+   }
+
+   return true;
+}
+
+//
+// Transform every page of a document stored in a container. Pages are
+// transformed concurrently into a new container, which replaces the old one
+// only once it is complete.
+//
+static bool JPEGTransform_Container(const std::string &docPath, const jpegtransform_t &transform, std::string &errorMsg)
+{
+   std::string path = FileCache::PathConcatenate(docPath, DOCCONTAINER_FILENAME);
+
+   MappedFile        src;
+   DocContainerIndex index;
+   if(!src.open(path.c_str()) || !DocContainer_ReadIndex(src.data(), src.size(), index))
+   {
+      errorMsg = "Cannot read " + path + ".";
+      return false;
+   }
+
+   DocContainerWriter writer;
+   if(!writer.create(docPath, index.size(), false))
+   {
+      errorMsg = "Cannot create a transformed copy of " + path + ".";
+      return false;
+   }
+
+   std::mutex        errorMutex;
+   std::atomic<bool> failed(false);
+
+   Parallel_For(index.size(), 0, [&] (size_t i) {
+      if(failed)
+         return;
+
+      const doccontainerpage_t &page = index[i];
+      std::string pageError;
+      CxMemFile   out;
+      uint32_t    width = 0, height = 0;
+
+      bool ok = out.open() && out.reserve(uint32_t(page.size + page.size / 8));
+      if(!ok)
+         pageError = "Out of memory transforming " + path + ".";
+      else if(!(ok = JPEGTransform_Memory(src.data() + page.offset, size_t(page.size), out, transform, pageError)))
+         pageError = path + ", page " + std::to_string(i + 1) + ": " + pageError;
+      else
+      {
+         JPEGDecode_GetSize(out.getBuffer(false), size_t(out.size()), width, height);
+         if(!(ok = writer.writePage(i, out.getBuffer(false), size_t(out.size()), width, height)))
+            pageError = "Cannot write transformed copy of " + path + ".";
+      }
+
+      if(!ok)
+      {
+         std::lock_guard<std::mutex> lock(errorMutex);
+         if(!failed.exchange(true))
+            errorMsg = pageError;
+      }
+   });
+
+   if(failed)
+      return false; // the writer deletes the partial copy
+
+   // a mapped file cannot be replaced
+   src.close();
+
+   docmanifestentry_t entry;
+   if(!writer.finish(entry))
+   {
+      errorMsg = "Cannot replace " + path + ".";
+      return false;
+   }
+
+   return true;
+}
+
+//
+// Transform every page of a stored document in place.
+//
+// Pages are transformed concurrently into staging files next to the
+// originals. Only if every page succeeds are the originals replaced, so a
+// failure part way through leaves the document as it was. The document's
+// manifest is then rewritten for the new page files, giving documents that
+// predate manifests one as well. A document stored in a container has its
+// container replaced instead.
+//
+bool ScanMgr_TransformDocument(const std::string &docPath, const jpegtransform_t &transform, std::string &errorMsg)
+{
+   DIR    *dir;
+   dirent *ent;
+   std::set<std::string> filenames;
+   bool hasContainer = false;
+
+   if(!(dir = opendir(docPath.c_str())))
+   {
+      errorMsg = "Cannot open document directory " + docPath + ".";
+      return false;
+   }
+
+   while((ent = readdir(dir)))
+   {
+      std::string lower = LowercaseString(ent->d_name);
+      if(lower.length() > 4 && !lower.compare(lower.length() - 4, 4, ".jpg"))
+         filenames.insert(ent->d_name);
+      else if(lower == DOCCONTAINER_FILENAME)
+         hasContainer = true;
+   }
+
+   closedir(dir);
+
+   if(hasContainer)
+   {
+      if(!JPEGTransform_Container(docPath, transform, errorMsg))
+         return false;
+
+      if(!DocManifest_Rebuild(docPath))
+      {
+         errorMsg = "Cannot update the manifest of " + docPath + ".";
+         return false;
+      }
+      return true;
+   }
+
+   if(filenames.empty())
+   {
+      errorMsg = "No pages found in " + docPath + ".";
+      return false;
+   }
+
+   std::vector<std::string> paths;
+   for(const auto &fn : filenames)
+      paths.push_back(FileCache::PathConcatenate(docPath, fn));
+
+   std::vector<char> staged(paths.size(), 0);
+   std::mutex        errorMutex;
+   std::atomic<bool> failed(false);
+
+   Parallel_For(paths.size(), 0, [&] (size_t i) {
+      if(failed)
+         return;
+
+      std::string pageError;
+      if(JPEGTransform_StageFile(paths[i], transform, pageError))
+         staged[i] = 1;
+      else
+      {
+         std::lock_guard<std::mutex> lock(errorMutex);
+         if(!failed.exchange(true))
+            errorMsg = pageError;
+      }
+   });
+
+   if(failed)
+   {
+      for(size_t i = 0; i < paths.size(); i++)
+      {
+         if(staged[i])
+            DeleteFileA(JPEGTransform_StagingPath(paths[i]).c_str());
+      }
+      return false;
+   }
+
+   for(size_t i = 0; i < paths.size(); i++)
+   {
+      if(!JPEGTransform_Publish(paths[i]))
+      {
+         // pages before this one are already replaced; clean up the rest
+         for(size_t j = i; j < paths.size(); j++)
+            DeleteFileA(JPEGTransform_StagingPath(paths[j]).c_str());
+         errorMsg = "Cannot replace " + paths[i] + "; the document is partially transformed.";
+         return false;
+      }
+   }
+
+   if(!DocManifest_Rebuild(docPath))
+   {
+      errorMsg = "Cannot update the manifest of " + docPath + ".";
+      return false;
+   }
+
+   return true;
+}
+
+// EOF
+
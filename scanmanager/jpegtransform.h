@@ -0,0 +1,51 @@
+/*
+  Scan Manager
+
+  Lossless JPEG transforms
+*/
+
+#ifndef JPEGTRANSFORM_H__
+#define JPEGTRANSFORM_H__
+
+#include <stdint.h>
+#include <string>
+
+class CxMemFile;
+
+// Rotations and flips that can be applied to stored pages without
+// decoding them.
+enum jpegxform_e
+{
+   JPEGXFORM_NONE,
+   JPEGXFORM_FLIP_H,     // mirror left to right
+   JPEGXFORM_FLIP_V,     // mirror top to bottom
+   JPEGXFORM_TRANSPOSE,  // mirror across the top-left to bottom-right diagonal
+   JPEGXFORM_TRANSVERSE, // mirror across the top-right to bottom-left diagonal
+   JPEGXFORM_ROT_90,     // rotate 90 degrees clockwise
+   JPEGXFORM_ROT_180,
+   JPEGXFORM_ROT_270
+};
+
+// A transform request. The crop region, if any, is given in the coordinates
+// of the transformed page; its top-left corner is moved up and left to the
+// nearest JPEG block boundary.
+struct jpegtransform_t
+{
+   jpegxform_e xform;
+   bool        crop;
+   uint32_t    cropX;
+   uint32_t    cropY;
+   uint32_t    cropWidth;
+   uint32_t    cropHeight;
+};
+
+bool JPEGTransform_ParseName(const std::string &name, jpegxform_e &xform);
+bool JPEGTransform_Memory(const uint8_t *src, size_t srcSize, CxMemFile &out,
+                          const jpegtransform_t &transform, std::string &errorMsg);
+bool ScanMgr_TransformJPEGFile(const std::string &path, const jpegtransform_t &transform, std::string &errorMsg);
+bool ScanMgr_TransformDocument(const std::string &docPath, const jpegtransform_t &transform, std::string &errorMsg);
+
+#endif
+
+// EOF
+
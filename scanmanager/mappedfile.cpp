@@ -0,0 +1,190 @@
+/*
+  Scan Manager
+
+  Read-only memory-mapped files
+*/
+
+#include <new>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "mappedfile.h"
+
+MappedFile::MappedFile()
+   : m_pData(nullptr), m_size(0),
+#ifdef _WIN32
+     m_hFile(INVALID_HANDLE_VALUE), m_hMapping(nullptr), m_upBuffer()
+#else
+     m_fd(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+   close();
+}
+
+#ifdef _WIN32
+
+//
+// Check whether a file is on a local fixed disk, where it is safe to map.
+// Anything that cannot be recognised as such, including every UNC path, is
+// taken to be remote.
+//
+static bool MappedFile_IsLocal(const char *path)
+{
+   char  fullPath[MAX_PATH + 1];
+   DWORD len = GetFullPathNameA(path, sizeof(fullPath), fullPath, nullptr);
+   if(!len || len > MAX_PATH || fullPath[1] != ':')
+      return false;
+
+   char root[] = { fullPath[0], ':', '\\', '\0' };
+   UINT type   = GetDriveTypeA(root);
+   return type == DRIVE_FIXED || type == DRIVE_RAMDISK;
+}
+
+//
+// Read the whole of the open file into m_upBuffer.
+//
+bool MappedFile::readAll(size_t size)
+{
+   m_upBuffer.reset(new (std::nothrow) uint8_t [size]);
+   if(!m_upBuffer)
+      return false;
+
+   size_t done = 0;
+   while(done < size)
+   {
+      DWORD chunk = DWORD((size - done < 0x40000000) ? size - done : 0x40000000);
+      DWORD got   = 0;
+      if(!ReadFile(m_hFile, m_upBuffer.get() + done, chunk, &got, nullptr) || !got)
+         return false;
+      done += got;
+   }
+   return true;
+}
+
+//
+// Map a file, or read it in if it is not on a local disk. Empty files cannot
+// be mapped and are reported as a failure.
+//
+bool MappedFile::open(const char *path)
+{
+   close();
+
+   m_hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+   if(m_hFile == INVALID_HANDLE_VALUE)
+      return false;
+
+   LARGE_INTEGER size;
+   if(!GetFileSizeEx(m_hFile, &size) || size.QuadPart <= 0 || uint64_t(size.QuadPart) > SIZE_MAX)
+   {
+      close();
+      return false;
+   }
+
+   if(!MappedFile_IsLocal(path))
+   {
+      if(!readAll(size_t(size.QuadPart)))
+      {
+         close();
+         return false;
+      }
+      m_pData = m_upBuffer.get();
+      m_size  = size_t(size.QuadPart);
+      return true;
+   }
+
+   if(!(m_hMapping = CreateFileMappingA(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr)))
+   {
+      close();
+      return false;
+   }
+
+   if(!(m_pData = static_cast<const uint8_t *>(MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0))))
+   {
+      close();
+      return false;
+   }
+
+   m_size = size_t(size.QuadPart);
+   return true;
+}
+
+//
+// Release the mapping and the file.
+//
+void MappedFile::close()
+{
+   if(m_pData && !m_upBuffer)
+      UnmapViewOfFile(m_pData);
+   m_pData = nullptr;
+   m_upBuffer.reset();
+   m_size  = 0;
+
+   if(m_hMapping)
+      CloseHandle(m_hMapping);
+   m_hMapping = nullptr;
+
+   if(m_hFile != INVALID_HANDLE_VALUE)
+      CloseHandle(m_hFile);
+   m_hFile = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+//
+// Map a file. Empty files cannot be mapped and are reported as a failure.
+//
+bool MappedFile::open(const char *path)
+{
+   close();
+
+   if((m_fd = ::open(path, O_RDONLY)) < 0)
+      return false;
+
+   struct stat st;
+   if(fstat(m_fd, &st) || st.st_size <= 0)
+   {
+      close();
+      return false;
+   }
+
+   void *data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, m_fd, 0);
+   if(data == MAP_FAILED)
+   {
+      close();
+      return false;
+   }
+
+   posix_madvise(data, size_t(st.st_size), POSIX_MADV_SEQUENTIAL);
+
+   m_pData = static_cast<const uint8_t *>(data);
+   m_size  = size_t(st.st_size);
+   return true;
+}
+
+//
+// Release the mapping and the file.
+//
+void MappedFile::close()
+{
+   if(m_pData)
+      munmap(const_cast<uint8_t *>(m_pData), m_size);
+   m_pData = nullptr;
+   m_size  = 0;
+
+   if(m_fd >= 0)
+      ::close(m_fd);
+   m_fd = -1;
+}
+
+#endif
+
+// EOF
+
@@ -0,0 +1,60 @@
+/*
+  Scan Manager
+
+  Read-only memory-mapped files
+*/
+
+#ifndef MAPPEDFILE_H__
+#define MAPPEDFILE_H__
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+
+//
+// Maps a whole file read-only into memory, so that its contents can be
+// handed to a decoder without copying them into a heap buffer first. The
+// mapping is released when the object is closed or destroyed.
+//
+// Only files on local fixed disks are mapped. A file on the share, or on any
+// other drive that can go away, is read into memory instead: an error paging
+// in a mapped file raises EXCEPTION_IN_PAGE_ERROR in whatever code happens to
+// touch the data, which would take the program down where a failed read can
+// simply be reported.
+//
+class MappedFile
+{
+protected:
+   const uint8_t *m_pData;
+   size_t         m_size;
+#ifdef _WIN32
+   HANDLE         m_hFile;
+   HANDLE         m_hMapping;
+   std::unique_ptr<uint8_t []> m_upBuffer; // contents of a file not mapped
+
+   bool readAll(size_t size);
+#else
+   int            m_fd;
+#endif
+
+public:
+   MappedFile();
+   ~MappedFile();
+
+   MappedFile(const MappedFile &) = delete;
+   MappedFile &operator = (const MappedFile &) = delete;
+
+   bool open(const char *path);
+   void close();
+
+   const uint8_t *data() const { return m_pData; }
+   size_t         size() const { return m_size;  }
+};
+
+#endif
+
+// EOF
+
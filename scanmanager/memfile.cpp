@@ -18,6 +18,7 @@ CxMemFile::CxMemFile(uint8_t *pBuffer, uint32_t size)
    m_Size = m_Edge = size;
    m_bFreeOnClose = (pBuffer == nullptr);
    m_bEOF = false;
+   m_nReallocs = 0;
 }
 
 //
@@ -73,6 +74,96 @@ uint8_t* CxMemFile::getBuffer(bool bDetachBuffer)
    return m_pBuffer;
 }
 
+//
+// Take ownership of the backing buffer away from this object. The memory file
+// is left closed and may be reopened. Only a buffer this object allocated
+// itself can be detached; for a caller-supplied buffer an empty pointer is
+// returned.
+//
+CxMemFile::buffer_ptr CxMemFile::detachBuffer(uint32_t *pSize)
+{
+   if(pSize)
+      *pSize = 0;
+
+   if(!m_pBuffer || !m_bFreeOnClose)
+      return buffer_ptr(nullptr, ::free);
+
+   if(pSize)
+      *pSize = m_Size;
+
+   buffer_ptr ret(m_pBuffer, ::free);
+   m_pBuffer  = nullptr;
+   m_Position = m_Edge = 0;
+   m_Size     = 0;
+   m_bEOF     = false;
+
+   return ret;
+}
+
+//
+// Ensure the buffer can hold at least nBytes without further reallocation.
+// Callers that know their final output size should reserve it up front.
+//
+bool CxMemFile::reserve(uint32_t nBytes)
+{
+   if(m_pBuffer == nullptr)
+      return false;
+
+   if(nBytes <= uint32_t(m_Edge))
+      return true;
+
+   uint8_t *pNewBuffer = static_cast<uint8_t *>(realloc(m_pBuffer, nBytes));
+   if(!pNewBuffer)
+      return false;
+
+   ++m_nReallocs;
+   m_pBuffer      = pNewBuffer;
+   m_bFreeOnClose = true;
+   m_Edge         = int32_t(nBytes);
+
+   return true;
+}
+
+//
+// Get direct access to the buffer for producers that write in place, such as
+// a libjpeg destination. Returns a pointer to at least minBytes of writable
+// space at the current position; the total space there is returned in
+// available. Data written to the window is not part of the file until it is
+// committed with commitWrite.
+//
+uint8_t *CxMemFile::writeWindow(uint32_t minBytes, uint32_t &available)
+{
+   available = 0;
+   if(m_pBuffer == nullptr)
+      return nullptr;
+
+   if(uint64_t(m_Position) + minBytes > uint64_t(m_Edge))
+   {
+      if(uint64_t(m_Position) + minBytes > uint64_t(INT32_MAX) || !alloc(m_Position + minBytes))
+         return nullptr;
+   }
+
+   available = uint32_t(m_Edge - m_Position);
+   return m_pBuffer + m_Position;
+}
+
+//
+// Accept nBytes written into the window returned by writeWindow and advance
+// past them.
+//
+bool CxMemFile::commitWrite(uint32_t nBytes)
+{
+   if(m_pBuffer == nullptr || uint64_t(m_Position) + nBytes > uint64_t(m_Edge))
+      return false;
+
+   m_bEOF = false;
+   m_Position += int32_t(nBytes);
+   if(m_Position > int32_t(m_Size))
+      m_Size = m_Position;
+
+   return true;
+}
+
 //
 // Read data from the buffer
 //
@@ -291,23 +382,45 @@ int32_t CxMemFile::scanf(const char *format, void* output)
 //
 // Reallocate the internal backing buffer.
 //
+// Capacity grows geometrically (by half again of the current size, rounded to
+// 64 KB), so filling a buffer one write at a time costs O(log n) reallocations
+// rather than one per 64 KB.
+//
 bool CxMemFile::alloc(uint32_t dwNewLen)
 {
    if(dwNewLen > uint32_t(m_Edge))
    {
+      // buffer positions are signed 32-bit
+      if(dwNewLen > uint32_t(INT32_MAX))
+         return false;
+
       // find new buffer size
-      uint32_t dwNewBufferSize = uint32_t(((dwNewLen >> 16) + 1) << 16);
+      uint64_t qwNewBufferSize = uint64_t(m_Edge) + (uint64_t(m_Edge) >> 1);
+      if(qwNewBufferSize < dwNewLen)
+         qwNewBufferSize = dwNewLen;
+      qwNewBufferSize = ((qwNewBufferSize >> 16) + 1) << 16;
+      if(qwNewBufferSize > uint64_t(INT32_MAX))
+         qwNewBufferSize = uint64_t(INT32_MAX);
+
+      uint32_t dwNewBufferSize = uint32_t(qwNewBufferSize);
 
-      // allocate new buffer
+      // allocate new buffer; on failure the old one is kept intact
+      uint8_t *pNewBuffer;
       if(m_pBuffer == nullptr) 
-         m_pBuffer = static_cast<uint8_t *>(malloc(dwNewBufferSize));
+         pNewBuffer = static_cast<uint8_t *>(malloc(dwNewBufferSize));
       else
-         m_pBuffer = static_cast<uint8_t *>(realloc(m_pBuffer, dwNewBufferSize));
+         pNewBuffer = static_cast<uint8_t *>(realloc(m_pBuffer, dwNewBufferSize));
+
+      if(pNewBuffer == nullptr)
+         return false;
+
+      ++m_nReallocs;
+      m_pBuffer = pNewBuffer;
 
       // I own this buffer now (caller knows nothing about it)
       m_bFreeOnClose = true;
 
-      m_Edge = dwNewBufferSize;
+      m_Edge = int32_t(dwNewBufferSize);
    }
 
    return (m_pBuffer != nullptr);
@@ -7,6 +7,8 @@
 #define MEMFILE_H__
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <memory>
 
 class CxMemFile
 {
@@ -20,13 +22,24 @@ protected:
    int32_t   m_Position;     // current position
    int32_t   m_Edge;         // buffer size
    bool      m_bEOF;
+   uint32_t  m_nReallocs;    // number of times the buffer was (re)allocated
 
 public:
+   // Owning pointer to a detached buffer; it was obtained from malloc.
+   typedef std::unique_ptr<uint8_t, void (*)(void *)> buffer_ptr;
+
    CxMemFile(uint8_t* pBuffer = nullptr, uint32_t size = 0);
    virtual ~CxMemFile();
 
    bool open();
    uint8_t *getBuffer(bool bDetachBuffer = true);
+   buffer_ptr detachBuffer(uint32_t *pSize = nullptr);
+   bool reserve(uint32_t nBytes);
+   uint8_t *writeWindow(uint32_t minBytes, uint32_t &available);
+   bool commitWrite(uint32_t nBytes);
+
+   uint32_t capacity()      const { return uint32_t(m_Edge); }
+   uint32_t reallocCount()  const { return m_nReallocs;      }
 
    virtual bool     close();
    virtual size_t   read(void *buffer, size_t size, size_t count);
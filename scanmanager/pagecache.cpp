@@ -0,0 +1,169 @@
+/*
+  Scan Manager
+
+  Decoded page cache
+
+  Holding every page of a long document decoded at once can exhaust the
+  address space of a 32-bit process. Only the pages around the one on screen
+  and those seen most recently are kept; the rest are dropped back to their
+  JPEG files and decoded again if the user returns to them.
+*/
+
+#include <string.h>
+#include "inifile.h"
+#include "pagecache.h"
+#include "util.h"
+
+#define PAGECACHE_SECTION "pagecache"
+
+// Default budget. A 32-bit build has to share 2 GB with GDI+ and everything
+// else; a 64-bit build can afford to hold a good deal more.
+#if defined(_WIN64) || defined(__LP64__)
+#define PAGECACHE_DEFAULTMB 1024
+#else
+#define PAGECACHE_DEFAULTMB 256
+#endif
+
+// Default number of pages either side of the current one to load ahead
+#define PAGECACHE_DEFAULTPREFETCH 2
+
+PageCache::PageCache()
+   : m_entries(), m_budget(0), m_clock(0)
+{
+   memset(&m_stats, 0, sizeof(m_stats));
+}
+
+//
+// Start over for a document of numPages pages, none of them held.
+//
+void PageCache::reset(size_t numPages, uint64_t budget)
+{
+   m_entries.assign(numPages, entry_t { false, 0, 0 });
+   m_budget = budget;
+   m_clock  = 0;
+   memset(&m_stats, 0, sizeof(m_stats));
+}
+
+//
+// A page is being shown. Counts a hit if it is held, or a miss if it still
+// has to be loaded, and makes it the most recently used either way.
+//
+bool PageCache::touch(size_t page)
+{
+   if(page >= m_entries.size())
+      return false;
+
+   entry_t &entry = m_entries[page];
+   entry.lastUse = ++m_clock;
+
+   if(entry.resident)
+      ++m_stats.hits;
+   else
+      ++m_stats.misses;
+
+   return entry.resident;
+}
+
+//
+// A page has been decoded and is now held, taking up the given bytes.
+//
+void PageCache::insert(size_t page, uint64_t bytes)
+{
+   if(page >= m_entries.size() || m_entries[page].resident)
+      return;
+
+   entry_t &entry = m_entries[page];
+   entry.resident = true;
+   entry.bytes    = bytes;
+   if(!entry.lastUse)
+      entry.lastUse = ++m_clock; // prefetched; not yet seen
+
+   m_stats.bytes += bytes;
+   if(m_stats.bytes > m_stats.peakBytes)
+      m_stats.peakBytes = m_stats.bytes;
+}
+
+//
+// Choose pages to drop, least recently used first, until the pages held fit
+// the budget. Pages keepFirst through keepLast are never chosen, so that the
+// pages being loaded ahead are not thrown away as soon as they arrive; if
+// they alone exceed the budget, it is overrun until the user moves on. The
+// chosen pages are no longer counted as held.
+//
+void PageCache::evict(size_t keepFirst, size_t keepLast, std::vector<size_t> &evicted)
+{
+   while(m_stats.bytes > m_budget)
+   {
+      size_t   victim  = m_entries.size();
+      uint64_t oldest  = UINT64_MAX;
+
+      for(size_t i = 0; i < m_entries.size(); i++)
+      {
+         const entry_t &entry = m_entries[i];
+         if(!entry.resident || (i >= keepFirst && i <= keepLast))
+            continue;
+         if(entry.lastUse < oldest)
+         {
+            victim = i;
+            oldest = entry.lastUse;
+         }
+      }
+
+      if(victim == m_entries.size())
+         break;
+
+      entry_t &entry = m_entries[victim];
+      entry.resident = false;
+      m_stats.bytes -= entry.bytes;
+      entry.bytes    = 0;
+      ++m_stats.evictions;
+
+      evicted.push_back(victim);
+   }
+}
+
+//=============================================================================
+//
+// Configuration
+//
+// [pagecache]
+// budgetmb=256
+// prefetch=2
+//
+
+static bool PageCache_GetIniInt(const char *key, int &value)
+{
+   std::string str;
+   if(!IniFile::GetIniValue(PAGECACHE_SECTION, key, str) || !IsInt(str))
+      return false;
+
+   value = StringToInt(str);
+   return true;
+}
+
+//
+// Get the number of bytes of decoded pages to hold at most.
+//
+uint64_t PageCache_BudgetFromIni()
+{
+   int mb;
+   if(!PageCache_GetIniInt("budgetmb", mb) || mb < 16)
+      mb = PAGECACHE_DEFAULTMB;
+
+   return uint64_t(mb) << 20;
+}
+
+//
+// Get the number of pages either side of the current one to load ahead.
+//
+size_t PageCache_PrefetchFromIni()
+{
+   int pages;
+   if(!PageCache_GetIniInt("prefetch", pages) || pages < 0)
+      pages = PAGECACHE_DEFAULTPREFETCH;
+
+   return size_t(pages);
+}
+
+// EOF
+
@@ -0,0 +1,65 @@
+/*
+  Scan Manager
+
+  Decoded page cache
+*/
+
+#ifndef PAGECACHE_H__
+#define PAGECACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+//
+// Counters for tuning the page cache budget.
+//
+struct pagecachestats_t
+{
+   uint64_t hits;      // page was decoded when it was shown
+   uint64_t misses;    // page had to be loaded before it could be shown
+   uint64_t evictions; // pages dropped to stay within the budget
+   uint64_t bytes;     // bytes of decoded pages held now
+   uint64_t peakBytes; // most bytes held at once
+};
+
+//
+// Keeps account of which pages of a document are held decoded, and picks the
+// least recently used ones to drop when their total size goes over a byte
+// budget. The cache owns no bitmaps itself; the caller frees the pages it is
+// told to evict and can have them decoded again from their files on demand.
+//
+class PageCache
+{
+protected:
+   struct entry_t
+   {
+      bool     resident;
+      uint64_t bytes;
+      uint64_t lastUse;
+   };
+
+   std::vector<entry_t> m_entries;
+   uint64_t             m_budget;
+   uint64_t             m_clock;
+   pagecachestats_t     m_stats;
+
+public:
+   PageCache();
+
+   void reset(size_t numPages, uint64_t budget);
+   bool touch(size_t page);
+   void insert(size_t page, uint64_t bytes);
+   void evict(size_t keepFirst, size_t keepLast, std::vector<size_t> &evicted);
+
+   uint64_t                getBudget() const { return m_budget; }
+   const pagecachestats_t &getStats()  const { return m_stats;  }
+};
+
+uint64_t PageCache_BudgetFromIni();
+size_t   PageCache_PrefetchFromIni();
+
+#endif
+
+// EOF
+
@@ -0,0 +1,243 @@
+/*
+  Scan Manager
+
+  Background document page loader
+
+  Opening a document used to read and decode every page before the first
+  one could be shown. The loader instead hands pages to a few worker threads
+  in order of distance from the page on screen, so page 1 appears as soon as
+  it alone has been fetched, and the pages the user is about to turn to are
+  normally ready before they are asked for. Pages further away are left on
+  disk until the user gets near them.
+*/
+
+#include <Windows.h>
+#include <gdiplus.h>
+#include <system_error>
+#include "cached_files.h"
+#include "docread.h"
+#include "pageloader.h"
+#include "parallel.h"
+#include "viewcache.h"
+
+// Bounds on the number of loader threads. Loading is as much waiting on the
+// file share as decoding, so even a single core benefits from a second
+// thread; past a handful the share becomes the bottleneck.
+#define PAGELOADER_MINTHREADS 2
+#define PAGELOADER_MAXTHREADS 6
+
+PageLoader::PageLoader()
+   : m_docPath(), m_pages(), m_cache(nullptr), m_containerPath(), m_threads(), m_mutex(), m_wake(), m_focus(0), m_radius(0), m_stopping(false),
+     m_maxWidth(0), m_maxHeight(0), m_hNotifyWnd(nullptr), m_notifyMsg(0)
+{
+}
+
+PageLoader::~PageLoader()
+{
+   stop();
+}
+
+//
+// Pick the unloaded page within range that is nearest the focus and mark it
+// as loading. Pages ahead of the focus are preferred over those behind it,
+// since documents are mostly read forward. Call with m_mutex held.
+//
+bool PageLoader::nextPage(size_t &page)
+{
+   size_t best     = m_pages.size();
+   size_t bestCost = SIZE_MAX;
+
+   for(size_t i = 0; i < m_pages.size(); i++)
+   {
+      if(m_pages[i].state != PAGE_IDLE)
+         continue;
+
+      size_t distance = (i >= m_focus) ? i - m_focus : m_focus - i;
+      if(distance > m_radius)
+         continue;
+
+      size_t cost = (i >= m_focus) ? 2 * distance : 2 * distance + 1;
+      if(cost < bestCost)
+      {
+         best     = i;
+         bestCost = cost;
+      }
+   }
+
+   if(best == m_pages.size())
+      return false;
+
+   m_pages[best].state = PAGE_LOADING;
+   page = best;
+   return true;
+}
+
+//
+// Worker thread body: load pages as they come into range until the loader
+// stops.
+//
+void PageLoader::workerLoop()
+{
+   std::unique_lock<std::mutex> lock(m_mutex);
+
+   size_t page;
+   for(;;)
+   {
+      m_wake.wait(lock, [&] { return m_stopping || nextPage(page); });
+      if(m_stopping)
+         break;
+
+      docmanifestentry_t file = m_pages[page].file;
+
+      lock.unlock();
+      std::string path;
+      if(DocManifest_IsContainer(file.name) && !m_containerPath.empty())
+         path = m_containerPath;
+      else
+      {
+         path = FileCache::PathConcatenate(m_docPath, file.name);
+         if(m_cache)
+            m_cache->fetch(m_docPath, file, path); // else read from the share
+      }
+      Gdiplus::Bitmap *bitmap = ScanMgr_ReadDocumentPage(path, page, m_maxWidth, m_maxHeight);
+      lock.lock();
+
+      if(m_stopping)
+      {
+         delete bitmap;
+         break;
+      }
+
+      m_pages[page].bitmap = bitmap;
+      m_pages[page].state  = bitmap ? PAGE_DONE : PAGE_FAILED;
+      PostMessage(m_hNotifyWnd, m_notifyMsg, WPARAM(page), LPARAM(bitmap ? 0 : 1));
+   }
+}
+
+//
+// Begin loading the given pages of the document in docPath in the
+// background, starting with the first radius + 1 pages. Pages are decoded no
+// larger than needed to be shown within maxWidth x maxHeight (0 for full
+// resolution). If cache is not null, files are read from local copies kept
+// there. Pages stored in a container are all read from containerPath, which
+// should be a local copy fetched beforehand: fetching the container on each
+// worker would copy the whole document several times over before page 1
+// could be shown. Any previous load is stopped first.
+//
+bool PageLoader::start(const std::string &docPath, const DocManifest &pages, ViewCache *cache,
+                       const std::string &containerPath, uint32_t maxWidth, uint32_t maxHeight, size_t radius,
+                       HWND hNotifyWnd, UINT notifyMsg)
+{
+   stop();
+
+   m_docPath       = docPath;
+   m_cache         = cache;
+   m_containerPath = containerPath;
+   m_pages.clear();
+   for(const auto &file : pages)
+      m_pages.push_back({ file, PAGE_IDLE, nullptr });
+
+   m_focus      = 0;
+   m_radius     = radius;
+   m_stopping   = false;
+   m_maxWidth   = maxWidth;
+   m_maxHeight  = maxHeight;
+   m_hNotifyWnd = hNotifyWnd;
+   m_notifyMsg  = notifyMsg;
+
+   size_t numThreads = Parallel_NumCores();
+   if(numThreads < PAGELOADER_MINTHREADS)
+      numThreads = PAGELOADER_MINTHREADS;
+   if(numThreads > PAGELOADER_MAXTHREADS)
+      numThreads = PAGELOADER_MAXTHREADS;
+   if(numThreads > m_pages.size())
+      numThreads = m_pages.size();
+
+   for(size_t t = 0; t < numThreads; t++)
+   {
+      try
+      {
+         m_threads.emplace_back(&PageLoader::workerLoop, this);
+      }
+      catch(const std::system_error &)
+      {
+         break; // carry on with the threads we have
+      }
+   }
+
+   return !m_threads.empty() || m_pages.empty();
+}
+
+//
+// Stop loading and free any pages that were never collected. Pages already
+// being read are finished and discarded.
+//
+void PageLoader::stop()
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+   }
+   m_wake.notify_all();
+
+   for(auto &thread : m_threads)
+      thread.join();
+   m_threads.clear();
+
+   for(auto &page : m_pages)
+   {
+      if(page.state == PAGE_DONE)
+         delete page.bitmap;
+      page.bitmap = nullptr;
+      page.state  = PAGE_TAKEN;
+   }
+}
+
+//
+// Tell the loader which page is on screen; the pages around it are loaded
+// next.
+//
+void PageLoader::setFocus(size_t page)
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_focus = page;
+   }
+   m_wake.notify_all();
+}
+
+//
+// The UI has dropped a page it took; load it again if it comes back into
+// range.
+//
+void PageLoader::release(size_t page)
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(page >= m_pages.size() || m_pages[page].state != PAGE_TAKEN)
+         return;
+      m_pages[page].state = PAGE_IDLE;
+   }
+   m_wake.notify_all();
+}
+
+//
+// Collect a finished page. The caller takes ownership of the bitmap. Returns
+// nullptr if the page is not ready, failed, or was already taken.
+//
+Gdiplus::Bitmap *PageLoader::takePage(size_t page)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   if(page >= m_pages.size() || m_pages[page].state != PAGE_DONE)
+      return nullptr;
+
+   Gdiplus::Bitmap *bitmap = m_pages[page].bitmap;
+   m_pages[page].bitmap = nullptr;
+   m_pages[page].state  = PAGE_TAKEN;
+
+   return bitmap;
+}
+
+// EOF
+
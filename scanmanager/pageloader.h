@@ -0,0 +1,90 @@
+/*
+  Scan Manager
+
+  Background document page loader
+*/
+
+#ifndef PAGELOADER_H__
+#define PAGELOADER_H__
+
+#include <Windows.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "docmanifest.h"
+
+class ViewCache;
+
+namespace Gdiplus
+{
+   class Bitmap;
+}
+
+//
+// Loads the pages of a stored document on worker threads, nearest to the
+// page being viewed first. Only pages within a prefetch radius of that page
+// are loaded. Each finished page is announced by posting notifyMsg to the
+// notify window with the page index in wParam and a non-zero lParam if the
+// page failed; the UI thread then collects it with takePage. A page the UI
+// later drops is handed back with release, and is loaded again when it
+// comes back into range. Files are read through the view cache, if given.
+// A document stored in a container is fetched once by the caller, before
+// the loader starts, and every worker reads its pages from that one copy.
+//
+class PageLoader
+{
+protected:
+   enum pagestate_e
+   {
+      PAGE_IDLE,    // not loaded
+      PAGE_LOADING, // being read by a worker
+      PAGE_DONE,    // loaded, waiting to be taken
+      PAGE_FAILED,  // could not be loaded; not tried again
+      PAGE_TAKEN    // owned by the UI
+   };
+
+   struct page_t
+   {
+      docmanifestentry_t file;
+      pagestate_e        state;
+      Gdiplus::Bitmap   *bitmap;
+   };
+
+   std::string              m_docPath;
+   std::vector<page_t>      m_pages;
+   ViewCache               *m_cache;
+   std::string              m_containerPath; // where to read a container from
+   std::vector<std::thread> m_threads;
+   std::mutex               m_mutex;
+   std::condition_variable  m_wake;
+   size_t                   m_focus;     // page the user is looking at
+   size_t                   m_radius;    // pages either side of the focus to load
+   bool                     m_stopping;
+   uint32_t                 m_maxWidth;
+   uint32_t                 m_maxHeight;
+   HWND                     m_hNotifyWnd;
+   UINT                     m_notifyMsg;
+
+   bool nextPage(size_t &page);
+   void workerLoop();
+
+public:
+   PageLoader();
+   ~PageLoader();
+
+   bool start(const std::string &docPath, const DocManifest &pages, ViewCache *cache,
+              const std::string &containerPath, uint32_t maxWidth, uint32_t maxHeight, size_t radius,
+              HWND hNotifyWnd, UINT notifyMsg);
+   void stop();
+   void setFocus(size_t page);
+   void release(size_t page);
+   Gdiplus::Bitmap *takePage(size_t page);
+};
+
+#endif
+
+// EOF
+
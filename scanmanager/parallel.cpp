@@ -0,0 +1,60 @@
+/*
+  Scan Manager
+
+  Simple data-parallel helpers
+*/
+
+#include <atomic>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "parallel.h"
+
+//
+// Number of hardware threads, never less than one.
+//
+unsigned Parallel_NumCores()
+{
+   unsigned cores = std::thread::hardware_concurrency();
+   return cores ? cores : 1;
+}
+
+//
+// Run fn over [0, count) on a set of short-lived worker threads.
+//
+void Parallel_For(size_t count, unsigned maxThreads, const std::function<void (size_t)> &fn)
+{
+   if(!count)
+      return;
+
+   size_t numThreads = maxThreads ? maxThreads : Parallel_NumCores();
+   if(numThreads > count)
+      numThreads = count;
+
+   std::atomic<size_t> next(0);
+   auto worker = [&] () {
+      size_t i;
+      while((i = next++) < count)
+         fn(i);
+   };
+
+   std::vector<std::thread> threads;
+   for(size_t t = 1; t < numThreads; t++)
+   {
+      try
+      {
+         threads.emplace_back(worker);
+      }
+      catch(const std::system_error &)
+      {
+         break; // carry on with the threads we have
+      }
+   }
+
+   worker();
+
+   for(auto &thread : threads)
+      thread.join();
+}
+
+// EOF
@@ -0,0 +1,22 @@
+/*
+  Scan Manager
+
+  Simple data-parallel helpers
+*/
+
+#ifndef PARALLEL_H__
+#define PARALLEL_H__
+
+#include <stddef.h>
+#include <functional>
+
+unsigned Parallel_NumCores();
+
+// Call fn(i) for every i in [0, count) on up to maxThreads threads, one of
+// which is the calling thread. Indices are handed out in increasing order.
+// A maxThreads of 0 means one thread per core. fn must not throw.
+void Parallel_For(size_t count, unsigned maxThreads, const std::function<void (size_t)> &fn);
+
+#endif
+
+// EOF
@@ -0,0 +1,439 @@
+/*
+  Scan Manager
+
+  Pixel format conversion kernels
+*/
+
+#include "cpufeatures.h"
+#include "pixconv.h"
+
+#if defined(SCANMGR_X86)
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+// Number of pixels unpacked to indices per step by the 1- and 4-bit wrappers;
+// a multiple of 8 so that every chunk starts on a source byte boundary.
+#define PIXCONV_CHUNK 512
+
+//=============================================================================
+//
+// Scalar kernels
+//
+
+static void SwapRB24_Scalar(const uint8_t *src, uint8_t *dst, uint32_t count)
+{
+   for(uint32_t x = 0; x < count; x++, src += 3, dst += 3)
+   {
+      dst[0] = src[2];
+      dst[1] = src[1];
+      dst[2] = src[0];
+   }
+}
+
+//
+// Every pixel but the last is written as a 4-byte store whose fourth byte is
+// overwritten by the following pixel.
+//
+static void Pal8To24_Scalar(const uint8_t *src, uint8_t *dst, uint32_t count, const uint32_t *pal)
+{
+   if(!count)
+      return;
+
+   for(uint32_t x = 0; x < count - 1; x++, dst += 3)
+      memcpy(dst, &pal[src[x]], 4);
+
+   memcpy(dst, &pal[src[count - 1]], 3);
+}
+
+//
+// Expand 1-bit pixels to c0 or c1; unpacking to indices is the case c0 = 0,
+// c1 = 1.
+//
+static void Mono1To8_Scalar(const uint8_t *src, uint8_t *dst, uint32_t count, uint8_t c0, uint8_t c1)
+{
+   const uint8_t lut[2] = { c0, c1 };
+   uint32_t x = 0;
+
+   for(; x + 8 <= count; x += 8, dst += 8)
+   {
+      const uint8_t b = *src++;
+      dst[0] = lut[(b >> 7) & 1];
+      dst[1] = lut[(b >> 6) & 1];
+      dst[2] = lut[(b >> 5) & 1];
+      dst[3] = lut[(b >> 4) & 1];
+      dst[4] = lut[(b >> 3) & 1];
+      dst[5] = lut[(b >> 2) & 1];
+      dst[6] = lut[(b >> 1) & 1];
+      dst[7] = lut[ b       & 1];
+   }
+
+   for(uint32_t bit = 7; x < count; x++, bit--)
+      *dst++ = lut[(*src >> bit) & 1];
+}
+
+static void Unpack1To8_Scalar(const uint8_t *src, uint8_t *dst, uint32_t count)
+{
+   Mono1To8_Scalar(src, dst, count, 0, 1);
+}
+
+static void Unpack4To8_Scalar(const uint8_t *src, uint8_t *dst, uint32_t count)
+{
+   uint32_t x = 0;
+
+   for(; x + 2 <= count; x += 2, dst += 2)
+   {
+      const uint8_t b = *src++;
+      dst[0] = b >> 4;
+      dst[1] = b & 0x0F;
+   }
+
+   if(x < count)
+      *dst = *src >> 4;
+}
+
+#if defined(SCANMGR_X86)
+
+//=============================================================================
+//
+// SSE2 kernels
+//
+
+//
+// SSE2 has no byte shuffle, so pixels are swizzled with whole-register byte
+// shifts. Each step converts the first 15 bytes (5 pixels) of a 16-byte load;
+// the 16th byte stored is garbage that the next step or the tail rewrites.
+//
+static void SwapRB24_SSE2(const uint8_t *src, uint8_t *dst, uint32_t count)
+{
+   const __m128i keepMask = _mm_setr_epi8(0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0);
+   const __m128i fromHigh = _mm_setr_epi8(-1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, 0);
+   const __m128i fromLow  = _mm_setr_epi8(0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0);
+
+   uint32_t x = 0;
+
+   for(; x + 6 <= count; x += 5, src += 15, dst += 15)
+   {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+      __m128i out = _mm_and_si128(v, keepMask);
+      out = _mm_or_si128(out, _mm_and_si128(_mm_srli_si128(v, 2), fromHigh));
+      out = _mm_or_si128(out, _mm_and_si128(_mm_slli_si128(v, 2), fromLow));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), out);
+   }
+
+   SwapRB24_Scalar(src, dst, count - x);
+}
+
+//
+// Convert one register of byte-sized bit masks into c0/c1 bytes; diff holds
+// c0 ^ c1.
+//
+static inline void Mono1To8_Store_SSE2(uint8_t *dst, __m128i bytes, __m128i bitMask, __m128i c0, __m128i diff)
+{
+   const __m128i set = _mm_cmpeq_epi8(_mm_and_si128(bytes, bitMask), bitMask);
+   _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_xor_si128(c0, _mm_and_si128(set, diff)));
+}
+
+//
+// Each source byte is replicated into eight lanes and tested against the
+// per-lane bit it represents. 16 source bytes produce 128 pixels per step.
+//
+static void Mono1To8_SSE2(const uint8_t *src, uint8_t *dst, uint32_t count, uint8_t c0, uint8_t c1)
+{
+   const __m128i bitMask = _mm_setr_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+   const __m128i fill0   = _mm_set1_epi8(char(c0));
+   const __m128i diff    = _mm_set1_epi8(char(c0 ^ c1));
+
+   uint32_t x = 0;
+
+   for(; x + 128 <= count; x += 128, src += 16, dst += 128)
+   {
+      const __m128i v  = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+      const __m128i lo = _mm_unpacklo_epi8(v, v);   // bytes 0-7, doubled
+      const __m128i hi = _mm_unpackhi_epi8(v, v);   // bytes 8-15, doubled
+      const __m128i q[4] =
+      {
+         _mm_unpacklo_epi16(lo, lo), _mm_unpackhi_epi16(lo, lo),
+         _mm_unpacklo_epi16(hi, hi), _mm_unpackhi_epi16(hi, hi)
+      };
+
+      for(int i = 0; i < 4; i++)
+      {
+         Mono1To8_Store_SSE2(dst + i * 32,      _mm_unpacklo_epi32(q[i], q[i]), bitMask, fill0, diff);
+         Mono1To8_Store_SSE2(dst + i * 32 + 16, _mm_unpackhi_epi32(q[i], q[i]), bitMask, fill0, diff);
+      }
+   }
+
+   Mono1To8_Scalar(src, dst, count - x, c0, c1);
+}
+
+static void Unpack1To8_SSE2(const uint8_t *src, uint8_t *dst, uint32_t count)
+{
+   Mono1To8_SSE2(src, dst, count, 0, 1);
+}
+
+//
+// Split 16 source bytes into high and low nibbles and interleave them back
+// into 32 indices per step.
+//
+static void Unpack4To8_SSE2(const uint8_t *src, uint8_t *dst, uint32_t count)
+{
+   const __m128i nibble = _mm_set1_epi8(0x0F);
+
+   uint32_t x = 0;
+
+   for(; x + 32 <= count; x += 32, src += 16, dst += 32)
+   {
+      const __m128i v  = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+      const __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+      const __m128i lo = _mm_and_si128(v, nibble);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst),      _mm_unpacklo_epi8(hi, lo));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 16), _mm_unpackhi_epi8(hi, lo));
+   }
+
+   Unpack4To8_Scalar(src, dst, count - x);
+}
+
+//=============================================================================
+//
+// AVX2 kernels
+//
+
+//
+// Store the low 12 bytes of each 128-bit lane back-to-back. Both stores are
+// 16 bytes wide, so 28 bytes must be writable at dst.
+//
+SCANMGR_TARGET_AVX2
+static inline void Store2x12_AVX2(uint8_t *dst, __m256i v)
+{
+   _mm_storeu_si128(reinterpret_cast<__m128i *>(dst),      _mm256_castsi256_si128(v));
+   _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 12), _mm256_extracti128_si256(v, 1));
+}
+
+//
+// Two 4-pixel groups are loaded into the two lanes and swizzled with one
+// byte shuffle; 8 pixels per step.
+//
+SCANMGR_TARGET_AVX2
+static void SwapRB24_AVX2(const uint8_t *src, uint8_t *dst, uint32_t count)
+{
+   const __m256i shuf = _mm256_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1,
+                                         2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1);
+   uint32_t x = 0;
+
+   for(; x + 10 <= count; x += 8, src += 24, dst += 24)
+   {
+      const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+      const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 12));
+      const __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(a), b, 1);
+      Store2x12_AVX2(dst, _mm256_shuffle_epi8(v, shuf));
+   }
+
+   SwapRB24_Scalar(src, dst, count - x);
+}
+
+//
+// Eight palette entries are fetched with one gather and packed down to 24
+// bytes.
+//
+SCANMGR_TARGET_AVX2
+static void Pal8To24_AVX2(const uint8_t *src, uint8_t *dst, uint32_t count, const uint32_t *pal)
+{
+   const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                         0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+   const int *ipal = reinterpret_cast<const int *>(pal);
+
+   uint32_t x = 0;
+
+   for(; x + 10 <= count; x += 8, src += 8, dst += 24)
+   {
+      const __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src)));
+      const __m256i rgb = _mm256_i32gather_epi32(ipal, idx, 4);
+      Store2x12_AVX2(dst, _mm256_shuffle_epi8(rgb, pack));
+   }
+
+   Pal8To24_Scalar(src, dst, count - x, pal);
+}
+
+//
+// Four source bytes are broadcast and each is spread over eight lanes with a
+// byte shuffle; 32 pixels per step.
+//
+SCANMGR_TARGET_AVX2
+static void Mono1To8_AVX2(const uint8_t *src, uint8_t *dst, uint32_t count, uint8_t c0, uint8_t c1)
+{
+   const __m256i spread  = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+   const __m256i bitMask = _mm256_setr_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1,
+                                            -128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+   const __m256i fill0   = _mm256_set1_epi8(char(c0));
+   const __m256i diff    = _mm256_set1_epi8(char(c0 ^ c1));
+
+   uint32_t x = 0;
+
+   for(; x + 32 <= count; x += 32, src += 4, dst += 32)
+   {
+      int32_t bits;
+      memcpy(&bits, src, sizeof(bits));
+
+      const __m256i v   = _mm256_shuffle_epi8(_mm256_set1_epi32(bits), spread);
+      const __m256i set = _mm256_cmpeq_epi8(_mm256_and_si256(v, bitMask), bitMask);
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), _mm256_xor_si256(fill0, _mm256_and_si256(set, diff)));
+   }
+
+   Mono1To8_Scalar(src, dst, count - x, c0, c1);
+}
+
+SCANMGR_TARGET_AVX2
+static void Unpack1To8_AVX2(const uint8_t *src, uint8_t *dst, uint32_t count)
+{
+   Mono1To8_AVX2(src, dst, count, 0, 1);
+}
+
+#endif // SCANMGR_X86
+
+//=============================================================================
+//
+// Kernel selection
+//
+
+static const pixconv_t pixConvScalar =
+{
+   "scalar",
+   SwapRB24_Scalar,
+   Pal8To24_Scalar,
+   Unpack1To8_Scalar,
+   Unpack4To8_Scalar,
+   Mono1To8_Scalar
+};
+
+#if defined(SCANMGR_X86)
+
+// SSE2 has no gather, so palette expansion stays on the scalar 4-byte store
+// path.
+static const pixconv_t pixConvSSE2 =
+{
+   "SSE2",
+   SwapRB24_SSE2,
+   Pal8To24_Scalar,
+   Unpack1To8_SSE2,
+   Unpack4To8_SSE2,
+   Mono1To8_SSE2
+};
+
+// Nibble unpacking is already bound by memory at SSE2 width.
+static const pixconv_t pixConvAVX2 =
+{
+   "AVX2",
+   SwapRB24_AVX2,
+   Pal8To24_AVX2,
+   Unpack1To8_AVX2,
+   Unpack4To8_SSE2,
+   Mono1To8_AVX2
+};
+
+#endif
+
+static const pixconv_t &PixConv_Select()
+{
+#if defined(SCANMGR_X86)
+   if(CPU_HasAVX2())
+      return pixConvAVX2;
+   if(CPU_HasSSE2())
+      return pixConvSSE2;
+#endif
+   return pixConvScalar;
+}
+
+//
+// Return the kernel set for this processor.
+//
+const pixconv_t &PixConv_Get()
+{
+   static const pixconv_t &kernels = PixConv_Select();
+   return kernels;
+}
+
+//=============================================================================
+//
+// Composite converters
+//
+
+//
+// Expand a row of 1-bit paletted pixels.
+//
+void PixConv_Pal1To24(const uint8_t *src, uint8_t *dst, uint32_t count, const uint32_t *pal)
+{
+   const pixconv_t &pc = PixConv_Get();
+   uint8_t idx[PIXCONV_CHUNK];
+
+   while(count)
+   {
+      const uint32_t n = (count < PIXCONV_CHUNK) ? count : PIXCONV_CHUNK;
+      pc.Unpack1To8(src, idx, n);
+      pc.Pal8To24(idx, dst, n, pal);
+      src   += n / 8;
+      dst   += n * 3;
+      count -= n;
+   }
+}
+
+//
+// Expand a row of 4-bit paletted pixels.
+//
+void PixConv_Pal4To24(const uint8_t *src, uint8_t *dst, uint32_t count, const uint32_t *pal)
+{
+   const pixconv_t &pc = PixConv_Get();
+   uint8_t idx[PIXCONV_CHUNK];
+
+   while(count)
+   {
+      const uint32_t n = (count < PIXCONV_CHUNK) ? count : PIXCONV_CHUNK;
+      pc.Unpack4To8(src, idx, n);
+      pc.Pal8To24(idx, dst, n, pal);
+      src   += n / 2;
+      dst   += n * 3;
+      count -= n;
+   }
+}
+
+//
+// Map a row of 8-bit palette indices through a one-byte-per-entry table, as
+// for gray levels.
+//
+void PixConv_Pal8To8(const uint8_t *src, uint8_t *dst, uint32_t count, const uint8_t *lut)
+{
+   uint32_t x = 0;
+
+   for(; x + 4 <= count; x += 4)
+   {
+      dst[x + 0] = lut[src[x + 0]];
+      dst[x + 1] = lut[src[x + 1]];
+      dst[x + 2] = lut[src[x + 2]];
+      dst[x + 3] = lut[src[x + 3]];
+   }
+
+   for(; x < count; x++)
+      dst[x] = lut[src[x]];
+}
+
+//
+// Expand a row of 4-bit paletted pixels to one byte each through lut.
+//
+void PixConv_Pal4To8(const uint8_t *src, uint8_t *dst, uint32_t count, const uint8_t *lut)
+{
+   const pixconv_t &pc = PixConv_Get();
+   uint8_t idx[PIXCONV_CHUNK];
+
+   while(count)
+   {
+      const uint32_t n = (count < PIXCONV_CHUNK) ? count : PIXCONV_CHUNK;
+      pc.Unpack4To8(src, idx, n);
+      PixConv_Pal8To8(idx, dst, n, lut);
+      src   += n / 2;
+      dst   += n;
+      count -= n;
+   }
+}
+
+// EOF
@@ -0,0 +1,68 @@
+/*
+  Scan Manager
+
+  Pixel format conversion kernels
+
+  Row converters used by the JPEG encoder and DIB construction. Each kernel
+  has a scalar implementation plus SSE2 and/or AVX2 versions where they pay
+  off; the fastest set supported by the processor is chosen at runtime.
+*/
+
+#ifndef PIXCONV_H__
+#define PIXCONV_H__
+
+#include <stdint.h>
+#include <string.h>
+
+//
+// Kernel table. All counts are in pixels. Kernels may not be called with
+// overlapping source and destination.
+//
+struct pixconv_t
+{
+   const char *name; // name of the instruction set in use
+
+   // Swap the first and third byte of each 3-byte pixel (BGR <-> RGB).
+   void (*SwapRB24)(const uint8_t *src, uint8_t *dst, uint32_t count);
+
+   // Expand 8-bit palette indices to packed 3-byte pixels. pal holds 256
+   // entries built with PixConv_PackPal.
+   void (*Pal8To24)(const uint8_t *src, uint8_t *dst, uint32_t count, const uint32_t *pal);
+
+   // Unpack 1-bit (MSB first) or 4-bit (high nibble first) pixels into one
+   // palette index per byte.
+   void (*Unpack1To8)(const uint8_t *src, uint8_t *dst, uint32_t count);
+   void (*Unpack4To8)(const uint8_t *src, uint8_t *dst, uint32_t count);
+
+   // Expand 1-bit (MSB first) pixels straight to c0 for clear bits and c1 for
+   // set bits, e.g. the two gray levels of a bilevel page.
+   void (*Mono1To8)(const uint8_t *src, uint8_t *dst, uint32_t count, uint8_t c0, uint8_t c1);
+};
+
+//
+// Build a Pal8To24 palette entry; the three bytes are stored in the order in
+// which they will be written out.
+//
+inline uint32_t PixConv_PackPal(uint8_t c0, uint8_t c1, uint8_t c2)
+{
+   const uint8_t bytes[4] = { c0, c1, c2, 0 };
+   uint32_t entry;
+   memcpy(&entry, bytes, sizeof(entry));
+   return entry;
+}
+
+const pixconv_t &PixConv_Get();
+
+// Convenience wrappers that unpack and expand 1- and 4-bit rows in small
+// chunks through the kernels selected by PixConv_Get.
+void PixConv_Pal1To24(const uint8_t *src, uint8_t *dst, uint32_t count, const uint32_t *pal);
+void PixConv_Pal4To24(const uint8_t *src, uint8_t *dst, uint32_t count, const uint32_t *pal);
+
+// Map 8- and 4-bit palette indices through a 256-entry byte table, such as
+// the gray levels of a gray palette.
+void PixConv_Pal8To8(const uint8_t *src, uint8_t *dst, uint32_t count, const uint8_t *lut);
+void PixConv_Pal4To8(const uint8_t *src, uint8_t *dst, uint32_t count, const uint8_t *lut);
+
+#endif
+
+// EOF
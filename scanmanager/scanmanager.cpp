@@ -7,16 +7,26 @@
 #include <shellapi.h>
 #include <ShlObj.h>
 #include <memory>
+#include <set>
+#include <vector>
 #include "cached_files.h"
+#include "docspool.h"
 #include "docwrite.h"
 #include "docread.h"
+#include "imagefxreport.h"
 #include "imagelist.h"
+#include "inifile.h"
+#include "jpegreport.h"
+#include "jpegtransform.h"
 #include "m_argv.h"
+#include "pagecache.h"
+#include "pageloader.h"
 #include "pargb32.h"
 #include "prometheusdb.h"
 #include "promuser.h"
 #include "scanning.h"
 #include "scanmanager.h"
+#include "viewcache.h"
 #include "effectdlg.h"
 #include "WiaAutomationProxy.h"
 
@@ -68,9 +78,20 @@ static ScanManagerEffectDlg *pEffectDlg; // current modeless effect dialog
 // Image List Management
 //
 
+// Posted by the page loader when a document page has been loaded
+#define WM_SCANMGR_PAGELOADED (WM_APP + 1)
+
 // Statics
 static ImageList  gImageList;    // list of scanned-in image objects
 static ImageNode *gCurrentImage; // currently viewed image
+static Gdiplus::Bitmap *gPreviewImage; // drawn in place of the current image, if set
+
+static PageLoader               gPageLoader;     // loads pages in view mode
+static PageCache                gPageCache;      // limits decoded pages held in view mode
+static size_t                   gPrefetch;       // pages either side of the current one to load
+static ViewCache                gViewCache;      // local copies of viewed document files
+static std::vector<ImageNode *> gViewPages;      // view mode pages by page number
+static bool                     gPageLoadFailed; // a view mode page could not be loaded
 
 // Forward declarations
 
@@ -116,7 +137,7 @@ static void ScanMgr_UpdateViewImgCmds()
 // Calculate the client rect of the image drawing area of the main window. 
 // This has the rebar control's height subtracted from the parent rect.
 //
-static RECT ScanMgr_CalcImageRect()
+RECT ScanMgr_CalcImageRect()
 {
    RECT barRect;
    RECT mainRect;
@@ -129,12 +150,105 @@ static RECT ScanMgr_CalcImageRect()
    return mainRect;
 }
 
+//
+// Drop decoded view mode pages that are outside the prefetch range around
+// the given page until the rest fit the cache budget. A dropped page is
+// given back to the loader to be read again from its file if needed.
+//
+static void ScanMgr_TrimPageCache(size_t focus)
+{
+   size_t first = (focus > gPrefetch) ? focus - gPrefetch : 0;
+   size_t last  = focus + gPrefetch;
+
+   std::vector<size_t> evicted;
+   gPageCache.evict(first, last, evicted);
+
+   for(size_t page : evicted)
+   {
+      ImageNode *node = gViewPages[page];
+      delete node->gdiBitmap;
+      node->gdiBitmap = nullptr;
+      gPageLoader.release(page);
+   }
+}
+
+//
+// Find the view mode page number of an image node.
+//
+static bool ScanMgr_FindViewPage(const ImageNode *node, size_t &page)
+{
+   for(size_t i = 0; node && i < gViewPages.size(); i++)
+   {
+      if(gViewPages[i] == node)
+      {
+         page = i;
+         return true;
+      }
+   }
+   return false;
+}
+
+//
+// Report the page cache counters for tuning the budget.
+//
+static void ScanMgr_LogPageCacheStats()
+{
+   const pagecachestats_t &stats = gPageCache.getStats();
+   if(!stats.hits && !stats.misses)
+      return;
+
+   char msg[256];
+   _snprintf(msg, sizeof(msg),
+            "Page cache: %llu hits, %llu misses, %llu evictions, peak %llu of %llu KB\n",
+            static_cast<unsigned long long>(stats.hits),
+            static_cast<unsigned long long>(stats.misses),
+            static_cast<unsigned long long>(stats.evictions),
+            static_cast<unsigned long long>(stats.peakBytes >> 10),
+            static_cast<unsigned long long>(gPageCache.getBudget() >> 10));
+   OutputDebugStringA(msg);
+}
+
+//
+// Report how much fetching from the share the view cache has saved.
+//
+static void ScanMgr_LogViewCacheStats()
+{
+   viewcachestats_t stats = gViewCache.getStats();
+   if(!stats.hits && !stats.misses)
+      return;
+
+   char msg[256];
+   _snprintf(msg, sizeof(msg),
+            "View cache: %llu hits, %llu misses (%d%% hit rate), %llu KB saved, %llu KB fetched, "
+            "%llu evictions, %llu of %llu KB held\n",
+            static_cast<unsigned long long>(stats.hits),
+            static_cast<unsigned long long>(stats.misses),
+            int(stats.hits * 100 / (stats.hits + stats.misses)),
+            static_cast<unsigned long long>(stats.bytesSaved >> 10),
+            static_cast<unsigned long long>(stats.bytesFetched >> 10),
+            static_cast<unsigned long long>(stats.evictions),
+            static_cast<unsigned long long>(stats.bytes >> 10),
+            static_cast<unsigned long long>(gViewCache.getBudget() >> 10));
+   OutputDebugStringA(msg);
+}
+
 //
 // Set the currently viewed image.
 //
 void ScanMgr_SetCurrentImage(ImageNode *node)
 {
    gCurrentImage = node;
+
+   // have the loader work outward from the page now on screen, decoding it
+   // again first if it was dropped from the cache
+   size_t page;
+   if(ScanMgr_FindViewPage(node, page))
+   {
+      gPageCache.touch(page);
+      gPageLoader.setFocus(page);
+      ScanMgr_TrimPageCache(page);
+   }
+
    RECT mainRect = ScanMgr_CalcImageRect();
    InvalidateRect(mainWnd, &mainRect, TRUE);
    ScanMgr_UpdateViewImgCmds();
@@ -145,11 +259,29 @@ void ScanMgr_SetCurrentImage(ImageNode *node)
       ScanMgr_DisableGDIPlusEditCmds();
 }
 
+//
+// Draw a bitmap in place of the current image, such as a preview of an edit
+// being made to it, or go back to drawing the image if null. The caller
+// keeps ownership and must reset it before freeing the bitmap.
+//
+void ScanMgr_SetPreviewImage(Gdiplus::Bitmap *bitmap)
+{
+   gPreviewImage = bitmap;
+
+   RECT mainRect = ScanMgr_CalcImageRect();
+   InvalidateRect(mainWnd, &mainRect, TRUE);
+}
+
 //
 // Empty the images list.
 //
 void ScanMgr_ClearImageList()
 {
+   gPageLoader.stop();
+   ScanMgr_LogPageCacheStats();
+   gPageCache.reset(0, 0);
+   gViewPages.clear();
+
    while(gImageList.head)
       delete gImageList.head->dllObject;
 
@@ -198,6 +330,56 @@ void ScanMgr_GotoPrevImage()
    }
 }
 
+//
+// A page of the document being viewed has been loaded in the background;
+// attach it to its image node.
+//
+static void ScanMgr_OnPageLoaded(size_t page, bool failed)
+{
+   if(page >= gViewPages.size())
+      return;
+
+   if(failed)
+   {
+      // report the first failure only; the rest of the pages keep loading
+      if(!gPageLoadFailed)
+      {
+         gPageLoadFailed = true;
+         ShowError("Document Read Error", "One or more document images could not be loaded.", mainWnd);
+      }
+      return;
+   }
+
+   ImageNode *node = gViewPages[page];
+   if(Gdiplus::Bitmap *bitmap = gPageLoader.takePage(page))
+   {
+      if(node->gdiBitmap)
+         delete bitmap;
+      else
+      {
+         node->gdiBitmap = bitmap;
+
+         // a page edited before it was dropped is made again from its history
+         if(node->history.canUndo())
+            node->revertToBackup();
+
+         bitmap = node->gdiBitmap;
+         gPageCache.insert(page, uint64_t(bitmap->GetWidth()) * bitmap->GetHeight() *
+                                 GetPixelFormatSize(bitmap->GetPixelFormat()) / 8);
+
+         size_t focus;
+         if(ScanMgr_FindViewPage(gCurrentImage, focus))
+            ScanMgr_TrimPageCache(focus);
+      }
+   }
+
+   if(node == gCurrentImage)
+   {
+      RECT mainRect = ScanMgr_CalcImageRect();
+      InvalidateRect(mainWnd, &mainRect, TRUE);
+   }
+}
+
 //
 // Images to view in document view mode have been loaded;
 // Set them up for viewing.
@@ -331,11 +513,9 @@ bool ScanMgr_FlipAndRotate(Gdiplus::RotateFlipType rft)
    if(!gCurrentImage)
       return true;
 
-   // Apply the selected transformation
-   bool res = false;
-   Gdiplus::Bitmap *pBmp = gCurrentImage->gdiBitmap;
-   if(pBmp && pBmp->GetLastStatus() == Gdiplus::Ok)
-      res = (pBmp->RotateFlip(rft) == Gdiplus::Ok);
+   // Apply the selected transformation; it goes into the image's history so
+   // that it can be undone
+   bool res = gCurrentImage->applyEdit(ImageEdit_RotateFlip(rft));
 
    // refresh image view
    ScanMgr_SetCurrentImage(gCurrentImage);
@@ -343,6 +523,19 @@ bool ScanMgr_FlipAndRotate(Gdiplus::RotateFlipType rft)
    return res;
 }
 
+//
+// Undo or redo an edit made to the current image (Ctrl+Z, Ctrl+Y).
+// Not while an effect dialog is open, as it is using the newest version.
+//
+static void ScanMgr_UndoEdit(bool redo)
+{
+   if(!gCurrentImage || pEffectDlg)
+      return;
+
+   if(redo ? gCurrentImage->redo() : gCurrentImage->undo())
+      ScanMgr_SetCurrentImage(gCurrentImage);
+}
+
 //
 // Paint function
 //
@@ -355,11 +548,16 @@ static void OnPaint(HDC hdc)
    if(!gCurrentImage)
       return;
 
-   if(!gCurrentImage->gdiBitmap)
-      ScanMgr_HBITMAPToGdiplusBitmap(gCurrentImage);
+   if(gPreviewImage)
+      bitmap = gPreviewImage;
+   else
+   {
+      if(!gCurrentImage->gdiBitmap)
+         ScanMgr_HBITMAPToGdiplusBitmap(gCurrentImage);
 
-   if(!(bitmap = gCurrentImage->gdiBitmap))
-      return;
+      if(!(bitmap = gCurrentImage->gdiBitmap))
+         return;
+   }
 
    if(bitmap->GetLastStatus() != Gdiplus::Ok)
       return;
@@ -742,11 +940,17 @@ static void ScanMgr_EnableGDIPlusEditCmds()
 // Document Saving
 //
 
+// Posted by the document spool when a document has been uploaded or given up on
+#define WM_SCANMGR_DOCPUBLISHED (WM_APP + 2)
+
+static DocSpool    gDocSpool;   // uploads saved documents to the CHS file share
+static std::string gSavingDoc;  // spool ID of the document this session is saving
+
 //
-// Saves the images to disk on the CHS file share and then writes a document 
-// record tied to the created file path to the Prometheus database. If any
-// failure is encountered along the process, the document files are deleted
-// and the directory created (if any) will be removed.
+// Saves the images into the local document spool, from where they are
+// uploaded to the CHS file share in the background. The document record is
+// written once the upload has finished; see ScanMgr_OnDocumentPublished.
+// Saving and scanning stay locked in the meantime.
 //
 static void ScanMgr_SaveDocument()
 {
@@ -758,27 +962,113 @@ static void ScanMgr_SaveDocument()
    else if(MessageBox(mainWnd, L"Are you sure you want to save the current images?", L"Scan Manager", MB_YESNO|MB_ICONQUESTION) == IDYES)
    {
       DocWriteStatus status;
+      docspooljob_t  job;
+
+      job.userID   = theUser.getUserID();
+      job.personID = personID;
+      job.title    = docTitle;
+      job.date     = docRecv;
+      job.type     = "Scanned Document";
 
-      if(ScanMgr_WriteDocument(status, gImageList))
+      if(ScanMgr_SpoolDocument(status, gImageList, job))
       {
-         // Saved files successfully; try to write database record.
-         if(ScanMgr_WriteDocumentRecord(status, theUser, personID, docTitle, docRecv, status.path, "Scanned Document"))
-         {        
-            // Fully successful; disable further saving and acquisition.
-            modified = false;
-            ScanMgr_DisableDocumentMutateCmds(true);
-            MessageBox(mainWnd, L"Document was successfully saved.", L"Scan Manager", MB_OK|MB_ICONINFORMATION);
-            return;
-         }
+         // Pages are safely on local disk; upload them in the background.
+         gSavingDoc = job.id;
+         modified   = false;
+         ScanMgr_DisableDocumentMutateCmds(false);
+         gDocSpool.submit(job);
+         return;
       }
 
       // Save failed, cleanup and warn user.
-      if(status.path.length())
-         ScanMgr_RemoveFailedDocument(status.path);
+      DocSpool_Discard(job);
       ShowError("Document Write Error", status.errorMsg.c_str(), mainWnd);
    }
 }
 
+//
+// Write the document records for spooled documents that have been
+// published to the share. A document that could not be recorded is taken
+// back off the share. Documents left over from an earlier session stay in
+// the spool to be tried again if they fail; the one saved in this session
+// is discarded from the spool either way, and on failure can be saved again.
+// A document that could be neither recorded nor taken back off the share
+// stays in the spool whichever session it is from, so that its record is
+// written the next time the spool is started.
+//
+static void ScanMgr_OnDocumentPublished()
+{
+   docspoolresult_t result;
+
+   while(gDocSpool.takeResult(result))
+   {
+      const docspooljob_t &job = result.job;
+      const bool thisSession = (job.id == gSavingDoc);
+
+      DocWriteStatus status;
+      bool saved = false, stranded = false;
+
+      status.path = result.sharePath;
+      if(!result.published)
+         status.errorMsg = result.errorMsg;
+      else if(ScanMgr_DocumentRecordExists(theUser, status.path))
+         saved = true; // recorded before the earlier session ended
+      else if(ScanMgr_WriteDocumentRecord(status, theUser, job.personID, job.title, job.date, status.path, job.type))
+         saved = true;
+      else
+         stranded = !ScanMgr_UnpublishDocument(status.path);
+
+      if(saved || (thisSession && !stranded))
+         DocSpool_Discard(job);
+
+      if(!thisSession)
+         continue;
+
+      gSavingDoc.clear();
+      if(saved)
+      {
+         // Fully successful; disable further saving and acquisition.
+         ScanMgr_DisableDocumentMutateCmds(true);
+         MessageBox(mainWnd, L"Document was successfully saved.", L"Scan Manager", MB_OK|MB_ICONINFORMATION);
+      }
+      else if(stranded)
+      {
+         // Saving again would make a second copy; the spool finishes this one.
+         ScanMgr_DisableDocumentMutateCmds(true);
+         status.errorMsg += "\n\nThe document is on the file share but could not be withdrawn from it. "
+                            "Its record will be written the next time Scan Manager is started.";
+         ShowError("Document Write Error", status.errorMsg.c_str(), mainWnd);
+      }
+      else
+      {
+         // Let the user try again.
+         modified = true;
+         ScanMgr_EnableDocumentMutateCmds();
+         ShowError("Document Write Error", status.errorMsg.c_str(), mainWnd);
+      }
+   }
+}
+
+//
+// Check with the user before closing if that would lose their work.
+//
+static bool ScanMgr_ConfirmExit(HWND hWnd)
+{
+   if(modified && !viewMode)
+   {
+      if(MessageBox(hWnd, L"Changes to the document have not been saved.\nAre you sure you want to exit?", L"Scan Manager", MB_YESNO|MB_ICONQUESTION) == IDNO)
+         return false;
+   }
+
+   if(gDocSpool.isBusy())
+   {
+      if(MessageBox(hWnd, L"A saved document is still being uploaded. It will finish uploading the next time Scan Manager is started.\nAre you sure you want to exit?", L"Scan Manager", MB_YESNO|MB_ICONQUESTION) == IDNO)
+         return false;
+   }
+
+   return true;
+}
+
 //=============================================================================
 //
 // Print Functionality
@@ -792,20 +1082,24 @@ static void ScanMgr_PrintDocument()
       return;
 
    std::set<std::string> filenames;
-   if(!ScanMgr_GetDocumentImagePaths(viewPath, filenames))
+   std::string           tempDir;
+   if(!ScanMgr_GetDocumentImagePaths(viewPath, filenames, tempDir))
       return;
 
    size_t numfilenames;
-   if(!(numfilenames = filenames.size()))
-      return;
+   if((numfilenames = filenames.size()))
+   {
+      size_t idx = 0;
+      std::unique_ptr<const char * []> upTmpPaths(new const char * [numfilenames]);
+      const char **pTmpPaths = upTmpPaths.get();
+      for(auto &fn : filenames)
+         pTmpPaths[idx++] = fn.c_str();
 
-   size_t idx = 0;
-   std::unique_ptr<const char * []> upTmpPaths(new const char * [numfilenames]);
-   const char **pTmpPaths = upTmpPaths.get();
-   for(auto &fn : filenames)
-      pTmpPaths[idx++] = fn.c_str();
+      WiaAutomationProxy::CommonDialog::ShowPhotoPrintingWizard(pTmpPaths, (unsigned int)numfilenames);
+   }
 
-   WiaAutomationProxy::CommonDialog::ShowPhotoPrintingWizard(pTmpPaths, (unsigned int)numfilenames);
+   // pages extracted from a container must not outlive the print job
+   ScanMgr_DeleteDocumentImagePaths(filenames, tempDir);
 }
 
 //=============================================================================
@@ -845,30 +1139,64 @@ static bool ScanMgr_GetPDFFileName(std::string &outstr)
 }
 
 //
-// Copy a PDF to user's local machine.
+// Progress callback for file copies made on the UI thread. The percentage
+// done is shown in the title bar, and pressing Escape cancels the copy.
+// Paint messages are dispatched so the window stays drawn meanwhile; call
+// ScanMgr_EndCopyProgress once the copy is over to restore the title.
 //
-static bool ScanMgr_CopyPDF(const std::string &src, std::string &dst)
+static filecopyprogress_t ScanMgr_CopyProgress(const wchar_t *action)
+{
+   int lastPercent = -1;
+
+   return [action, lastPercent] (uint64_t copied, uint64_t total) mutable -> bool {
+      int percent = total ? int(copied * 100 / total) : 100;
+      if(percent != lastPercent)
+      {
+         wchar_t title[MAX_LOADSTRING + 64];
+         _snwprintf(title, _countof(title), L"%s - %s %d%% (Esc to cancel)", szTitle, action, percent);
+         title[_countof(title) - 1] = L'\0';
+         SetWindowTextW(mainWnd, title);
+         lastPercent = percent;
+      }
+
+      MSG msg;
+      while(PeekMessage(&msg, nullptr, WM_PAINT, WM_PAINT, PM_REMOVE))
+         DispatchMessage(&msg);
+
+      return !(GetForegroundWindow() == mainWnd && (GetAsyncKeyState(VK_ESCAPE) & 0x8000));
+   };
+}
+
+static void ScanMgr_EndCopyProgress()
+{
+   SetWindowTextW(mainWnd, szTitle);
+}
+
+//
+// Copy a PDF to user's local machine under the given name.
+//
+static bool ScanMgr_CopyPDF(const std::string &src, const std::string &name, std::string &dst)
 {
    char localAppData[_MAX_PATH + 1];
    memset(localAppData, 0, sizeof(localAppData));
    SHGetFolderPathA(nullptr, CSIDL_LOCAL_APPDATA, nullptr, SHGFP_TYPE_CURRENT, localAppData);
 
-   std::string fn = FileCache::GetFileSpec(src).second;
    FileCache::SetBasePath(localAppData);
-   if(FileCache::CopyIntoCache(src, "Temp\\ScanManager"))
-   {
-      dst = FileCache::PathConcatenate(FileCache::PathConcatenate(localAppData, "Temp\\ScanManager"), fn);
-      return true;
-   }
-   else
+   if(!FileCache::CreateDirectoryRecursive("Temp\\ScanManager"))
       return false;
+
+   dst = FileCache::PathConcatenate(FileCache::PathConcatenate(localAppData, "Temp\\ScanManager"), name);
+
+   bool copied = (FileCopy_Copy(src, dst, false, ScanMgr_CopyProgress(L"Copying")) == FILECOPY_OK);
+   ScanMgr_EndCopyProgress();
+
+   return copied;
 }
 
 //
 // Prompts user to select a PDF file to copy to the CHS file share and then writes
 // a document record tied to the created file path to the Prometheus database. 
-// If any failure is encountered along the process, the document files are deleted
-// and the directory created (if any) will be removed.
+// If the record cannot be written, the document is withdrawn from the share.
 //
 static void ScanMgr_SavePDFDocument()
 {
@@ -889,31 +1217,36 @@ static void ScanMgr_SavePDFDocument()
    {
       DocWriteStatus status;
 
-      if(ScanMgr_WritePDFDocument(status, filename))
+      bool written = ScanMgr_WritePDFDocument(status, filename, ScanMgr_CopyProgress(L"Saving"));
+      ScanMgr_EndCopyProgress();
+
+      if(written)
       {
          // Saved file successfully; try to write database record.
          if(ScanMgr_WriteDocumentRecord(status, theUser, personID, docTitle, docRecv, status.path, "Adobe PDF"))
          {        
             // Fully successful; disable further saving and acquisition.
-            std::string loadPath, tmpFile;
             modified = false;
             ScanMgr_DisableDocumentMutateCmds(true);
             MessageBox(mainWnd, L"Document was successfully saved.", L"Scan Manager", MB_OK|MB_ICONINFORMATION);
 
-            // display the file that was just saved
-            if(ScanMgr_ReadPDFDocumentFromPath(status.path, loadPath))
-            {
-               if(ScanMgr_CopyPDF(loadPath, tmpFile))
-                  ShellExecuteA(mainWnd, "open", tmpFile.c_str(), nullptr, nullptr, SW_SHOW);
-            }
+            // display the file that was just saved; the local original is
+            // identical to the copy on the share, so open it rather than
+            // fetching the upload back again
+            ShellExecuteA(mainWnd, "open", filename.c_str(), nullptr, nullptr, SW_SHOW);
             return;
          }
       }
 
       // Save failed, cleanup and warn user.
-      if(status.path.length())
-         ScanMgr_RemoveFailedDocument(status.path);
-      ShowError("Document Write Error", status.errorMsg.c_str(), mainWnd);
+      bool stranded = (status.path.length() && !ScanMgr_UnpublishDocument(status.path));
+      if(stranded)
+      {
+         status.errorMsg += "\n\nThe document could not be withdrawn from the file share, and has been left "
+                            "in " + status.path + " without a record.";
+      }
+      if(status.code != DOCWRITE_CANCELLED || stranded)
+         ShowError("Document Write Error", status.errorMsg.c_str(), mainWnd);
    }
 }
 
@@ -930,14 +1263,26 @@ static void ScanMgr_SetupViewMode()
    ScanMgr_DisableDocumentMutateCmds(true);
    ScanMgr_DisableGDIPlusEditCmds();
 
+   // files viewed before are read from local copies rather than the share
+   if(!gViewCache.isOpen())
+   {
+      std::string cacheDir;
+      if(ViewCache_GetBasePath(cacheDir))
+         gViewCache.open(cacheDir, ViewCache_BudgetFromIni());
+   }
+
    if(isPDF)
    {
-      std::string pdfPath, tmpPath;
-      if(!ScanMgr_ReadPDFDocumentFromPath(viewPath, pdfPath))
+      docmanifestentry_t pdf;
+      if(!ScanMgr_GetDocumentPDF(viewPath, pdf))
          ShowError("Document Read Error", "PDF file is missing or cannot be read.", mainWnd);
       else
       {
-         if(!ScanMgr_CopyPDF(pdfPath, tmpPath))
+         std::string pdfPath = FileCache::PathConcatenate(viewPath, pdf.name), tmpPath;
+         gViewCache.fetch(viewPath, pdf, pdfPath, ScanMgr_CopyProgress(L"Fetching"));
+         ScanMgr_EndCopyProgress();
+
+         if(!ScanMgr_CopyPDF(pdfPath, pdf.name, tmpPath))
             ShowError("Document Read Error", "Cannot copy PDF to local system for viewing.", mainWnd);
          else
             ShellExecuteA(mainWnd, "open", tmpPath.c_str(), nullptr, nullptr, SW_SHOW);
@@ -945,11 +1290,168 @@ static void ScanMgr_SetupViewMode()
    }
    else
    {
-      if(!ScanMgr_ReadDocumentFromPath(viewPath, gImageList))
+      DocManifest pages;
+      if(!ScanMgr_GetDocumentPages(viewPath, pages) || pages.empty())
+      {
          ShowError("Document Read Error", "One or more document images could not be loaded.", mainWnd);
-      else
-         ScanMgr_SetupViewImages();
+         return;
+      }
+
+      // every page gets a node at once so that navigation works while the
+      // pages themselves are loaded in the background, nearest first
+      for(size_t i = 0; i < pages.size(); i++)
+      {
+         auto node = new ImageNode();
+         node->hBitmap   = nullptr;
+         node->gdiBitmap = nullptr;
+         gImageList.tailInsert(node);
+         gViewPages.push_back(node);
+      }
+
+      // pages are only ever shown fitted to the window in view mode, and
+      // printing goes back to the files, so they need not be decoded at
+      // more than screen size
+      uint32_t maxWidth  = uint32_t(GetSystemMetrics(SM_CXVIRTUALSCREEN));
+      uint32_t maxHeight = uint32_t(GetSystemMetrics(SM_CYVIRTUALSCREEN));
+
+      // only the pages near the one on screen are loaded, and the least
+      // recently seen are dropped again once over the cache budget
+      gPrefetch = PageCache_PrefetchFromIni();
+      gPageCache.reset(pages.size(), PageCache_BudgetFromIni());
+
+      // a container holds every page, so it is fetched once, here, rather
+      // than by each loader thread; if it cannot be cached it is read
+      // straight from the share
+      std::string containerPath;
+      if(DocManifest_IsContainer(pages.front().name))
+      {
+         containerPath = FileCache::PathConcatenate(viewPath, pages.front().name);
+         gViewCache.fetch(viewPath, pages.front(), containerPath, ScanMgr_CopyProgress(L"Fetching"));
+         ScanMgr_EndCopyProgress();
+      }
+
+      if(!gPageLoader.start(viewPath, pages, &gViewCache, containerPath, maxWidth, maxHeight, gPrefetch,
+                            mainWnd, WM_SCANMGR_PAGELOADED))
+         ShowError("Document Read Error", "Cannot start loading the document images.", mainWnd);
+
+      ScanMgr_SetupViewImages();
+   }
+}
+
+//=============================================================================
+//
+// Configuration
+//
+
+//
+// Load scanmanager.ini from the directory containing the executable, if it
+// exists. Every setting has a built-in default.
+//
+static void ScanMgr_LoadIniFile()
+{
+   char path[MAX_PATH];
+   DWORD len = GetModuleFileNameA(nullptr, path, MAX_PATH);
+   if(!len || len == MAX_PATH)
+      return;
+
+   std::string iniPath = path;
+   size_t slash = iniPath.find_last_of("\\/");
+   iniPath = (slash == std::string::npos) ? "scanmanager.ini" : iniPath.substr(0, slash + 1) + "scanmanager.ini";
+
+   IniFile::GetIniFile().loadOptionsFromFile(iniPath);
+}
+
+typedef bool (*samplereport_t)(const std::string &inDir, const std::string &outPath, std::string &errorMsg);
+
+//
+// Run a report over a directory of sample pages, requested with
+// <arg> <dir> <out.csv>, and return the program exit code. No window is
+// created in this mode.
+//
+static int ScanMgr_RunSampleReport(const char *arg, samplereport_t report, const char *title)
+{
+   int p;
+   if(!(p = M_GetArgParameter(arg, 2)))
+   {
+      std::string usage = std::string("Usage: ") + arg + " <sample image directory> <report .csv file>";
+      ShowError("Scan Manager", usage.c_str());
+      return 1;
+   }
+
+   if(!ScanMgr_InitGDIPlus())
+   {
+      ShowError("Scan Manager", "Could not initialize GDI+ graphics.");
+      return 1;
    }
+
+   std::string errorMsg;
+   bool res = report(argv[p], argv[p + 1], errorMsg);
+
+   ScanMgr_ShutdownGDIPlus();
+
+   if(!res)
+   {
+      ShowError(title, errorMsg.c_str());
+      return 1;
+   }
+
+   return 0;
+}
+
+//
+// Losslessly rotate or flip a stored document, or a single page, requested
+// with -jpegtransform <document directory | page.jpg> <transform>, optionally
+// followed by -crop WxH+X+Y. Returns the program exit code.
+//
+static int ScanMgr_RunJPEGTransform()
+{
+   int p;
+   jpegtransform_t transform = {};
+   if(!(p = M_GetArgParameter("-jpegtransform", 2)) || !JPEGTransform_ParseName(argv[p + 1], transform.xform))
+   {
+      ShowError("Scan Manager", "Usage: -jpegtransform <document directory or .jpg file> "
+                                "<rot90|rot180|rot270|fliph|flipv|transpose|transverse> [-crop WxH+X+Y]");
+      return 1;
+   }
+
+   int c;
+   if((c = M_GetArgParameter("-crop", 1)))
+   {
+      unsigned w, h, x, y;
+      if(sscanf(argv[c], "%ux%u+%u+%u", &w, &h, &x, &y) != 4 || !w || !h)
+      {
+         ShowError("Scan Manager", "Crop region must be given as WxH+X+Y.");
+         return 1;
+      }
+      transform.crop       = true;
+      transform.cropWidth  = w;
+      transform.cropHeight = h;
+      transform.cropX      = x;
+      transform.cropY      = y;
+   }
+
+   // documents live on the file share; a local path works without it
+   ScanMgr_ConnectToShare();
+
+   std::string path = argv[p];
+   std::string errorMsg;
+   bool res;
+
+   DWORD attribs = GetFileAttributesA(path.c_str());
+   if(attribs != INVALID_FILE_ATTRIBUTES && (attribs & FILE_ATTRIBUTE_DIRECTORY))
+      res = ScanMgr_TransformDocument(path, transform, errorMsg);
+   else
+      res = ScanMgr_TransformJPEGFile(path, transform, errorMsg);
+
+   ScanMgr_CloseShare();
+
+   if(!res)
+   {
+      ShowError("JPEG Transform", errorMsg.c_str());
+      return 1;
+   }
+
+   return 0;
 }
 
 //=============================================================================
@@ -979,6 +1481,45 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
       return OutOfMemory();
    ParseCommandLine(cmdline, argv);
 
+   // load configuration
+   ScanMgr_LoadIniFile();
+
+   // check for JPEG profile report mode
+   if(M_FindArgument("-jpegreport"))
+   {
+      int res = ScanMgr_RunSampleReport("-jpegreport", ScanMgr_JPEGReport, "JPEG Report");
+      free(argv);
+      free(cmdline);
+      return res;
+   }
+
+   // check for striped JPEG encoding report mode
+   if(M_FindArgument("-jpegstripereport"))
+   {
+      int res = ScanMgr_RunSampleReport("-jpegstripereport", ScanMgr_JPEGStripeReport, "JPEG Stripe Report");
+      free(argv);
+      free(cmdline);
+      return res;
+   }
+
+   // check for image effect validation mode
+   if(M_FindArgument("-imagefxreport"))
+   {
+      int res = ScanMgr_RunSampleReport("-imagefxreport", ScanMgr_ImageFxReport, "Image Effect Report");
+      free(argv);
+      free(cmdline);
+      return res;
+   }
+
+   // check for lossless page transform mode
+   if(M_FindArgument("-jpegtransform"))
+   {
+      int res = ScanMgr_RunJPEGTransform();
+      free(argv);
+      free(cmdline);
+      return res;
+   }
+
    // Initialize global strings
    LoadStringW(hInstance, IDS_APP_TITLE, szTitle, MAX_LOADSTRING);
    LoadStringW(hInstance, IDC_SCANMANAGER, szWindowClass, MAX_LOADSTRING);
@@ -1019,6 +1560,10 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
    }
    else
    {
+      // finish uploading any documents this user saved in an earlier session
+      if(gDocSpool.start(mainWnd, WM_SCANMGR_DOCPUBLISHED))
+         gDocSpool.resume(theUser.getUserID());
+
       // check for document view mode
       int p;
       if((p = M_GetArgParameter("-view", 1)))
@@ -1181,11 +1726,8 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             DialogBox(hInst, MAKEINTRESOURCE(IDD_ABOUTBOX), hWnd, About);
             break;
          case IDM_EXIT:
-            if(modified && !viewMode)
-            {
-               if(MessageBox(hWnd, L"Changes to the document have not been saved.\nAre you sure you want to exit?", L"Scan Manager", MB_YESNO|MB_ICONQUESTION) == IDNO)
-                  break;
-            }
+            if(!ScanMgr_ConfirmExit(hWnd))
+               break;
             DestroyWindow(hWnd);
             break;
          case ID_FILE_SAVEDOCUMENT:
@@ -1265,20 +1807,25 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
       }
       break;
    case WM_SYSCOMMAND:
-      if(wParam == SC_CLOSE && modified && !viewMode)
-      {
-         if(MessageBox(hWnd, L"Changes to the document have not been saved.\nAre you sure you want to exit?", L"Scan Manager", MB_YESNO|MB_ICONQUESTION) == IDNO)
-            break;
-      }
+      if(wParam == SC_CLOSE && !ScanMgr_ConfirmExit(hWnd))
+         break;
       return DefWindowProc(hWnd, message, wParam, lParam);
    case WM_KEYDOWN:
       switch(wParam)
       {
       case VK_LEFT:
-         ScanMgr_GotoPrevImage();
+         if(!pEffectDlg)
+            ScanMgr_GotoPrevImage();
          break;
       case VK_RIGHT:
-         ScanMgr_GotoNextImage();
+         if(!pEffectDlg)
+            ScanMgr_GotoNextImage();
+         break;
+      case 'Z':
+      case 'Y':
+         if(GetKeyState(VK_CONTROL) >= 0)
+            return DefWindowProc(hWnd, message, wParam, lParam);
+         ScanMgr_UndoEdit(wParam == 'Y');
          break;
       default:
          return DefWindowProc(hWnd, message, wParam, lParam);
@@ -1292,9 +1839,24 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
          EndPaint(hWnd, &ps);
       }
       break;
+   case WM_SCANMGR_PAGELOADED:
+      ScanMgr_OnPageLoaded(size_t(wParam), lParam != 0);
+      break;
+   case WM_SCANMGR_DOCPUBLISHED:
+      ScanMgr_OnDocumentPublished();
+      break;
    case WM_DESTROY:
-      ScanMgr_CloseShare();
+      // finish with any effect being applied before its image goes away
+      if(pEffectDlg)
+      {
+         delete pEffectDlg;
+         pEffectDlg = nullptr;
+      }
+      // stop any page loading or uploading before the share goes away
+      gDocSpool.stop();
       ScanMgr_ShutdownImages();
+      ScanMgr_LogViewCacheStats();
+      ScanMgr_CloseShare();
       ScanMgr_ShutdownGDIPlus();
       twainMgr.shutdown(mainWnd);
       PostQuitMessage(0);
@@ -4,6 +4,13 @@
 
 class ImageNode;
 
+namespace Gdiplus
+{
+   class Bitmap;
+}
+
+RECT ScanMgr_CalcImageRect();
 void ScanMgr_HBITMAPToGdiplusBitmap(ImageNode *node);
 void ScanMgr_SetCurrentImage(ImageNode *node);
+void ScanMgr_SetPreviewImage(Gdiplus::Bitmap *bitmap);
 
@@ -0,0 +1,146 @@
+/*
+  Scan Manager
+
+  Image effect kernel check
+
+  Checks, without Windows or GDI+, that the vector kernels in imagefx.cpp
+  give exactly what the scalar ones do on this processor, and that a chain
+  of effects made in one pass gives exactly what making them one at a time
+  does. The comparison against GDI+ itself needs Windows; see the
+  -imagefxreport mode of the program.
+
+  Builds on its own, without the rest of the program:
+
+     cl /O2 /EHsc imagefxcheck.cpp ..\imagefx.cpp ..\cpufeatures.cpp ..\parallel.cpp
+     g++ -O2 -std=c++14 imagefxcheck.cpp ../imagefx.cpp ../cpufeatures.cpp ../parallel.cpp -pthread -o imagefxcheck
+
+  Exits with 0 if everything matched.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "../imagefx.h"
+
+// Size of the test image; odd, so no row or column count is a multiple of
+// any vector width
+#define IMAGEFXCHECK_WIDTH  613
+#define IMAGEFXCHECK_HEIGHT 409
+
+//
+// Fill an image with smooth gradients and some noise, so that the colour
+// effects see every level and sharpening has edges to work on.
+//
+static void ImageFxCheck_Fill(std::vector<uint8_t> &pixels, uint32_t channels)
+{
+   uint32_t state = 0x5ca11ed;
+
+   pixels.resize(size_t(IMAGEFXCHECK_WIDTH) * IMAGEFXCHECK_HEIGHT * channels);
+   for(uint32_t y = 0; y < IMAGEFXCHECK_HEIGHT; y++)
+   {
+      for(uint32_t x = 0; x < IMAGEFXCHECK_WIDTH; x++)
+      {
+         uint8_t *p = &pixels[(size_t(y) * IMAGEFXCHECK_WIDTH + x) * channels];
+         for(uint32_t c = 0; c < channels; c++)
+         {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            p[c] = uint8_t((x * (c + 1) + y * (3 - c % 3)) / 4 + (state & 15));
+         }
+      }
+   }
+}
+
+//
+// Add the effects of one test chain; step picks the effect and seed its
+// settings.
+//
+static void ImageFxCheck_AddEffect(ImageFxChain &chain, int step, int seed)
+{
+   switch(step % 5)
+   {
+   case 0:
+      chain.addBrightnessContrast(seed % 101 - 50, seed % 61 - 30);
+      break;
+   case 1:
+      chain.addTint(seed % 361 - 180, seed % 101 - 50);
+      break;
+   case 2:
+      chain.addHueSaturationLightness(seed % 91 - 45, seed % 81 - 40, seed % 41 - 20);
+      break;
+   case 3:
+      chain.addColorBalance(seed % 61 - 30, seed % 41 - 20, seed % 81 - 40);
+      break;
+   default:
+      chain.addSharpen(float(1 + seed % 20), float(seed % 101));
+      break;
+   }
+}
+
+//
+// Check that chains of effects made together match the same effects made
+// one at a time, for gray, BGR and BGRA images.
+//
+static bool ImageFxCheck_Chains(std::string &report)
+{
+   static const uint32_t channelCounts[] = { 1, 3, 4 };
+
+   unsigned tried = 0, failures = 0;
+   for(uint32_t channels : channelCounts)
+   {
+      std::vector<uint8_t> original;
+      ImageFxCheck_Fill(original, channels);
+
+      for(int trial = 0; trial < 20; trial++)
+      {
+         std::vector<uint8_t> together(original), apart(original);
+         imagefxbuf_t bufTogether = { &together[0], ptrdiff_t(IMAGEFXCHECK_WIDTH * channels),
+                                      IMAGEFXCHECK_WIDTH, IMAGEFXCHECK_HEIGHT, channels };
+         imagefxbuf_t bufApart    = bufTogether;
+         bufApart.pixels = &apart[0];
+
+         ImageFxChain chain;
+         const int    numEffects = 2 + trial % 4;
+         bool         ok         = true;
+         for(int i = 0; i < numEffects; i++)
+         {
+            const int step = trial + i * 3, seed = trial * 37 + i * 101;
+
+            ImageFxCheck_AddEffect(chain, step, seed);
+
+            ImageFxChain single;
+            ImageFxCheck_AddEffect(single, step, seed);
+            ok = single.apply(bufApart) && ok;
+         }
+         ok = chain.apply(bufTogether) && ok;
+
+         ++tried;
+         if(!ok || together != apart)
+            ++failures;
+      }
+   }
+
+   char line[120];
+   snprintf(line, sizeof(line), "chains: %u of %u made in one pass differ from their effects made one at a time\n",
+            failures, tried);
+   report += line;
+
+   return !failures;
+}
+
+int main()
+{
+   std::string report;
+
+   bool ok = ImageFx_CheckKernels(report);
+   ok = ImageFxCheck_Chains(report) && ok;
+
+   fputs(report.c_str(), stdout);
+   puts(ok ? "all checks passed" : "CHECKS FAILED");
+
+   return ok ? 0 : 1;
+}
+
+// EOF
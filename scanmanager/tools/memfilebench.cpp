@@ -0,0 +1,118 @@
+/*
+  Scan Manager
+
+  CxMemFile growth benchmark
+
+  Fills memory files of 1, 25 and 100 MB, the range from a single
+  compressed page to a large multi-page document, one byte at a time, in
+  4 KB writes, and after reserving the final size, and reports how many
+  times each buffer was reallocated and the fill throughput. Run it after
+  changing CxMemFile's growth policy to see what the change did.
+
+  Builds on its own, without the rest of the program:
+
+     cl /O2 /EHsc memfilebench.cpp ..\memfile.cpp
+     g++ -O2 -std=c++14 memfilebench.cpp ../memfile.cpp -o memfilebench
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include "../memfile.h"
+
+// Each fill is repeated this many times and the fastest run kept
+#define MEMFILEBENCH_RUNS 5
+
+// Block size of the chunked fill
+#define MEMFILEBENCH_CHUNK 4096
+
+enum fillmode_e
+{
+   FILL_PUTC,     // one byte at a time
+   FILL_CHUNKS,   // MEMFILEBENCH_CHUNK bytes at a time
+   FILL_RESERVED, // one byte at a time, after reserving the final size
+   FILL_MAX
+};
+
+static const char *const fillNames[FILL_MAX] = { "putc", "4k-write", "reserved" };
+
+//
+// Fill a memory file with size bytes. Returns false if the file could not
+// be filled.
+//
+static bool MemFileBench_Fill(CxMemFile &mem, uint32_t size, fillmode_e mode)
+{
+   static uint8_t chunk[MEMFILEBENCH_CHUNK];
+
+   if(!mem.open())
+      return false;
+
+   if(mode == FILL_RESERVED && !mem.reserve(size))
+      return false;
+
+   if(mode == FILL_CHUNKS)
+   {
+      for(uint32_t done = 0; done < size; done += MEMFILEBENCH_CHUNK)
+      {
+         size_t n = (size - done < MEMFILEBENCH_CHUNK) ? size - done : MEMFILEBENCH_CHUNK;
+         if(mem.write(chunk, 1, n) != n)
+            return false;
+      }
+   }
+   else
+   {
+      for(uint32_t i = 0; i < size; i++)
+      {
+         if(!mem.putc(uint8_t(i)))
+            return false;
+      }
+   }
+
+   return mem.size() == int32_t(size);
+}
+
+int main()
+{
+   static const uint32_t sizesMB[] = { 1, 25, 100 };
+
+   printf("size_mb,mode,reallocs,capacity,best_ms,mb_per_s\n");
+
+   for(uint32_t mb : sizesMB)
+   {
+      const uint32_t size = mb << 20;
+
+      for(int mode = 0; mode < FILL_MAX; mode++)
+      {
+         uint32_t reallocs = 0, capacity = 0;
+         double   bestMs   = 0.0;
+
+         for(int run = 0; run < MEMFILEBENCH_RUNS; run++)
+         {
+            CxMemFile mem;
+
+            auto start = std::chrono::steady_clock::now();
+            bool ok    = MemFileBench_Fill(mem, size, fillmode_e(mode));
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+            if(!ok)
+            {
+               fprintf(stderr, "%u MB %s fill failed\n", mb, fillNames[mode]);
+               return 1;
+            }
+
+            reallocs = mem.reallocCount();
+            capacity = mem.capacity();
+            if(run == 0 || elapsed.count() < bestMs)
+               bestMs = elapsed.count();
+         }
+
+         printf("%u,%s,%u,%u,%.2f,%.1f\n", mb, fillNames[mode], reallocs, capacity, bestMs,
+                bestMs > 0.0 ? mb * 1000.0 / bestMs : 0.0);
+      }
+   }
+
+   return 0;
+}
+
+// EOF
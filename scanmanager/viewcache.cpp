@@ -0,0 +1,390 @@
+/*
+  Scan Manager
+
+  Local cache of viewed document files
+
+  Clinicians reopen the same chart documents many times, and each time used
+  to pull every page over the share again. Files fetched for viewing are now
+  kept under the user's local application data, named so that a name can
+  only ever refer to one version of one document's file: by the document's
+  GUID and the file's name, and then by the checksum and size from the
+  document's manifest where it has one, so that checking for a copy costs no
+  trip to the share at all, or else by size and modification time, which
+  costs one. Copies are never updated in place, only added and deleted, so no
+  copy can be found half-written or out of date.
+*/
+
+#include <Windows.h>
+#include <ShlObj.h>
+#include <algorithm>
+#include <atomic>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <sys/utime.h>
+#define utime _utime
+#else
+#include <utime.h>
+#endif
+
+#include "cached_files.h"
+#include "crc32.h"
+#include "filecopy.h"
+#include "i_opndir.h"
+#include "inifile.h"
+#include "util.h"
+#include "viewcache.h"
+
+#define VIEWCACHE_SECTION "viewcache"
+
+// Default budget; 0 in the ini file turns the cache off
+#define VIEWCACHE_DEFAULTMB 512
+
+// Suffix of copies still being fetched
+#define VIEWCACHE_TEMPSUFFIX ".tmp"
+
+ViewCache::ViewCache()
+   : m_entries(), m_mutex(), m_dir(), m_budget(0), m_clock(0)
+{
+   memset(&m_stats, 0, sizeof(m_stats));
+}
+
+//
+// Work out the cache file name for a document file. Every name starts with
+// the document's directory name, which is its GUID, and the file's name, so
+// a copy can never be served for another document's file however alike
+// their checksums. Files listed in a manifest go on to be named by their
+// checksum and size; others, or with byShare, by their size and
+// modification time as looked up on the share.
+//
+bool ViewCache::makeKey(const std::string &docPath, const docmanifestentry_t &file, const std::string &srcPath,
+                        bool byShare, std::string &key)
+{
+   std::string docID = FileCache::GetFileSpec(FileCache::RemoveTrailingSlash(docPath)).second;
+   std::string stem  = file.name, ext;
+   size_t      dot   = stem.find_last_of('.');
+   if(dot != std::string::npos)
+   {
+      ext = stem.substr(dot);
+      stem.erase(dot);
+   }
+
+   key = LowercaseString(docID + "-" + stem);
+
+   char version[80];
+   if(file.crc || file.size)
+   {
+      _snprintf(version, sizeof(version), "-%08x-%llx", file.crc, static_cast<unsigned long long>(file.size));
+      version[sizeof(version) - 1] = '\0';
+      key += version;
+   }
+   else
+      byShare = true;
+
+   if(byShare)
+   {
+      struct stat st;
+      if(stat(srcPath.c_str(), &st))
+         return false;
+
+      _snprintf(version, sizeof(version), "-%llx-%llx", static_cast<unsigned long long>(st.st_size),
+                static_cast<unsigned long long>(st.st_mtime));
+      version[sizeof(version) - 1] = '\0';
+      key += version;
+   }
+
+   // keep the extension, so the copy can be opened like the original
+   key += LowercaseString(ext);
+   return true;
+}
+
+//
+// Find a cached file and mark it as the most recently used. A copy missing
+// or damaged on disk is forgotten. Call with m_mutex held.
+//
+bool ViewCache::lookup(const std::string &key, std::string &localPath)
+{
+   auto itr = m_entries.find(key);
+   if(itr == m_entries.end())
+      return false;
+
+   std::string path = FileCache::PathConcatenate(m_dir, key);
+   struct stat st;
+   if(stat(path.c_str(), &st) || uint64_t(st.st_size) != itr->second.size)
+   {
+      remove(path.c_str());
+      m_stats.bytes -= itr->second.size;
+      m_entries.erase(itr);
+      return false;
+   }
+
+   // the modification time records use across sessions
+   itr->second.lastUse = ++m_clock;
+   utime(path.c_str(), nullptr);
+
+   localPath = path;
+   return true;
+}
+
+//
+// Account for a file newly added to the cache. Call with m_mutex held.
+//
+void ViewCache::insert(const std::string &key, uint64_t size)
+{
+   auto itr = m_entries.find(key);
+   if(itr != m_entries.end())
+      m_stats.bytes -= itr->second.size;
+
+   m_entries[key] = entry_t { size, ++m_clock };
+   m_stats.bytes += size;
+}
+
+//
+// Delete the least recently used files until the cache is within budget,
+// sparing the one named by keep. A file that cannot be deleted, because it
+// is still being read, is left for next time. Call with m_mutex held.
+//
+void ViewCache::evict(const std::string &keep)
+{
+   if(m_stats.bytes <= m_budget)
+      return;
+
+   std::vector<std::pair<uint64_t, std::string>> byAge;
+   for(const auto &pr : m_entries)
+   {
+      if(pr.first != keep)
+         byAge.push_back(std::make_pair(pr.second.lastUse, pr.first));
+   }
+   std::sort(byAge.begin(), byAge.end());
+
+   for(const auto &victim : byAge)
+   {
+      if(m_stats.bytes <= m_budget)
+         break;
+
+      if(remove(FileCache::PathConcatenate(m_dir, victim.second).c_str()))
+         continue;
+
+      m_stats.bytes -= m_entries[victim.second].size;
+      m_entries.erase(victim.second);
+      ++m_stats.evictions;
+   }
+}
+
+//
+// Take over the cache in the given directory, holding at most budget bytes.
+// Files already there from earlier sessions are kept, oldest used first in
+// line for eviction; copies left half-fetched are deleted.
+//
+bool ViewCache::open(const std::string &dir, uint64_t budget)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   m_entries.clear();
+   m_dir.clear();
+   m_budget = budget;
+   m_clock  = 0;
+   memset(&m_stats, 0, sizeof(m_stats));
+
+   if(!budget)
+      return false;
+
+   DIR *d = opendir(dir.c_str());
+   if(!d)
+      return false;
+
+   std::vector<std::pair<uint64_t, std::string>> byAge;
+   dirent *ent;
+   while((ent = readdir(d)))
+   {
+      if(ent->d_name[0] == '.')
+         continue;
+
+      std::string name = ent->d_name;
+      std::string path = FileCache::PathConcatenate(dir, name);
+      size_t      len  = strlen(VIEWCACHE_TEMPSUFFIX);
+
+      if(name.length() > len && !name.compare(name.length() - len, len, VIEWCACHE_TEMPSUFFIX))
+      {
+         remove(path.c_str());
+         continue;
+      }
+
+      struct stat st;
+      if(!stat(path.c_str(), &st) && (st.st_mode & S_IFMT) == S_IFREG)
+      {
+         byAge.push_back(std::make_pair(uint64_t(st.st_mtime), name));
+         m_entries[name] = entry_t { uint64_t(st.st_size), 0 };
+         m_stats.bytes += uint64_t(st.st_size);
+      }
+   }
+   closedir(d);
+
+   std::sort(byAge.begin(), byAge.end());
+   for(const auto &pr : byAge)
+      m_entries[pr.second].lastUse = ++m_clock;
+
+   m_dir = dir;
+   evict(std::string());
+
+   return true;
+}
+
+//
+// Get a local copy of a file of the document in docPath, fetching it from
+// the share if it is not already cached; progress, if given, is told how the
+// fetch is going and may cancel it. Returns false if the file could not be
+// cached, in which case the caller should read it from the share directly.
+//
+bool ViewCache::fetch(const std::string &docPath, const docmanifestentry_t &file, std::string &localPath,
+                      const filecopyprogress_t &progress)
+{
+   static std::atomic<unsigned int> tmpSerial(0);
+
+   if(!isOpen())
+      return false;
+
+   std::string srcPath = FileCache::PathConcatenate(docPath, file.name);
+   std::string key;
+   if(!makeKey(docPath, file, srcPath, false, key))
+      return false;
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(lookup(key, localPath))
+      {
+         ++m_stats.hits;
+         m_stats.bytesSaved += m_entries[key].size;
+         return true;
+      }
+   }
+
+   // a file whose manifest entry turned out to be out of date was filed by
+   // what is on the share as well; see below
+   bool        byManifest = (file.crc || file.size);
+   std::string shareKey;
+   if(byManifest && makeKey(docPath, file, srcPath, true, shareKey))
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(lookup(shareKey, localPath))
+      {
+         ++m_stats.hits;
+         m_stats.bytesSaved += m_entries[shareKey].size;
+         return true;
+      }
+   }
+
+   // fetch under a name of this thread's own, so a copy is only ever found
+   // under its real name once it is complete
+   char suffix[32];
+   _snprintf(suffix, sizeof(suffix), ".%u" VIEWCACHE_TEMPSUFFIX, ++tmpSerial);
+   suffix[sizeof(suffix) - 1] = '\0';
+
+   std::string     tmpPath = FileCache::PathConcatenate(m_dir, key + suffix);
+   filecopystats_t stats;
+   if(FileCopy_Copy(srcPath, tmpPath, false, progress, &stats) != FILECOPY_OK)
+      return false;
+
+   // a manifest that does not match the file is out of date. The copy cannot
+   // go under the manifest's name, which says it is something it is not, so
+   // it is filed by the file's size and modification time, which is where
+   // the next fetch looks once the manifest's name is not found. If the file
+   // changed while it was copied, it is not kept.
+   if(byManifest && (stats.crc != file.crc || stats.bytes != file.size))
+   {
+      std::string newShareKey;
+      if(shareKey.empty() || !makeKey(docPath, file, srcPath, true, newShareKey) || newShareKey != shareKey)
+      {
+         remove(tmpPath.c_str());
+         return false;
+      }
+      key = shareKey;
+   }
+
+   std::string path = FileCache::PathConcatenate(m_dir, key);
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+   ++m_stats.misses;
+   m_stats.bytesFetched += stats.bytes;
+
+   if(!MoveFileExA(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+   {
+      // another thread fetching the same file got there first, and its
+      // copy may be open
+      remove(tmpPath.c_str());
+      return lookup(key, localPath);
+   }
+
+   insert(key, stats.bytes);
+   evict(key);
+
+   localPath = path;
+   return true;
+}
+
+//
+// Get a snapshot of the cache's counters.
+//
+viewcachestats_t ViewCache::getStats()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return m_stats;
+}
+
+//=============================================================================
+//
+// Configuration
+//
+// [viewcache]
+// budgetmb=512
+// dir=D:\ScanViewCache
+//
+
+//
+// Get the local directory viewed files are cached in, creating it if
+// needed. This is ScanManager\ViewCache under the user's local application
+// data unless set in the ini file.
+//
+bool ViewCache_GetBasePath(std::string &path)
+{
+   if(IniFile::GetIniValue(VIEWCACHE_SECTION, "dir", path))
+   {
+      path = FileCache::RemoveTrailingSlash(path);
+      return (CreateDirectoryA(path.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS);
+   }
+
+   char localAppData[_MAX_PATH + 1];
+   memset(localAppData, 0, sizeof(localAppData));
+   if(SHGetFolderPathA(nullptr, CSIDL_LOCAL_APPDATA, nullptr, SHGFP_TYPE_CURRENT, localAppData) != S_OK)
+      return false;
+
+   FileCache::SetBasePath(localAppData);
+   if(!FileCache::CreateDirectoryRecursive("ScanManager\\ViewCache"))
+      return false;
+
+   path = FileCache::PathConcatenate(localAppData, "ScanManager\\ViewCache");
+   return true;
+}
+
+//
+// Get the number of bytes of files to keep cached at most; 0 if the cache
+// is turned off.
+//
+uint64_t ViewCache_BudgetFromIni()
+{
+   std::string value;
+   int mb = VIEWCACHE_DEFAULTMB;
+
+   if(IniFile::GetIniValue(VIEWCACHE_SECTION, "budgetmb", value) && IsInt(value))
+      mb = StringToInt(value);
+   if(mb < 0)
+      mb = 0;
+
+   return uint64_t(mb) << 20;
+}
+
+// EOF
+
@@ -0,0 +1,80 @@
+/*
+  Scan Manager
+
+  Local cache of viewed document files
+*/
+
+#ifndef VIEWCACHE_H__
+#define VIEWCACHE_H__
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include "docmanifest.h"
+#include "filecopy.h"
+
+//
+// Counters for judging how well the view cache is working.
+//
+struct viewcachestats_t
+{
+   uint64_t hits;         // files served from local disk
+   uint64_t misses;       // files that had to be fetched from the share
+   uint64_t evictions;    // files dropped to stay within the budget
+   uint64_t bytesSaved;   // bytes not fetched from the share thanks to hits
+   uint64_t bytesFetched; // bytes fetched from the share on misses
+   uint64_t bytes;        // bytes held in the cache now
+};
+
+//
+// Keeps local copies of document files fetched from the share, so that a
+// document opened again is read from local disk. Files are named by their
+// document and name, and then by their contents where the document's
+// manifest gives a checksum, or otherwise by their size and modification
+// time on the share; a changed file thus gets a new name and the stale copy
+// simply ages out. The least recently used files are deleted once the total
+// goes over a byte budget.
+// Safe to use from several threads at once.
+//
+class ViewCache
+{
+protected:
+   struct entry_t
+   {
+      uint64_t size;
+      uint64_t lastUse;
+   };
+
+   std::map<std::string, entry_t> m_entries; // by file name within m_dir
+   std::mutex                     m_mutex;
+   std::string                    m_dir;
+   uint64_t                       m_budget;
+   uint64_t                       m_clock;
+   viewcachestats_t               m_stats;
+
+   bool makeKey(const std::string &docPath, const docmanifestentry_t &file, const std::string &srcPath,
+                bool byShare, std::string &key);
+   bool lookup(const std::string &key, std::string &localPath);
+   void insert(const std::string &key, uint64_t size);
+   void evict(const std::string &keep);
+
+public:
+   ViewCache();
+
+   bool open(const std::string &dir, uint64_t budget);
+   bool isOpen() const { return !m_dir.empty(); }
+   bool fetch(const std::string &docPath, const docmanifestentry_t &file, std::string &localPath,
+              const filecopyprogress_t &progress = nullptr);
+
+   uint64_t         getBudget() const { return m_budget; }
+   viewcachestats_t getStats();
+};
+
+bool     ViewCache_GetBasePath(std::string &path);
+uint64_t ViewCache_BudgetFromIni();
+
+#endif
+
+// EOF
+